@@ -0,0 +1,437 @@
+// allocation_test.cpp
+// Checks that a chat line gets from one client, through the server, to the other clients without the server allocating any
+// memory. The general purpose allocator is quick on average, but now and then it takes a lock or goes to the operating
+// system - and that's the message that arrives late. So the message path doesn't use it.
+//
+// How: we replace the global operator new with one that counts, connect a few clients to real Sessions, warm them up, and then
+// send chat lines while counting. Any allocation is a failure. We do that twice:
+//   - over socket pairs, with a LocalTransport on the server's side - the same thing a bot on the local socket gets
+//   - over TCP on loopback with TLS, with a TlsTransport on the server's side - what every ordinary client gets
+// OpenSSL doesn't use operator new - it calls malloc through its own hook - so we count that hook too (the server's side only).
+// OpenSSL 3 allocates a few bytes of bookkeeping for every record it writes - that's inside OpenSSL and we can't change it, so
+// it's only reported. What must not happen is OpenSSL taking its record buffers again and again (SSL_MODE_RELEASE_BUFFERS does that).
+// The TLS half is rougher on purpose: the sender's records reach the server in little pieces (see TestClient::pump()) and the
+// sockets get small kernel buffers, so the server keeps having to wait for the rest of a record, or for room to write. The
+// waiting has to be free too, not just the easy path where every read and write goes through at once.
+// The warm up matters: the first messages DO allocate - the pools are still empty (see object_pool.hpp and protocol::Frame)
+// and the history fills up. It's the steady state after that which has to be free.
+//
+//   g++ -o allocation_test allocation_test.cpp -lssl -lcrypto -lzstd -pthread -std=c++20
+//   ./allocation_test       <- prints what it found, and exits with 1 if anything allocated
+//
+// Run it from the folder with ssl_certification in it, like the server - without it the TLS half is skipped.
+// It runs the real server code: server.cpp is included here (without its main()). Linux and macOS only (socket pairs).
+
+#define CHAT_SERVER_NO_MAIN
+#include "server.cpp"
+
+#include <cstdlib>
+#include <netinet/tcp.h>
+
+// ---------------------------------- //
+// Every new and delete in the program comes through here while the test runs.
+
+static bool counting = false;
+static bool in_client = false; // The test's own TLS clients are in OpenSSL - don't count them.
+static std::size_t allocations = 0;
+static std::size_t openssl_allocations = 0;
+static std::size_t openssl_buffers = 0; // The big ones - record buffers. See TlsTransport::release_buffers().
+
+// (g++ -Wall thinks a new that calls malloc is paired with the wrong delete - here they're the pair, so we tell it that.)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void *operator new(std::size_t size)
+{
+    if (counting)
+    {
+        ++allocations;
+    }
+    if (void *memory = std::malloc(size == 0 ? 1 : size))
+    {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+void operator delete(void *memory) noexcept { std::free(memory); }
+void operator delete[](void *memory) noexcept { std::free(memory); }
+void operator delete(void *memory, std::size_t) noexcept { std::free(memory); }
+void operator delete[](void *memory, std::size_t) noexcept { std::free(memory); }
+#pragma GCC diagnostic pop
+
+// OpenSSL's own allocations (see CRYPTO_set_mem_functions()). realloc only counts when it has to find new memory.
+static void *openssl_malloc(std::size_t size, const char *, int)
+{
+    if (counting && !in_client)
+    {
+        ++openssl_allocations;
+        openssl_buffers += size >= 4096 ? 1 : 0;
+    }
+    return std::malloc(size);
+}
+
+static void *openssl_realloc(void *memory, std::size_t size, const char *file, int line)
+{
+    if (!memory)
+    {
+        return openssl_malloc(size, file, line);
+    }
+    return std::realloc(memory, size);
+}
+
+static void openssl_free(void *memory, const char *, int) { std::free(memory); }
+
+#if defined(LOCAL_CLIENTS_SUPPORTED)
+using boost::asio::local::stream_protocol;
+
+// ---------------------------------- //
+// The client's end of a connection to a real Session. The test writes to it and reads from it directly (no ASIO), into memory
+// it already has - so the client side never allocates, and whatever the counter sees was the server.
+// With a TLS context it's a TCP connection on loopback and plain OpenSSL on our side; without one, a socket pair.
+
+class TestClient
+{
+public:
+    TestClient(boost::asio::io_context &io_context, ServerState &state)
+    {
+        stream_protocol::socket server_side(io_context);
+        stream_protocol::socket client_side(io_context);
+        boost::asio::local::connect_pair(server_side, client_side);
+        fd_ = client_side.release();
+        auto credentials = peer_credentials(server_side.native_handle());
+        Session::create(std::make_unique<LocalTransport>(std::move(server_side), credentials), state)->start();
+    }
+
+    TestClient(boost::asio::io_context &io_context, ServerState &state, tcp::acceptor &acceptor, boost::asio::ssl::context &server_context, SSL_CTX *client_context)
+    {
+        tcp::socket client_side(io_context);
+        client_side.open(tcp::v4());
+        client_side.set_option(boost::asio::socket_base::receive_buffer_size(small_socket_buffer));
+        client_side.set_option(boost::asio::socket_base::send_buffer_size(small_socket_buffer));
+        client_side.connect(acceptor.local_endpoint());
+        client_side.set_option(tcp::no_delay(true));
+        client_side.non_blocking(true);
+        fd_ = client_side.release();
+        auto server_side = acceptor.accept();
+        server_side.set_option(boost::asio::socket_base::receive_buffer_size(small_socket_buffer));
+        server_side.set_option(boost::asio::socket_base::send_buffer_size(small_socket_buffer));
+        Session::create(std::make_unique<TlsTransport>(std::move(server_side), server_context), state)->start();
+
+        ssl_ = SSL_new(client_context);
+        SSL_set_fd(ssl_, fd_);
+        outgoing_ = BIO_new(BIO_s_mem());
+        SSL_set0_wbio(ssl_, outgoing_); // What OpenSSL writes waits there for pump() - see there.
+        SSL_set_connect_state(ssl_);
+    }
+
+    ~TestClient()
+    {
+        if (ssl_)
+        {
+            SSL_free(ssl_);
+        }
+        ::close(fd_);
+    }
+
+    TestClient(const TestClient &) = delete;
+    TestClient &operator=(const TestClient &) = delete;
+
+    // A step of the TLS handshake - call it (and let the server run) until it says true. A socket pair has nothing to do.
+    bool connected()
+    {
+        in_client = true;
+        bool done = !ssl_ || SSL_do_handshake(ssl_) == 1;
+        in_client = false;
+        pump(outbox_.size());
+        return done;
+    }
+
+    // With TLS the bytes only go as far as OpenSSL (and its memory BIO) - pump() sends them on.
+    void send(std::string_view bytes)
+    {
+        if (ssl_)
+        {
+            in_client = true;
+            std::size_t written = 0;
+            bool ok = SSL_write_ex(ssl_, bytes.data(), bytes.size(), &written) == 1;
+            in_client = false;
+            if (!ok)
+            {
+                std::cerr << "The test client couldn't write." << std::endl;
+                std::exit(1);
+            }
+            return;
+        }
+        while (!bytes.empty())
+        {
+            ssize_t sent = ::send(fd_, bytes.data(), bytes.size(), 0);
+            if (sent <= 0)
+            {
+                std::cerr << "The test client couldn't write." << std::endl;
+                std::exit(1);
+            }
+            bytes.remove_prefix(static_cast<std::size_t>(sent));
+        }
+    }
+
+    // Sends on at most most bytes of what OpenSSL has written - a record at a time would be too kind, the server would never
+    // see half of one. Returns false when everything has gone.
+    bool pump(std::size_t most)
+    {
+        if (!ssl_)
+        {
+            return false;
+        }
+        if (out_begin_ == out_end_)
+        {
+            in_client = true;
+            int length = BIO_read(outgoing_, outbox_.data(), static_cast<int>(outbox_.size()));
+            in_client = false;
+            out_begin_ = 0;
+            out_end_ = length > 0 ? static_cast<std::size_t>(length) : 0;
+        }
+        if (out_begin_ == out_end_)
+        {
+            return false;
+        }
+        ssize_t sent = ::send(fd_, outbox_.data() + out_begin_, std::min(most, out_end_ - out_begin_), MSG_DONTWAIT | MSG_NOSIGNAL);
+        out_begin_ += sent > 0 ? static_cast<std::size_t>(sent) : 0;
+        return true;
+    }
+
+    // Reads whatever the server has written to us so far and counts the chat frames in it.
+    void drain()
+    {
+        while (true)
+        {
+            std::size_t length = 0;
+            if (ssl_)
+            {
+                in_client = true;
+                bool ok = SSL_read_ex(ssl_, inbox_.data() + used_, inbox_.size() - used_, &length) == 1;
+                in_client = false;
+                if (!ok)
+                {
+                    return;
+                }
+            }
+            else
+            {
+                ssize_t received = ::recv(fd_, inbox_.data() + used_, inbox_.size() - used_, MSG_DONTWAIT);
+                if (received <= 0)
+                {
+                    return;
+                }
+                length = static_cast<std::size_t>(received);
+            }
+            used_ += length;
+
+            std::size_t start = 0;
+            protocol::MessageType type;
+            bool compressed = false;
+            std::size_t body_length = 0;
+            while (used_ - start >= protocol::header_length && protocol::parse_header(inbox_.data() + start, type, compressed, body_length) &&
+                   used_ - start >= protocol::header_length + body_length)
+            {
+                chat_frames_ += type == protocol::MessageType::chat ? 1 : 0;
+                start += protocol::header_length + body_length;
+            }
+            std::memmove(inbox_.data(), inbox_.data() + start, used_ - start);
+            used_ -= start;
+        }
+    }
+
+    std::size_t chat_frames() const { return chat_frames_; }
+
+private:
+    static constexpr int small_socket_buffer = 4096; // The kernel doubles it, and won't go below a couple of KB anyway.
+
+    int fd_ = -1;
+    SSL *ssl_ = nullptr;
+    BIO *outgoing_ = nullptr; // Belongs to ssl_.
+    std::array<char, 16 * 1024> outbox_;
+    std::size_t out_begin_ = 0;
+    std::size_t out_end_ = 0;
+    std::array<char, 256 * 1024> inbox_;
+    std::size_t used_ = 0;
+    std::size_t chat_frames_ = 0;
+};
+
+static std::string frame_bytes(protocol::MessageType type, std::string body)
+{
+    auto frame = protocol::make_frame(type, std::move(body));
+    return std::string(frame->header.data(), frame->header.size()) + frame->body;
+}
+
+static std::string hello(const std::string &name)
+{
+    std::string body;
+    protocol::Writer writer(body);
+    writer.str(name);
+    writer.u32(0); // No compression.
+    writer.u32(0);
+    writer.u64(0);
+    writer.u64(0);
+    return frame_bytes(protocol::MessageType::hello, std::move(body));
+}
+
+// Sends count chat lines, a few at a time (like a busy client), and lets the server run until every receiver has all of them.
+// Sets delivered to false if they didn't all arrive. With measure, allocations are counted while it runs.
+//
+// This runs as a coroutine INSIDE io_context.run(), like the server does - not as a loop calling io_context.poll(). ASIO keeps
+// its recycled memory for the thread inside each run()/poll() call, so every poll() would start with none and allocate.
+static awaitable<void> send_lines(boost::asio::io_context &io_context, std::vector<std::unique_ptr<TestClient>> &clients,
+                                  const std::vector<std::string> &lines, std::size_t count, bool measure, bool &delivered)
+{
+    constexpr std::size_t batch = 64;
+    constexpr std::size_t pump_step = 100; // A chat line's record is 50 to 250 bytes - most arrive in two or three pieces.
+    co_await boost::asio::post(io_context.get_executor(), use_awaitable); // Our own first wait allocates - don't count that.
+    counting = measure;
+    std::size_t expected = clients[1]->chat_frames();
+    for (std::size_t sent = 0; sent < count; sent += batch)
+    {
+        std::size_t this_batch = std::min(batch, count - sent);
+        for (std::size_t i = sent; i < sent + this_batch; ++i)
+        {
+            clients[0]->send(lines[i % lines.size()]);
+        }
+        expected += this_batch;
+
+        for (int tries = 0; tries < 100000; ++tries)
+        {
+            bool sending = clients[0]->pump(pump_step);
+            co_await boost::asio::post(io_context.get_executor(), use_awaitable); // Let the server run.
+            if (sending)
+            {
+                continue; // The receivers only read once the whole batch is out - until then the server's writes pile up.
+            }
+            bool everyone = true;
+            for (std::size_t i = 1; i < clients.size(); ++i)
+            {
+                clients[i]->drain();
+                everyone = everyone && clients[i]->chat_frames() == expected;
+            }
+            if (everyone)
+            {
+                break;
+            }
+        }
+    }
+    counting = false;
+
+    for (std::size_t i = 1; i < clients.size(); ++i)
+    {
+        delivered = delivered && clients[i]->chat_frames() == expected;
+    }
+}
+
+// One run: a sender and some receivers, a warm up, and then measured_lines lines while counting.
+// With TLS, the clients connect over loopback to real TlsTransports. Returns false if anything allocated or went missing.
+static bool run(bool tls, boost::asio::ssl::context *server_context, SSL_CTX *client_context)
+{
+    constexpr std::size_t receivers = 3;
+    constexpr std::size_t measured_lines = 2000;
+
+    boost::asio::io_context io_context;
+    ServerState state(io_context, std::string());
+    state.limits = RateLimits{{}, {}, {}, {}, {}, {}}; // No rate limits - we want every line to go straight through.
+    tcp::acceptor acceptor(io_context, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+
+    std::vector<std::unique_ptr<TestClient>> clients; // clients[0] sends, the others receive.
+    for (std::size_t i = 0; i <= receivers; ++i)
+    {
+        clients.push_back(tls ? std::make_unique<TestClient>(io_context, state, acceptor, *server_context, client_context)
+                              : std::make_unique<TestClient>(io_context, state));
+    }
+
+    // Different lengths, longer than a short string keeps inside itself, like real chat.
+    std::vector<std::string> lines;
+    for (std::size_t i = 0; i < 64; ++i)
+    {
+        lines.push_back(frame_bytes(protocol::MessageType::chat, "line " + std::to_string(i) + ": " + std::string(20 + i * 3, 'x')));
+    }
+
+    std::cout.setstate(std::ios::failbit); // The server prints every chat line - not needed here.
+
+    allocations = 0;
+    openssl_allocations = 0;
+    openssl_buffers = 0;
+    bool delivered = true;
+    boost::asio::co_spawn(io_context, [&]() -> awaitable<void>
+                          {
+                              // The TLS handshakes (the server does its side in the same io_context), then everyone says hello.
+                              for (int tries = 0; tries < 10000; ++tries)
+                              {
+                                  bool everyone = true;
+                                  for (auto &client : clients)
+                                  {
+                                      everyone = client->connected() && everyone;
+                                  }
+                                  if (everyone)
+                                  {
+                                      break;
+                                  }
+                                  co_await boost::asio::post(io_context.get_executor(), use_awaitable);
+                              }
+                              for (std::size_t i = 0; i < clients.size(); ++i)
+                              {
+                                  clients[i]->send(hello(i == 0 ? "sender" : "receiver" + std::to_string(i)));
+                                  while (clients[i]->pump(SIZE_MAX))
+                                  {
+                                      co_await boost::asio::post(io_context.get_executor(), use_awaitable);
+                                  }
+                              }
+                              // Let the server read every hello first - a receiver that hasn't joined yet wouldn't get the lines.
+                              for (int i = 0; i < 100; ++i)
+                              {
+                                  co_await boost::asio::post(io_context.get_executor(), use_awaitable);
+                              }
+                              // Warm up: fill the history (so the oldest frames start going back to the pool) and then some.
+                              co_await send_lines(io_context, clients, lines, ServerState::history_size + 512, false, delivered);
+                              co_await send_lines(io_context, clients, lines, measured_lines, true, delivered);
+                              io_context.stop(); },
+                          boost::asio::detached);
+    io_context.run();
+
+    std::cout.clear();
+    std::cout << (tls ? "TLS:          " : "local socket: ") << measured_lines << " chat lines to " << receivers << " clients: "
+              << allocations << " allocation(s)"
+              << (tls ? " - and in OpenSSL " + std::to_string(openssl_buffers) + " buffer(s), " + std::to_string(openssl_allocations) + " in all" : std::string())
+              << (delivered ? "" : " - and not every line was delivered!") << std::endl;
+    return allocations == 0 && openssl_buffers == 0 && delivered;
+}
+
+int main()
+{
+    // This has to come before OpenSSL allocates anything at all.
+    CRYPTO_set_mem_functions(openssl_malloc, openssl_realloc, openssl_free);
+
+    bool ok = run(false, nullptr, nullptr);
+
+    // The server's TLS setup, like main() in server.cpp.
+    std::error_code ec;
+    if (std::filesystem::exists("ssl_certification/certificate.crt", ec))
+    {
+        boost::asio::ssl::context server_context(boost::asio::ssl::context::sslv23);
+        server_context.use_certificate_chain_file("ssl_certification/certificate.crt");
+        server_context.use_private_key_file("ssl_certification/private.key", boost::asio::ssl::context::pem);
+        SSL_CTX *client_context = SSL_CTX_new(TLS_client_method()); // No certificate check - it's our own server, in this process.
+        ok = run(true, &server_context, client_context) && ok;
+        SSL_CTX_free(client_context);
+    }
+    else
+    {
+        std::cout << "TLS: no ssl_certification folder here - skipped." << std::endl;
+    }
+
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
+#else
+int main()
+{
+    std::cout << "This test needs local sockets (Linux or macOS) - skipped." << std::endl;
+    return 0;
+}
+#endif
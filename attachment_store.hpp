@@ -0,0 +1,470 @@
+#pragma once
+
+// attachment_store.hpp
+// This is where the server keeps the files that clients share.
+//
+// The big idea is "content addressing": a file is stored under the SHA-256 hash of its bytes, not under the name the user gave it.
+// So if 20 people share the same cat picture, or the same file gets re-shared next week, we only keep ONE copy on disk.
+// The client sends the hash first - if we already have it, the client doesn't even need to upload it again.
+//
+// Layout on disk (inside the root folder, "attachments" by default):
+//   objects/ab/abcdef...   - the actual files, named by their hash (first 2 hex chars used as a sub folder so no folder gets huge)
+//   tmp/                   - uploads that are still in progress
+//   posts.log              - one line per time a file was shared: "<hash> <unix time>". This is our reference count.
+//
+// Reference counting: every share (post) of a file is one reference. A post stays alive for the retention period.
+// When a post gets too old it is dropped, and when a file has no posts left, collect_garbage() deletes it.
+// The posts.log file means the counts survive a server restart.
+//
+// Disk work happens on a thread of its own (disk_), not on the server's io thread. A 1 MB write, or walking the whole objects/
+// folder, can take a while on a busy disk - and while the io thread waits for that, no client gets a single message.
+// So: looking up whether we have a file and creating the temporary one for an upload (offer()), the writes of an upload,
+// finishing it (close, rename), posts.log and the garbage collector's folder scan all go to disk_,
+// one after another in the order they were handed over. Everything that decides something (the reference counts, which files are
+// mapped) stays on the io thread, and disk_ reports back by posting to it (home_).
+
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include "protocol.hpp"
+
+class AttachmentStore
+{
+public:
+    // A read-only memory mapping of one stored file.
+    // Every client downloading the same file shares the same Mapping - the bytes are only in memory once,
+    // and the operating system pages them in from disk as they are needed.
+    struct Mapping
+    {
+        boost::interprocess::file_mapping file;
+        boost::interprocess::mapped_region region;
+
+        const char *data() const { return static_cast<const char *>(region.get_address()); }
+        std::uint64_t size() const { return region.get_size(); }
+    };
+
+    // The temporary file of an upload. Only the disk thread touches it - it's shared so that the writes waiting on disk_ still
+    // have it after the Upload itself is gone.
+    struct TempFile
+    {
+        explicit TempFile(std::filesystem::path temp_path) : path(std::move(temp_path)) {}
+
+        std::filesystem::path path;
+        std::FILE *handle = nullptr; // Opened by the disk thread, in offer().
+        bool failed = false;         // A write went wrong - the upload can't be stored.
+    };
+
+    // An upload that is in progress.
+    // Chunks come in over the network as 64 KB pieces. Writing each one to disk straight away means lots of small writes,
+    // so instead we collect them in pending_ and hand them to the disk thread in one go once we have batch_size bytes.
+    // A client can send faster than the disk writes, though - and every batch waiting for the disk thread is 1 MB of memory.
+    // So at most max_batches_in_flight of them may wait: after that busy() says so, and the session stops reading from that
+    // client until when_ready() calls back. The chunks then wait in the client's socket, and TCP slows the client down.
+    class Upload
+    {
+    public:
+        Upload(const protocol::Hash &hash, std::uint64_t size, std::shared_ptr<TempFile> file,
+               std::shared_ptr<boost::asio::thread_pool> disk, boost::asio::any_io_executor home)
+            : hash_(hash), size_(size), file_(std::move(file)), disk_(std::move(disk)), home_(std::move(home)), queue_(std::make_shared<Queue>())
+        {
+            pending_.reserve(batch_size);
+        }
+
+        ~Upload()
+        {
+            if (file_)
+            {
+                // Upload never finished - the disk thread closes and removes the file, after any writes still waiting for it.
+                // (If the server is shutting down and the disk thread is already gone, the file stays in tmp/ until the next start.)
+                boost::asio::post(*disk_, [file = std::move(file_)]()
+                                  {
+                                      std::fclose(file->handle);
+                                      file->handle = nullptr;
+                                      std::error_code ignored;
+                                      std::filesystem::remove(file->path, ignored); });
+            }
+        }
+
+        Upload(const Upload &) = delete;
+        Upload &operator=(const Upload &) = delete;
+
+        const protocol::Hash &hash() const { return hash_; }
+        std::uint64_t size() const { return size_; }
+        bool complete() const { return received_ == size_; }
+
+        // True while the disk thread is max_batches_in_flight batches behind - don't give this upload any more chunks until
+        // when_ready() calls back.
+        bool busy() const { return queue_->batches >= max_batches_in_flight; }
+
+        // ready runs on the io thread once the disk thread has caught up (once only - call again next time busy() is true).
+        void when_ready(std::function<void()> ready) { queue_->ready = std::move(ready); }
+
+        // Returns false if the chunk is out of order or too big.
+        // TLS runs over TCP so chunks always arrive in order - an out of order chunk means a broken client.
+        // A failed disk write only shows up when the upload finishes (finish_upload() says "not stored") - it happens later, on disk_.
+        bool write(std::uint64_t offset, std::string_view bytes)
+        {
+            if (!file_ || offset != received_ || bytes.size() > size_ - received_)
+                return false;
+
+            hasher_.update(bytes.data(), bytes.size());
+            pending_.insert(pending_.end(), bytes.begin(), bytes.end());
+            received_ += bytes.size();
+
+            if (pending_.size() >= batch_size && !complete())
+            {
+                flush();
+                pending_.reserve(batch_size);
+            }
+            return true;
+        }
+
+    private:
+        friend class AttachmentStore;
+
+        // How many batches the disk thread still has to write. Only the io thread touches it, but the disk thread reports back
+        // to it - maybe after the Upload is gone, so it's shared as well.
+        struct Queue
+        {
+            std::size_t batches = 0;
+            std::function<void()> ready;
+        };
+
+        // Hand what we have collected to the disk thread. pending_ moves into the job, so it's empty (and unallocated) afterwards.
+        void flush()
+        {
+            if (pending_.empty())
+                return;
+            ++queue_->batches;
+            boost::asio::post(*disk_, [file = file_, batch = std::move(pending_), home = home_, queue = queue_]()
+                              {
+                                  if (!file->failed && std::fwrite(batch.data(), 1, batch.size(), file->handle) != batch.size())
+                                      file->failed = true;
+                                  boost::asio::post(home, [queue]()
+                                                    {
+                                                        if (--queue->batches < max_batches_in_flight && queue->ready)
+                                                        {
+                                                            auto ready = std::move(queue->ready);
+                                                            queue->ready = nullptr;
+                                                            ready();
+                                                        } }); });
+            pending_ = std::vector<char>();
+        }
+
+        static constexpr std::size_t batch_size = 1024 * 1024; // 1 MB - 16 chunks per disk write.
+        static constexpr std::size_t max_batches_in_flight = 2;
+
+        protocol::Hash hash_;
+        std::uint64_t size_;
+        std::uint64_t received_ = 0;
+        std::shared_ptr<TempFile> file_;
+        std::shared_ptr<boost::asio::thread_pool> disk_; // Shared - a Session (and its Upload) can outlive the AttachmentStore at shutdown.
+        boost::asio::any_io_executor home_;
+        std::shared_ptr<Queue> queue_;
+        std::vector<char> pending_;
+        protocol::Hasher hasher_;
+    };
+
+    // home is the io thread's executor - that's where finish_upload() and collect_garbage() report back.
+    AttachmentStore(std::filesystem::path root, boost::asio::any_io_executor home,
+                    std::chrono::seconds retention = std::chrono::hours(24 * 7))
+        : root_(std::move(root)), retention_(retention), home_(std::move(home))
+    {
+        std::filesystem::create_directories(root_ / "objects");
+        std::filesystem::create_directories(root_ / "tmp");
+
+        // Anything left in tmp is from an upload that was cut off when the server stopped.
+        for (const auto &entry : std::filesystem::directory_iterator(root_ / "tmp"))
+        {
+            std::error_code ignored;
+            std::filesystem::remove(entry.path(), ignored);
+        }
+
+        load_posts();
+        if (drop_expired_posts())
+            rewrite_posts_log(root_, posts_);
+        // Nothing else is running yet, so here the first collection can simply happen right away.
+        for (const auto &hash : stored_hashes(root_))
+        {
+            if (!references_.count(hash))
+            {
+                std::error_code ignored;
+                std::filesystem::remove(object_path(root_, hash), ignored);
+            }
+        }
+    }
+
+    // Let the disk thread finish everything it was given (the last upload, posts.log) before the server goes.
+    ~AttachmentStore()
+    {
+        disk_->join();
+    }
+
+    AttachmentStore(const AttachmentStore &) = delete;
+    AttachmentStore &operator=(const AttachmentStore &) = delete;
+
+    static constexpr std::uint64_t max_attachment_size = 512ull * 1024 * 1024; // 512 MB
+
+    // Somebody wants to share a file. The disk thread looks whether we already have it, and if not, creates the temporary file
+    // to upload it into. Then, back on the io thread, done() gets one of:
+    //   stored = true                      - we have it, nothing needs uploading.
+    //   stored = false and an Upload       - send the bytes into that.
+    //   stored = false and nullptr         - we don't have it and couldn't create the temporary file.
+    // A file that the garbage collector is deleting right now counts as gone - whoever shares it again has to upload it again.
+    // (The deleting happens on disk_ before our fopen, so the new upload can't be deleted by mistake.)
+    void offer(const protocol::Hash &hash, std::uint64_t size, std::function<void(bool stored, std::unique_ptr<Upload> upload)> done)
+    {
+        bool deleting = deleting_.count(hash) != 0;
+        auto file = std::make_shared<TempFile>(root_ / "tmp" / (protocol::to_hex(hash) + "." + std::to_string(++upload_counter_)));
+        boost::asio::post(*disk_, [this, hash, size, deleting, file, target = object_path(root_, hash), done = std::move(done)]() mutable
+                          {
+                              std::error_code ec;
+                              bool stored = !deleting && std::filesystem::exists(target, ec);
+                              if (!stored)
+                                  file->handle = std::fopen(file->path.string().c_str(), "wb");
+                              boost::asio::post(home_, [this, hash, size, stored, file, done = std::move(done)]() mutable
+                                                {
+                                                    if (stored && deleting_.count(hash))
+                                                    {
+                                                        // The garbage collector picked it while we were looking - ask again.
+                                                        offer(hash, size, std::move(done));
+                                                        return;
+                                                    }
+                                                    if (stored || !file->handle)
+                                                    {
+                                                        done(stored, nullptr);
+                                                        return;
+                                                    }
+                                                    done(false, std::make_unique<Upload>(hash, size, file, disk_, home_)); }); });
+    }
+
+    // Called once the last chunk has arrived. We check the bytes really do hash to what the client promised -
+    // otherwise a client could store rubbish under somebody else's hash. Then the disk thread writes the rest, closes the file and
+    // moves it into objects/ - and done(true) runs back on the io thread once it's there (done(false) if it couldn't be stored).
+    void finish_upload(std::unique_ptr<Upload> upload, std::function<void(bool stored)> done)
+    {
+        bool matches = upload->complete() && upload->hasher_.finish() == upload->hash_;
+        upload->flush();
+        auto target = object_path(root_, upload->hash_);
+        boost::asio::post(*disk_, [this, file = std::move(upload->file_), matches, target, done = std::move(done)]() mutable
+                          {
+                              bool stored = matches && !file->failed;
+                              if (std::fclose(file->handle) != 0)
+                                  stored = false;
+                              file->handle = nullptr;
+
+                              std::error_code ec;
+                              if (stored)
+                              {
+                                  std::filesystem::create_directories(target.parent_path(), ec);
+                                  std::filesystem::rename(file->path, target, ec); // If two clients upload the same file at once, the last rename just wins - same bytes anyway.
+                                  stored = !ec;
+                              }
+                              if (!stored)
+                                  std::filesystem::remove(file->path, ec);
+                              boost::asio::post(home_, [stored, done = std::move(done)]()
+                                                { done(stored); }); });
+    }
+
+    // Memory map a stored file so it can be sent out. If somebody is already downloading it we hand back the same mapping.
+    // Returns nullptr if we don't have the file (or it is empty - an empty file can't be mapped, and has nothing to send).
+    std::shared_ptr<const Mapping> open(const protocol::Hash &hash)
+    {
+        auto it = open_mappings_.find(hash);
+        if (it != open_mappings_.end())
+        {
+            if (auto mapping = it->second.lock())
+                return mapping;
+            open_mappings_.erase(it);
+        }
+
+        try
+        {
+            if (deleting_.count(hash))
+                return nullptr;
+            auto mapping = std::make_shared<Mapping>();
+            mapping->file = boost::interprocess::file_mapping(object_path(root_, hash).string().c_str(), boost::interprocess::read_only);
+            mapping->region = boost::interprocess::mapped_region(mapping->file, boost::interprocess::read_only);
+            open_mappings_[hash] = mapping;
+            return mapping;
+        }
+        catch (const std::exception &)
+        {
+            return nullptr;
+        }
+    }
+
+    // Somebody shared this file - add a reference.
+    void add_post(const protocol::Hash &hash)
+    {
+        auto now = std::time(nullptr);
+        posts_.push_back({hash, now});
+        ++references_[hash];
+
+        boost::asio::post(*disk_, [log_path = root_ / "posts.log", line = protocol::to_hex(hash) + ' ' + std::to_string(now) + '\n']()
+                          {
+                              std::ofstream log(log_path, std::ios::app);
+                              log << line; });
+    }
+
+    // Drop posts that are older than the retention period and delete any file nobody references any more.
+    // Files that are still being downloaded (still mapped) are left for the next run.
+    // The disk thread lists what's in objects/, we pick the files nobody needs here on the io thread, and the disk thread deletes
+    // them. done(number of files deleted) runs on the io thread at the end.
+    void collect_garbage(std::function<void(std::size_t deleted)> done)
+    {
+        if (drop_expired_posts())
+        {
+            boost::asio::post(*disk_, [root = root_, posts = posts_]()
+                              { rewrite_posts_log(root, posts); });
+        }
+
+        boost::asio::post(*disk_, [this, done = std::move(done)]() mutable
+                          {
+                              boost::asio::post(home_, [this, stored = stored_hashes(root_), done = std::move(done)]() mutable
+                                                { delete_unreferenced(stored, std::move(done)); }); });
+    }
+
+private:
+    struct Post
+    {
+        protocol::Hash hash;
+        std::time_t time;
+    };
+
+    struct HashHasher
+    {
+        std::size_t operator()(const protocol::Hash &hash) const
+        {
+            std::size_t value;
+            std::memcpy(&value, hash.data(), sizeof(value)); // SHA-256 output is already random - the first 8 bytes are a fine hash.
+            return value;
+        }
+    };
+
+    static std::filesystem::path object_path(const std::filesystem::path &root, const protocol::Hash &hash)
+    {
+        auto hex = protocol::to_hex(hash);
+        return root / "objects" / hex.substr(0, 2) / hex;
+    }
+
+    // Every file in objects/. This is the slow part of collecting garbage, so it runs on the disk thread (or in the constructor).
+    static std::vector<protocol::Hash> stored_hashes(const std::filesystem::path &root)
+    {
+        std::vector<protocol::Hash> hashes;
+        std::error_code ec;
+        for (const auto &folder : std::filesystem::directory_iterator(root / "objects", ec))
+        {
+            if (!folder.is_directory())
+                continue;
+            for (const auto &entry : std::filesystem::directory_iterator(folder.path(), ec))
+            {
+                protocol::Hash hash;
+                if (protocol::from_hex(entry.path().filename().string(), hash))
+                    hashes.push_back(hash);
+            }
+        }
+        return hashes;
+    }
+
+    // Back on the io thread with the list from stored_hashes(). A file that was uploaded after the list was made isn't on it,
+    // and one that got a new post in the meantime is referenced again - either way it stays.
+    void delete_unreferenced(const std::vector<protocol::Hash> &stored, std::function<void(std::size_t deleted)> done)
+    {
+        std::vector<protocol::Hash> unreferenced;
+        for (const auto &hash : stored)
+        {
+            if (references_.count(hash) || deleting_.count(hash))
+                continue;
+            auto mapped = open_mappings_.find(hash);
+            if (mapped != open_mappings_.end() && !mapped->second.expired())
+                continue;
+            unreferenced.push_back(hash);
+            deleting_.insert(hash);
+        }
+
+        boost::asio::post(*disk_, [this, unreferenced = std::move(unreferenced), done = std::move(done)]() mutable
+                          {
+                              std::size_t deleted = 0;
+                              for (const auto &hash : unreferenced)
+                              {
+                                  std::error_code ec;
+                                  if (std::filesystem::remove(object_path(root_, hash), ec))
+                                      ++deleted;
+                              }
+                              boost::asio::post(home_, [this, unreferenced = std::move(unreferenced), deleted, done = std::move(done)]()
+                                                {
+                                                    for (const auto &hash : unreferenced)
+                                                        deleting_.erase(hash);
+                                                    done(deleted); }); });
+    }
+
+    // Returns true if any post was old enough to go.
+    bool drop_expired_posts()
+    {
+        auto cutoff = std::time(nullptr) - static_cast<std::time_t>(retention_.count());
+        bool dropped_posts = false;
+        while (!posts_.empty() && posts_.front().time < cutoff)
+        {
+            auto it = references_.find(posts_.front().hash);
+            if (it != references_.end() && --it->second == 0)
+                references_.erase(it);
+            posts_.pop_front();
+            dropped_posts = true;
+        }
+        return dropped_posts;
+    }
+
+    void load_posts()
+    {
+        std::ifstream log(root_ / "posts.log");
+        std::string hex;
+        std::time_t time;
+        while (log >> hex >> time)
+        {
+            protocol::Hash hash;
+            if (!protocol::from_hex(hex, hash))
+                continue;
+            posts_.push_back({hash, time});
+            ++references_[hash];
+        }
+    }
+
+    // Write the log again with only the posts we still keep - otherwise it would grow forever.
+    // It gets a copy of the posts because it runs on the disk thread, while posts_ carries on changing on the io thread.
+    static void rewrite_posts_log(const std::filesystem::path &root, const std::deque<Post> &posts)
+    {
+        auto temp = root / "posts.log.tmp";
+        {
+            std::ofstream log(temp, std::ios::trunc);
+            for (const auto &post : posts)
+                log << protocol::to_hex(post.hash) << ' ' << post.time << '\n';
+        }
+        std::error_code ec;
+        std::filesystem::rename(temp, root / "posts.log", ec);
+    }
+
+    std::filesystem::path root_;
+    std::chrono::seconds retention_;
+    std::deque<Post> posts_; // Oldest first - posts are always added with the current time.
+    std::unordered_map<protocol::Hash, std::size_t, HashHasher> references_;
+    std::unordered_map<protocol::Hash, std::weak_ptr<Mapping>, HashHasher> open_mappings_;
+    std::unordered_set<protocol::Hash, HashHasher> deleting_; // Handed to the disk thread to delete - see contains().
+    std::uint64_t upload_counter_ = 0;
+    boost::asio::any_io_executor home_;
+    std::shared_ptr<boost::asio::thread_pool> disk_ = std::make_shared<boost::asio::thread_pool>(1); // One thread, so its jobs run one at a time, in the order they were posted.
+};
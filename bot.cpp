@@ -0,0 +1,308 @@
+#include <iostream>
+#include <utility> // Boost 1.74's awaitable.hpp uses std::exchange without including this itself.
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <boost/asio.hpp>
+#include "protocol.hpp"
+#include "shm_ring.hpp"
+
+// Overview:
+// A tiny bot for programs that run on the same machine as the server. It connects to the server's local socket
+// (./server 12345 --local chat.sock) - no TLS, no certificates - posts every line it reads from its input as a chat line,
+// and prints the chat it sees. So anything that writes lines can talk in the chat:
+//
+//   ./server 12345 --local chat.sock
+//   tail -f /var/log/backup.log | ./bot chat.sock backup-bot
+//   ./price-feed | ./bot chat.sock prices --ring      <- lots of lines: through shared memory instead (see shm_ring.hpp, Linux only)
+//
+// It speaks exactly the same frames as the real client (see protocol.hpp) - only without TLS in between. A bot written in
+// another language can do the same: connect to the socket file, send a hello, and go.
+//
+// This one is deliberately simple, with plain blocking reads and writes: one thread reads the input and sends, the other reads
+// from the server (and answers its pings, or the server would think we had gone). The mutex makes sure their writes don't get mixed up.
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+using boost::asio::local::stream_protocol;
+
+class Bot
+{
+public:
+    Bot(boost::asio::io_context &io_context, const std::string &path) : socket_(io_context)
+    {
+        socket_.connect(stream_protocol::endpoint(path));
+    }
+
+    // The hello, like the client's (see Client::send_hello() in client.cpp) - but we don't ask for compression, and don't resume.
+    // False if the name is too long to send (see protocol::Writer::str()).
+    bool hello(const std::string &name)
+    {
+        std::string body;
+        protocol::Writer writer(body);
+        writer.str(name);
+        writer.u32(0);
+        writer.u32(0);
+        writer.u64(0);
+        writer.u64(0);
+        if (writer.truncated())
+        {
+            return false;
+        }
+        send(protocol::MessageType::hello, std::move(body));
+        return true;
+    }
+
+    void send(protocol::MessageType type, std::string body)
+    {
+        auto frame = protocol::make_frame(type, std::move(body));
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        boost::system::error_code ignored;
+        boost::asio::write(socket_, frame->buffers(), ignored);
+    }
+
+    // A chat line - through the ring if we have one, otherwise over the socket.
+    void post(std::string line)
+    {
+#if defined(SHM_RING_SUPPORTED)
+        if (ring_)
+        {
+            ring_->write(*protocol::make_frame(protocol::MessageType::chat, std::move(line)));
+            return;
+        }
+#endif
+        send(protocol::MessageType::chat, std::move(line));
+    }
+
+#if defined(SHM_RING_SUPPORTED)
+    // Makes a shared memory ring and sends it to the server: a ring_attach frame, with the ring's memory and eventfd riding along
+    // in the same sendmsg() (SCM_RIGHTS). They arrive with the frame's first byte, so they're there when the server handles it.
+    bool attach_ring()
+    {
+        auto ring = std::make_unique<shm_ring::Writer>();
+        if (!ring->ok())
+        {
+            return false;
+        }
+
+        auto frame = protocol::make_frame(protocol::MessageType::ring_attach, std::string());
+        iovec data{const_cast<char *>(frame->header.data()), frame->header.size()};
+        alignas(cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))] = {};
+        msghdr message{};
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr *descriptors = CMSG_FIRSTHDR(&message);
+        descriptors->cmsg_level = SOL_SOCKET;
+        descriptors->cmsg_type = SCM_RIGHTS;
+        descriptors->cmsg_len = CMSG_LEN(2 * sizeof(int));
+        int fds[2] = {ring->memory_fd(), ring->wake_fd()};
+        std::memcpy(CMSG_DATA(descriptors), fds, sizeof(fds));
+
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        if (::sendmsg(socket_.native_handle(), &message, 0) != static_cast<ssize_t>(frame->header.size()))
+        {
+            return false;
+        }
+        ring_ = std::move(ring);
+        return true;
+    }
+
+    // Before we hang up: give the server up to a few seconds to read what's still in the ring.
+    void wait_for_ring()
+    {
+        auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (ring_ && !ring_->drained() && !server_gone_ && std::chrono::steady_clock::now() < give_up)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+#endif
+
+    // Reads frames until the server closes the connection.
+    void read_frames()
+    {
+        read_until_closed();
+        server_gone_ = true;
+#if defined(SHM_RING_SUPPORTED)
+        if (ring_)
+        {
+            ring_->stop(); // A write waiting for room in the ring would wait forever.
+        }
+#endif
+    }
+
+    // No more input - we tell the server we're done sending. It closes its side, and read_frames() returns.
+    void finish()
+    {
+        boost::system::error_code ignored;
+        socket_.shutdown(stream_protocol::socket::shutdown_send, ignored);
+    }
+
+private:
+    void read_until_closed()
+    {
+        std::array<char, protocol::header_length> header;
+        std::string body;
+        boost::system::error_code ec;
+        while (true)
+        {
+            boost::asio::read(socket_, boost::asio::buffer(header), ec);
+            protocol::MessageType type;
+            bool compressed = false;
+            std::size_t length = 0;
+            if (ec || !protocol::parse_header(header.data(), type, compressed, length))
+            {
+                return;
+            }
+            body.resize(length);
+            boost::asio::read(socket_, boost::asio::buffer(body), ec);
+            if (ec)
+            {
+                return;
+            }
+            handle_frame(type, body);
+        }
+    }
+
+    void handle_frame(protocol::MessageType type, std::string_view body)
+    {
+        protocol::Reader reader(body);
+        switch (type)
+        {
+        case protocol::MessageType::chat:
+        {
+            // Only the sender and the text from the envelope - a bot that doesn't reconnect has no use for the sequence number.
+            protocol::Envelope envelope(body);
+            if (envelope.ok())
+            {
+                auto it = senders_.find(envelope.sender());
+                std::cout << (it != senders_.end() ? it->second : "#" + std::to_string(envelope.sender())) << ": " << envelope.text() << std::endl;
+            }
+            break;
+        }
+
+        case protocol::MessageType::names:
+            // Who the sender numbers are (see protocol::MessageType::names).
+            for (std::uint32_t count = reader.u32(); count > 0 && reader.ok(); --count)
+            {
+                auto id = reader.u32();
+                auto name = reader.str();
+                if (reader.ok())
+                {
+                    senders_[id] = std::string(name);
+                }
+            }
+            break;
+
+        case protocol::MessageType::notice:
+            std::cout << body << std::endl;
+            break;
+
+        case protocol::MessageType::direct:
+        {
+            auto sender = reader.str();
+            auto text = reader.rest();
+            if (reader.ok())
+            {
+                std::cout << "[private] " << sender << ": " << text << std::endl;
+            }
+            break;
+        }
+
+        case protocol::MessageType::ping:
+            send(protocol::MessageType::pong, std::string(body));
+            break;
+
+        default:
+            break; // Presence, files... a bot can ignore those.
+        }
+    }
+
+    stream_protocol::socket socket_;
+    std::mutex write_mutex_;
+    std::atomic<bool> server_gone_{false};
+    std::unordered_map<std::uint32_t, std::string> senders_; // Only used by the reading thread.
+#if defined(SHM_RING_SUPPORTED)
+    std::unique_ptr<shm_ring::Writer> ring_;
+#endif
+};
+#endif
+
+int main(int argc, char *argv[])
+{
+    bool use_ring = argc == 4 && std::string(argv[3]) == "--ring";
+    if (argc != 3 && !use_ring)
+    {
+        std::cerr << "Usage: ./bot <server's local socket> <name> [--ring]\n";
+        return 1;
+    }
+    if (std::string_view(argv[2]).size() > protocol::max_name_length)
+    {
+        std::cerr << "The name can be at most " << protocol::max_name_length << " bytes long.\n";
+        return 1;
+    }
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    try
+    {
+        boost::asio::io_context io_context;
+        Bot bot(io_context, argv[1]);
+        if (!bot.hello(argv[2]))
+        {
+            std::cerr << "The name is too long to send - " << protocol::max_string_length << " bytes at most.\n";
+            return 1;
+        }
+        if (use_ring)
+        {
+#if defined(SHM_RING_SUPPORTED)
+            if (!bot.attach_ring())
+            {
+                std::cerr << "Couldn't set up the shared memory ring - sending over the socket instead.\n";
+            }
+#else
+            std::cerr << "Shared memory rings need Linux - sending over the socket instead.\n";
+#endif
+        }
+
+        std::thread reader([&bot]()
+                           { bot.read_frames(); });
+
+        std::string line;
+        while (std::getline(std::cin, line))
+        {
+            if (!line.empty())
+            {
+                bot.post(line);
+            }
+        }
+#if defined(SHM_RING_SUPPORTED)
+        bot.wait_for_ring();
+#endif
+        bot.finish();
+        reader.join();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Exception: " << e.what() << "\n";
+        return 1;
+    }
+#else
+    std::cerr << "This system doesn't have local sockets.\n";
+#endif
+
+    return 0;
+}
+
+// g++ -o bot bot.cpp -lssl -lcrypto -pthread -std=c++20
+// (protocol.hpp uses OpenSSL for its SHA-256 - that's why -lssl -lcrypto.)
+
+/*
+
+
+*/
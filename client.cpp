@@ -1,177 +1,1816 @@
 #include <iostream>
+#include <utility> // Boost 1.74's awaitable.hpp uses std::exchange without including this itself.
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <optional>
+#include <random>
+#include <set>
+#include <unordered_map>
+#include <fstream>
+#include <filesystem>
+#include "protocol.hpp"
+#include "compression.hpp"
+#include "peer.hpp"
+#include "datagram.hpp"
+
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+#include <unistd.h>
+#else
 #include <thread>
+#endif
 
 // Overview:
 // The io_context object is used to manage the I/O services. It's the main big boss that runs the show 😎
 // The server has its own io_context object. Each client has its own io_context object.
 // The io_context object is created in the main function.
 // Boost ASIO means we can have many operations running all at the same time - sending and receiving simultaneously.
+//
+// The client used to have two threads: a detached thread blocking on read_some() and the main thread blocking on std::getline() + write().
+// Both threads used the same ssl::stream at the same time - and an SSL stream is NOT safe to use from two threads at once.
+// Now everything runs on the one io_context, on the one (main) thread, as three coroutines (C++20 co_await - see run()):
+// - reader() reads from the server,
+// - writer() sends everything that goes into the write queue, one async_write at a time,
+// - keyboard() reads stdin asynchronously too, so typing never blocks anything else.
+//
+// If the connection drops, run() connects again by itself (see reconnect_delay()). Lines typed in the meantime wait in the write queue.
+//
+// With --p2p the client also takes direct connections from other clients, for private messages and /sendto files (see peer.hpp).
+// Those run on the same io_context too: accept_peers(), connect_peer() and a reader() + writer() inside every PeerLink.
 
 // Same as for server.cpp
 using boost::asio::ip::tcp;
+using boost::asio::awaitable;
+using boost::asio::use_awaitable;
+using boost::asio::redirect_error;
+
+// Added colouring to the text.
+// You need to set the colour back to normal after you've finished with the colouring.
+// We create colour objects to set and reset the colour of the text.
+const std::string colour = "\033[38;5;112m";
+const std::string file_colour = "\033[38;5;153m";
+const std::string direct_colour = "\033[38;5;213m";
+const std::string reset = "\033[0m";
+// orange = "\033[38;2;255;165;0m" olive_green = "\033[38;5;112m" light_blue = "\033[38;5;153m" light_purple = "\033[38;5;189m" light_green = "\033[38;5;120m" light_red = "\033[38;5;196m" light_yellow = "\033[38;5;226m" light_orange = "\033[38;5;215m" light_pink = "\033[38;5;213m" light_cyan = "\033[38;5;87m" light_brown = "\033[38;5;130m" light_grey = "\033[38;5;250m" light_black = "\033[38;5;232m" light_white = "\033[38;5;231m" gray = "\033[1;30m" yellow = "\033[1;33m"
+
+// The Client class is the client's equivalent of the Session class in server.cpp.
+// I originally didn't make a class for the client because it was a simple client that connects to the server and sends messages.
+// Now that everything is asynchronous, the coroutines need somewhere to keep the state they share - so a class it is.
+class Client
+{
+public:
+    // The constructor takes the io_context object, the ssl_context object, the host name, the port number and the name of the chat client.
+    Client(boost::asio::io_context &io_context, boost::asio::ssl::context &ssl_context, const std::string &host, short port, const std::string &name, bool p2p)
+        : io_context_(io_context), ssl_context_(ssl_context), resolver_(io_context), host_(host), port_(port), name_(name), p2p_(p2p),
+          write_signal_(io_context), input_signal_(io_context), reconnect_timer_(io_context), watchdog_timer_(io_context), random_(std::random_device{}())
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+          ,
+          input_(io_context)
+#endif
+    {
+        // These two timers never go off by themselves - they are only used to wake up a coroutine that is waiting (see wake()).
+        write_signal_.expires_at(boost::asio::steady_timer::time_point::max());
+        input_signal_.expires_at(boost::asio::steady_timer::time_point::max());
+    }
+
+    // This starts the run() coroutine. io_context.run() in main() is what actually runs it.
+    // The Client lives in main() until io_context.run() returns, so the coroutines can safely use `this`.
+    void start()
+    {
+        if (p2p_)
+        {
+            start_peer_listener();
+        }
+        boost::asio::co_spawn(io_context_, run(), boost::asio::detached);
+    }
+
+private:
+    struct Announced
+    {
+        std::string name;
+        std::uint64_t size;
+    };
+
+    struct Upload
+    {
+        protocol::Hash hash;
+        std::filesystem::path path;
+        std::ifstream file;
+        std::uint64_t size = 0;
+        std::uint64_t offset = 0;
+    };
+
+    struct Download
+    {
+        std::filesystem::path path;
+        std::ofstream file;
+        protocol::Hasher hasher;
+        std::string from; // Who is sending it, for a file coming over a direct connection.
+    };
+
+    // The keyboard and the writer keep going for as long as the client runs. The connection comes and goes:
+    // connect, read until it drops, wait a bit, connect again. We only stop for good once we have sent everything
+    // after the keyboard input has ended (or if there is nothing left to send when the connection drops).
+    awaitable<void> run()
+    {
+        boost::asio::co_spawn(io_context_, writer(), boost::asio::detached);
+        boost::asio::co_spawn(io_context_, keyboard(), boost::asio::detached);
+
+        int failures = 0;
+        while (!closed_)
+        {
+            if (co_await connect())
+            {
+                failures = 0;
+                co_await reader();
+                disconnected();
+            }
+
+            if (finishing_ || closed_ || (input_done_ && write_queue_.empty() && interrupted_uploads_.empty() && downloads_.empty()))
+            {
+                break;
+            }
+
+            // A server that is being replaced tells us when to come back (see going_away in handle_frame()). That isn't a failure,
+            // so it doesn't count towards the backoff.
+            auto delay = going_away_ ? *going_away_ : reconnect_delay(failures++);
+            going_away_.reset();
+            std::cout << "Trying to connect again in " << std::chrono::duration_cast<std::chrono::milliseconds>(delay).count() << " ms..." << std::endl;
+            boost::system::error_code ignored;
+            reconnect_timer_.expires_after(delay);
+            co_await reconnect_timer_.async_wait(redirect_error(use_awaitable, ignored));
+        }
+
+        close();
+    }
+
+    // How long to wait before connecting again: "exponential backoff with full jitter".
+    // The longest we might wait doubles with each failed try (0.5 s, 1 s, 2 s ... up to 30 s), and the actual wait is a random
+    // time between 0 and that. The random part matters: when the server restarts, every client loses its connection at the
+    // same moment. Without it, they would all come back at exactly the same moment too (and again, and again...).
+    std::chrono::milliseconds reconnect_delay(int failures)
+    {
+        auto longest = std::min(max_reconnect_delay, first_reconnect_delay * (1 << std::min(failures, 16)));
+        std::uniform_int_distribution<long long> pick(0, longest.count());
+        return std::chrono::milliseconds(pick(random_));
+    }
+
+    // resolve -> connect -> handshake -> hello. Returns false if any step failed.
+    // Every co_await waits for the async operation to finish without blocking the thread - it reads like blocking code but isn't.
+    awaitable<bool> connect()
+    {
+        boost::system::error_code ec;
+
+        // The tcp::resolver class is used to resolve hostnames into IP addresses and service names into port numbers.
+        // It can take something like www.domain.com and convert it into an IP address, along with translating a service name like "http" into a port number like 80.
+        // In our case, if we give "localhost" as the hostname, the code will resolve it to the IP address 127.0.0.1.
+        auto endpoints = co_await resolver_.async_resolve(host_, std::to_string(port_), redirect_error(use_awaitable, ec));
+        if (ec)
+        {
+            std::cerr << "Couldn't find the server " << host_ << ": " << ec.message() << std::endl;
+            co_return false;
+        }
+
+        // An SSL stream can't be used again once its connection is gone, so every connection gets a fresh one.
+        auto stream = std::make_shared<boost::asio::ssl::stream<tcp::socket>>(io_context_, ssl_context_);
+        ssl_socket_ = stream;
+
+        // Here we connect to the server using the endpoints that we resolved.
+        // The lowest_layer function is used to get the underlying socket object.
+        // We now have access to the raw TCP socket wrapped by the SSL/TLS layer.
+        co_await boost::asio::async_connect(stream->lowest_layer(), endpoints, redirect_error(use_awaitable, ec));
+        if (ec || closed_)
+        {
+            std::cerr << "Couldn't connect to the server - is it running? (" << ec.message() << ")" << std::endl;
+            co_return false;
+        }
+        std::cout << "Connected to server at " << host_ << ":" << port_ << std::endl;
+
+        // Chat lines are small - we don't want the operating system holding them back to fill up a bigger packet.
+        stream->lowest_layer().set_option(tcp::no_delay(true), ec);
+
+        // If we have been connected before, offer the server the TLS session from last time.
+        // If the server still remembers it, the handshake skips the expensive public key maths - which matters a lot
+        // when thousands of clients all reconnect at once.
+        if (tls_session_)
+        {
+            SSL_set_session(stream->native_handle(), tls_session_.get());
+        }
+
+        // Perform the SSL handshake
+        co_await stream->async_handshake(boost::asio::ssl::stream_base::client, redirect_error(use_awaitable, ec));
+        if (ec || closed_)
+        {
+            std::cerr << "Exception during SSL handshake: " << ec.message() << std::endl;
+            boost::system::error_code ignored;
+            stream->lowest_layer().close(ignored);
+            co_return false;
+        }
+
+        std::cout << "Client side: SSL handshake completed successfully with the server"
+                  << (SSL_session_reused(stream->native_handle()) ? " (resumed the previous TLS session)." : ".") << std::endl
+                  << std::endl;
+
+        // The hello has to be the very first frame, in front of any lines that were waiting while we were disconnected.
+        send_hello();
+        send_peer_info();
+        connected_ = true;
+        last_heard_ = std::chrono::steady_clock::now();
+        resume_transfers();
+        wake(write_signal_);
+        boost::asio::co_spawn(io_context_, watchdog(connection_number_), boost::asio::detached);
+
+        std::cout << "Connected to server, ready to send and receive messages." << std::endl;
+        std::cout << "To share a file type: /send <path to file>" << std::endl;
+        std::cout << "To send a private message type: /msg <name> <message>. To see who is online type: /who" << std::endl;
+        std::cout << "To send a file to one person type: /sendto <name> <path to file>" << std::endl;
+        std::cout << "To set your status type: /status <text>" << std::endl;
+        std::cout << std::endl
+                  << std::endl;
+        co_return true;
+    }
+
+    // The server pings us if it hasn't sent us anything for protocol::heartbeat_interval. If we hear nothing at all for heartbeat_timeout, the connection is
+    // dead even if the operating system hasn't noticed yet (a laptop going to sleep, a Wi-Fi network dropping out...),
+    // so we close it and run() connects again.
+    awaitable<void> watchdog(std::uint64_t connection)
+    {
+        boost::system::error_code ignored;
+        while (!closed_ && connected_ && connection == connection_number_)
+        {
+            if (std::chrono::steady_clock::now() - last_heard_ >= protocol::heartbeat_timeout)
+            {
+                std::cout << "The server stopped answering." << std::endl;
+                drop_connection(*ssl_socket_);
+                co_return;
+            }
+            watchdog_timer_.expires_after(std::chrono::seconds(1));
+            co_await watchdog_timer_.async_wait(redirect_error(use_awaitable, ignored));
+        }
+    }
+
+    // Called when reader() has finished - the connection is gone (or we closed it).
+    // - We keep the TLS session so the next handshake can resume it.
+    // - Chat lines and private messages that haven't been written yet stay in the queue and go out after the next hello.
+    //   Anything else in the queue (file pieces, the old hello) is thrown away - resume_transfers() starts the files again.
+    //   Compressed lines are unpacked again, because the next connection might not use the same dictionary (or compression at all).
+    // - Files we were uploading or downloading are started again from the beginning on the next connection.
+    void disconnected()
+    {
+        connected_ = false;
+        ++connection_number_;
+        watchdog_timer_.cancel();
+        stop_datagrams(); // Its key came from this connection - the next one gets a new one.
+
+        // We keep a copy: when a connection ends without a clean TLS shutdown (which is exactly what a dropped connection is),
+        // OpenSSL marks that connection's own session object as "don't resume". That rule is from TLS 1.0 - since TLS 1.1 resuming is allowed.
+        SSL_SESSION *session = SSL_get_session(ssl_socket_->native_handle());
+        if (session && SSL_SESSION_is_resumable(session))
+        {
+            tls_session_.reset(SSL_SESSION_dup(session));
+        }
+
+        std::deque<std::shared_ptr<const protocol::Frame>> kept;
+        queued_bytes_ = 0;
+        for (const auto &frame : write_queue_)
+        {
+            auto type = protocol::frame_type(*frame);
+            if (type != protocol::MessageType::chat && type != protocol::MessageType::direct)
+            {
+                continue;
+            }
+            auto original = frame;
+            if (frame->header[4] & protocol::compressed_flag)
+            {
+                if (!codec_ || !codec_->decompress(frame->body, inflated_))
+                {
+                    continue;
+                }
+                original = protocol::make_frame(type, std::string(inflated_.begin(), inflated_.end()));
+            }
+            queued_bytes_ += protocol::header_length + original->body.size();
+            kept.push_back(std::move(original));
+        }
+        write_queue_ = std::move(kept);
+        codec_.reset();
+
+        for (const auto &upload : uploads_)
+        {
+            interrupted_uploads_.push_back(upload.path);
+        }
+        for (const auto &offer : offers_)
+        {
+            interrupted_uploads_.push_back(offer.second);
+        }
+        uploads_.clear();
+        offers_.clear();
+
+        // Introductions we were waiting for won't come now. Direct connections don't need the server, so they stay up.
+        for (const auto &name : requested_)
+        {
+            direct_failed(name, false);
+        }
+    }
+
+    // Offer the files we were uploading again (the server might have had enough of them to say "stored" already),
+    // and ask again for the files we were downloading, starting them from the beginning.
+    void resume_transfers()
+    {
+        auto uploads = std::move(interrupted_uploads_);
+        interrupted_uploads_.clear();
+        for (const auto &path : uploads)
+        {
+            offer_file(path);
+        }
+
+        for (auto &[hash, download] : downloads_)
+        {
+            download.file.close();
+            download.file.open(download.path, std::ios::binary | std::ios::trunc);
+            download.hasher = protocol::Hasher();
+            request_file(hash);
+        }
+    }
+
+    // ---------------------------------- //
+    // Added Sunday 02 March 2025 0009 - I need to send the name of the chat client, this is a bit of a hack I think, I would prefer to pass in as an object
+    // This is the first message that the server receives from the client. It reads in and stores the name of the client.
+    // The name goes in a hello frame (see protocol.hpp), along with the optional features we support and the ID of the
+    // compression dictionary we already have (if any). The server answers with a welcome frame - see handle_welcome().
+    // When we are reconnecting, the hello also says which server run we were talking to and the last message we saw from it,
+    // so the server can send us what we missed while we were gone.
+    void send_hello()
+    {
+        std::string hello;
+        protocol::Writer writer(hello);
+        writer.str(name_);
+        writer.u32(protocol::feature_zstd | protocol::feature_datagrams);
+        writer.u32(compression::dictionary_id(compression::load_dictionary()));
+        writer.u64(server_run_id_);
+        writer.u64(last_seen_);
+        if (writer.truncated())
+        {
+            std::cerr << "Your name is too long to send - " << protocol::max_string_length << " bytes at most.\n";
+            close();
+            return;
+        }
+
+        auto frame = protocol::make_frame(protocol::MessageType::hello, std::move(hello));
+        queued_bytes_ += protocol::header_length + frame->body.size();
+        write_queue_.push_front(std::move(frame));
+    }
+
+    // ---------------------------------- //
+    // Reading from the server.
+
+    // This function reads data from the server AND outputs to the screen.
+    // Every message is a frame (see protocol.hpp). Like the server, we read as much as the socket has and then handle every
+    // complete frame in the buffer - a busy chat room sends lots of small frames and this is one read for all of them.
+    // A frame that is only partly there stays at the front of read_buffer_ until the rest of it arrives.
+    awaitable<void> reader()
+    {
+        auto stream = ssl_socket_;
+        boost::system::error_code ec;
+        read_buffer_.resize(read_buffer_size);
+        std::size_t start = 0;
+        std::size_t end = 0;
+
+        while (!closed_)
+        {
+            protocol::MessageType type;
+            bool compressed = false;
+            std::size_t body_length = 0;
+            while (end - start >= protocol::header_length)
+            {
+                if (!protocol::parse_header(read_buffer_.data() + start, type, compressed, body_length))
+                {
+                    std::cerr << "The server sent a message we don't understand.\n";
+                    drop_connection(*stream);
+                    co_return;
+                }
+                if (end - start < protocol::header_length + body_length)
+                {
+                    break;
+                }
+
+                std::string_view message(read_buffer_.data() + start + protocol::header_length, body_length);
+                if (compressed)
+                {
+                    if (!codec_ || !codec_->decompress(message, inflated_))
+                    {
+                        std::cerr << "The server sent a message we couldn't decompress.\n";
+                        drop_connection(*stream);
+                        co_return;
+                    }
+                    message = std::string_view(inflated_.data(), inflated_.size());
+                }
+
+                start += protocol::header_length + body_length;
+                handle_frame(type, message);
+            }
+
+            if (start > 0)
+            {
+                std::memmove(read_buffer_.data(), read_buffer_.data() + start, end - start);
+                end -= start;
+                start = 0;
+            }
+            if (end >= protocol::header_length)
+            {
+                read_buffer_.resize(std::max(read_buffer_.size(), protocol::header_length + body_length));
+            }
+
+            std::size_t length = co_await stream->async_read_some(
+                boost::asio::buffer(read_buffer_.data() + end, read_buffer_.size() - end), redirect_error(use_awaitable, ec));
+            if (ec)
+            {
+                // If the error is an EOF error, the connection was closed cleanly by the server.
+                if (finishing_ || going_away_)
+                {
+                    // We asked for this - see finish_if_done() and going_away in handle_frame().
+                }
+                else if (ec == boost::asio::error::eof)
+                {
+                    std::cout << "Connection closed by server." << std::endl;
+                }
+                else if (ec != boost::asio::error::operation_aborted)
+                {
+                    std::cerr << "Lost the connection to the server: " << ec.message() << std::endl;
+                }
+                break;
+            }
+            end += length;
+            last_heard_ = std::chrono::steady_clock::now();
+        }
+
+        drop_connection(*stream);
+    }
+
+    void handle_frame(protocol::MessageType type, std::string_view message)
+    {
+        switch (type)
+        {
+        case protocol::MessageType::chat:
+        {
+            // Chat lines start with their sequence number. We remember the last one we saw so we can pick up from there after a reconnect.
+            // If we see one we already have (the server re-sent a few more than we needed), we skip it.
+            // Who sent it comes as a number - the server told us who the numbers are in names frames (see handle_names()).
+            // Both are in the envelope in front of the text (see protocol::Envelope), read straight out of the frame.
+            protocol::Envelope envelope(message);
+            if (envelope.ok() && seen(envelope.sequence()))
+            {
+                // We print the data that was received from the server.
+                // To print in colour, we have to use in the format given below. I'll change this when I do the GUI version.
+                auto it = senders_.find(envelope.sender());
+                std::cout << colour << (it != senders_.end() ? it->second : "#" + std::to_string(envelope.sender())) << ": " << envelope.text() << reset << "\n";
+            }
+            break;
+        }
+
+        case protocol::MessageType::names:
+            handle_names(message);
+            break;
+
+        case protocol::MessageType::notice:
+            std::cout << colour << message << reset << "\n";
+            break;
+
+        case protocol::MessageType::file_announce:
+        {
+            protocol::Envelope envelope(message);
+            protocol::Reader reader(envelope.ok() ? envelope.text() : std::string_view());
+            auto hash = reader.hash();
+            auto size = reader.u64();
+            auto name = reader.str();
+            auto sender = reader.str();
+            if (envelope.ok() && reader.ok() && (envelope.sequence() == 0 || seen(envelope.sequence()))) // 0: a private file, which isn't numbered - see Session::announce_file().
+            {
+                announced_[hash] = {std::string(name), size};
+                std::cout << file_colour << sender << " shared " << name << " (" << size << " bytes). Type: /get " << protocol::to_hex(hash) << reset << "\n";
+            }
+            break;
+        }
+
+        case protocol::MessageType::file_status:
+            handle_file_status(message);
+            break;
+
+        case protocol::MessageType::file_chunk:
+            receive_file_chunk(message, downloads_);
+            break;
+
+        case protocol::MessageType::welcome:
+            handle_welcome(message);
+            break;
+
+        case protocol::MessageType::ping:
+            queue(protocol::make_frame(protocol::MessageType::pong, std::string(message)));
+            break;
+
+        case protocol::MessageType::direct:
+        {
+            protocol::Reader reader(message);
+            auto sender = reader.str();
+            auto text = reader.rest();
+            if (reader.ok())
+            {
+                std::cout << direct_colour << "[private] " << sender << ": " << text << reset << "\n";
+            }
+            break;
+        }
+
+        case protocol::MessageType::who:
+            print_who(message);
+            break;
+
+        case protocol::MessageType::presence:
+            handle_presence(message);
+            break;
+
+        case protocol::MessageType::peer_intro:
+            handle_peer_intro(message);
+            break;
+
+        case protocol::MessageType::events:
+            print_events(message);
+            break;
+
+        case protocol::MessageType::going_away:
+        {
+            // The server is being replaced by a new version (a hot restart). We leave now, and come back at a random moment
+            // within the window it gave us - if every client came back at once, the new server would get all the TLS handshakes at once.
+            // Nothing is lost: unsent lines stay queued, and the new server has the message history so we pick up where we left off.
+            protocol::Reader reader(message);
+            auto window = reader.u32();
+            if (reader.ok())
+            {
+                std::uniform_int_distribution<long long> pick(0, window);
+                going_away_ = std::chrono::milliseconds(pick(random_));
+                std::cout << "The server is restarting - reconnecting in a moment." << std::endl;
+                drop_connection(*ssl_socket_);
+            }
+            break;
+        }
+
+        default:
+            break; // Something newer than this client - ignore it.
+        }
+    }
+
+    // Who the sender numbers in chat frames are. We get all the ones in use right after the welcome, and then each new one just
+    // before its first line. Numbers are never reused while the server runs, so we only ever add to the list.
+    void handle_names(std::string_view body)
+    {
+        protocol::Reader reader(body);
+        for (std::uint32_t count = reader.u32(); count > 0 && reader.ok(); --count)
+        {
+            auto id = reader.u32();
+            auto name = reader.str();
+            if (reader.ok())
+            {
+                senders_[id] = std::string(name);
+            }
+        }
+    }
+
+    // Who is online. When we log in the server sends a snapshot: how many are online and the first page of names - /who pages
+    // through the rest. Then one update per tick with who joined and who left (see Server::flush_presence() in server.cpp).
+    // We print the changes, but not the snapshot itself. online_ is only the names we've been told about, so it's used to skip a
+    // "joined" for somebody who was already in the snapshot - a "left" is printed either way.
+    void handle_presence(std::string_view body)
+    {
+        protocol::Reader reader(body);
+        auto kind = static_cast<protocol::PresenceKind>(reader.u8());
+        auto online = reader.u32();
+        if (kind == protocol::PresenceKind::snapshot)
+        {
+            online_.clear();
+        }
+
+        std::vector<std::string_view> joined;
+        std::vector<std::string_view> left;
+        for (auto count = reader.u32(); count > 0 && reader.ok(); --count)
+        {
+            auto name = reader.str();
+            if (online_.insert(std::string(name)).second)
+            {
+                joined.push_back(name);
+            }
+        }
+        for (auto count = reader.u32(); count > 0 && reader.ok(); --count)
+        {
+            auto name = reader.str();
+            online_.erase(std::string(name));
+            left.push_back(name);
+        }
+        if (!reader.ok())
+        {
+            return;
+        }
+
+        if (kind != protocol::PresenceKind::update)
+        {
+            if (kind == protocol::PresenceKind::snapshot)
+            {
+                std::cout << colour << online << " online. Type /who to see who." << reset << "\n";
+            }
+            return;
+        }
+        print_names(joined, "joined");
+        print_names(left, "left");
+    }
+
+    // "alice joined", "alice, bob and carol joined", "alice, bob, carol and 997 others joined".
+    void print_names(const std::vector<std::string_view> &names, const char *what)
+    {
+        if (names.empty())
+        {
+            return;
+        }
+        constexpr std::size_t shown = 3;
+        std::cout << colour;
+        for (std::size_t i = 0; i < names.size() && i < shown; ++i)
+        {
+            if (i > 0)
+            {
+                std::cout << (i + 1 == names.size() ? " and " : ", ");
+            }
+            std::cout << names[i];
+        }
+        if (names.size() > shown)
+        {
+            std::cout << " and " << names.size() - shown << " others";
+        }
+        std::cout << " " << what << "." << reset << "\n";
+    }
+
+    // One page of the server's list of who is online - see Session::handle_who() in server.cpp.
+    void print_who(std::string_view body)
+    {
+        protocol::Reader reader(body);
+        auto total = reader.u32();
+        auto page = reader.u32();
+        auto pages = reader.u32();
+        std::string names;
+        for (auto count = reader.u16(); count > 0 && reader.ok(); --count)
+        {
+            names += names.empty() ? "" : ", ";
+            names += reader.str();
+        }
+        if (!reader.ok())
+        {
+            return;
+        }
+
+        std::cout << colour << total << " online";
+        if (pages > 1)
+        {
+            std::cout << " (page " << page + 1 << " of " << pages << ")";
+        }
+        std::cout << ": " << names << reset << "\n";
+        if (page + 1 < pages)
+        {
+            std::cout << colour << "Type /who " << page + 2 << " for more." << reset << "\n";
+        }
+    }
+
+    // Returns false if we have already seen the message with this sequence number.
+    bool seen(std::uint64_t sequence)
+    {
+        if (sequence <= last_seen_)
+        {
+            return false;
+        }
+        last_seen_ = sequence;
+        return true;
+    }
+
+    // The server's answer to our hello. If compression is switched on, we set up the codec with the server's dictionary -
+    // either the copy we saved last time, or the one the server just sent us (which we then save for next time).
+    void handle_welcome(std::string_view body)
+    {
+        protocol::Reader reader(body);
+        auto enabled = reader.u32();
+        auto dictionary_id = reader.u32();
+        auto run_id = reader.u64();
+        auto latest = reader.u64();
+        auto sent_dictionary = reader.rest();
+        if (!reader.ok())
+        {
+            return;
+        }
+        senders_.clear(); // The server sends the ones we need again, straight after this.
+
+        // A different run ID means this is our first connection, or the server has restarted since we last talked to it.
+        // Either way there is nothing to catch up on - we start counting from the server's latest message.
+        if (run_id != server_run_id_)
+        {
+            server_run_id_ = run_id;
+            last_seen_ = latest;
+        }
+
+        if (enabled & protocol::feature_datagrams)
+        {
+            start_datagrams();
+        }
+
+        if (!(enabled & protocol::feature_zstd))
+        {
+            return;
+        }
+
+        std::string dictionary;
+        if (!sent_dictionary.empty())
+        {
+            dictionary = std::string(sent_dictionary);
+            std::filesystem::create_directories(std::filesystem::path(compression::dictionary_path).parent_path());
+            std::ofstream(compression::dictionary_path, std::ios::binary | std::ios::trunc).write(dictionary.data(), dictionary.size());
+        }
+        else if (dictionary_id != 0)
+        {
+            dictionary = compression::load_dictionary();
+            if (compression::dictionary_id(dictionary) != dictionary_id)
+            {
+                return; // The server thinks we have its dictionary but we don't - safer to leave compression off.
+            }
+        }
+
+        codec_ = std::make_unique<compression::Codec>(dictionary);
+    }
+
+    // ---------------------------------- //
+    // Events and the UDP side channel - see datagram.hpp.
+
+    // The server has switched the side channel on for this connection. It's on the same port number as TCP, at the address
+    // we're connected to. If it doesn't come up (UDP is blocked), events simply keep going over TCP.
+    void start_datagrams()
+    {
+        boost::system::error_code ec;
+        auto server = ssl_socket_->lowest_layer().remote_endpoint(ec);
+        auto secret = datagram::export_secret(ssl_socket_->native_handle());
+        if (ec || secret.identity.empty())
+        {
+            return;
+        }
+        DatagramLink::Handlers handlers{
+            [this](protocol::MessageType type, std::string_view body)
+            {
+                if (type == protocol::MessageType::events)
+                {
+                    print_events(body);
+                }
+            },
+            [](bool up)
+            {
+                std::cout << (up ? "UDP side channel is up - status updates go over it." : "No UDP side channel - status updates go over TCP.") << std::endl;
+            }};
+        datagrams_ = std::make_shared<DatagramLink>(io_context_, datagram::udp::endpoint(server.address(), port_), std::move(secret), std::move(handlers));
+        datagrams_->start();
+    }
+
+    void stop_datagrams()
+    {
+        if (datagrams_)
+        {
+            datagrams_->close();
+            datagrams_.reset();
+        }
+    }
+
+    // Over UDP if we can. Otherwise in the stream - but only while we're connected: an event that waited for a reconnect would be stale.
+    void send_event(protocol::EventKind kind, std::string_view text)
+    {
+        if (text.size() > protocol::max_event_text)
+        {
+            std::cerr << "That's too long - " << protocol::max_event_text << " characters at most.\n";
+            return;
+        }
+        std::string body;
+        protocol::Writer writer(body);
+        writer.u8(static_cast<std::uint8_t>(kind));
+        writer.str(text);
+        auto frame = protocol::make_frame(protocol::MessageType::event, std::move(body));
+        if (datagrams_ && datagrams_->send(*frame))
+        {
+            return;
+        }
+        if (connected_)
+        {
+            queue(frame);
+        }
+    }
+
+    // One tick's events from the server. Our own come back too - we skip those.
+    // This console client can only see whole lines, so it never sends typing events itself - but it shows other people's.
+    void print_events(std::string_view body)
+    {
+        protocol::Reader reader(body);
+        for (auto count = reader.u32(); count > 0 && reader.ok(); --count)
+        {
+            auto kind = static_cast<protocol::EventKind>(reader.u8());
+            auto name = reader.str();
+            auto text = reader.str();
+            if (!reader.ok() || name == name_)
+            {
+                continue;
+            }
+            if (kind == protocol::EventKind::typing)
+            {
+                std::cout << colour << name << " is typing..." << reset << "\n";
+            }
+            else if (kind == protocol::EventKind::status)
+            {
+                std::cout << colour << name << (text.empty() ? std::string(" cleared their status.") : " is now: " + std::string(text)) << reset << "\n";
+            }
+        }
+    }
+
+    // ---------------------------------- //
+    // Writing to the server.
+
+    // Everything we send goes through here. If compression is on and it makes the frame smaller, the compressed version is queued instead.
+    // Frames wait in write_queue_ until writer() picks them up - only one async_write may be running on the stream at a time.
+    void queue(const std::shared_ptr<const protocol::Frame> &frame)
+    {
+        std::shared_ptr<const protocol::Frame> compressed = codec_ ? codec_->compress(*frame) : nullptr;
+        const auto &to_send = compressed ? compressed : frame;
+
+        queued_bytes_ += protocol::header_length + to_send->body.size() + to_send->tail.size();
+        write_queue_.push_back(to_send);
+        wake(write_signal_);
+    }
+
+    // This writes everything that is waiting in the queue with ONE async_write (up to a limit - see protocol::stage_frames()).
+    // If you paste a thousand lines, they get sent as a few big writes rather than a thousand tiny ones -
+    // fewer TLS records, fewer system calls, and it goes out at full speed.
+    awaitable<void> writer()
+    {
+        boost::system::error_code ec;
+
+        while (!closed_)
+        {
+            if (!connected_ || write_queue_.empty())
+            {
+                finish_if_done();
+                co_await wait(write_signal_);
+                continue;
+            }
+
+            // If the connection drops while this write is going, disconnected() rebuilds the queue - so afterwards we check
+            // connection_number_ to make sure we are still looking at the same queue before removing what we wrote.
+            auto stream = ssl_socket_;
+            auto connection = connection_number_;
+            std::size_t frames = protocol::stage_frames(write_queue_, write_staging_, write_buffers_, max_frames_per_write, max_bytes_per_write);
+            std::size_t length = co_await boost::asio::async_write(*stream, write_buffers_, redirect_error(use_awaitable, ec));
+            if (ec || connection != connection_number_)
+            {
+                drop_connection(*stream); // reader() notices, and run() connects again.
+                continue;
+            }
+
+            write_queue_.erase(write_queue_.begin(), write_queue_.begin() + frames);
+            queued_bytes_ -= length;
+
+            // If there is room in the queue again, send the next piece of any upload and let the keyboard carry on.
+            queue_next_chunk();
+            if (input_paused_ && queued_bytes_ < resume_input_bytes)
+            {
+                input_paused_ = false;
+                wake(input_signal_);
+            }
+        }
+    }
+
+    // write_signal_ and input_signal_ are timers set to go off "never". A coroutine with nothing to do waits on one of them,
+    // and cancelling the timer is how we wake it up. The wait "fails" with operation_aborted - that's fine, it's just the wake up call.
+    awaitable<void> wait(boost::asio::steady_timer &signal)
+    {
+        boost::system::error_code ignored;
+        co_await signal.async_wait(redirect_error(use_awaitable, ignored));
+    }
+
+    void wake(boost::asio::steady_timer &signal)
+    {
+        signal.cancel();
+    }
+
+    // ---------------------------------- //
+    // Reading from the keyboard (stdin).
+    //
+    // On Linux/macOS stdin is a file descriptor and Boost ASIO can wait on it just like a socket (posix::stream_descriptor).
+    // If stdin has been redirected from a normal file (./client ... < messages.txt), it can't be waited on - but reading a file never blocks, so we just read it in pieces.
+    // Windows consoles can't be read asynchronously by Boost ASIO, so there (only there) a small thread does std::getline and hands each line to the io_context.
+    //
+    // If the write queue gets too full (a huge paste on a slow link), we stop reading until writer() has sent most of it -
+    // so the data waits in the pipe / terminal instead of piling up in our memory.
+    awaitable<void> keyboard()
+    {
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+        // We hand ASIO a copy (dup) of stdin, so closing input_ later doesn't close the real stdin.
+        boost::system::error_code ec;
+        int descriptor = ::dup(STDIN_FILENO);
+        input_.assign(descriptor, ec);
+        bool input_is_file = false;
+        if (ec)
+        {
+            ::close(descriptor);
+            input_is_file = true;
+        }
+#else
+        start_input_thread();
+#endif
+
+        while (!closed_)
+        {
+            consume_input();
+            if (input_paused_)
+            {
+                co_await wait(input_signal_); // writer() wakes us once the queue has drained.
+                continue;
+            }
+            if (input_eof_)
+            {
+                input_done_ = true;
+                finish_if_done();
+                co_return;
+            }
+
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+            std::size_t length = 0;
+            if (input_is_file)
+            {
+                // Read the next piece of the file, then let the io_context run everything else before we handle it -
+                // so a huge file doesn't hog the io_context.
+                auto read = ::read(STDIN_FILENO, input_buffer_.prepare(input_chunk_size).data(), input_chunk_size);
+                length = read > 0 ? static_cast<std::size_t>(read) : 0;
+                ec = read > 0 ? boost::system::error_code() : boost::asio::error::eof;
+                co_await boost::asio::post(io_context_, use_awaitable);
+            }
+            else
+            {
+                // async_read_some grabs whatever has been typed (or pasted) so far - maybe half a line, maybe thousands of lines.
+                length = co_await input_.async_read_some(input_buffer_.prepare(input_chunk_size), redirect_error(use_awaitable, ec));
+            }
+            input_buffer_.commit(length);
+            if (ec)
+            {
+                input_eof_ = true; // Ctrl+D (or the end of the redirected file).
+            }
+#else
+            co_await wait(input_signal_); // The input thread wakes us when it has handed over a line.
+#endif
+        }
+    }
+
+#if !defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+    void start_input_thread()
+    {
+        std::thread(
+            [this]()
+            {
+                std::string line;
+                while (std::getline(std::cin, line))
+                {
+                    boost::asio::post(io_context_, [this, line]()
+                                      {
+                                          std::ostream(&input_buffer_) << line << '\n';
+                                          wake(input_signal_);
+                                      });
+                }
+                boost::asio::post(io_context_, [this]()
+                                  {
+                                      input_eof_ = true;
+                                      wake(input_signal_);
+                                  });
+            })
+            .detach();
+    }
+#endif
+
+    // Takes every complete line out of input_buffer_ and handles it.
+    // Stops early (and sets input_paused_) if the write queue is too full - keyboard() then waits until writer() has caught up.
+    void consume_input()
+    {
+        const char *data = static_cast<const char *>(input_buffer_.data().data());
+        std::string_view pending(data, input_buffer_.size());
+
+        std::size_t used = 0;
+        while (!closed_)
+        {
+            if (queued_bytes_ >= pause_input_bytes)
+            {
+                input_paused_ = true;
+                break;
+            }
+
+            auto end = pending.find('\n', used);
+            if (end == std::string_view::npos)
+            {
+                if (input_eof_ && used < pending.size())
+                {
+                    end = pending.size(); // The last line didn't end with a new line - send it anyway.
+                }
+                else
+                {
+                    break;
+                }
+            }
+
+            auto line = pending.substr(used, end - used);
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.remove_suffix(1); // Windows line endings.
+            }
+            used = std::min(end + 1, pending.size());
+            handle_line(line);
+        }
+        input_buffer_.consume(used);
+    }
 
-// This function reads data from the server AND outputs to the screen.
-// It reads data from the SSL/TLS-encrypted socket and stores it in a buffer for processing.
-void read_from_server(boost::asio::ssl::stream<tcp::socket> &ssl_socket)
-{
-    try
+    void handle_line(std::string_view message)
     {
-        // Loop runs indefinitely until the server closes the connection
-        for (;;)
+        // Lines starting with /send or /get are file sharing commands, everything else is chat.
+        if (message.rfind("/send ", 0) == 0)
         {
-            // Declare a char array to store the reply from the server
-            // This is our buffer that we use to store the data that is read from the server.
-            char reply[1024];
+            offer_file(std::string(message.substr(6)));
+            return;
+        }
 
-            // Make an error code object to store any errors that occur
-            boost::system::error_code error;
+        if (message.rfind("/get ", 0) == 0)
+        {
+            protocol::Hash hash;
+            if (!protocol::from_hex(message.substr(5), hash))
+            {
+                std::cerr << "Usage: /get <hash>\n";
+                return;
+            }
+            start_download(hash);
+            return;
+        }
 
-            // Read some data from the server and store it in the reply buffer
-            // The read_some function reads data from the socket and stores it in the buffer.
-            // The function returns the number of bytes read. We need the size of the buffer to know how many bytes ti write further below.
-            size_t reply_length = ssl_socket.read_some(boost::asio::buffer(reply), error);
+        // /msg <name> <message> - a private message, only <name> sees it.
+        if (message.rfind("/msg ", 0) == 0)
+        {
+            auto rest = message.substr(5);
+            auto space = rest.find(' ');
+            if (space == std::string_view::npos || space == 0 || space + 1 == rest.size())
+            {
+                std::cerr << "Usage: /msg <name> <message>\n";
+                return;
+            }
+            send_direct(std::string(rest.substr(0, space)), rest.substr(space + 1));
+            return;
+        }
 
-            // If there is an error, we check if the error is an EOF error
-            // If it is, we print a message and break out of the loop
-            if (error == boost::asio::error::eof)
+        // /sendto <name> <path> - a file for one person only. Directly if we can, through the server if we can't.
+        if (message.rfind("/sendto ", 0) == 0)
+        {
+            auto rest = message.substr(8);
+            auto space = rest.find(' ');
+            if (space == std::string_view::npos || space == 0 || space + 1 == rest.size())
             {
-                // Connection closed cleanly by peer
-                std::cout << "Connection closed by server. Code will stop running now.\n";
-                break;
+                std::cerr << "Usage: /sendto <name> <path to file>\n";
+                return;
             }
-            else if (error)
+            send_file_to(std::string(rest.substr(0, space)), std::string(rest.substr(space + 1)));
+            return;
+        }
+
+        // /status <text> - a short status everyone online sees ("away", "back in 5"). It's an event, not a chat line: it isn't kept,
+        // so people who log in later don't see it. /status on its own clears it.
+        if (message == "/status" || message.rfind("/status ", 0) == 0)
+        {
+            send_event(protocol::EventKind::status, message.size() > 8 ? message.substr(8) : std::string_view());
+            return;
+        }
+
+        // /who, /who 2, /who 3... - who is online, one page at a time.
+        if (message == "/who" || message.rfind("/who ", 0) == 0)
+        {
+            unsigned long page = 1;
+            if (message.size() > 5)
             {
-                throw boost::system::system_error(error); // Some other error
+                page = std::strtoul(std::string(message.substr(5)).c_str(), nullptr, 10);
             }
+            std::string body;
+            protocol::Writer(body).u32(static_cast<std::uint32_t>(page > 0 ? page - 1 : 0)); // Pages are counted from 0 on the wire.
+            queue(protocol::make_frame(protocol::MessageType::who, std::move(body)));
+            return;
+        }
+
+        if (message.empty())
+        {
+            return; // std::cin >> name leaves the end of that line behind - don't send it as an empty chat message.
+        }
+
+        // The message goes in a chat frame so the server knows where it starts and ends.
+        queue(protocol::make_frame(protocol::MessageType::chat, std::string(message)));
+    }
+
+    // ---------------------------------- //
+    // File sharing.
 
-            // Added colouring to the text.
-            // You need to set the colour back to normal after you've finished with the colouring.
-            // We create colour objects to set and reset the colour of the text.
-            std::string colour = "\033[38;5;112m";
-            std::string reset = "\033[0m";
-            // orange = "\033[38;2;255;165;0m" olive_green = "\033[38;5;112m" light_blue = "\033[38;5;153m" light_purple = "\033[38;5;189m" light_green = "\033[38;5;120m" light_red = "\033[38;5;196m" light_yellow = "\033[38;5;226m" light_orange = "\033[38;5;215m" light_pink = "\033[38;5;213m" light_cyan = "\033[38;5;87m" light_brown = "\033[38;5;130m" light_grey = "\033[38;5;250m" light_black = "\033[38;5;232m" light_white = "\033[38;5;231m" gray = "\033[1;30m" yellow = "\033[1;33m"
+    // Works out the hash of a file and sends a file_offer. The server answers with file_status - see handle_file_status().
+    // With a recipient, the server only tells that one person about the file (a /sendto that couldn't go directly).
+    void offer_file(const std::filesystem::path &path, const std::string &recipient = {})
+    {
+        protocol::Hash hash;
+        std::uint64_t size = 0;
+        if (!peer::hash_file(path, hash, size))
+        {
+            std::cerr << "Can't open " << path.string() << "\n";
+            return;
+        }
+        offers_[hash] = path;
 
-            // We print the data that was received from the server.
-            // TODO - add the name of the client to the message.
-            // To print in colour, we have to use in the format given below. I'll change this when I do the GUI version.
-            // std::cout << colour << "Received message: ";
-            std::cout << colour;
-            std::cout.write(reply, reply_length);
-            std::cout << reset << "\n";
+        std::string body;
+        protocol::Writer writer(body);
+        writer.hash(hash);
+        writer.u64(size);
+        writer.str(path.filename().string());
+        if (!recipient.empty())
+        {
+            writer.str(recipient);
+        }
+        if (writer.truncated())
+        {
+            std::cerr << "That name is too long to send - " << protocol::max_string_length << " bytes at most.\n";
+            offers_.erase(hash);
+            return;
         }
+        queue(protocol::make_frame(protocol::MessageType::file_offer, std::move(body)));
     }
-    catch (std::exception &e)
+
+    // The download is noted straight away (not when the first piece arrives), so we know to wait for it before exiting.
+    void start_download(const protocol::Hash &hash)
     {
-        std::cerr << "Exception: " << e.what() << "\n";
+        if (downloads_.count(hash))
+        {
+            return; // Already on its way.
+        }
+
+        auto known = announced_.find(hash);
+        std::string name = known != announced_.end() ? known->second.name : protocol::to_hex(hash);
+        std::filesystem::create_directories("downloads");
+
+        auto &download = downloads_[hash];
+        download.path = std::filesystem::path("downloads") / std::filesystem::path(name).filename();
+        download.file.open(download.path, std::ios::binary | std::ios::trunc);
+        request_file(hash);
     }
-}
 
-// This function is the client function that connects to the server
-// It takes the io_context object, the ssl_context object, the host name, and the port number as arguments.
-// I didn't make a class for the client because it's a simple client that connects to the server and sends messages.
-// void client(boost::asio::io_context &io_context, boost::asio::ssl::context &ssl_context, const std::string &host, short port)
-void client(boost::asio::io_context &io_context, boost::asio::ssl::context &ssl_context, const std::string &host, short port, const std::string &name) // I need to send the name of the chat client, this is a bit of a hack I think, I would prefer to pass in as an object
-{
-    // std::cout << "Client function has been called." << std::endl; // Used for debugging
+    void request_file(const protocol::Hash &hash)
+    {
+        std::string body;
+        protocol::Writer(body).hash(hash);
+        queue(protocol::make_frame(protocol::MessageType::file_request, std::move(body)));
+    }
 
-    try
+    void handle_file_status(std::string_view message)
     {
-        // The tcp::resolver class is used to resolve hostnames into IP addresses and service names into port numbers.
-        // It can take something like www.domain.com and convert it into an IP address, along with translating a service name like "http" into a port number like 80.
-        // The resolver object is created with the io_context object, which is used to perform asynchronous operations.
-        // The resolver is used to perform the resolution process using the address and service names provided in string format.
-        tcp::resolver resolver(io_context);
-        // In our case, if we give "localhost" as the hostname, the code will resolve it to the IP address 127.0.0.1.
+        protocol::Reader reader(message);
+        auto hash = reader.hash();
+        auto status = static_cast<protocol::FileStatus>(reader.u8());
 
-        // The resolve function is called with the hostname and port number as arguments.
-        // The resolve function returns a list of endpoints that can be used to connect to the server.
-        // endpoints is a list of IP addresses and port numbers that can be used to connect to the server.
-        // host is for example "localhost" and port is for example 1234.
-        tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
+        if (!reader.ok())
+        {
+            return;
+        }
 
-        // The ssl_socket object is created with the io_context object and the ssl_context object.
-        // Once we have the SSL Socket object, we can connect to the server and send messages.
-        // The ssl::stream class is used to apply SSL/TLS to a normal TCP socket that would otherwise be encrypted.
-        boost::asio::ssl::stream<tcp::socket> ssl_socket(io_context, ssl_context);
+        // The server can't send us a file we asked for. It sends a notice saying why, too.
+        auto download = downloads_.find(hash);
+        if (download != downloads_.end() && status == protocol::FileStatus::rejected)
+        {
+            download->second.file.close();
+            std::error_code ignored;
+            std::filesystem::remove(download->second.path, ignored);
+            downloads_.erase(download);
+            finish_if_done();
+            return;
+        }
 
-        // Here we connect to the server using the endpoints that we resolved earlier.
-        // The lowest_layer function is used to get the underlying socket object.
-        // We now have access to the raw TCP socket wrapped by the SSL/TLS layer.
-        // boost::asio::connect(ssl_socket.lowest_layer(), endpoints);
-        // std::cout << "Connected to server at " << host << ":" << port << std::endl;
+        auto it = offers_.find(hash);
+        if (it == offers_.end())
+        {
+            return;
+        }
 
-        try
+        if (status == protocol::FileStatus::upload)
         {
-            boost::asio::connect(ssl_socket.lowest_layer(), endpoints);
-            std::cout << "Connected to server at " << host << ":" << port << std::endl;
+            std::cout << file_colour << "Uploading " << it->second.string() << "..." << reset << "\n";
+
+            Upload upload;
+            upload.hash = hash;
+            upload.path = it->second;
+            upload.file.open(it->second, std::ios::binary);
+            upload.size = std::filesystem::file_size(it->second);
+            uploads_.push_back(std::move(upload));
+            queue_next_chunk();
         }
-        catch (const std::exception &e)
+        offers_.erase(it);
+        finish_if_done();
+    }
+
+    // Uploads are sent one chunk at a time, and only while the write queue is nearly empty.
+    // That way a big upload never sits in memory all at once, and chat lines you type still get through in between the chunks.
+    void queue_next_chunk()
+    {
+        while (!uploads_.empty() && queued_bytes_ < protocol::file_chunk_size)
+        {
+            auto &upload = uploads_.front();
+            upload_buffer_.resize(protocol::file_chunk_size);
+            upload.file.read(upload_buffer_.data(), upload_buffer_.size());
+            std::size_t length = static_cast<std::size_t>(upload.file.gcount());
+
+            if (length > 0)
+            {
+                std::string body;
+                protocol::Writer writer(body);
+                writer.hash(upload.hash);
+                writer.u64(upload.size);
+                writer.u64(upload.offset);
+                writer.raw(std::string_view(upload_buffer_.data(), length));
+                upload.offset += length;
+                queue(protocol::make_frame(protocol::MessageType::file_chunk, std::move(body)));
+            }
+
+            // length == 0 means the file got shorter while we were sending it. The server will notice the hash doesn't match.
+            if (length == 0 || upload.offset >= upload.size)
+            {
+                uploads_.pop_front();
+            }
+        }
+    }
+
+    // One piece of a file we asked for with /get (or one somebody is sending us over a direct connection - those are in peer_downloads_).
+    // Downloads go into the "downloads" folder. Once the last piece is in, we check the hash so we know the file arrived exactly as it was shared.
+    void receive_file_chunk(std::string_view body, std::map<protocol::Hash, Download> &downloads)
+    {
+        protocol::Reader reader(body);
+        auto hash = reader.hash();
+        auto size = reader.u64();
+        auto offset = reader.u64();
+        auto bytes = reader.rest();
+        if (!reader.ok())
         {
-            std::cerr << "Exception: " << e.what() << std::endl;
+            return;
         }
 
-        // Perform the SSL handshake
-        // ssl_socket.handshake(boost::asio::ssl::stream_base::client);
-        // std::cout << "Client side: SSL handshake completed successfully with the server.\n";
+        auto it = downloads.find(hash);
+        if (it == downloads.end())
+        {
+            return; // We didn't ask for this one.
+        }
+
+        auto &download = it->second;
+        download.file.write(bytes.data(), bytes.size());
+        download.hasher.update(bytes.data(), bytes.size());
+
+        if (offset + bytes.size() >= size)
+        {
+            download.file.close();
+            bool ok = download.hasher.finish() == hash;
+            std::cout << file_colour << (ok ? "Downloaded " : "Download failed the hash check: ") << download.path.string() << reset << "\n";
+            downloads.erase(it);
+            finish_if_done();
+        }
+    }
+
+    // ---------------------------------- //
+    // Direct connections (--p2p). See peer.hpp for the whole idea.
+    //
+    // - We listen on a port the operating system picks, and tell the server about it (and our fingerprint) after every hello.
+    // - /msg and /sendto use a direct connection if there is one. If there isn't, /msg goes through the server as always and we ask
+    //   the server to introduce us, so the NEXT message goes directly. /sendto waits for the introduction (a file is worth waiting a moment for).
+    // - Whatever goes wrong (no --p2p on the other side, a firewall, a fingerprint that doesn't match), we remember that in direct_failed_
+    //   and use the server for that person from then on.
+
+    void start_peer_listener()
+    {
         try
         {
-            ssl_socket.handshake(boost::asio::ssl::stream_base::client);
-            std::cout << "Client side: SSL handshake completed successfully with the server." << std::endl
-                      << std::endl;
+            identity_ = std::make_unique<peer::Identity>(name_);
+            peer_context_ = std::make_unique<boost::asio::ssl::context>(boost::asio::ssl::context::tls);
+            identity_->use_in(*peer_context_);
+            peer_acceptor_ = std::make_unique<tcp::acceptor>(io_context_, tcp::endpoint(tcp::v4(), 0));
         }
         catch (const std::exception &e)
         {
-            std::cerr << "Exception during SSL handshake: " << e.what() << std::endl;
+            std::cerr << "Direct connections are off: " << e.what() << std::endl;
+            p2p_ = false;
+            return;
         }
+        std::cout << "Taking direct connections on port " << peer_acceptor_->local_endpoint().port() << "." << std::endl;
+        boost::asio::co_spawn(io_context_, accept_peers(), boost::asio::detached);
+    }
 
-        // ---------------------------------- //
-        // Added Sunday 02 March 2025 0009 - I need to send the name of the chat client, this is a bit of a hack I think, I would prefer to pass in as an object
-        // We write the name to the server using the ssl_socket object. This is the first message that the server receives from the client. It reads in and stores the name of the client in a newly added variable.
-        boost::asio::write(ssl_socket, boost::asio::buffer(name));
-
-        // I decided not to output this message - it's not needed. I'll remove in later version.
-        // std::cout << "Name sent to server." << std::endl;
-        // std::cout << std::endl
-        //           << std::endl;
-        // ---------------------------------- //
+    void send_peer_info()
+    {
+        if (!p2p_)
+        {
+            return;
+        }
+        std::string body;
+        protocol::Writer writer(body);
+        writer.u16(peer_acceptor_->local_endpoint().port());
+        writer.hash(identity_->fingerprint());
+        queue(protocol::make_frame(protocol::MessageType::peer_info, std::move(body)));
+    }
 
-        std::cout << "Connected to server, ready to send and receive messages." << std::endl;
-        std::cout << std::endl
-                  << std::endl;
+    void request_peer(const std::string &name)
+    {
+        if (!p2p_ || name == name_ || links_.count(name) || direct_failed_.count(name) || !requested_.insert(name).second)
+        {
+            return;
+        }
+        std::string body;
+        protocol::Writer(body).str(name);
+        queue(protocol::make_frame(protocol::MessageType::peer_request, std::move(body)));
+    }
+
+    void send_direct(const std::string &recipient, std::string_view text)
+    {
+        std::string body;
+        protocol::Writer writer(body);
+        if (auto link = links_.find(recipient); link != links_.end())
+        {
+            writer.str(name_);
+            writer.raw(text);
+            link->second->send(protocol::make_frame(protocol::MessageType::direct, std::move(body)));
+            return;
+        }
 
-        // We create a thread that reads data from the server.
-        // The thread is detached so that it runs independently of the main thread.
-        // read_from_server(ssl_socket) - this is the fn we made above - above, we got the ssl_socket.
-        std::thread(read_from_server, std::ref(ssl_socket)).detach();
-        // When a thread is detached, it becomes a detached thread, meaning it runs independently from the main program.
-        // std::ref() - this is used to pass the ssl_socket object by reference to the thread.
-        // I asked ChatGPT why we couldn't use &ssl_socket instead of std::ref(ssl_socket) - there was a long explanation. We can use, but then we need to change the function signature to take a reference to the ssl_socket object - this didn't make too much sense to be honest.
+        writer.str(recipient);
+        if (writer.truncated())
+        {
+            std::cerr << "That name is too long - nobody is called that.\n";
+            return;
+        }
+        writer.raw(text);
+        queue(protocol::make_frame(protocol::MessageType::direct, std::move(body)));
+        request_peer(recipient);
+    }
 
-        // We create a string object to store the message that we want to send to the server.
-        // We then use a while loop to keep reading messages from the user and sending them to the server.
-        // message gets over written all the time - so we can keep sending messages.
-        std::string message;
+    void send_file_to(const std::string &recipient, const std::filesystem::path &path)
+    {
+        if (auto link = links_.find(recipient); link != links_.end())
+        {
+            if (!link->second->send_file(path))
+            {
+                std::cerr << "Can't send " << path.string() << "\n";
+                return;
+            }
+            std::cout << file_colour << "Sending " << path.string() << " to " << recipient << " directly..." << reset << "\n";
+            return;
+        }
+        if (!p2p_ || direct_failed_.count(recipient) || recipient == name_)
+        {
+            offer_file(path, recipient);
+            return;
+        }
+        pending_files_[recipient].push_back(path);
+        request_peer(recipient);
+    }
 
-        // We have an indefinite loop that keeps on reading messages from the user and sending them to the server.
-        while (std::getline(std::cin, message))
+    // The server's answer to a peer_request - or, if somebody else asked, a heads-up that they are about to connect to us.
+    void handle_peer_intro(std::string_view body)
+    {
+        protocol::Reader reader(body);
+        auto name = std::string(reader.str());
+        auto host = std::string(reader.str());
+        auto port = reader.u16();
+        auto fingerprint = reader.hash();
+        if (!reader.ok() || !p2p_)
         {
-            // We write to the server using the ssl_socket object.
-            // The write function writes the message to the SSL socket.
-            boost::asio::write(ssl_socket, boost::asio::buffer(message));
+            return;
+        }
 
-            // std::cout << "Sent message: " << message << std::endl;
-            // std::cout << "Message sent to server." << std::endl; // Sunday 02 March 2025 0058 Don't need to print this message - it's not needed.
+        if (!requested_.count(name))
+        {
+            expected_peers_[fingerprint] = name;
+            return;
+        }
+        if (port == 0)
+        {
+            direct_failed(name, true);
+            return;
         }
-        // I asked ChatGPT why this loop wasn't detached like the one above. The answer was that the loop involves a cin - this in int's nature is a blocking fn. Trying to detach would apparently cause a lot of complexity. If cin where not involved and something else happend that didn't use somehing similar to cin, then detaching would maybe OK to do. I left it there.
+        boost::asio::co_spawn(io_context_, connect_peer(name, host, port, fingerprint), boost::asio::detached);
     }
-    // If we've had problems making the client, we catch the exception and print an error message.
-    catch (std::exception &e)
+
+    // A handshake (or connect) that takes longer than peer_timeout is given up on - the stream gets closed under it.
+    // The timer holds on to the stream, so it's safe even if the coroutine has finished by the time the timer goes off.
+    std::shared_ptr<boost::asio::steady_timer> peer_deadline(const std::shared_ptr<peer::PeerLink::Stream> &stream)
     {
-        std::cerr << "Exception: " << e.what() << "\n";
+        auto timer = std::make_shared<boost::asio::steady_timer>(io_context_, peer_timeout);
+        timer->async_wait([stream](const boost::system::error_code &ec)
+                          {
+                              if (!ec)
+                              {
+                                  boost::system::error_code ignored;
+                                  stream->lowest_layer().close(ignored);
+                              } });
+        return timer;
+    }
+
+    // We asked, so we connect. The certificate on the other end must have the fingerprint the server gave us.
+    awaitable<void> connect_peer(std::string name, std::string host, std::uint16_t port, protocol::Hash fingerprint)
+    {
+        boost::system::error_code ec;
+        auto stream = std::make_shared<peer::PeerLink::Stream>(io_context_, *peer_context_);
+        auto deadline = peer_deadline(stream);
+
+        tcp::endpoint endpoint(boost::asio::ip::make_address(host, ec), port);
+        if (!ec)
+        {
+            co_await stream->lowest_layer().async_connect(endpoint, redirect_error(use_awaitable, ec));
+        }
+        if (!ec)
+        {
+            stream->lowest_layer().set_option(tcp::no_delay(true), ec);
+            co_await stream->async_handshake(boost::asio::ssl::stream_base::client, redirect_error(use_awaitable, ec));
+        }
+        deadline->cancel();
+
+        if (closed_)
+        {
+            co_return;
+        }
+        if (ec || peer::remote_fingerprint(stream->native_handle()) != fingerprint)
+        {
+            direct_failed(name, true);
+            co_return;
+        }
+        add_link(std::move(*stream), name, true);
+    }
+
+    awaitable<void> accept_peers()
+    {
+        while (!closed_)
+        {
+            boost::system::error_code ec;
+            tcp::socket socket(io_context_);
+            co_await peer_acceptor_->async_accept(socket, redirect_error(use_awaitable, ec));
+            if (ec)
+            {
+                if (closed_ || ec == boost::asio::error::operation_aborted)
+                {
+                    co_return;
+                }
+                continue;
+            }
+            boost::asio::co_spawn(io_context_, accept_peer(std::move(socket)), boost::asio::detached);
+        }
+    }
+
+    // Somebody connected to us. We only keep the connection if their certificate is one the server introduced to us.
+    awaitable<void> accept_peer(tcp::socket socket)
+    {
+        boost::system::error_code ec;
+        auto stream = std::make_shared<peer::PeerLink::Stream>(std::move(socket), *peer_context_);
+        auto deadline = peer_deadline(stream);
+        stream->lowest_layer().set_option(tcp::no_delay(true), ec);
+        co_await stream->async_handshake(boost::asio::ssl::stream_base::server, redirect_error(use_awaitable, ec));
+        deadline->cancel();
+        if (ec || closed_)
+        {
+            co_return;
+        }
+
+        auto known = expected_peers_.find(peer::remote_fingerprint(stream->native_handle()));
+        if (known == expected_peers_.end())
+        {
+            boost::system::error_code ignored;
+            stream->lowest_layer().close(ignored);
+            co_return;
+        }
+        add_link(std::move(*stream), known->second, false);
+    }
+
+    void add_link(peer::PeerLink::Stream stream, const std::string &name, bool we_connected)
+    {
+        // If we both asked at the same moment there are two connections. Both sides keep the one started by the name that sorts first.
+        if (auto existing = links_.find(name); existing != links_.end())
+        {
+            if (we_connected != (name_ < name))
+            {
+                boost::system::error_code ignored;
+                stream.lowest_layer().close(ignored);
+                return;
+            }
+            existing->second->close();
+        }
+
+        peer::PeerLink::Handlers handlers{
+            [this](peer::PeerLink &link, protocol::MessageType type, std::string_view body)
+            { handle_peer_frame(link, type, body); },
+            [this](peer::PeerLink &)
+            { finish_if_done(); },
+            [this](peer::PeerLink &link)
+            { link_closed(link); }};
+        auto link = std::make_shared<peer::PeerLink>(std::move(stream), name, std::move(handlers));
+        links_[name] = link;
+        requested_.erase(name);
+        link->start();
+        std::cout << direct_colour << "Connected directly to " << name << " - private messages and /sendto files to them skip the server now." << reset << std::endl;
+
+        auto pending = pending_files_.find(name);
+        if (pending != pending_files_.end())
+        {
+            auto files = std::move(pending->second);
+            pending_files_.erase(pending);
+            for (const auto &path : files)
+            {
+                send_file_to(name, path);
+            }
+        }
+    }
+
+    void handle_peer_frame(peer::PeerLink &link, protocol::MessageType type, std::string_view body)
+    {
+        protocol::Reader reader(body);
+        switch (type)
+        {
+        case protocol::MessageType::direct:
+        {
+            reader.str(); // The sender's name - but we know for certain who is on the other end, so we use that.
+            auto text = reader.rest();
+            if (reader.ok())
+            {
+                std::cout << direct_colour << "[direct] " << link.name() << ": " << text << reset << "\n";
+            }
+            break;
+        }
+
+        case protocol::MessageType::file_offer:
+        {
+            auto hash = reader.hash();
+            auto size = reader.u64();
+            auto file_name = reader.str();
+            if (!reader.ok() || peer_downloads_.count(hash))
+            {
+                break;
+            }
+            std::filesystem::create_directories("downloads");
+            auto &download = peer_downloads_[hash];
+            download.path = std::filesystem::path("downloads") / std::filesystem::path(std::string(file_name)).filename();
+            download.file.open(download.path, std::ios::binary | std::ios::trunc);
+            download.from = link.name();
+            std::cout << file_colour << link.name() << " is sending you " << file_name << " (" << size << " bytes) directly..." << reset << "\n";
+            if (size == 0)
+            {
+                download.file.close();
+                std::cout << file_colour << "Downloaded " << download.path.string() << reset << "\n";
+                peer_downloads_.erase(hash);
+            }
+            break;
+        }
+
+        case protocol::MessageType::file_chunk:
+            receive_file_chunk(body, peer_downloads_);
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    // A direct connection closed. Private messages that hadn't gone out yet go through the server instead,
+    // and files that were only partly received are thrown away.
+    void link_closed(peer::PeerLink &link)
+    {
+        auto it = links_.find(link.name());
+        if (it == links_.end() || it->second.get() != &link)
+        {
+            return; // The losing one of two connections - see add_link().
+        }
+        auto keep_alive = it->second;
+        links_.erase(it);
+        if (closed_)
+        {
+            return;
+        }
+        std::cout << direct_colour << "The direct connection to " << link.name() << " closed." << reset << std::endl;
+
+        for (const auto &frame : link.unsent())
+        {
+            if (protocol::frame_type(*frame) == protocol::MessageType::direct)
+            {
+                protocol::Reader reader(frame->body);
+                reader.str();
+                auto text = reader.rest();
+                std::string body;
+                protocol::Writer writer(body);
+                writer.str(link.name());
+                writer.raw(text);
+                queue(protocol::make_frame(protocol::MessageType::direct, std::move(body)));
+            }
+        }
+
+        for (auto download = peer_downloads_.begin(); download != peer_downloads_.end();)
+        {
+            if (download->second.from != link.name())
+            {
+                ++download;
+                continue;
+            }
+            download->second.file.close();
+            std::error_code ignored;
+            std::filesystem::remove(download->second.path, ignored);
+            std::cout << file_colour << "The direct transfer of " << download->second.path.filename().string() << " from " << link.name() << " was cut off." << reset << "\n";
+            download = peer_downloads_.erase(download);
+        }
+        finish_if_done();
+    }
+
+    // We can't talk to this person directly - from now on everything for them goes through the server, including /sendto files that were waiting.
+    void direct_failed(const std::string &name, bool tell)
+    {
+        requested_.erase(name);
+        auto pending = pending_files_.find(name);
+        if (!tell && pending == pending_files_.end())
+        {
+            return; // Just a lost introduction (we got disconnected) - we'll ask again next time.
+        }
+        direct_failed_.insert(name);
+        if (tell)
+        {
+            std::cout << direct_colour << "Couldn't connect to " << name << " directly - going through the server." << reset << std::endl;
+        }
+        if (pending != pending_files_.end())
+        {
+            auto files = std::move(pending->second);
+            pending_files_.erase(pending);
+            for (const auto &path : files)
+            {
+                offer_file(path, name);
+            }
+        }
+    }
+
+    bool peers_busy() const
+    {
+        for (const auto &[name, link] : links_)
+        {
+            if (link->busy())
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // ---------------------------------- //
+
+    // Once the keyboard input has ended (Ctrl+D, or the end of a redirected file) we finish sending what's queued,
+    // wait for any file transfers to complete, and then tell the server we are done sending.
+    // We don't just close() here: closing a socket that still has unread data in it makes the operating system reset the connection,
+    // and the server would throw away our last messages. Instead we "half close" - the server sees the end of our data,
+    // closes its side, and reader() then gets EOF and closes properly. io_context.run() then returns.
+    void finish_if_done()
+    {
+        if (connected_ && !finishing_ && input_done_ && write_queue_.empty() && offers_.empty() && uploads_.empty() && downloads_.empty() &&
+            pending_files_.empty() && peer_downloads_.empty() && !peers_busy())
+        {
+            finishing_ = true;
+            boost::system::error_code ignored;
+            ssl_socket_->lowest_layer().shutdown(tcp::socket::shutdown_send, ignored);
+        }
+    }
+
+    // Closes one connection. reader() then finishes, and run() decides whether to connect again.
+    void drop_connection(boost::asio::ssl::stream<tcp::socket> &stream)
+    {
+        boost::system::error_code ignored;
+        stream.lowest_layer().close(ignored);
     }
-}
+
+    // Stops everything for good.
+    void close()
+    {
+        if (closed_)
+        {
+            return;
+        }
+        closed_ = true;
+
+        boost::system::error_code ignored;
+        if (ssl_socket_)
+        {
+            ssl_socket_->lowest_layer().close(ignored);
+        }
+        stop_datagrams();
+        reconnect_timer_.cancel();
+        watchdog_timer_.cancel();
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+        input_.close(ignored);
+#endif
+        if (peer_acceptor_)
+        {
+            peer_acceptor_->close(ignored);
+        }
+        auto links = links_; // close() takes each one out of links_.
+        for (auto &[name, link] : links)
+        {
+            link->close();
+        }
+        // Wake up writer() and keyboard() if they are waiting, so they see closed_ and finish too.
+        wake(write_signal_);
+        wake(input_signal_);
+    }
+
+    static constexpr std::size_t max_frames_per_write = 256;
+    static constexpr std::size_t max_bytes_per_write = 256 * 1024;
+    static constexpr std::size_t input_chunk_size = 64 * 1024;
+    static constexpr std::size_t pause_input_bytes = 1024 * 1024; // Stop reading the keyboard when this much is waiting to be sent...
+    static constexpr std::size_t resume_input_bytes = 256 * 1024;  // ...and start again once it's down to this.
+
+    static constexpr std::chrono::milliseconds first_reconnect_delay{500};
+    static constexpr std::chrono::milliseconds max_reconnect_delay{30 * 1000};
+
+    boost::asio::io_context &io_context_;
+    boost::asio::ssl::context &ssl_context_;
+    tcp::resolver resolver_;
+
+    // The ssl_socket object is created with the io_context object and the ssl_context object - a new one for every connection.
+    // The ssl::stream class is used to apply SSL/TLS to a normal TCP socket that would otherwise be unencrypted.
+    // It's a shared_ptr because reader() and writer() each hold on to the stream they are using - when we reconnect,
+    // the old stream stays alive until the operations that were still running on it have finished.
+    std::shared_ptr<boost::asio::ssl::stream<tcp::socket>> ssl_socket_;
+    std::unique_ptr<SSL_SESSION, decltype(&SSL_SESSION_free)> tls_session_{nullptr, SSL_SESSION_free}; // From the last connection, for resuming.
+    bool connected_ = false;
+    std::uint64_t connection_number_ = 0;
+
+    std::string host_;
+    short port_;
+    std::string name_;
+    bool p2p_ = false; // --p2p: take direct connections from other clients.
+
+    // This is our buffer that we use to store the data that is read from the server - see reader().
+    std::vector<char> read_buffer_;
+    std::vector<char> inflated_; // Where compressed bodies get unpacked to.
+    static constexpr std::size_t read_buffer_size = 16 * 1024;
+
+    // Frames waiting to be sent, and the buffers of the write that is running right now.
+    std::deque<std::shared_ptr<const protocol::Frame>> write_queue_;
+    std::string write_staging_;
+    std::vector<boost::asio::const_buffer> write_buffers_;
+    std::size_t queued_bytes_ = 0;
+
+    // How writer() and keyboard() get woken up - see wait() and wake().
+    boost::asio::steady_timer write_signal_;
+    boost::asio::steady_timer input_signal_;
+
+    boost::asio::steady_timer reconnect_timer_;
+    boost::asio::steady_timer watchdog_timer_;
+    std::chrono::steady_clock::time_point last_heard_; // When we last read anything from the server - see watchdog().
+    std::mt19937 random_; // For the reconnect jitter.
+    std::optional<std::chrono::milliseconds> going_away_; // Set when the server asked us to come back later - see handle_frame().
+
+    // Which server run we are talking to, and the sequence number of the last chat message / file announcement we saw from it.
+    std::uint64_t server_run_id_ = 0;
+    std::uint64_t last_seen_ = 0;
+
+    std::set<std::string> online_; // Who we know is online - see handle_presence().
+    std::unordered_map<std::uint32_t, std::string> senders_; // Sender number -> name, for chat lines - see handle_names().
+    std::shared_ptr<DatagramLink> datagrams_; // The UDP side channel, while this connection has one - see start_datagrams().
+
+    // The keyboard.
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+    boost::asio::posix::stream_descriptor input_;
+#endif
+    boost::asio::streambuf input_buffer_;
+    bool input_paused_ = false;
+    bool input_eof_ = false;  // We have reached the end of stdin...
+    bool input_done_ = false; // ...and handled every line from it.
+
+    std::map<protocol::Hash, std::filesystem::path> offers_; // Files we offered and might have to upload.
+    std::map<protocol::Hash, Announced> announced_;          // Files other people shared, so we know their names when we /get them.
+    std::deque<Upload> uploads_;
+    std::vector<char> upload_buffer_;
+    std::map<protocol::Hash, Download> downloads_;
+    std::vector<std::filesystem::path> interrupted_uploads_; // Offered again on the next connection.
+
+    // Only set once the server's welcome frame says compression is on. See compression.hpp.
+    std::unique_ptr<compression::Codec> codec_;
+
+    // Direct connections - see peer.hpp and the "Direct connections" part above.
+    std::unique_ptr<peer::Identity> identity_;
+    std::unique_ptr<boost::asio::ssl::context> peer_context_;
+    std::unique_ptr<tcp::acceptor> peer_acceptor_;
+    std::map<std::string, std::shared_ptr<peer::PeerLink>> links_;      // Open direct connections, by name.
+    std::map<protocol::Hash, std::string> expected_peers_;               // Fingerprints the server introduced to us, and whose they are.
+    std::set<std::string> requested_;                                    // We sent a peer_request and are waiting for the intro.
+    std::set<std::string> direct_failed_;                                // Don't try these again - go through the server.
+    std::map<std::string, std::vector<std::filesystem::path>> pending_files_; // /sendto files waiting for a direct connection.
+    std::map<protocol::Hash, Download> peer_downloads_;
+    static constexpr std::chrono::seconds peer_timeout{5};
+
+    bool finishing_ = false;
+    bool closed_ = false;
+};
 
 int main(int argc, char *argv[])
 {
@@ -187,6 +1826,7 @@ int main(int argc, char *argv[])
     std::string ip_address;
     std::string port_number;
     std::string name;
+    bool p2p = false;
 
     if (arguements_passed_in == 0) // Now we run the code and ask the user to give inputs
     {
@@ -225,18 +1865,26 @@ int main(int argc, char *argv[])
                   << std::endl;
         // ---------------------------------- //
     }
-    else if (arguements_passed_in == 3)
+    else if (arguements_passed_in == 3 || (arguements_passed_in == 4 && std::string(argv[4]) == "--p2p"))
     {
         // std::cout << "THREE arguments passed in." << std::endl;
 
         ip_address = argv[1];
         port_number = argv[2];
         name = argv[3];
+        p2p = arguements_passed_in == 4; // Take direct connections from other clients - see peer.hpp.
     }
     else
     {
         // The user has called the function incorrectly. We give instruction how to call.
-        std::cerr << "Usage: ./client <ip_address> <port_number> <name>\n";
+        std::cerr << "Usage: ./client <ip_address> <port_number> <name> [--p2p]\n";
+        return 1;
+    }
+
+    // The server turns away longer names (and just drops the connection), so we say so here instead.
+    if (name.size() > protocol::max_name_length)
+    {
+        std::cerr << "Your name can be at most " << protocol::max_name_length << " bytes long.\n";
         return 1;
     }
 
@@ -260,10 +1908,12 @@ int main(int argc, char *argv[])
         std::cerr << "Error loading certificate: " << e.what() << std::endl;
     }
 
-    // We call the client function with the io_context object, the ssl_context object, the host name, and the port number.
-    // client(io_context, ssl_context, argv[1], std::atoi(argv[2]));
-    // client(io_context, ssl_context, ip_address, std::stoi(port_number)); Sunday 02 March 2025 0030
-    client(io_context, ssl_context, ip_address, std::stoi(port_number), name);
+    // We create the Client with the io_context object, the ssl_context object, the host name, the port number and the name.
+    // start() only starts the run() coroutine - io_context.run() is what actually runs everything,
+    // and it returns once the connection has been closed and there is nothing left to do.
+    Client client(io_context, ssl_context, ip_address, std::stoi(port_number), name, p2p);
+    client.start();
+    io_context.run();
 
     return 0;
 }
@@ -281,6 +1931,12 @@ int main(int argc, char *argv[])
 // VSCODE prompted this as well:
 // g++ -o client client.cpp -L/C/Coding/C++/boost_1_87_0/stage/lib -lboost_system-mgw14-mt-x64-1_87 -lboost_filesystem-mgw14-mt-x64-1_87 -lws2_32 -lmswsock -lssl -lcrypto -pthread -std=c++11
 // g++ -o client client.cpp -L/C/Coding/C++/boost_1_87_0/stage/lib -lboost_system-mgw14-mt-x64-1_87 -lboost_filesystem-mgw14-mt-x64-1_87 -lws2_32 -lmswsock -lssl -lcrypto -pthread -std=c++11
+// protocol.hpp uses std::filesystem and std::string_view, so we now need C++17:
+// g++ -o client client.cpp -L/C/Coding/C++/boost_1_87_0/stage/lib -lboost_system-mgw14-mt-x64-1_87 -lboost_filesystem-mgw14-mt-x64-1_87 -lws2_32 -lmswsock -lssl -lcrypto -pthread -std=c++17
+// compression.hpp needs zstd (MSYS2: pacman -S mingw-w64-ucrt-x86_64-zstd), so add -lzstd:
+// g++ -o client client.cpp -L/C/Coding/C++/boost_1_87_0/stage/lib -lboost_system-mgw14-mt-x64-1_87 -lboost_filesystem-mgw14-mt-x64-1_87 -lws2_32 -lmswsock -lssl -lcrypto -lzstd -pthread -std=c++17
+// The client is written with coroutines (co_await) now, so we need C++20:
+// g++ -o client client.cpp -L/C/Coding/C++/boost_1_87_0/stage/lib -lboost_system-mgw14-mt-x64-1_87 -lboost_filesystem-mgw14-mt-x64-1_87 -lws2_32 -lmswsock -lssl -lcrypto -lzstd -pthread -std=c++20
 
 /*
 
@@ -0,0 +1,118 @@
+#pragma once
+
+// compression.hpp
+// Optional zstd compression of frame bodies - shared by client.cpp and server.cpp.
+//
+// How it's switched on:
+// - The client says in its hello frame that it can do zstd, and which dictionary it already has (by dictionary ID, 0 = none).
+// - The server answers with a welcome frame saying whether compression is on, and which dictionary to use.
+//   If the client doesn't have that dictionary yet, the welcome frame carries the dictionary bytes and the client saves them.
+// - From then on either side MAY compress a frame. A compressed frame has protocol::compressed_flag set in its type byte.
+//   Frames are only sent compressed if that actually makes them smaller.
+//
+// Why a dictionary? A chat line like "lol see you at 5" is far too short for normal compression to find anything to re-use.
+// A dictionary trained on lots of typical chat lines (see train_dictionary.cpp) gives zstd that shared history up front,
+// so even short lines shrink.
+
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+#include <zstd.h>
+#include "protocol.hpp"
+
+namespace compression
+{
+    // Where the trained dictionary lives. The server loads it at start up, the client caches the copy the server sends it here.
+    inline const char *dictionary_path = "compression/chat.dict";
+
+    inline std::string load_dictionary(const std::string &path = dictionary_path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    // The dictionary ID is stored inside the dictionary itself. 0 means "no dictionary".
+    inline std::uint32_t dictionary_id(const std::string &dictionary)
+    {
+        return dictionary.empty() ? 0 : ZSTD_getDictID_fromDict(dictionary.data(), dictionary.size());
+    }
+
+    // One compressor + decompressor pair, set up with (optionally) a dictionary.
+    // The dictionary is "digested" once into a CDict/DDict here - doing that for every message would cost more than the compression saves.
+    // Not thread safe - use one Codec per thread (the server has one io thread, the client keeps one per connection).
+    class Codec
+    {
+    public:
+        explicit Codec(const std::string &dictionary = {}, int level = 3)
+            : cctx_(ZSTD_createCCtx(), ZSTD_freeCCtx), dctx_(ZSTD_createDCtx(), ZSTD_freeDCtx),
+              cdict_(dictionary.empty() ? nullptr : ZSTD_createCDict(dictionary.data(), dictionary.size(), level), ZSTD_freeCDict),
+              ddict_(dictionary.empty() ? nullptr : ZSTD_createDDict(dictionary.data(), dictionary.size()), ZSTD_freeDDict),
+              level_(level)
+        {
+        }
+
+        // Compresses the body (and tail, if the frame has one) into a new frame.
+        // Returns nullptr if compressing didn't make it smaller - the caller then just sends the original frame.
+        std::shared_ptr<const protocol::Frame> compress(const protocol::Frame &frame)
+        {
+            std::size_t tail_size = frame.tail.size();
+            std::size_t input_size = frame.body.size() + tail_size;
+            if (input_size < minimum_size)
+            {
+                return nullptr;
+            }
+
+            // zstd wants one contiguous input. Chat frames have no tail, so usually we can compress the body directly.
+            const char *input = frame.body.data();
+            if (tail_size > 0)
+            {
+                scratch_.assign(frame.body.begin(), frame.body.end());
+                const char *tail = static_cast<const char *>(frame.tail.data());
+                scratch_.insert(scratch_.end(), tail, tail + tail_size);
+                input = scratch_.data();
+            }
+
+            std::string output = protocol::take_body(); // Usually has room already - see protocol::Frame.
+            output.resize(ZSTD_compressBound(input_size));
+            std::size_t length = cdict_
+                                     ? ZSTD_compress_usingCDict(cctx_.get(), output.data(), output.size(), input, input_size, cdict_.get())
+                                     : ZSTD_compressCCtx(cctx_.get(), output.data(), output.size(), input, input_size, level_);
+
+            if (ZSTD_isError(length) || length >= input_size)
+            {
+                return nullptr;
+            }
+
+            output.resize(length);
+            return protocol::make_frame(protocol::frame_type(frame), std::move(output), {}, nullptr, true);
+        }
+
+        // Decompresses a compressed body into out. Returns false if it's broken or would be bigger than a frame is allowed to be.
+        bool decompress(std::string_view input, std::vector<char> &out)
+        {
+            unsigned long long size = ZSTD_getFrameContentSize(input.data(), input.size());
+            if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN || size > protocol::max_body_length)
+            {
+                return false;
+            }
+
+            out.resize(static_cast<std::size_t>(size));
+            std::size_t length = ddict_
+                                     ? ZSTD_decompress_usingDDict(dctx_.get(), out.data(), out.size(), input.data(), input.size(), ddict_.get())
+                                     : ZSTD_decompressDCtx(dctx_.get(), out.data(), out.size(), input.data(), input.size());
+            return !ZSTD_isError(length) && length == out.size();
+        }
+
+    private:
+        static constexpr std::size_t minimum_size = 8; // Below this the zstd frame header alone is bigger than anything we could save.
+
+        std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx_;
+        std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx_;
+        std::unique_ptr<ZSTD_CDict, decltype(&ZSTD_freeCDict)> cdict_;
+        std::unique_ptr<ZSTD_DDict, decltype(&ZSTD_freeDDict)> ddict_;
+        int level_;
+        std::vector<char> scratch_;
+    };
+}
@@ -0,0 +1,663 @@
+#pragma once
+
+// datagram.hpp
+// A UDP side channel (DTLS) for small "right now or never" events - see EventKind in protocol.hpp.
+//
+// Everything else goes through the one TCP connection, in order. That's what we want for chat lines and files - but it means a
+// status change sent while a 64 KB file chunk is on its way has to wait for the whole chunk (and if a TCP packet is lost, for the
+// resend too). That's "head of line blocking". Events don't need any of TCP's guarantees: if one gets lost, the next one replaces it.
+// So when both sides support it (./server ... --udp), they also go over UDP, where nothing waits for anything else.
+//
+// UDP isn't encrypted, so we use DTLS - TLS for datagrams. The key for it comes from the TLS connection the client already has:
+// both ends ask OpenSSL for "keying material" from that connection (RFC 5705 - export_key()) and get the same secret bytes,
+// which nobody else can work out. One part is the name the client gives ("identity"), the other is the DTLS key (a "pre-shared key").
+// So the DTLS handshake needs no certificates, and a DTLS association can only belong to the client whose TLS connection made the key.
+//
+// If UDP doesn't get through (a firewall, some Wi-Fi networks), the handshake never finishes and the client gives up after a few
+// seconds. Everything then keeps going over TCP, like before. The server sends events over UDP only to clients that have
+// sent something over it recently (the client sends a ping every keepalive_interval).
+//
+// OpenSSL normally reads and writes a socket itself. Here it only ever sees memory (two memory "BIOs"): we hand it each datagram
+// that arrives, and send whatever it gives us back. That way one UDP socket on the server serves every client, on the io_context like everything else.
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <boost/asio.hpp>
+#include <openssl/ssl.h>
+#include "protocol.hpp"
+
+namespace datagram
+{
+    using boost::asio::ip::udp;
+
+    constexpr std::size_t mtu = 1200;          // Small enough to get through nearly any network without being split up.
+    constexpr std::size_t max_payload = 1000;  // The most we put in one datagram (an event batch) - the rest of mtu is for DTLS itself.
+    constexpr std::size_t psk_length = 32;
+    constexpr std::chrono::seconds keepalive_interval{10};
+    constexpr std::chrono::seconds stale_after{25};      // No datagram from a client for this long - it goes back to TCP.
+    constexpr std::chrono::seconds handshake_timeout{4}; // How long the client tries before deciding UDP is blocked.
+
+    // The identity (hex) and the key, both exported from a TLS connection. The labels start with EXPERIMENTAL, as RFC 5705 asks for private use.
+    struct Secret
+    {
+        std::string identity;
+        std::string key;
+    };
+
+    inline Secret export_secret(SSL *ssl)
+    {
+        Secret secret;
+        unsigned char id[16];
+        unsigned char key[psk_length];
+        static constexpr char id_label[] = "EXPERIMENTAL chat datagram id";
+        static constexpr char key_label[] = "EXPERIMENTAL chat datagram key";
+        if (SSL_export_keying_material(ssl, id, sizeof(id), id_label, sizeof(id_label) - 1, nullptr, 0, 0) != 1 ||
+            SSL_export_keying_material(ssl, key, sizeof(key), key_label, sizeof(key_label) - 1, nullptr, 0, 0) != 1)
+        {
+            return secret;
+        }
+        static constexpr char digits[] = "0123456789abcdef";
+        for (unsigned char byte : id)
+        {
+            secret.identity += digits[byte >> 4];
+            secret.identity += digits[byte & 15];
+        }
+        secret.key.assign(reinterpret_cast<const char *>(key), sizeof(key));
+        return secret;
+    }
+
+    // An SSL_CTX for DTLS 1.2 with a pre-shared key, no certificates.
+    inline SSL_CTX *make_context(bool server)
+    {
+        SSL_CTX *context = SSL_CTX_new(server ? DTLS_server_method() : DTLS_client_method());
+        SSL_CTX_set_min_proto_version(context, DTLS1_2_VERSION);
+        SSL_CTX_set_cipher_list(context, "PSK-AES128-GCM-SHA256");
+        return context;
+    }
+
+    // One DTLS association, driven through memory BIOs. receive() takes a datagram in, take_output() gives the datagram to send.
+    class Association
+    {
+    public:
+        Association(SSL_CTX *context, bool server) : ssl_(SSL_new(context), SSL_free)
+        {
+            BIO *in = BIO_new(BIO_s_mem());
+            BIO *out = BIO_new(BIO_s_mem());
+            BIO_set_mem_eof_return(in, -1); // "Nothing there yet" rather than "end of file".
+            BIO_set_mem_eof_return(out, -1);
+            SSL_set_bio(ssl_.get(), in, out);
+            SSL_set_options(ssl_.get(), SSL_OP_NO_QUERY_MTU); // There's no socket to ask - we tell it.
+            SSL_set_mtu(ssl_.get(), mtu);
+            SSL_set_app_data(ssl_.get(), this);
+            if (server)
+            {
+                SSL_set_accept_state(ssl_.get());
+            }
+            else
+            {
+                SSL_set_connect_state(ssl_.get());
+            }
+        }
+
+        SSL *native_handle() { return ssl_.get(); }
+        bool established() const { return SSL_is_init_finished(ssl_.get()); }
+
+        // Starts (or carries on with) the handshake. Returns false if it has failed for good.
+        bool handshake()
+        {
+            if (established())
+            {
+                return true;
+            }
+            int result = SSL_do_handshake(ssl_.get());
+            if (result <= 0)
+            {
+                int error = SSL_get_error(ssl_.get(), result);
+                return error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE;
+            }
+            return true;
+        }
+
+        // A datagram arrived. Each record inside it (a frame, for us) goes to on_record. Returns false if the association is dead.
+        bool receive(const char *data, std::size_t length, const std::function<void(std::string_view)> &on_record)
+        {
+            BIO_write(SSL_get_rbio(ssl_.get()), data, static_cast<int>(length));
+            if (!established())
+            {
+                return handshake();
+            }
+            char record[mtu];
+            while (true)
+            {
+                int read = SSL_read(ssl_.get(), record, sizeof(record));
+                if (read > 0)
+                {
+                    on_record(std::string_view(record, static_cast<std::size_t>(read)));
+                    continue;
+                }
+                int error = SSL_get_error(ssl_.get(), read);
+                return error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE;
+            }
+        }
+
+        bool write(std::string_view record)
+        {
+            return established() && SSL_write(ssl_.get(), record.data(), static_cast<int>(record.size())) > 0;
+        }
+
+        // A handshake datagram may get lost like any other - this sends it again when it's time.
+        void handle_timeout()
+        {
+            if (!established())
+            {
+                DTLSv1_handle_timeout(ssl_.get());
+            }
+        }
+
+        // Whatever OpenSSL wants sent (empty if nothing).
+        std::string take_output()
+        {
+            std::string out;
+            char buffer[mtu];
+            int read;
+            while ((read = BIO_read(SSL_get_wbio(ssl_.get()), buffer, sizeof(buffer))) > 0)
+            {
+                out.append(buffer, static_cast<std::size_t>(read));
+            }
+            return out;
+        }
+
+        // Set by the PSK callbacks.
+        std::string identity;
+        std::string key;
+
+    private:
+        std::unique_ptr<SSL, decltype(&SSL_free)> ssl_;
+    };
+
+    // A frame inside a record - the same header + body as on TCP (never compressed). Returns false if it isn't one.
+    inline bool parse_record(std::string_view record, protocol::MessageType &type, std::string_view &body)
+    {
+        bool compressed = false;
+        std::size_t length = 0;
+        if (record.size() < protocol::header_length || !protocol::parse_header(record.data(), type, compressed, length) ||
+            compressed || record.size() != protocol::header_length + length)
+        {
+            return false;
+        }
+        body = record.substr(protocol::header_length);
+        return true;
+    }
+
+    inline std::string record(const protocol::Frame &frame)
+    {
+        return std::string(frame.header.begin(), frame.header.end()) + frame.body;
+    }
+}
+
+// The server's end: one UDP socket (on the same port number as TCP) for every client.
+class DatagramServer
+{
+public:
+    struct Handlers
+    {
+        // A frame from the client whose TLS connection made this identity.
+        std::function<void(const std::string &identity, protocol::MessageType, std::string_view)> frame;
+    };
+
+    DatagramServer(boost::asio::io_context &io_context, unsigned short port, Handlers handlers)
+        : socket_(io_context, datagram::udp::endpoint(datagram::udp::v4(), port)), context_(datagram::make_context(true), SSL_CTX_free),
+          handlers_(std::move(handlers))
+    {
+        SSL_CTX_set_app_data(context_.get(), this);
+        SSL_CTX_set_psk_server_callback(context_.get(), &DatagramServer::find_key);
+        socket_.non_blocking(true); // A send that would have to wait is dropped instead - see send_to().
+        boost::asio::co_spawn(socket_.get_executor(), receive(), boost::asio::detached);
+    }
+
+    // A client that has logged in over TLS, and may link up over UDP with this identity and key.
+    void expect(const datagram::Secret &secret)
+    {
+        clients_[secret.identity].key = secret.key;
+    }
+
+    // The client has gone.
+    void forget(const std::string &identity)
+    {
+        auto it = clients_.find(identity);
+        if (it == clients_.end())
+        {
+            return;
+        }
+        if (it->second.linked)
+        {
+            peers_.erase(it->second.endpoint);
+        }
+        clients_.erase(it);
+    }
+
+    // Sends a frame to that client over UDP - if it has a working association. Returns false if it hasn't (use TCP instead).
+    bool send(const std::string &identity, const protocol::Frame &frame)
+    {
+        auto it = clients_.find(identity);
+        if (it == clients_.end() || !it->second.linked)
+        {
+            return false;
+        }
+        auto peer = peers_.find(it->second.endpoint);
+        if (peer == peers_.end() || std::chrono::steady_clock::now() - peer->second->last_heard > datagram::stale_after)
+        {
+            return false;
+        }
+        if (!peer->second->dtls.write(datagram::record(frame)))
+        {
+            return false;
+        }
+        flush(peer->first, *peer->second);
+        return true;
+    }
+
+    // Called every tick: handshakes that need a datagram sent again, and associations nobody has used for a while.
+    void tick()
+    {
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = peers_.begin(); it != peers_.end();)
+        {
+            auto &peer = *it->second;
+            auto limit = peer.dtls.established() ? datagram::stale_after * 2 : datagram::handshake_timeout * 2;
+            if (now - peer.last_heard > limit)
+            {
+                unlink(it->first, peer);
+                it = peers_.erase(it);
+                continue;
+            }
+            peer.dtls.handle_timeout();
+            flush(it->first, peer);
+            ++it;
+        }
+    }
+
+    std::size_t linked() const
+    {
+        std::size_t count = 0;
+        for (const auto &[endpoint, peer] : peers_)
+        {
+            count += peer->dtls.established() ? 1 : 0;
+        }
+        return count;
+    }
+
+    void close()
+    {
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+        peers_.clear();
+    }
+
+private:
+    struct Peer
+    {
+        explicit Peer(SSL_CTX *context) : dtls(context, true) {}
+        datagram::Association dtls;
+        std::chrono::steady_clock::time_point last_heard = std::chrono::steady_clock::now();
+    };
+
+    struct Client
+    {
+        std::string key;
+        bool linked = false; // endpoint is where its association is.
+        datagram::udp::endpoint endpoint;
+    };
+
+    // Somebody sending us lots of handshakes from made-up addresses shouldn't be able to make us keep lots of state.
+    static constexpr std::size_t max_handshaking = 256;
+
+    boost::asio::awaitable<void> receive()
+    {
+        std::vector<char> buffer(2048);
+        datagram::udp::endpoint from;
+        while (socket_.is_open())
+        {
+            boost::system::error_code ec;
+            std::size_t length = co_await socket_.async_receive_from(boost::asio::buffer(buffer), from,
+                                                                     boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+            if (ec == boost::asio::error::operation_aborted || !socket_.is_open())
+            {
+                co_return;
+            }
+            if (ec)
+            {
+                continue; // On Windows an ICMP "port unreachable" from an earlier send shows up here - it's not our problem.
+            }
+            received(from, buffer.data(), length);
+        }
+    }
+
+    void received(const datagram::udp::endpoint &from, const char *data, std::size_t length)
+    {
+        auto it = peers_.find(from);
+        if (it == peers_.end())
+        {
+            if (handshaking() >= max_handshaking)
+            {
+                return;
+            }
+            it = peers_.emplace(from, std::make_unique<Peer>(context_.get())).first;
+        }
+        auto &peer = *it->second;
+        bool was_established = peer.dtls.established();
+        peer.last_heard = std::chrono::steady_clock::now();
+
+        bool alive = peer.dtls.receive(data, length, [&](std::string_view record)
+                                       { on_record(from, peer, record); });
+        flush(from, peer);
+        if (!alive)
+        {
+            unlink(from, peer);
+            peers_.erase(from);
+            return;
+        }
+        if (!was_established && peer.dtls.established())
+        {
+            link(from, peer);
+        }
+    }
+
+    void on_record(const datagram::udp::endpoint &from, Peer &peer, std::string_view record)
+    {
+        protocol::MessageType type;
+        std::string_view body;
+        if (!datagram::parse_record(record, type, body))
+        {
+            return;
+        }
+        if (type == protocol::MessageType::ping)
+        {
+            // The client's keepalive. The pong tells it that UDP works in our direction too.
+            if (peer.dtls.write(datagram::record(*protocol::make_frame(protocol::MessageType::pong, std::string(body)))))
+            {
+                flush(from, peer);
+            }
+            return;
+        }
+        handlers_.frame(peer.dtls.identity, type, body);
+    }
+
+    // The handshake has just finished: this endpoint now belongs to that client. A client whose address changed (a home router
+    // picking a new port, say) does a new handshake from the new address - the old association is dropped.
+    void link(const datagram::udp::endpoint &from, Peer &peer)
+    {
+        auto it = clients_.find(peer.dtls.identity);
+        if (it == clients_.end())
+        {
+            return;
+        }
+        if (it->second.linked && it->second.endpoint != from)
+        {
+            peers_.erase(it->second.endpoint);
+        }
+        it->second.linked = true;
+        it->second.endpoint = from;
+    }
+
+    void unlink(const datagram::udp::endpoint &from, Peer &peer)
+    {
+        auto it = clients_.find(peer.dtls.identity);
+        if (it != clients_.end() && it->second.linked && it->second.endpoint == from)
+        {
+            it->second.linked = false;
+        }
+    }
+
+    std::size_t handshaking() const
+    {
+        std::size_t count = 0;
+        for (const auto &[endpoint, peer] : peers_)
+        {
+            count += peer->dtls.established() ? 0 : 1;
+        }
+        return count;
+    }
+
+    void flush(const datagram::udp::endpoint &to, Peer &peer)
+    {
+        auto out = peer.dtls.take_output();
+        if (!out.empty())
+        {
+            send_to(to, out);
+        }
+    }
+
+    // UDP sends are fire and forget. If the socket's send buffer is full, the datagram is dropped - which is fine for what goes over it.
+    void send_to(const datagram::udp::endpoint &to, const std::string &bytes)
+    {
+        boost::system::error_code ignored;
+        socket_.send_to(boost::asio::buffer(bytes), to, 0, ignored);
+    }
+
+    // OpenSSL asks: what's the key for this identity? 0 = no such client, and the handshake fails.
+    static unsigned int find_key(SSL *ssl, const char *identity, unsigned char *psk, unsigned int max_psk_len)
+    {
+        auto *self = static_cast<DatagramServer *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+        auto *association = static_cast<datagram::Association *>(SSL_get_app_data(ssl));
+        auto it = self->clients_.find(identity ? identity : "");
+        if (it == self->clients_.end() || it->second.key.size() > max_psk_len)
+        {
+            return 0;
+        }
+        association->identity = it->first;
+        std::memcpy(psk, it->second.key.data(), it->second.key.size());
+        return static_cast<unsigned int>(it->second.key.size());
+    }
+
+    datagram::udp::socket socket_;
+    std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)> context_;
+    Handlers handlers_;
+    std::map<datagram::udp::endpoint, std::unique_ptr<Peer>> peers_;
+    std::unordered_map<std::string, Client> clients_; // By identity.
+};
+
+// The client's end.
+class DatagramLink : public std::enable_shared_from_this<DatagramLink>
+{
+public:
+    struct Handlers
+    {
+        std::function<void(protocol::MessageType, std::string_view)> frame; // A frame from the server.
+        std::function<void(bool)> changed;                                   // The side channel has come up (true), or didn't / went down (false).
+    };
+
+    DatagramLink(boost::asio::io_context &io_context, datagram::udp::endpoint server, datagram::Secret secret, Handlers handlers)
+        : socket_(io_context), timer_(io_context), server_(server), context_(datagram::make_context(false), SSL_CTX_free),
+          handlers_(std::move(handlers))
+    {
+        SSL_CTX_set_psk_client_callback(context_.get(), &DatagramLink::give_key);
+        dtls_ = std::make_unique<datagram::Association>(context_.get(), false);
+        dtls_->identity = std::move(secret.identity);
+        dtls_->key = std::move(secret.key);
+    }
+
+    void start()
+    {
+        boost::system::error_code ec;
+        socket_.open(server_.protocol(), ec);
+        if (!ec)
+            socket_.connect(server_, ec);
+        if (ec)
+        {
+            closed_ = true;
+            return;
+        }
+        socket_.non_blocking(true, ec);
+        dtls_->handshake();
+        flush();
+        started_ = std::chrono::steady_clock::now();
+        boost::asio::co_spawn(socket_.get_executor(), [self = shared_from_this()]()
+                              { return self->receive(); },
+                              boost::asio::detached);
+        boost::asio::co_spawn(socket_.get_executor(), [self = shared_from_this()]()
+                              { return self->keep_alive(); },
+                              boost::asio::detached);
+    }
+
+    bool up() const { return up_ && !closed_; }
+
+    bool send(const protocol::Frame &frame)
+    {
+        if (!up() || !dtls_->write(datagram::record(frame)))
+        {
+            return false;
+        }
+        flush();
+        return true;
+    }
+
+    void close()
+    {
+        if (closed_)
+        {
+            return;
+        }
+        closed_ = true;
+        up_ = false;
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+        timer_.cancel();
+    }
+
+private:
+    boost::asio::awaitable<void> receive()
+    {
+        auto self = shared_from_this();
+        std::vector<char> buffer(2048);
+        while (!closed_)
+        {
+            boost::system::error_code ec;
+            std::size_t length = co_await socket_.async_receive(boost::asio::buffer(buffer), boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+            if (closed_)
+            {
+                co_return;
+            }
+            if (ec)
+            {
+                continue; // "Connection refused" - the server isn't listening for UDP (yet). The handshake timeout deals with that.
+            }
+            bool alive = dtls_->receive(buffer.data(), length, [this](std::string_view record)
+                                        { on_record(record); });
+            flush();
+            if (!alive)
+            {
+                fail();
+                co_return;
+            }
+            if (dtls_->established() && !up_)
+            {
+                up_ = true;
+                last_pong_ = std::chrono::steady_clock::now();
+                handlers_.changed(true);
+            }
+        }
+    }
+
+    // Once a second: resend handshake datagrams that got lost, give up on a handshake that takes too long, send the keepalive ping,
+    // and notice when the server's pongs stop coming (UDP got blocked after all).
+    boost::asio::awaitable<void> keep_alive()
+    {
+        auto self = shared_from_this();
+        auto last_ping = std::chrono::steady_clock::now();
+        while (!closed_)
+        {
+            boost::system::error_code ignored;
+            timer_.expires_after(std::chrono::seconds(1));
+            co_await timer_.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ignored));
+            if (closed_)
+            {
+                co_return;
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (!dtls_->established())
+            {
+                if (now - started_ > datagram::handshake_timeout)
+                {
+                    fail();
+                    co_return;
+                }
+                dtls_->handle_timeout();
+                flush();
+                continue;
+            }
+            if (now - last_pong_ > datagram::stale_after)
+            {
+                fail();
+                co_return;
+            }
+            if (now - last_ping >= datagram::keepalive_interval)
+            {
+                last_ping = now;
+                send(*protocol::make_frame(protocol::MessageType::ping, std::string()));
+            }
+        }
+    }
+
+    void on_record(std::string_view record)
+    {
+        protocol::MessageType type;
+        std::string_view body;
+        if (!datagram::parse_record(record, type, body))
+        {
+            return;
+        }
+        if (type == protocol::MessageType::pong)
+        {
+            last_pong_ = std::chrono::steady_clock::now();
+            return;
+        }
+        handlers_.frame(type, body);
+    }
+
+    // The handshake never finished, or the server stopped answering. close() on its own is for when we're done with it anyway.
+    void fail()
+    {
+        close();
+        handlers_.changed(false);
+    }
+
+    void flush()
+    {
+        auto out = dtls_->take_output();
+        if (!out.empty())
+        {
+            boost::system::error_code ignored;
+            socket_.send(boost::asio::buffer(out), 0, ignored);
+        }
+    }
+
+    static unsigned int give_key(SSL *ssl, const char *, char *identity, unsigned int max_identity_len, unsigned char *psk, unsigned int max_psk_len)
+    {
+        auto *association = static_cast<datagram::Association *>(SSL_get_app_data(ssl));
+        if (association->identity.size() + 1 > max_identity_len || association->key.size() > max_psk_len)
+        {
+            return 0;
+        }
+        std::memcpy(identity, association->identity.c_str(), association->identity.size() + 1);
+        std::memcpy(psk, association->key.data(), association->key.size());
+        return static_cast<unsigned int>(association->key.size());
+    }
+
+    datagram::udp::socket socket_;
+    boost::asio::steady_timer timer_;
+    datagram::udp::endpoint server_;
+    std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)> context_;
+    std::unique_ptr<datagram::Association> dtls_;
+    Handlers handlers_;
+    std::chrono::steady_clock::time_point started_;
+    std::chrono::steady_clock::time_point last_pong_;
+    bool up_ = false;
+    bool closed_ = false;
+};
@@ -0,0 +1,435 @@
+#include <iostream>
+#include <utility> // Boost 1.74's awaitable.hpp uses std::exchange without including this itself.
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "protocol.hpp"
+#include "peer.hpp"
+#include "edge.hpp"
+#include "record_sizing.hpp"
+
+// Overview:
+// The edge proxy. It sits in front of the server, takes the clients' connections and does their TLS - the handshakes and all the
+// encryption - and passes what they send on to the server over a few long-lived links (see edge.hpp for the frames on those links).
+//
+//   ./server 12345 --edge 14345
+//   ./edge 12346 127.0.0.1 14345      <- clients now connect to port 12346 instead of 12345
+//
+// You can run as many edges as you like, on other machines or other cores, each with its own port - the server only sees a couple
+// of links from each. Clients don't know the difference: ./client <edge address> 12346 <name> works exactly like connecting to the server.
+//
+// The edge doesn't understand the chat at all - it never looks inside the bytes. Everything that makes the chat work (names, history,
+// rate limits, files) stays in the server. That's the point: the edge can be copied and restarted freely, it has nothing to lose.
+//
+// The edge needs the same ssl_certification folder as the server: clients check the certificate like before, and the server only takes
+// links from an edge with exactly its own certificate.
+
+using boost::asio::awaitable;
+using boost::asio::use_awaitable;
+using boost::asio::redirect_error;
+using boost::asio::ip::tcp;
+
+class Edge
+{
+public:
+    // client_context: the TLS setup the clients see. core_host / core_port: the server's --edge port. links: how many links to keep open to it.
+    Edge(boost::asio::io_context &io_context, boost::asio::ssl::context &client_context, unsigned short port,
+         std::string core_host, std::string core_port, std::size_t links)
+        : io_context_(io_context), client_context_(client_context), acceptor_(io_context, tcp::endpoint(tcp::v4(), port)),
+          core_context_(boost::asio::ssl::context::tls), core_host_(std::move(core_host)), core_port_(std::move(core_port)), links_(links)
+    {
+        fingerprint_ = peer::use_server_certificate(core_context_);
+    }
+
+    void start()
+    {
+        std::cout << "Edge started on port " << acceptor_.local_endpoint().port() << ", linking to the server at "
+                  << core_host_ << ":" << core_port_ << " with " << links_.size() << " link(s)." << std::endl << std::endl;
+        for (std::size_t slot = 0; slot < links_.size(); ++slot)
+        {
+            boost::asio::co_spawn(io_context_, keep_linked(slot), boost::asio::detached);
+        }
+        boost::asio::co_spawn(io_context_, accept_clients(), boost::asio::detached);
+    }
+
+private:
+    // One client. Its bytes go up the link as edge_data, the server's come back down as edge_data and are written to it.
+    // Both ways only edge_window bytes are ever in flight: reader() waits for edge_ack before reading more, and the server waits
+    // for our edge_ack (which we send once the bytes are written to the client) before sending more.
+    class Client : public std::enable_shared_from_this<Client>
+    {
+    public:
+        Client(Edge &edge, boost::asio::ssl::stream<tcp::socket> stream)
+            : edge_(edge), stream_(std::move(stream)), readable_signal_(stream_.get_executor()), write_signal_(stream_.get_executor())
+        {
+            readable_signal_.expires_at(boost::asio::steady_timer::time_point::max());
+            write_signal_.expires_at(boost::asio::steady_timer::time_point::max());
+        }
+
+        void start()
+        {
+            boost::asio::co_spawn(stream_.get_executor(), [self = shared_from_this()]()
+                                  { return self->run(); },
+                                  boost::asio::detached);
+        }
+
+        const std::shared_ptr<peer::PeerLink> &link() const { return link_; }
+
+        // ---------------------------------- //
+        // From the link.
+
+        void received(std::string_view bytes)
+        {
+            outbound_.emplace_back(bytes);
+            write_signal_.cancel();
+        }
+
+        void acked(std::uint32_t count)
+        {
+            unacked_ -= std::min<std::size_t>(unacked_, count);
+            readable_signal_.cancel();
+        }
+
+        // The server is done with this client: we send it whatever is still waiting, then hang up.
+        void closed_by_core()
+        {
+            core_closed_ = true;
+            write_signal_.cancel();
+        }
+
+        // tell_core: let the server know (not needed when the close came from the server, or the link is gone).
+        void close(bool tell_core)
+        {
+            if (closed_)
+            {
+                return;
+            }
+            closed_ = true;
+            if (tell_core && !core_closed_ && link_)
+            {
+                link_->send(edge::frame(protocol::MessageType::edge_close, channel_));
+            }
+            boost::system::error_code ignored;
+            stream_.lowest_layer().close(ignored);
+            readable_signal_.cancel();
+            write_signal_.cancel();
+            if (channel_ != 0)
+            {
+                edge_.clients_.erase(channel_);
+            }
+        }
+
+    private:
+        awaitable<void> run()
+        {
+            auto self = shared_from_this();
+            boost::system::error_code ec;
+            address_ = stream_.lowest_layer().remote_endpoint(ec).address().to_string();
+            records_.start(stream_.next_layer()); // The same record sizes as the server's - see record_sizing.hpp.
+
+            // Same as the server's login_timeout: a client that never finishes its handshake doesn't get to hold a socket forever.
+            boost::asio::steady_timer deadline(stream_.get_executor(), handshake_timeout);
+            deadline.async_wait([self](const boost::system::error_code &ec)
+                                {
+                                    if (!ec)
+                                    {
+                                        self->close(false);
+                                    } });
+            co_await stream_.async_handshake(boost::asio::ssl::stream_base::server, redirect_error(use_awaitable, ec));
+            deadline.cancel();
+            if (ec || closed_)
+            {
+                close(false);
+                co_return;
+            }
+
+            link_ = edge_.pick_link();
+            if (!link_)
+            {
+                close(false); // No link to the server right now - the client will try again in a moment.
+                co_return;
+            }
+            channel_ = edge_.next_channel_++;
+            if (edge_.next_channel_ == 0)
+            {
+                edge_.next_channel_ = 1; // 0 means "no channel yet".
+            }
+            edge_.clients_[channel_] = self;
+
+            std::string body;
+            protocol::Writer(body).str(address_);
+            link_->send(edge::frame(protocol::MessageType::edge_open, channel_, body));
+
+            boost::asio::co_spawn(stream_.get_executor(), [self]()
+                                  { return self->writer(); },
+                                  boost::asio::detached);
+            co_await reader();
+        }
+
+        awaitable<void> reader()
+        {
+            std::vector<char> buffer(16 * 1024);
+            boost::system::error_code ec;
+            while (!closed_)
+            {
+                if (unacked_ >= protocol::edge_window)
+                {
+                    co_await readable_signal_.async_wait(redirect_error(use_awaitable, ec)); // Woken up by acked().
+                    continue;
+                }
+                std::size_t length = co_await stream_.async_read_some(boost::asio::buffer(buffer), redirect_error(use_awaitable, ec));
+                if (ec || closed_)
+                {
+                    break;
+                }
+                link_->send(edge::frame(protocol::MessageType::edge_data, channel_, std::string_view(buffer.data(), length)));
+                unacked_ += length;
+            }
+            close(true);
+        }
+
+        awaitable<void> writer()
+        {
+            auto self = shared_from_this();
+            boost::system::error_code ec;
+            while (!closed_)
+            {
+                if (outbound_.empty())
+                {
+                    if (core_closed_)
+                    {
+                        break; // Everything the server sent is out - now we hang up.
+                    }
+                    co_await write_signal_.async_wait(redirect_error(use_awaitable, ec));
+                    continue;
+                }
+
+                // A record at a time, so we choose how big the records are (see record_sizing.hpp).
+                std::size_t length = outbound_.front().size();
+                std::size_t record_size = records_.before_write(length);
+                ec = {}; // It still says how the wait above was woken up.
+                for (std::size_t done = 0; done < length && !ec && !closed_;)
+                {
+                    done += co_await boost::asio::async_write(stream_, boost::asio::buffer(outbound_.front().data() + done, std::min(record_size, length - done)),
+                                                              redirect_error(use_awaitable, ec));
+                }
+                if (ec || closed_)
+                {
+                    break;
+                }
+                outbound_.pop_front();
+                link_->send(edge::ack(channel_, static_cast<std::uint32_t>(length)));
+            }
+            close(true);
+        }
+
+        Edge &edge_;
+        boost::asio::ssl::stream<tcp::socket> stream_;
+        RecordSizer records_;
+        std::string address_;
+        std::shared_ptr<peer::PeerLink> link_;
+        std::uint32_t channel_ = 0;
+        std::deque<std::string> outbound_; // From the server, not written to the client yet.
+        std::size_t unacked_ = 0;          // Sent to the server, not acked yet.
+        boost::asio::steady_timer readable_signal_;
+        boost::asio::steady_timer write_signal_;
+        bool core_closed_ = false;
+        bool closed_ = false;
+    };
+
+    awaitable<void> accept_clients()
+    {
+        while (true)
+        {
+            boost::system::error_code ec;
+            tcp::socket socket(io_context_);
+            co_await acceptor_.async_accept(socket, redirect_error(use_awaitable, ec));
+            if (ec)
+            {
+                continue;
+            }
+            std::make_shared<Client>(*this, boost::asio::ssl::stream<tcp::socket>(std::move(socket), client_context_))->start();
+        }
+    }
+
+    // The links take turns, so the clients are spread over all of them.
+    std::shared_ptr<peer::PeerLink> pick_link()
+    {
+        for (std::size_t tries = 0; tries < links_.size(); ++tries)
+        {
+            auto &link = links_[next_link_++ % links_.size()];
+            if (link)
+            {
+                return link;
+            }
+        }
+        return nullptr;
+    }
+
+    // Keeps one link to the server open: connects, and when the link drops (the server was restarted, say), connects again.
+    awaitable<void> keep_linked(std::size_t slot)
+    {
+        boost::asio::steady_timer retry(io_context_);
+        tcp::resolver resolver(io_context_);
+        while (true)
+        {
+            if (!links_[slot])
+            {
+                boost::system::error_code ec;
+                auto endpoints = co_await resolver.async_resolve(core_host_, core_port_, redirect_error(use_awaitable, ec));
+                auto stream = std::make_shared<peer::PeerLink::Stream>(io_context_, core_context_);
+                auto deadline = peer::handshake_deadline(stream, handshake_timeout);
+                if (!ec)
+                {
+                    co_await boost::asio::async_connect(stream->lowest_layer(), endpoints, redirect_error(use_awaitable, ec));
+                }
+                if (!ec)
+                {
+                    co_await stream->async_handshake(boost::asio::ssl::stream_base::client, redirect_error(use_awaitable, ec));
+                }
+                deadline->cancel();
+                if (!ec && peer::remote_fingerprint(stream->native_handle()) != fingerprint_)
+                {
+                    std::cout << "The server at " << core_host_ << ":" << core_port_ << " doesn't have our certificate - not linking to it." << std::endl;
+                    ec = boost::asio::error::access_denied;
+                }
+                if (!ec)
+                {
+                    link_up(slot, std::move(*stream));
+                }
+            }
+
+            boost::system::error_code ignored;
+            retry.expires_after(retry_delay);
+            co_await retry.async_wait(redirect_error(use_awaitable, ignored));
+        }
+    }
+
+    void link_up(std::size_t slot, peer::PeerLink::Stream stream)
+    {
+        peer::PeerLink::Handlers handlers{
+            [this](peer::PeerLink &link, protocol::MessageType type, std::string_view body)
+            { on_frame(link, type, body); },
+            [](peer::PeerLink &) {},
+            [this, slot](peer::PeerLink &link)
+            { on_closed(slot, link); }};
+        links_[slot] = std::make_shared<peer::PeerLink>(std::move(stream), "link " + std::to_string(slot + 1), std::move(handlers));
+        links_[slot]->start();
+        std::cout << "Linked to the server (" << links_[slot]->name() << ")." << std::endl;
+    }
+
+    void on_frame(peer::PeerLink &link, protocol::MessageType type, std::string_view body)
+    {
+        protocol::Reader reader(body);
+        auto channel = reader.u32();
+        auto it = clients_.find(channel);
+        if (!reader.ok() || it == clients_.end() || it->second->link().get() != &link)
+        {
+            return; // A client we've already closed - our edge_close is on its way to the server.
+        }
+        auto client = it->second;
+
+        switch (type)
+        {
+        case protocol::MessageType::edge_data:
+            client->received(reader.rest());
+            break;
+
+        case protocol::MessageType::edge_ack:
+        {
+            auto count = reader.u32();
+            if (reader.ok())
+            {
+                client->acked(count);
+            }
+            break;
+        }
+
+        case protocol::MessageType::edge_close:
+            client->closed_by_core();
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    // The clients on a link that's gone can't reach the server any more. We hang up on them - they connect again by themselves,
+    // and get one of the other links (or this one, once it's back).
+    void on_closed(std::size_t slot, peer::PeerLink &link)
+    {
+        if (links_[slot].get() != &link)
+        {
+            return;
+        }
+        std::cout << "Lost the link to the server (" << link.name() << ")." << std::endl;
+        auto clients = clients_;
+        for (auto &[channel, client] : clients)
+        {
+            if (client->link().get() == &link)
+            {
+                client->close(false);
+            }
+        }
+        links_[slot].reset();
+    }
+
+    static constexpr std::chrono::seconds handshake_timeout{10};
+    static constexpr std::chrono::seconds retry_delay{1};
+
+    boost::asio::io_context &io_context_;
+    boost::asio::ssl::context &client_context_;
+    tcp::acceptor acceptor_;
+    boost::asio::ssl::context core_context_;
+    protocol::Hash fingerprint_{};
+    std::string core_host_;
+    std::string core_port_;
+    std::vector<std::shared_ptr<peer::PeerLink>> links_; // Empty slot = not linked right now.
+    std::size_t next_link_ = 0;
+    std::map<std::uint32_t, std::shared_ptr<Client>> clients_;
+    std::uint32_t next_channel_ = 1;
+};
+
+int main(int argc, char *argv[])
+{
+    // ./edge <port> <server host> <server's --edge port> [links]
+    if (argc < 4 || argc > 5)
+    {
+        std::cerr << "Usage: ./edge <port> <server host> <server edge port> [links]\n";
+        return 1;
+    }
+    std::size_t links = argc == 5 ? static_cast<std::size_t>(std::atoi(argv[4])) : 2;
+    if (links == 0)
+    {
+        links = 1;
+    }
+
+    try
+    {
+        boost::asio::io_context io_context;
+
+        // The same TLS setup the server uses for its clients - to them, the edge IS the server.
+        boost::asio::ssl::context ssl_context(boost::asio::ssl::context::sslv23);
+        ssl_context.use_certificate_chain_file("ssl_certification/certificate.crt");
+        ssl_context.use_private_key_file("ssl_certification/private.key", boost::asio::ssl::context::pem);
+        SSL_CTX_set_mode(ssl_context.native_handle(), SSL_MODE_RELEASE_BUFFERS); // Like the server: idle clients don't keep OpenSSL's record buffers.
+
+        Edge edge(io_context, ssl_context, static_cast<unsigned short>(std::atoi(argv[1])), argv[2], argv[3], links);
+        edge.start();
+        io_context.run();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Exception: " << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+// g++ -o edge edge.cpp -L/C/Coding/C++/boost_1_87_0/stage/lib -lboost_system-mgw14-mt-x64-1_87 -lboost_filesystem-mgw14-mt-x64-1_87 -lws2_32 -lmswsock -lssl -lcrypto -pthread -std=c++20
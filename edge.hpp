@@ -0,0 +1,440 @@
+#pragma once
+
+// edge.hpp
+// The server's side of the edge proxies (edge.cpp), and the few things both sides need.
+//
+// An edge is a small program that sits in front of the server: clients connect to the edge, the edge does their TLS handshake and
+// encryption, and passes the plain bytes on to the server. Lots of clients share a couple of long-lived links from the edge to the
+// server, so the server has a few sockets and no TLS handshakes to do, however many people connect:
+//
+//   client --TLS--> edge --one link for many clients--> server
+//
+//   ./server 12345 --edge 14345
+//   ./edge 12346 127.0.0.1 14345
+//
+// Every client gets a "channel" number on the link. The frames on a link (all of them start with the channel):
+//
+//   edge_open  (edge -> server)  channel, the client's IP address     a new client
+//   edge_data  (both ways)       channel, bytes                       what the client sent / what we send it
+//   edge_ack   (both ways)       channel, u32 count                   "I've passed on count bytes of yours"
+//   edge_close (both ways)       channel                              the client is gone / throw the client out
+//
+// The bytes inside edge_data are the client's own frames, exactly as they would be on a direct connection - the edge doesn't look at them.
+//
+// Flow control: each side only has edge_window bytes of a channel "in flight" (sent but not acked yet). Without that, one client that
+// reads slowly would make the edge buffer everything we send it - and one client that sends fast would fill the server up. With it,
+// a slow client holds up its own channel and nothing else, just like a slow TCP connection would.
+//
+// The link itself is TLS with the server's certificate at both ends, checked the same way as the links between servers (see federation.hpp).
+// The edge tells us the client's real IP address, so the blocklist and the rate limits work just like for a direct client.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include "peer.hpp"
+#include "protocol.hpp"
+#include "transport.hpp"
+
+namespace edge
+{
+    // The most bytes we put in one edge_data frame - a bigger write is split up.
+    constexpr std::size_t max_data = 64 * 1024;
+
+    // A frame for one channel: the channel number, then the rest of the body.
+    inline std::shared_ptr<const protocol::Frame> frame(protocol::MessageType type, std::uint32_t channel, std::string_view rest = {})
+    {
+        std::string body;
+        protocol::Writer writer(body);
+        writer.u32(channel);
+        writer.raw(rest);
+        return protocol::make_frame(type, std::move(body));
+    }
+
+    inline std::shared_ptr<const protocol::Frame> ack(std::uint32_t channel, std::uint32_t count)
+    {
+        std::string body;
+        protocol::Writer writer(body);
+        writer.u32(channel);
+        writer.u32(count);
+        return protocol::make_frame(protocol::MessageType::edge_ack, std::move(body));
+    }
+}
+
+class EdgeTransport;
+
+// One link from an edge, and the clients that are on it.
+struct EdgeLink
+{
+    std::shared_ptr<peer::PeerLink> link;
+    std::map<std::uint32_t, EdgeTransport *> channels;
+};
+
+// A client that came in through an edge. To its Session it looks just like a non-blocking socket: read_some() hands out the
+// edge_data that has arrived, write_some() sends edge_data - and each says "would block" when there's nothing yet, or when the
+// edge hasn't acked enough of what we sent before. wait() waits on readable_ or writable_ for that to change.
+class EdgeTransport : public Transport
+{
+public:
+    EdgeTransport(boost::asio::any_io_executor executor, std::shared_ptr<EdgeLink> link, std::uint32_t channel, std::string address)
+        : executor_(std::move(executor)), link_(std::move(link)), channel_(channel), address_(std::move(address)), readable_(executor_), writable_(executor_)
+    {
+        // Like the Session's write_signal_: these never go off by themselves, cancelling them wakes up whoever is waiting.
+        readable_.expires_at(boost::asio::steady_timer::time_point::max());
+        writable_.expires_at(boost::asio::steady_timer::time_point::max());
+    }
+
+    ~EdgeTransport() override { forget(); }
+
+    boost::asio::any_io_executor executor() override { return executor_; }
+
+    boost::asio::awaitable<void> handshake(boost::system::error_code &ec) override
+    {
+        ec = {}; // The edge did it.
+        co_return;
+    }
+
+    std::size_t read_some(boost::asio::mutable_buffer buffer, Wait &wait, boost::system::error_code &ec) override
+    {
+        if (inbound_start_ == inbound_.size())
+        {
+            wait = Wait::wait_read;
+            ec = closed_ ? boost::system::error_code(boost::asio::error::operation_aborted)
+                 : edge_closed_ ? boost::system::error_code(boost::asio::error::eof)
+                                : boost::system::error_code(boost::asio::error::would_block);
+            return 0;
+        }
+
+        std::size_t length = std::min(buffer.size(), inbound_.size() - inbound_start_);
+        std::memcpy(buffer.data(), inbound_.data() + inbound_start_, length);
+        inbound_start_ += length;
+        if (inbound_start_ == inbound_.size())
+        {
+            inbound_.clear();
+            inbound_start_ = 0;
+            if (inbound_.capacity() > idle_capacity)
+            {
+                std::string().swap(inbound_); // A big burst is over - don't keep its memory for a client that may now be quiet for hours.
+            }
+        }
+
+        // The edge may send more now.
+        if (link_)
+        {
+            link_->link->send(edge::ack(channel_, static_cast<std::uint32_t>(length)));
+        }
+        ec = {};
+        return length;
+    }
+
+    boost::asio::awaitable<void> wait_readable(boost::system::error_code &ec) override
+    {
+        while (inbound_start_ == inbound_.size() && !closed_ && !edge_closed_)
+        {
+            co_await readable_.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        }
+        ec = {}; // If we were closed, read_some() says so.
+    }
+
+    std::size_t write_some(std::span<const boost::asio::const_buffer> buffers, std::size_t offset, Wait &wait, boost::system::error_code &ec) override
+    {
+        if (closed_ || edge_closed_ || !link_)
+        {
+            ec = boost::asio::error::broken_pipe;
+            return 0;
+        }
+        if (unacked_ >= protocol::edge_window)
+        {
+            wait = Wait::wait_write;
+            ec = boost::asio::error::would_block;
+            return 0;
+        }
+
+        std::size_t total = 0;
+        for (const auto &buffer : buffers)
+        {
+            std::string_view bytes(static_cast<const char *>(buffer.data()), buffer.size());
+            if (offset >= bytes.size())
+            {
+                offset -= bytes.size();
+                continue;
+            }
+            bytes.remove_prefix(offset);
+            offset = 0;
+            for (std::size_t start = 0; start < bytes.size(); start += edge::max_data)
+            {
+                link_->link->send(edge::frame(protocol::MessageType::edge_data, channel_, bytes.substr(start, edge::max_data)));
+            }
+            total += bytes.size();
+        }
+        unacked_ += total;
+        ec = {};
+        return total;
+    }
+
+    // Nothing goes off by itself here: received(), acked() and close() cancel the timer, and that's the wake up.
+    boost::asio::awaitable<void> wait(Wait wait, boost::system::error_code &ec) override
+    {
+        auto &timer = wait == Wait::wait_write ? writable_ : readable_;
+        return timer.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    }
+
+    // The Session is done with the client: tell the edge to hang up on it (unless that's where the close came from).
+    void close() override
+    {
+        if (closed_)
+        {
+            return;
+        }
+        closed_ = true;
+        if (!edge_closed_ && link_)
+        {
+            link_->link->send(edge::frame(protocol::MessageType::edge_close, channel_));
+        }
+        forget();
+        readable_.cancel();
+        writable_.cancel();
+    }
+
+    std::string address() override { return address_; }
+    std::string describe() override { return address_ + " (through " + (link_ ? link_->link->name() : std::string("an edge")) + ")"; }
+
+    // ---------------------------------- //
+    // These are called by the EdgeHub when frames for this channel arrive.
+
+    void received(std::string_view bytes)
+    {
+        inbound_.append(bytes);
+        readable_.cancel();
+    }
+
+    void acked(std::uint32_t count)
+    {
+        unacked_ -= std::min<std::size_t>(unacked_, count);
+        writable_.cancel();
+    }
+
+    // The client hung up on the edge, or the whole link is gone. Whatever is still in inbound_ is read first, then read_some() returns eof.
+    void closed_by_edge()
+    {
+        edge_closed_ = true;
+        forget();
+        readable_.cancel();
+        writable_.cancel();
+    }
+
+private:
+    // Takes us out of the link's channels - after this, nothing more arrives for us.
+    void forget()
+    {
+        if (!link_)
+        {
+            return;
+        }
+        auto it = link_->channels.find(channel_);
+        if (it != link_->channels.end() && it->second == this)
+        {
+            link_->channels.erase(it);
+        }
+        link_.reset();
+    }
+
+    boost::asio::any_io_executor executor_;
+    std::shared_ptr<EdgeLink> link_;
+    std::uint32_t channel_;
+    std::string address_;
+    std::string inbound_; // What the edge sent that the Session hasn't read yet - never more than edge_window.
+    std::size_t inbound_start_ = 0;
+    static constexpr std::size_t idle_capacity = 4 * 1024;
+    std::size_t unacked_ = 0; // What we sent that the edge hasn't acked yet.
+    boost::asio::steady_timer readable_;
+    boost::asio::steady_timer writable_;
+    bool closed_ = false;      // We closed it.
+    bool edge_closed_ = false; // The edge closed it.
+};
+
+// Takes links from edges (./server ... --edge <port>) and turns each new client on them into an EdgeTransport for the Server.
+class EdgeHub
+{
+public:
+    using NewClient = std::function<void(std::unique_ptr<Transport>)>;
+
+    EdgeHub(boost::asio::io_context &io_context, unsigned short port, NewClient new_client)
+        : io_context_(io_context), context_(boost::asio::ssl::context::tls), acceptor_(io_context), new_client_(std::move(new_client))
+    {
+        fingerprint_ = peer::use_server_certificate(context_);
+        boost::asio::co_spawn(io_context_, accept_links(port), boost::asio::detached);
+    }
+
+    std::size_t links() const { return links_.size(); }
+
+    // The server is being replaced (see Server::hand_over()): the edges lose their links and connect to the new server by themselves.
+    void close()
+    {
+        closed_ = true;
+        boost::system::error_code ignored;
+        acceptor_.close(ignored);
+        auto links = links_;
+        for (const auto &link : links)
+        {
+            link->link->close();
+        }
+    }
+
+private:
+    using tcp = boost::asio::ip::tcp;
+    using Stream = peer::PeerLink::Stream;
+
+    boost::asio::awaitable<void> accept_links(unsigned short port)
+    {
+        co_await peer::listen_when_free(acceptor_, port, closed_);
+        while (!closed_)
+        {
+            boost::system::error_code ec;
+            tcp::socket socket(io_context_);
+            co_await acceptor_.async_accept(socket, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+            if (ec)
+            {
+                if (closed_ || ec == boost::asio::error::operation_aborted)
+                {
+                    co_return;
+                }
+                continue;
+            }
+            boost::asio::co_spawn(io_context_, accept_link(std::move(socket)), boost::asio::detached);
+        }
+    }
+
+    boost::asio::awaitable<void> accept_link(tcp::socket socket)
+    {
+        boost::system::error_code ec;
+        auto endpoint = socket.remote_endpoint(ec);
+        std::string name = "edge " + endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+        auto stream = std::make_shared<Stream>(std::move(socket), context_);
+
+        auto deadline = peer::handshake_deadline(stream, std::chrono::seconds(5));
+        co_await stream->async_handshake(boost::asio::ssl::stream_base::server, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        deadline->cancel();
+        if (ec || closed_)
+        {
+            co_return;
+        }
+        if (peer::remote_fingerprint(stream->native_handle()) != fingerprint_)
+        {
+            std::cout << "Refused a link from " << name << " - it doesn't have our certificate." << std::endl << std::endl;
+            boost::system::error_code ignored;
+            stream->lowest_layer().close(ignored);
+            co_return;
+        }
+
+        // The handlers only hold a weak_ptr: the EdgeLink holds the PeerLink, so a shared_ptr here would keep both alive forever.
+        auto state = std::make_shared<EdgeLink>();
+        std::weak_ptr<EdgeLink> weak = state;
+        peer::PeerLink::Handlers handlers{
+            [this, weak](peer::PeerLink &, protocol::MessageType type, std::string_view body)
+            {
+                if (auto state = weak.lock())
+                {
+                    on_frame(state, type, body);
+                }
+            },
+            [](peer::PeerLink &) {},
+            [this, weak](peer::PeerLink &)
+            {
+                if (auto state = weak.lock())
+                {
+                    on_closed(state);
+                }
+            }};
+        state->link = std::make_shared<peer::PeerLink>(std::move(*stream), name, std::move(handlers));
+        links_.insert(state);
+        state->link->start();
+        std::cout << "Linked to " << name << "." << std::endl << std::endl;
+    }
+
+    void on_frame(const std::shared_ptr<EdgeLink> &state, protocol::MessageType type, std::string_view body)
+    {
+        protocol::Reader reader(body);
+        auto channel = reader.u32();
+        if (!reader.ok())
+        {
+            return;
+        }
+        auto it = state->channels.find(channel);
+        EdgeTransport *transport = it == state->channels.end() ? nullptr : it->second;
+
+        switch (type)
+        {
+        case protocol::MessageType::edge_open:
+        {
+            auto address = reader.str();
+            if (!reader.ok() || transport)
+            {
+                break;
+            }
+            auto client = std::make_unique<EdgeTransport>(io_context_.get_executor(), state, channel, std::string(address));
+            state->channels[channel] = client.get();
+            new_client_(std::move(client));
+            break;
+        }
+
+        // Data for a client we've already closed is simply dropped - our edge_close is on its way to the edge.
+        case protocol::MessageType::edge_data:
+            if (transport)
+            {
+                transport->received(reader.rest());
+            }
+            break;
+
+        case protocol::MessageType::edge_ack:
+        {
+            auto count = reader.u32();
+            if (transport && reader.ok())
+            {
+                transport->acked(count);
+            }
+            break;
+        }
+
+        case protocol::MessageType::edge_close:
+            if (transport)
+            {
+                transport->closed_by_edge();
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    // Every client on a link that's gone has gone with it.
+    void on_closed(const std::shared_ptr<EdgeLink> &state)
+    {
+        auto channels = state->channels;
+        for (auto &[channel, transport] : channels)
+        {
+            transport->closed_by_edge();
+        }
+        if (links_.erase(state) > 0 && !closed_)
+        {
+            std::cout << "Lost the link to " << state->link->name() << "." << std::endl << std::endl;
+        }
+    }
+
+    boost::asio::io_context &io_context_;
+    boost::asio::ssl::context context_;
+    tcp::acceptor acceptor_;
+    NewClient new_client_;
+    protocol::Hash fingerprint_{};
+    std::set<std::shared_ptr<EdgeLink>> links_;
+    bool closed_ = false;
+};
@@ -0,0 +1,481 @@
+#pragma once
+
+// federation.hpp
+// Several server processes acting as ONE chat room.
+//
+// One server process can only handle so many clients. With federation you run several servers ("nodes"), each with its own
+// clients, and link them together over TLS - a "mesh", where every node has a link to every other node:
+//
+//   ./server 12345 --node 13345 --peer 127.0.0.1:13346
+//   ./server 12346 --node 13346 --peer 127.0.0.1:13345
+//
+// --node is the port this server takes links from other servers on, --peer is another server's node port (you can give several).
+// It's enough for one of each pair to list the other - if both do, the second link is dropped (see on_hello()).
+//
+// When a client on one node sends a chat line, that node sends it down every link (node_chat) - but only to nodes that have
+// somebody logged in. A node with nobody on it has nobody to show it to, so we save the bandwidth (node_members tells us who has people).
+// The node at the other end hands it to its own clients as if it had been sent there, with its own sequence number.
+// (A chat line's body between nodes is the sender's name and then the text - the numbers clients see instead of names are per node.)
+//
+// Every message carries the ID of the node it came from ("origin") and that node's sequence number for it. Each node remembers the
+// last sequence number it has seen from every origin, and throws away anything it has already had. That matters when a link drops and
+// comes back: we tell the other node the last number we saw from it (node_resume), it sends what we missed from its history,
+// and anything that overlaps is simply skipped.
+//
+// Nodes prove who they are with the server certificate: a node only keeps a link if the other end has EXACTLY the same certificate
+// as itself (same fingerprint - see peer.hpp). So give every node in the mesh the same ssl_certification folder.
+//
+// Only chat lines are shared. Files are stored on the node they were shared on, and private messages and /who only see the people on your node.
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include "peer.hpp"
+#include "protocol.hpp"
+
+class Federation
+{
+public:
+    struct Options
+    {
+        unsigned short port = 0;        // --node: where other nodes connect to us. 0 = we only connect out.
+        std::vector<std::string> peers; // --peer host:port, one for each node we connect to.
+
+        bool enabled() const { return port != 0 || !peers.empty(); }
+    };
+
+    // What the Server does for us.
+    struct Handlers
+    {
+        std::function<void(protocol::MessageType, std::string_view)> deliver; // A message from another node - give it to our clients.
+        std::function<std::uint64_t()> last_sequence;                          // Our latest sequence number.
+        // Calls send(sequence, type, body) for every message in our history that was sent on THIS node, after `after`.
+        std::function<void(std::uint64_t after, const std::function<void(std::uint64_t, protocol::MessageType, std::string_view)> &send)> replay;
+    };
+
+    // node_id is the server's run ID: it stays the same through a hot restart (so do the sequence numbers), and changes when the
+    // server starts from scratch - which is exactly when its sequence numbers start again from 1.
+    Federation(boost::asio::io_context &io_context, const Options &options, std::uint64_t node_id, Handlers handlers)
+        : io_context_(io_context), context_(boost::asio::ssl::context::tls), acceptor_(io_context), node_id_(node_id), handlers_(std::move(handlers))
+    {
+        fingerprint_ = peer::use_server_certificate(context_); // Checked against the other end's in link_up().
+
+        if (options.port != 0)
+        {
+            boost::asio::co_spawn(io_context_, accept_nodes(options.port), boost::asio::detached);
+        }
+        for (const auto &address : options.peers)
+        {
+            boost::asio::co_spawn(io_context_, keep_connected(address), boost::asio::detached);
+        }
+    }
+
+    // A message that was sent on this node. It goes to every node that has somebody logged in.
+    void forward(std::uint64_t sequence, protocol::MessageType type, std::string_view body)
+    {
+        std::shared_ptr<const protocol::Frame> frame;
+        for (auto &[link, node] : nodes_)
+        {
+            if (node.id != 0 && node.members > 0)
+            {
+                if (!frame)
+                {
+                    frame = chat_frame(sequence, type, body); // Built once, however many nodes it goes to.
+                }
+                node.link->send(frame);
+            }
+        }
+    }
+
+    // How many people are logged in here. The other nodes only hear about it when it changes.
+    void set_members(std::uint32_t count)
+    {
+        if (count == members_)
+        {
+            return;
+        }
+        members_ = count;
+        std::string body;
+        protocol::Writer(body).u32(count);
+        auto frame = protocol::make_frame(protocol::MessageType::node_members, std::move(body));
+        for (auto &[link, node] : nodes_)
+        {
+            node.link->send(frame);
+        }
+    }
+
+    // Linked nodes, and how many people are on each - for the server's console.
+    std::size_t nodes() const { return nodes_.size(); }
+    std::uint64_t remote_members() const
+    {
+        std::uint64_t total = 0;
+        for (const auto &[link, node] : nodes_)
+        {
+            total += node.members;
+        }
+        return total;
+    }
+
+    // Stops for good (the server is being replaced - see Server::hand_over()). The new server links up again by itself.
+    void close()
+    {
+        closed_ = true;
+        boost::system::error_code ignored;
+        acceptor_.close(ignored);
+        auto nodes = nodes_;
+        for (auto &[link, node] : nodes)
+        {
+            node.link->close();
+        }
+    }
+
+    // The last sequence number seen from every origin. It goes into the hot restart state, so the new server carries on from there
+    // instead of getting (and showing its clients) everything again.
+    std::string save() const
+    {
+        std::string out;
+        protocol::Writer writer(out);
+        writer.u32(static_cast<std::uint32_t>(seen_.size()));
+        for (const auto &[origin, sequence] : seen_)
+        {
+            writer.u64(origin);
+            writer.u64(sequence);
+        }
+        return out;
+    }
+
+    void restore(protocol::Reader &reader)
+    {
+        for (std::uint32_t count = reader.u32(); count > 0 && reader.ok(); --count)
+        {
+            auto origin = reader.u64();
+            auto sequence = reader.u64();
+            if (reader.ok())
+            {
+                seen_[origin] = sequence;
+            }
+        }
+    }
+
+private:
+    using tcp = boost::asio::ip::tcp;
+    using Stream = peer::PeerLink::Stream;
+
+    struct Node
+    {
+        std::shared_ptr<peer::PeerLink> link;
+        bool outgoing = false;  // We connected to them (rather than them to us).
+        std::string address;    // For outgoing links, the --peer address - see keep_connected().
+        std::uint64_t id = 0;   // 0 until their node_hello arrives.
+        std::uint32_t members = 0;
+        std::optional<std::uint64_t> resume_after; // A node_resume that came while nobody was on that node yet - see on_frame().
+    };
+
+    // node_chat: origin node ID, the origin's sequence number, the type of the message, its body.
+    std::shared_ptr<const protocol::Frame> chat_frame(std::uint64_t sequence, protocol::MessageType type, std::string_view body) const
+    {
+        std::string out;
+        protocol::Writer writer(out);
+        writer.u64(node_id_);
+        writer.u64(sequence);
+        writer.u8(static_cast<std::uint8_t>(type));
+        writer.raw(body);
+        return protocol::make_frame(protocol::MessageType::node_chat, std::move(out));
+    }
+
+    // Keeps trying to link to a --peer for as long as we run. If the link drops, we connect again.
+    // If that node is already linked to us the other way round (it has us in its own --peer list), we leave it at that.
+    boost::asio::awaitable<void> keep_connected(std::string address)
+    {
+        auto colon = address.rfind(':');
+        std::string host = address.substr(0, colon);
+        std::string port = colon == std::string::npos ? std::string() : address.substr(colon + 1);
+        boost::asio::steady_timer retry(io_context_);
+        tcp::resolver resolver(io_context_);
+
+        while (!closed_)
+        {
+            if (!linked(address))
+            {
+                boost::system::error_code ec;
+                auto endpoints = co_await resolver.async_resolve(host, port, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+                auto stream = std::make_shared<Stream>(io_context_, context_);
+                auto deadline = handshake_deadline(stream);
+                if (!ec)
+                {
+                    co_await boost::asio::async_connect(stream->lowest_layer(), endpoints, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+                }
+                if (!ec)
+                {
+                    co_await stream->async_handshake(boost::asio::ssl::stream_base::client, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+                }
+                deadline->cancel();
+                if (!ec && !closed_)
+                {
+                    link_up(std::move(*stream), address, true);
+                }
+            }
+
+            boost::system::error_code ignored;
+            retry.expires_after(retry_delay);
+            co_await retry.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ignored));
+        }
+    }
+
+    bool linked(const std::string &address) const
+    {
+        auto known = peer_ids_.find(address);
+        for (const auto &[link, node] : nodes_)
+        {
+            if ((node.outgoing && node.address == address) || (known != peer_ids_.end() && node.id == known->second))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // When this node restarts, the old server may still be holding the port for a moment - see peer::listen_when_free().
+    boost::asio::awaitable<void> accept_nodes(unsigned short port)
+    {
+        co_await peer::listen_when_free(acceptor_, port, closed_);
+        while (!closed_)
+        {
+            boost::system::error_code ec;
+            tcp::socket socket(io_context_);
+            co_await acceptor_.async_accept(socket, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+            if (ec)
+            {
+                if (closed_ || ec == boost::asio::error::operation_aborted)
+                {
+                    co_return;
+                }
+                continue;
+            }
+            boost::asio::co_spawn(io_context_, accept_node(std::move(socket)), boost::asio::detached);
+        }
+    }
+
+    boost::asio::awaitable<void> accept_node(tcp::socket socket)
+    {
+        boost::system::error_code ec;
+        std::string address = socket.remote_endpoint(ec).address().to_string();
+        auto stream = std::make_shared<Stream>(std::move(socket), context_);
+        auto deadline = handshake_deadline(stream);
+        co_await stream->async_handshake(boost::asio::ssl::stream_base::server, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        deadline->cancel();
+        if (!ec && !closed_)
+        {
+            link_up(std::move(*stream), address, false);
+        }
+    }
+
+    std::shared_ptr<boost::asio::steady_timer> handshake_deadline(const std::shared_ptr<Stream> &stream)
+    {
+        return peer::handshake_deadline(stream, handshake_timeout);
+    }
+
+    // The TLS handshake worked. If the other end has our certificate, it's one of us: we say hello and wait for theirs.
+    void link_up(Stream stream, const std::string &address, bool outgoing)
+    {
+        if (peer::remote_fingerprint(stream.native_handle()) != fingerprint_)
+        {
+            std::cout << "Refused a node link with " << address << " - it doesn't have our certificate." << std::endl << std::endl;
+            boost::system::error_code ignored;
+            stream.lowest_layer().close(ignored);
+            return;
+        }
+
+        peer::PeerLink::Handlers handlers{
+            [this](peer::PeerLink &link, protocol::MessageType type, std::string_view body)
+            { on_frame(link, type, body); },
+            [](peer::PeerLink &) {},
+            [this](peer::PeerLink &link)
+            { on_closed(link); }};
+        auto link = std::make_shared<peer::PeerLink>(std::move(stream), address, std::move(handlers));
+        nodes_[link.get()] = Node{link, outgoing, outgoing ? address : std::string(), 0, 0, std::nullopt};
+        link->start();
+
+        std::string body;
+        protocol::Writer writer(body);
+        writer.u64(node_id_);
+        writer.u32(members_);
+        writer.u64(handlers_.last_sequence());
+        link->send(protocol::make_frame(protocol::MessageType::node_hello, std::move(body)));
+    }
+
+    void on_frame(peer::PeerLink &link, protocol::MessageType type, std::string_view body)
+    {
+        auto it = nodes_.find(&link);
+        if (it == nodes_.end())
+        {
+            return;
+        }
+        Node &node = it->second;
+        protocol::Reader reader(body);
+
+        if (node.id == 0 && type != protocol::MessageType::node_hello)
+        {
+            link.close(); // The hello always comes first.
+            return;
+        }
+
+        switch (type)
+        {
+        case protocol::MessageType::node_hello:
+        {
+            auto id = reader.u64();
+            auto members = reader.u32();
+            auto last_sequence = reader.u64();
+            if (reader.ok())
+            {
+                on_hello(link, node, id, members, last_sequence);
+            }
+            break;
+        }
+
+        case protocol::MessageType::node_resume:
+        {
+            // Everything sent here since `after` - but only once anybody over there is going to see it. A server that has just been
+            // restarted has nobody on it yet (its clients are still reconnecting), so then we wait for its node_members.
+            auto after = reader.u64();
+            if (reader.ok())
+            {
+                node.resume_after = after;
+                resume(link, node);
+            }
+            break;
+        }
+
+        case protocol::MessageType::node_members:
+        {
+            auto members = reader.u32();
+            if (reader.ok())
+            {
+                node.members = members;
+                resume(link, node);
+            }
+            break;
+        }
+
+        case protocol::MessageType::node_chat:
+        {
+            auto origin = reader.u64();
+            auto sequence = reader.u64();
+            auto inner = static_cast<protocol::MessageType>(reader.u8());
+            auto message = reader.rest();
+            if (!reader.ok())
+            {
+                break;
+            }
+            auto &last = seen_[origin];
+            if (sequence <= last)
+            {
+                break; // Already had this one.
+            }
+            last = sequence;
+            handlers_.deliver(inner, message);
+            break;
+        }
+
+        default:
+            break;
+        }
+    }
+
+    void resume(peer::PeerLink &link, Node &node)
+    {
+        if (!node.resume_after || node.members == 0)
+        {
+            return;
+        }
+        handlers_.replay(*node.resume_after, [this, &link](std::uint64_t sequence, protocol::MessageType type, std::string_view body)
+                         { link.send(chat_frame(sequence, type, body)); });
+        node.resume_after.reset();
+    }
+
+    void on_hello(peer::PeerLink &link, Node &node, std::uint64_t id, std::uint32_t members, std::uint64_t last_sequence)
+    {
+        if (id == node_id_)
+        {
+            link.close(); // We connected to ourselves (a --peer with our own address).
+            return;
+        }
+
+        // Two nodes that both list each other end up with two links. Both sides keep the one the node with the smaller ID started.
+        for (auto &[other_link, other] : nodes_)
+        {
+            if (other_link != &link && other.id == id)
+            {
+                bool keep_this = node.outgoing ? node_id_ < id : id < node_id_;
+                if (!keep_this)
+                {
+                    if (node.outgoing)
+                    {
+                        peer_ids_[node.address] = id; // So keep_connected() knows we're already linked to that address.
+                    }
+                    link.close();
+                    return;
+                }
+                other.link->close();
+                break;
+            }
+        }
+
+        node.id = id;
+        node.members = members;
+        if (node.outgoing)
+        {
+            peer_ids_[node.address] = id;
+        }
+
+        // If we've never heard from this node before, we start from now - its old history was never part of our room.
+        auto seen = seen_.find(id);
+        if (seen == seen_.end())
+        {
+            seen = seen_.emplace(id, last_sequence).first;
+        }
+        std::string body;
+        protocol::Writer(body).u64(seen->second);
+        link.send(protocol::make_frame(protocol::MessageType::node_resume, std::move(body)));
+
+        std::cout << "Linked to node " << link.name() << " (" << members << " online there)." << std::endl << std::endl;
+    }
+
+    void on_closed(peer::PeerLink &link)
+    {
+        auto it = nodes_.find(&link);
+        if (it == nodes_.end())
+        {
+            return;
+        }
+        if (it->second.id != 0 && !closed_)
+        {
+            std::cout << "Lost the link to node " << link.name() << "." << std::endl << std::endl;
+        }
+        nodes_.erase(it);
+    }
+
+    static constexpr std::chrono::seconds handshake_timeout{5};
+    static constexpr std::chrono::seconds retry_delay{2};
+
+    boost::asio::io_context &io_context_;
+    boost::asio::ssl::context context_;
+    tcp::acceptor acceptor_;
+    std::uint64_t node_id_;
+    Handlers handlers_;
+    protocol::Hash fingerprint_{};
+
+    std::map<peer::PeerLink *, Node> nodes_;
+    std::map<std::string, std::uint64_t> peer_ids_; // --peer address -> the ID of the node we found there.
+    std::map<std::uint64_t, std::uint64_t> seen_;   // Origin node ID -> the last sequence number we've had from it.
+    std::uint32_t members_ = 0;
+    bool closed_ = false;
+};
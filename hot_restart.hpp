@@ -0,0 +1,143 @@
+#pragma once
+
+// hot_restart.hpp
+// Handing the server over to a new copy of itself without closing the listening port - Linux/macOS only.
+//
+// Normally upgrading the server means: stop the old one (every client gets cut off), start the new one. For a moment nobody is
+// listening on the port, so clients that try to reconnect in that moment get "connection refused" and back off.
+//
+// With a hot restart:
+//   1. The new server is started with --takeover. Instead of opening the port itself, it connects to the old server's
+//      control socket (a Unix domain socket - a file like "server-12345.sock" that only programs on this machine can use).
+//   2. The old server stops accepting, tells its clients to reconnect (spread out over a few seconds) and waits for them to leave.
+//   3. The old server sends the new one its LISTENING SOCKET (the file descriptor itself - see send_handoff()) plus a snapshot of
+//      its state (message history, sequence numbers, TLS session ticket keys). Then it exits.
+//   4. The new server starts accepting on the very same socket. Clients that connected while all this happened were just
+//      waiting in the operating system's queue - nobody sees "connection refused".
+//
+// Because the new server has the same TLS ticket keys, reconnecting clients resume their TLS sessions (no full handshake),
+// and because it has the same history and sequence numbers, they pick up their messages exactly where they left off.
+
+// Passing a socket to another process like this is a Unix thing - on Windows the server just starts and stops the old way.
+#if !defined(_WIN32)
+#define HOT_RESTART_SUPPORTED 1
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "protocol.hpp"
+
+namespace hot_restart
+{
+    inline std::string control_path(unsigned short port)
+    {
+        return "server-" + std::to_string(port) + ".sock";
+    }
+
+    // A file descriptor is just a number, and the number means nothing in another process. To really hand a socket over,
+    // the operating system has to copy it into the other process - that is what an SCM_RIGHTS "control message" on a Unix socket does.
+    // The state goes in the same message (after a 4 byte length) and, if it's big, in the following writes.
+    inline bool send_handoff(int unix_socket, int listening_socket, const std::string &state)
+    {
+        std::string message(4, '\0');
+        protocol::put_u32(message.data(), static_cast<std::uint32_t>(state.size()));
+        message += state;
+
+        iovec data{message.data(), message.size()};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr header{};
+        header.msg_iov = &data;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+
+        cmsghdr *fd_message = CMSG_FIRSTHDR(&header);
+        fd_message->cmsg_level = SOL_SOCKET;
+        fd_message->cmsg_type = SCM_RIGHTS;
+        fd_message->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(fd_message), &listening_socket, sizeof(int));
+
+        ssize_t sent = ::sendmsg(unix_socket, &header, 0);
+        if (sent <= 0)
+        {
+            return false;
+        }
+
+        // Only the first write carries the file descriptor - the rest is plain bytes.
+        std::size_t done = static_cast<std::size_t>(sent);
+        while (done < message.size())
+        {
+            ssize_t more = ::write(unix_socket, message.data() + done, message.size() - done);
+            if (more <= 0)
+            {
+                return false;
+            }
+            done += static_cast<std::size_t>(more);
+        }
+        return true;
+    }
+
+    // The new server's side: connect to the old server's control socket and wait (blocking - nothing else is running yet)
+    // for the listening socket and the state. Returns -1 if there's no old server to take over from, or it went wrong.
+    inline int receive_handoff(const std::string &path, std::string &state)
+    {
+        int unix_socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+        if (unix_socket < 0 || ::connect(unix_socket, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+        {
+            if (unix_socket >= 0)
+            {
+                ::close(unix_socket);
+            }
+            return -1;
+        }
+
+        char first[64 * 1024];
+        iovec data{first, sizeof(first)};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr header{};
+        header.msg_iov = &data;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+
+        ssize_t received = ::recvmsg(unix_socket, &header, 0);
+        cmsghdr *fd_message = CMSG_FIRSTHDR(&header);
+        if (received < 4 || !fd_message || fd_message->cmsg_level != SOL_SOCKET || fd_message->cmsg_type != SCM_RIGHTS)
+        {
+            ::close(unix_socket);
+            return -1;
+        }
+
+        int listening_socket = -1;
+        std::memcpy(&listening_socket, CMSG_DATA(fd_message), sizeof(int));
+
+        std::size_t length = protocol::get_u32(first);
+        state.assign(first + 4, static_cast<std::size_t>(received) - 4);
+        while (state.size() < length)
+        {
+            ssize_t more = ::read(unix_socket, first, std::min(sizeof(first), length - state.size()));
+            if (more <= 0)
+            {
+                break;
+            }
+            state.append(first, static_cast<std::size_t>(more));
+        }
+        ::close(unix_socket);
+
+        if (state.size() != length)
+        {
+            ::close(listening_socket);
+            return -1;
+        }
+        return listening_socket;
+    }
+}
+
+#endif
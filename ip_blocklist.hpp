@@ -0,0 +1,253 @@
+#pragma once
+
+// ip_blocklist.hpp
+// A list of IP addresses and address ranges the server refuses to talk to.
+//
+// The list is a text file (blocklist.txt next to the server), one entry per line, in "CIDR" notation:
+//   203.0.113.7          - one address
+//   198.51.100.0/24      - every address that starts with the same first 24 bits (198.51.100.0 - 198.51.100.255)
+//   2001:db8::/32        - IPv6 works the same way
+//   # comments and empty lines are ignored
+//
+// The server checks every new connection against the list BEFORE the TLS handshake - the handshake is by far the most
+// expensive thing a connection costs us, so that's what we want to save when somebody is hammering the server.
+//
+// With hundreds of thousands of ranges we can't just go through the list for every connection. Instead the ranges are stored
+// in a "radix trie": a binary tree where going left or right means "the next bit of the address is 0 or 1".
+// A range like /24 is a node 24 steps down. To check an address we walk down following its bits, and if we pass a node that is
+// a blocked range, the address is in it. That's at most 128 steps however long the list is.
+// The trie is "compressed" (also called a Patricia trie): a chain of nodes with only one child is squashed into one node that
+// remembers all of those bits. So a list of 500,000 ranges has about 1,000,000 nodes, not 500,000 x 24 - and lookups take far fewer steps.
+//
+// IPv4 addresses are stored as IPv6 addresses of the form ::ffff:a.b.c.d (that's the standard way to write an IPv4 address as IPv6),
+// so one trie holds both.
+//
+// Once built, an IpBlocklist is never changed - a reload builds a whole new one and swaps the shared_ptr (see Server::reload_blocklist()).
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio/ip/address.hpp>
+
+class IpBlocklist
+{
+public:
+    IpBlocklist() : nodes_(1) {} // nodes_[0] is the root: length 0, matches every address.
+
+    // Reads the file. Lines that aren't a valid address or range are counted in bad_lines and skipped.
+    // A missing file is simply an empty list.
+    static std::shared_ptr<const IpBlocklist> load(const std::string &path, std::size_t &bad_lines)
+    {
+        auto list = std::make_shared<IpBlocklist>();
+        bad_lines = 0;
+
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line))
+        {
+            auto first = line.find_first_not_of(" \t\r");
+            if (first == std::string::npos || line[first] == '#')
+            {
+                continue;
+            }
+            auto last = line.find_last_not_of(" \t\r");
+            if (!list->add(line.substr(first, last - first + 1)))
+            {
+                ++bad_lines;
+            }
+        }
+        return list;
+    }
+
+    // Adds "address" or "address/prefix length". Returns false if it doesn't make sense.
+    bool add(const std::string &cidr)
+    {
+        auto slash = cidr.find('/');
+        boost::system::error_code ec;
+        auto address = boost::asio::ip::make_address(cidr.substr(0, slash), ec);
+        if (ec)
+        {
+            return false;
+        }
+
+        unsigned full = address.is_v4() ? 32 : 128;
+        unsigned length = full;
+        if (slash != std::string::npos)
+        {
+            try
+            {
+                std::size_t used = 0;
+                auto value = std::stoul(cidr.substr(slash + 1), &used);
+                if (used != cidr.size() - slash - 1 || value > full)
+                {
+                    return false;
+                }
+                length = static_cast<unsigned>(value);
+            }
+            catch (const std::exception &)
+            {
+                return false;
+            }
+        }
+
+        insert(to_key(address), length + 128 - full);
+        ++ranges_;
+        return true;
+    }
+
+    bool contains(const boost::asio::ip::address &address) const
+    {
+        Key key = to_key(address);
+        std::uint32_t index = 0;
+        while (true)
+        {
+            const Node &node = nodes_[index];
+            if (common_length(key, node.key, node.length) < node.length)
+            {
+                return false; // The address goes a different way somewhere in the bits this node squashed together.
+            }
+            if (node.blocked)
+            {
+                return true;
+            }
+            if (node.length == 128)
+            {
+                return false;
+            }
+            index = node.child[key.bit(node.length)];
+            if (index == 0)
+            {
+                return false;
+            }
+        }
+    }
+
+    std::size_t size() const { return ranges_; }
+
+private:
+    // 128 bits, most significant first - hi holds bits 0-63, lo holds bits 64-127.
+    struct Key
+    {
+        std::uint64_t hi = 0;
+        std::uint64_t lo = 0;
+
+        int bit(unsigned i) const { return static_cast<int>(i < 64 ? (hi >> (63 - i)) & 1 : (lo >> (127 - i)) & 1); }
+
+        // The same key with every bit from length onwards set to 0.
+        Key first(unsigned length) const
+        {
+            Key out;
+            out.hi = length == 0 ? 0 : length >= 64 ? hi : hi & (~std::uint64_t(0) << (64 - length));
+            out.lo = length <= 64 ? 0 : length >= 128 ? lo : lo & (~std::uint64_t(0) << (128 - length));
+            return out;
+        }
+    };
+
+    // A node stands for the first `length` bits of `key`. child[0] / child[1] are where to go if the next bit is 0 / 1
+    // (0 means "nowhere" - the root can never be anybody's child). The nodes live in one vector, so a million of them are
+    // one big allocation instead of a million small ones, and indexes are half the size of pointers.
+    struct Node
+    {
+        Key key;
+        std::uint32_t child[2] = {0, 0};
+        std::uint8_t length = 0;
+        bool blocked = false;
+    };
+
+    static Key to_key(const boost::asio::ip::address &address)
+    {
+        Key key;
+        if (address.is_v4())
+        {
+            key.lo = 0x0000ffff00000000ULL | address.to_v4().to_uint();
+            return key;
+        }
+        auto bytes = address.to_v6().to_bytes();
+        for (int i = 0; i < 8; ++i)
+        {
+            key.hi = (key.hi << 8) | bytes[i];
+            key.lo = (key.lo << 8) | bytes[i + 8];
+        }
+        return key;
+    }
+
+    // How many leading bits a and b have in common, up to limit.
+    static unsigned common_length(const Key &a, const Key &b, unsigned limit)
+    {
+        std::uint64_t difference = a.hi ^ b.hi;
+        unsigned same = difference ? std::countl_zero(difference) : 64 + std::countl_zero(a.lo ^ b.lo); // countl_zero(0) is 64.
+        return same < limit ? same : limit;
+    }
+
+    std::uint32_t new_node(Key key, unsigned length, bool blocked)
+    {
+        Node node;
+        node.key = key;
+        node.length = static_cast<std::uint8_t>(length);
+        node.blocked = blocked;
+        nodes_.push_back(node);
+        return static_cast<std::uint32_t>(nodes_.size() - 1);
+    }
+
+    void insert(Key key, unsigned length)
+    {
+        key = key.first(length);
+        std::uint32_t index = 0;
+
+        // Walk down while the node we're at is a prefix of the new range.
+        while (true)
+        {
+            if (nodes_[index].length == length)
+            {
+                nodes_[index].blocked = true;
+                return;
+            }
+            if (nodes_[index].blocked)
+            {
+                return; // A bigger range that covers this one is already blocked.
+            }
+
+            int direction = key.bit(nodes_[index].length);
+            std::uint32_t child = nodes_[index].child[direction];
+            if (child == 0)
+            {
+                std::uint32_t leaf = new_node(key, length, true); // push_back may move the nodes - so no references held across this.
+                nodes_[index].child[direction] = leaf;
+                return;
+            }
+
+            unsigned child_length = nodes_[child].length;
+            unsigned same = common_length(key, nodes_[child].key, std::min(length, child_length));
+            if (same == child_length)
+            {
+                index = child;
+                continue;
+            }
+
+            // The new range and the child part ways (or the new range ends) somewhere inside the child's squashed bits,
+            // so we put a new node there with the child hanging off it.
+            Key child_key = nodes_[child].key;
+            if (same == length)
+            {
+                std::uint32_t middle = new_node(key, length, true);
+                nodes_[middle].child[child_key.bit(length)] = child;
+                nodes_[index].child[direction] = middle;
+                return;
+            }
+
+            std::uint32_t middle = new_node(key.first(same), same, false);
+            std::uint32_t leaf = new_node(key, length, true);
+            nodes_[middle].child[key.bit(same)] = leaf;
+            nodes_[middle].child[child_key.bit(same)] = child;
+            nodes_[index].child[direction] = middle;
+            return;
+        }
+    }
+
+    std::vector<Node> nodes_;
+    std::size_t ranges_ = 0;
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+// object_pool.hpp
+// Recycled memory for objects that come and go all the time (Sessions - one for every connection).
+//
+// new and delete go to the general purpose allocator. It's fast, but it is shared by every thread in the program: with a few
+// io threads creating and destroying objects at the same time, they end up waiting for each other inside it (that's the
+// "allocator contention" you see at the top of a profile). It also has to find a block of the right size every time.
+//
+// Here, every type gets a list of spare blocks of exactly its size, and every thread has its own lists (thread_local) - so
+// there's no lock and no searching. When an object is destroyed its memory goes on the list of the thread that destroyed it,
+// and the next object of that type made on that thread takes it from there. Only an empty list goes to the heap.
+//
+// Use it through std::allocate_shared:
+//
+//   auto session = std::allocate_shared<Session>(object_pool::Allocator<Session>(), ...);
+//
+// (allocate_shared puts the reference counts and the object in one block, so the pooled type is really that block - the
+// allocator is "rebound" to it. That's why FreeList is per type rather than per size: it just works for whatever gets rebound.)
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+namespace object_pool
+{
+    template <typename T>
+    class FreeList
+    {
+    public:
+        static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "::operator new doesn't align this type well enough");
+
+        // This many spare blocks per type and thread at most - after a rush of connections we keep some, not all.
+        static constexpr std::size_t max_spare = 1024;
+
+        static void *take()
+        {
+            if (List::closed || spare().blocks.empty())
+            {
+                return ::operator new(sizeof(T));
+            }
+            auto &blocks = spare().blocks;
+            void *block = blocks.back();
+            blocks.pop_back();
+            return block;
+        }
+
+        static void give_back(void *block)
+        {
+            if (List::closed)
+            {
+                ::operator delete(block);
+                return;
+            }
+            auto &blocks = spare().blocks;
+            if (blocks.size() < max_spare)
+            {
+                blocks.push_back(block); // Never allocates - see List.
+            }
+            else
+            {
+                ::operator delete(block);
+            }
+        }
+
+    private:
+        struct List
+        {
+            List() { blocks.reserve(max_spare); }
+            ~List()
+            {
+                for (void *block : blocks)
+                {
+                    ::operator delete(block);
+                }
+                closed = true;
+            }
+
+            std::vector<void *> blocks;
+            // Set once this thread's list is gone (at exit). Objects destroyed after that - a static, say - just use the heap.
+            static inline thread_local bool closed = false;
+        };
+
+        static List &spare()
+        {
+            thread_local List list;
+            return list;
+        }
+    };
+
+    // A standard allocator that takes single objects from FreeList (arrays go to the heap as usual).
+    // It has no state, so any two of them are equal: memory from one can be given back through another.
+    template <typename T>
+    class Allocator
+    {
+    public:
+        using value_type = T;
+
+        Allocator() = default;
+        template <typename U>
+        Allocator(const Allocator<U> &) {}
+
+        T *allocate(std::size_t n)
+        {
+            if (n == 1)
+            {
+                return static_cast<T *>(FreeList<T>::take());
+            }
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(T *pointer, std::size_t n)
+        {
+            if (n == 1)
+            {
+                FreeList<T>::give_back(pointer);
+                return;
+            }
+            ::operator delete(pointer);
+        }
+    };
+
+    template <typename T, typename U>
+    bool operator==(const Allocator<T> &, const Allocator<U> &) { return true; }
+
+    template <typename T, typename U>
+    bool operator!=(const Allocator<T> &, const Allocator<U> &) { return false; }
+}
@@ -0,0 +1,408 @@
+#pragma once
+
+// peer.hpp
+// Direct (peer to peer) connections between two clients.
+//
+// Normally every message goes client -> server -> client. For private messages and files sent to one person that's a waste:
+// the server pays for the bandwidth twice, and a 1 GB file has to go through it. With ./client ... --p2p the server only introduces
+// people to each other ("rendezvous"), and then they talk directly:
+//
+//   1. Each --p2p client listens on a port of its own and tells the server the port and its certificate fingerprint (peer_info).
+//   2. When alice wants to talk to bob directly she asks the server (peer_request). The server sends alice bob's address, port and
+//      fingerprint, and sends bob alice's fingerprint (peer_intro) - so bob knows who to expect.
+//   3. alice connects straight to bob with TLS. Both sides check that the other one's certificate has exactly the fingerprint the server gave them.
+//      That's how we know we're talking to bob and not somebody pretending to be him.
+//   4. From then on /msg bob and /sendto bob go over that connection. If it can't be made (bob is behind a firewall, or not using --p2p),
+//      messages just keep going through the server like before.
+//
+// Nobody has a "real" certificate for this - every client makes up its own key and self-signed certificate when it starts (Identity).
+// That's fine, because we never trust a certificate for what it says, only for matching the fingerprint the server told us about.
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include "protocol.hpp"
+
+namespace peer
+{
+    using boost::asio::ip::tcp;
+
+    // The SHA-256 of a certificate - a short, unique "name" for it.
+    inline protocol::Hash fingerprint(X509 *certificate)
+    {
+        protocol::Hash value{};
+        unsigned int length = 0;
+        if (certificate)
+        {
+            X509_digest(certificate, EVP_sha256(), value.data(), &length);
+        }
+        return value;
+    }
+
+    // The fingerprint of the certificate the other end of this TLS connection showed us (all zeroes if it didn't show one).
+    inline protocol::Hash remote_fingerprint(SSL *ssl)
+    {
+        std::unique_ptr<X509, decltype(&X509_free)> certificate(SSL_get1_peer_certificate(ssl), X509_free);
+        return fingerprint(certificate.get());
+    }
+
+    // Links between our own servers (federation.hpp, replication.hpp) and between an edge and the server (edge.hpp) use the server's own certificate
+    // at BOTH ends, and only keep the link if the other end's certificate is exactly the same one (compare remote_fingerprint() with the result).
+    inline protocol::Hash use_server_certificate(boost::asio::ssl::context &context)
+    {
+        context.use_certificate_chain_file("ssl_certification/certificate.crt");
+        context.use_private_key_file("ssl_certification/private.key", boost::asio::ssl::context::pem);
+        context.set_verify_mode(boost::asio::ssl::verify_peer | boost::asio::ssl::verify_fail_if_no_peer_cert);
+        context.set_verify_callback([](bool, boost::asio::ssl::verify_context &)
+                                    { return true; });
+        return fingerprint(SSL_CTX_get0_certificate(context.native_handle()));
+    }
+
+    // A connect + handshake that takes too long gets its socket closed under it - which makes the handshake fail.
+    // Cancel the timer once the handshake is done. (The timer keeps the stream alive until then, which is why it's a shared_ptr.)
+    inline std::shared_ptr<boost::asio::steady_timer> handshake_deadline(const std::shared_ptr<boost::asio::ssl::stream<tcp::socket>> &stream,
+                                                                         std::chrono::steady_clock::duration timeout)
+    {
+        auto timer = std::make_shared<boost::asio::steady_timer>(stream->get_executor(), timeout);
+        timer->async_wait([stream](const boost::system::error_code &ec)
+                          {
+                              if (!ec)
+                              {
+                                  boost::system::error_code ignored;
+                                  stream->lowest_layer().close(ignored);
+                              } });
+        return timer;
+    }
+
+    // Opens the acceptor on port. After a hot restart the old server may still be holding the port for a moment (it only hands over
+    // the port the clients use), so if it's taken we just try again every second - until it works, or closed becomes true.
+    inline boost::asio::awaitable<void> listen_when_free(tcp::acceptor &acceptor, unsigned short port, const bool &closed)
+    {
+        boost::asio::steady_timer retry(acceptor.get_executor());
+        while (!closed && !acceptor.is_open())
+        {
+            boost::system::error_code ec;
+            tcp::endpoint endpoint(tcp::v4(), port);
+            acceptor.open(endpoint.protocol(), ec);
+            if (!ec)
+                acceptor.set_option(tcp::acceptor::reuse_address(true), ec);
+            if (!ec)
+                acceptor.bind(endpoint, ec);
+            if (!ec)
+                acceptor.listen(boost::asio::socket_base::max_listen_connections, ec);
+            if (ec)
+            {
+                boost::system::error_code ignored;
+                acceptor.close(ignored);
+                retry.expires_after(std::chrono::seconds(1));
+                co_await retry.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ignored));
+            }
+        }
+    }
+
+    // Hashes a whole file - the receiver checks the hash when it has all of it. Returns false if the file can't be read.
+    inline bool hash_file(const std::filesystem::path &path, protocol::Hash &hash, std::uint64_t &size)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+        {
+            return false;
+        }
+        protocol::Hasher hasher;
+        std::vector<char> chunk(protocol::file_chunk_size);
+        size = 0;
+        while (file.read(chunk.data(), chunk.size()) || file.gcount() > 0)
+        {
+            hasher.update(chunk.data(), static_cast<std::size_t>(file.gcount()));
+            size += static_cast<std::uint64_t>(file.gcount());
+        }
+        hash = hasher.finish();
+        return true;
+    }
+
+    // A key and self-signed certificate, made up when the client starts and thrown away when it stops.
+    // An EC (P-256) key takes about a millisecond to make - an RSA key would take much longer.
+    class Identity
+    {
+    public:
+        explicit Identity(const std::string &name) : key_(nullptr, EVP_PKEY_free), certificate_(X509_new(), X509_free)
+        {
+            std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> context(EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr), EVP_PKEY_CTX_free);
+            EVP_PKEY *key = nullptr;
+            if (!context || EVP_PKEY_keygen_init(context.get()) <= 0 ||
+                EVP_PKEY_CTX_set_ec_paramgen_curve_nid(context.get(), NID_X9_62_prime256v1) <= 0 || EVP_PKEY_keygen(context.get(), &key) <= 0)
+            {
+                throw std::runtime_error("couldn't make a key for direct connections");
+            }
+            key_.reset(key);
+
+            X509 *certificate = certificate_.get();
+            X509_set_version(certificate, 2);
+            ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+            X509_gmtime_adj(X509_getm_notBefore(certificate), -60 * 60);
+            X509_gmtime_adj(X509_getm_notAfter(certificate), 7 * 24 * 60 * 60);
+            X509_set_pubkey(certificate, key_.get());
+            X509_NAME *subject = X509_get_subject_name(certificate);
+            X509_NAME_add_entry_by_txt(subject, "CN", MBSTRING_UTF8, reinterpret_cast<const unsigned char *>(name.c_str()), -1, -1, 0);
+            X509_set_issuer_name(certificate, subject); // Self-signed: it's its own issuer.
+            if (X509_sign(certificate, key_.get(), EVP_sha256()) == 0)
+            {
+                throw std::runtime_error("couldn't make a certificate for direct connections");
+            }
+            fingerprint_ = peer::fingerprint(certificate);
+        }
+
+        // Sets up an ssl::context for direct connections: we show our own certificate, and insist on seeing the other side's.
+        // The verify callback accepts any certificate - the real check is the fingerprint, after the handshake (see remote_fingerprint()).
+        void use_in(boost::asio::ssl::context &context) const
+        {
+            SSL_CTX_use_certificate(context.native_handle(), certificate_.get());
+            SSL_CTX_use_PrivateKey(context.native_handle(), key_.get());
+            context.set_verify_mode(boost::asio::ssl::verify_peer | boost::asio::ssl::verify_fail_if_no_peer_cert);
+            context.set_verify_callback([](bool, boost::asio::ssl::verify_context &)
+                                        { return true; });
+        }
+
+        const protocol::Hash &fingerprint() const { return fingerprint_; }
+
+    private:
+        std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key_;
+        std::unique_ptr<X509, decltype(&X509_free)> certificate_;
+        protocol::Hash fingerprint_{};
+    };
+
+    // One direct connection to one other client, after the handshake and fingerprint check.
+    // (The servers use the same thing for the links between them - see federation.hpp.)
+    // Like the client's connection to the server it has a reader() and a writer() coroutine, and frames wait in a queue until writer() sends them.
+    // Files are sent a chunk at a time, only when nothing else is waiting - so a private message never gets stuck behind a big file.
+    class PeerLink : public std::enable_shared_from_this<PeerLink>
+    {
+    public:
+        using Stream = boost::asio::ssl::stream<tcp::socket>;
+
+        // What the owner (the Client) wants to hear about.
+        struct Handlers
+        {
+            std::function<void(PeerLink &, protocol::MessageType, std::string_view)> frame; // A frame arrived.
+            std::function<void(PeerLink &)> idle;                                          // Everything queued has been sent.
+            std::function<void(PeerLink &)> closed;                                        // The connection is gone (called once).
+        };
+
+        PeerLink(Stream stream, std::string name, Handlers handlers)
+            : stream_(std::move(stream)), name_(std::move(name)), handlers_(std::move(handlers)), write_signal_(stream_.get_executor())
+        {
+            write_signal_.expires_at(boost::asio::steady_timer::time_point::max());
+        }
+
+        void start()
+        {
+            boost::asio::co_spawn(stream_.get_executor(), [self = shared_from_this()]()
+                                  { return self->reader(); },
+                                  boost::asio::detached);
+            boost::asio::co_spawn(stream_.get_executor(), [self = shared_from_this()]()
+                                  { return self->writer(); },
+                                  boost::asio::detached);
+        }
+
+        const std::string &name() const { return name_; }
+
+        // Still sending something?
+        bool busy() const { return !closed_ && (!queue_.empty() || !files_.empty()); }
+
+        // Frames that hadn't gone out when the connection closed - the Client sends the private messages among them through the server instead.
+        const std::deque<std::shared_ptr<const protocol::Frame>> &unsent() const { return queue_; }
+
+        void send(std::shared_ptr<const protocol::Frame> frame)
+        {
+            queue_.push_back(std::move(frame));
+            wake_writer();
+        }
+
+        // A file_offer (hash, size, name) and then the file as file_chunk frames - the same frames the server uses.
+        bool send_file(const std::filesystem::path &path)
+        {
+            Outgoing file;
+            if (!hash_file(path, file.hash, file.size))
+            {
+                return false;
+            }
+            file.file.open(path, std::ios::binary);
+
+            std::string body;
+            protocol::Writer writer(body);
+            writer.hash(file.hash);
+            writer.u64(file.size);
+            writer.str(path.filename().string());
+            if (writer.truncated())
+            {
+                return false; // The name wouldn't arrive as it is.
+            }
+            send(protocol::make_frame(protocol::MessageType::file_offer, std::move(body)));
+
+            files_.push_back(std::move(file));
+            wake_writer();
+            return true;
+        }
+
+        void close()
+        {
+            if (closed_)
+            {
+                return;
+            }
+            closed_ = true;
+            boost::system::error_code ignored;
+            stream_.lowest_layer().close(ignored);
+            write_signal_.cancel();
+            handlers_.closed(*this);
+        }
+
+    private:
+        struct Outgoing
+        {
+            protocol::Hash hash{};
+            std::uint64_t size = 0;
+            std::uint64_t offset = 0;
+            std::ifstream file;
+        };
+
+        // The same buffered reading as the client's reader(): read as much as there is, then handle every complete frame.
+        boost::asio::awaitable<void> reader()
+        {
+            auto self = shared_from_this();
+            std::vector<char> buffer(16 * 1024);
+            std::size_t start = 0;
+            std::size_t end = 0;
+            boost::system::error_code ec;
+
+            while (!closed_)
+            {
+                protocol::MessageType type;
+                bool compressed = false;
+                std::size_t body_length = 0;
+                while (end - start >= protocol::header_length)
+                {
+                    if (!protocol::parse_header(buffer.data() + start, type, compressed, body_length) || compressed)
+                    {
+                        close(); // We never compress on a direct link, so a compressed frame means something is wrong.
+                        co_return;
+                    }
+                    if (end - start < protocol::header_length + body_length)
+                    {
+                        break;
+                    }
+                    std::string_view body(buffer.data() + start + protocol::header_length, body_length);
+                    start += protocol::header_length + body_length;
+                    handlers_.frame(*this, type, body);
+                    if (closed_)
+                    {
+                        co_return;
+                    }
+                }
+
+                if (start > 0)
+                {
+                    std::memmove(buffer.data(), buffer.data() + start, end - start);
+                    end -= start;
+                    start = 0;
+                }
+                if (end >= protocol::header_length)
+                {
+                    buffer.resize(std::max(buffer.size(), protocol::header_length + body_length));
+                }
+
+                std::size_t length = co_await stream_.async_read_some(boost::asio::buffer(buffer.data() + end, buffer.size() - end),
+                                                                      boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+                if (ec)
+                {
+                    break;
+                }
+                end += length;
+            }
+            close();
+        }
+
+        boost::asio::awaitable<void> writer()
+        {
+            auto self = shared_from_this();
+            std::string staging;
+            std::vector<boost::asio::const_buffer> buffers;
+            boost::system::error_code ec;
+
+            while (!closed_)
+            {
+                if (queue_.empty())
+                {
+                    queue_next_chunk();
+                }
+                if (queue_.empty())
+                {
+                    handlers_.idle(*this);
+                    if (queue_.empty() && !closed_)
+                    {
+                        co_await write_signal_.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+                    }
+                    continue;
+                }
+
+                std::size_t frames = protocol::stage_frames(queue_, staging, buffers, 256, 256 * 1024);
+                co_await boost::asio::async_write(stream_, buffers, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+                if (ec)
+                {
+                    break;
+                }
+                queue_.erase(queue_.begin(), queue_.begin() + static_cast<std::ptrdiff_t>(frames));
+            }
+            close();
+        }
+
+        // The next piece of the first file waiting to go.
+        void queue_next_chunk()
+        {
+            if (files_.empty())
+            {
+                return;
+            }
+            auto &file = files_.front();
+            chunk_.resize(protocol::file_chunk_size);
+            file.file.read(chunk_.data(), static_cast<std::streamsize>(chunk_.size()));
+            std::size_t length = static_cast<std::size_t>(file.file.gcount());
+            if (length > 0)
+            {
+                std::string body;
+                protocol::Writer writer(body);
+                writer.hash(file.hash);
+                writer.u64(file.size);
+                writer.u64(file.offset);
+                writer.raw(std::string_view(chunk_.data(), length));
+                file.offset += length;
+                queue_.push_back(protocol::make_frame(protocol::MessageType::file_chunk, std::move(body)));
+            }
+            if (length == 0 || file.offset >= file.size)
+            {
+                files_.pop_front(); // length == 0: the file got shorter while we were sending it - the other side's hash check catches that.
+            }
+        }
+
+        void wake_writer() { write_signal_.cancel(); }
+
+        Stream stream_;
+        std::string name_;
+        Handlers handlers_;
+        std::deque<std::shared_ptr<const protocol::Frame>> queue_;
+        std::deque<Outgoing> files_;
+        std::vector<char> chunk_;
+        boost::asio::steady_timer write_signal_; // Never goes off by itself - cancelling it wakes writer() up.
+        bool closed_ = false;
+    };
+}
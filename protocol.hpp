@@ -0,0 +1,589 @@
+#pragma once
+
+// protocol.hpp
+// This file holds everything that BOTH client.cpp and server.cpp need to agree on - the "wire format".
+// Before this file existed, the client just wrote raw text and the server did a read_some() and hoped one read == one message.
+// That works for short chat lines, but not for files - a file has to be cut into pieces and put back together in the right order.
+// So now every message is sent as a "frame":
+//
+//   [4 bytes: length of everything after the header, big-endian][1 byte: message type][body...]
+//
+// The reader always reads the 5 byte header first, then it knows exactly how many more bytes to read for the body.
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <boost/asio/buffer.hpp>
+#include <openssl/evp.h>
+#include "object_pool.hpp"
+
+namespace protocol
+{
+    // Every kind of message we can send. The number is what goes on the wire, so never re-use or re-order these.
+    enum class MessageType : std::uint8_t
+    {
+        hello = 1,         // client -> server: the client's name, features, dictionary ID and where to resume from. Always the first frame.
+        chat = 2,          // client -> server: a chat line. server -> client: an envelope (see Envelope), then the chat line.
+        file_offer = 3,    // client -> server: "I want to share this file" (hash, size, file name, and optionally who it is only for).
+        file_status = 4,   // server -> client: reply to file_offer - "upload it" or "I already have it". Also "rejected" for a file_request we can't serve.
+        file_chunk = 5,    // both ways: one piece of a file (hash, offset, bytes).
+        file_announce = 6, // server -> clients: somebody shared a file - an envelope (see Envelope), then hash, size, file name, sender name.
+        file_request = 7,  // client -> server: "please send me the file with this hash".
+        notice = 8,        // server -> client: a plain text message from the server itself.
+        welcome = 9,       // server -> client: reply to hello - which optional features are switched on (see compression.hpp),
+                           // and the server's run ID and latest sequence number (see Client::handle_welcome()).
+        ping = 10,         // both ways: "are you still there?" The body is a timestamp, and must be sent straight back in a pong.
+        pong = 11,         // both ways: the answer to a ping, with the ping's body. The time it took is the round trip time (RTT).
+        going_away = 12,   // server -> client: "I'm being replaced - disconnect, and connect again at a random moment within this many ms" (u32).
+        direct = 13,       // client -> server: a private message (recipient name, text). server -> client: (sender name, text).
+        who = 14,          // client -> server: "who is online?" (page number). server -> client: one page of names (see Session::handle_who()).
+        presence = 15,     // server -> client: who joined and who left (see PresenceKind and ServerState::presence_frames()).
+        peer_info = 16,    // client -> server: "I take direct connections" (the port I listen on, my certificate fingerprint). See peer.hpp.
+        peer_request = 17, // client -> server: "introduce me to this person" (name).
+        peer_intro = 18,   // server -> client: somebody to talk to directly (name, address, port, fingerprint). Port 0 means "you can't - use the server".
+
+        // Between servers only (see federation.hpp).
+        node_hello = 19,   // The first frame on a link: node ID, how many are online, latest sequence number.
+        node_resume = 20,  // "Send me what you've had since this sequence number."
+        node_members = 21, // How many are online on the sending server now.
+        node_chat = 22,    // A message: origin node ID, origin sequence number, type (u8), body.
+
+        // Between an edge proxy and the server only (see edge.cpp). Every one starts with the channel (u32) - one channel per client.
+        edge_open = 23,    // edge -> server: a new client (its IP address).
+        edge_data = 24,    // both ways: bytes from / for that client - exactly what it sent or will receive over its own TLS connection.
+        edge_ack = 25,     // both ways: "I've passed on this many of your bytes (u32) - you can send that many more". See edge_window.
+        edge_close = 26,   // both ways: the client has gone / disconnect the client.
+
+        // From a server to its hot standby only (see replication.hpp). going_away on this link means "I'm being hot restarted - wait for the new one".
+        repl_begin = 27,   // The start of a snapshot: TLS ticket keys (str), run ID, latest sequence number, then the federation state.
+        repl_entry = 28,   // One history entry - the snapshot's, then every new one as it happens (see ServerState::save_entry()).
+        repl_presence = 29, // Names that joined (u32 count + names) and names that left (the same). The snapshot sends everybody online as joined.
+
+        // Ephemeral events (see EventKind). Over the UDP side channel when there is one (see datagram.hpp), otherwise in the TCP stream.
+        event = 30,        // client -> server: kind (u8), text.
+        events = 31,       // server -> client: one tick's events - count (u32), then kind (u8), name, text for each.
+
+        // Local socket only (see shm_ring.hpp).
+        ring_attach = 32,  // client -> server: no body, but a shared memory ring (memfd) and its eventfd come with it (SCM_RIGHTS).
+
+        names = 33         // server -> client: who the sender numbers in chat frames are - count (u32), then number (u32) and name for each.
+                           // All of them after the welcome, then each new one before its first line (see ServerState::senders).
+    };
+
+    // If this bit is set in the type byte, the body is zstd compressed (see compression.hpp).
+    constexpr std::uint8_t compressed_flag = 0x80;
+
+    // Optional features. The client lists what it can do in hello, the server answers with what it switched on in welcome.
+    enum Feature : std::uint32_t
+    {
+        feature_zstd = 1,
+        feature_datagrams = 2 // The UDP side channel (see datagram.hpp).
+    };
+
+    // file_status codes.
+    enum class FileStatus : std::uint8_t
+    {
+        upload = 1,   // The server doesn't have this content yet - send the chunks.
+        stored = 2,   // The server has it stored (either already had it, or the upload has just finished).
+        rejected = 3  // Too big, bad hash, disk problem... the notice that follows says why.
+    };
+
+    // The first byte of a presence frame. The body is: kind (u8), how many are online after this frame (u32),
+    // joined names (u32 count + names), left names (u32 count + names).
+    // A snapshot is for somebody who has just logged in: the first page of the list (who_page_size names - the rest is there with who)
+    // and how many are online in all. After that, the server sends one update per tick with everyone who joined or left in it.
+    // snapshot_more is from when the snapshot was the whole list, split over several frames - today's servers don't send it.
+    enum class PresenceKind : std::uint8_t
+    {
+        snapshot = 0,      // Forget the list you have - these are everybody online.
+        update = 1,        // These joined, these left.
+        snapshot_more = 2  // The rest of a long snapshot.
+    };
+
+    // Things that are only worth knowing right now - if one gets lost, the next one makes up for it. The server keeps only the newest
+    // one per sender and kind, and sends them all once per tick.
+    enum class EventKind : std::uint8_t
+    {
+        typing = 1, // The text is empty: "is typing". A client sends this at most every few seconds while the user types.
+        status = 2  // A short status ("away", "in a meeting").
+    };
+
+    constexpr std::size_t header_length = 5;
+    constexpr std::size_t max_body_length = 256 * 1024; // Anything bigger than this is a broken or hostile peer.
+    constexpr std::size_t file_chunk_size = 64 * 1024;  // How big each file_chunk piece is.
+    constexpr std::size_t hash_length = 32;             // SHA-256
+    constexpr std::size_t who_page_size = 50;           // Names per page in a who reply.
+    constexpr std::size_t edge_window = 256 * 1024;     // How many bytes of one edge channel may be on their way before an edge_ack.
+    constexpr std::size_t max_event_text = 100;         // Bytes of text in one event.
+    constexpr std::size_t max_name_length = 64;         // Bytes in a client's name - the server turns away a hello with a longer one.
+    constexpr std::size_t max_string_length = 0xffff;   // The most a string's 2 byte length can say (see Writer::str()).
+
+    // Heartbeats. If we haven't heard anything from the other side for heartbeat_interval we send a ping,
+    // and if we still haven't heard anything after heartbeat_timeout we give up on the connection.
+    // Any frame counts as "hearing from them" - a busy connection never needs pings (the server still sends one every few minutes,
+    // to measure the round trip time - see Session::heartbeat()). The server also pings a client it hasn't sent anything to for
+    // heartbeat_interval - the client is doing the same check at its end.
+    constexpr std::chrono::seconds heartbeat_interval{15};
+    constexpr std::chrono::seconds heartbeat_timeout{45};
+
+    using Hash = std::array<unsigned char, hash_length>;
+
+    // ---------------------------------- //
+    // Big-endian (network order) helpers. We write numbers byte by byte so it works the same on every machine.
+
+    inline void put_u32(char *out, std::uint32_t value)
+    {
+        out[0] = static_cast<char>(value >> 24);
+        out[1] = static_cast<char>(value >> 16);
+        out[2] = static_cast<char>(value >> 8);
+        out[3] = static_cast<char>(value);
+    }
+
+    inline std::uint32_t get_u32(const char *in)
+    {
+        const auto *p = reinterpret_cast<const unsigned char *>(in);
+        return (std::uint32_t(p[0]) << 24) | (std::uint32_t(p[1]) << 16) | (std::uint32_t(p[2]) << 8) | std::uint32_t(p[3]);
+    }
+
+    inline std::uint16_t get_u16(const char *in)
+    {
+        const auto *p = reinterpret_cast<const unsigned char *>(in);
+        return static_cast<std::uint16_t>((p[0] << 8) | p[1]);
+    }
+
+    inline std::uint64_t get_u64(const char *in)
+    {
+        return (std::uint64_t(get_u32(in)) << 32) | get_u32(in + 4);
+    }
+
+    // Writer appends fields to a body string. Strings are written as a 2 byte length followed by the characters.
+    class Writer
+    {
+    public:
+        explicit Writer(std::string &out) : out_(out) {}
+
+        void u8(std::uint8_t value) { out_.push_back(static_cast<char>(value)); }
+
+        void u16(std::uint16_t value)
+        {
+            out_.push_back(static_cast<char>(value >> 8));
+            out_.push_back(static_cast<char>(value));
+        }
+
+        void u32(std::uint32_t value)
+        {
+            char bytes[4];
+            put_u32(bytes, value);
+            out_.append(bytes, 4);
+        }
+
+        void u64(std::uint64_t value)
+        {
+            u32(static_cast<std::uint32_t>(value >> 32));
+            u32(static_cast<std::uint32_t>(value));
+        }
+
+        void hash(const Hash &value) { out_.append(reinterpret_cast<const char *>(value.data()), value.size()); }
+
+        // A string longer than max_string_length doesn't fit its length field. Writing the wrong length would make the other side
+        // misread everything after it, so we cut the string short instead - the frame stays readable - and truncated() says so.
+        // A cut name is a different name (and a cut file name a different file), so whoever writes one from what the user typed
+        // checks truncated() and doesn't send the frame at all. Strings read off the wire always fit - they came in the same way.
+        void str(std::string_view value)
+        {
+            if (value.size() > max_string_length)
+            {
+                value = value.substr(0, max_string_length);
+                truncated_ = true;
+            }
+            u16(static_cast<std::uint16_t>(value.size()));
+            out_.append(value.data(), value.size());
+        }
+
+        void raw(std::string_view value) { out_.append(value.data(), value.size()); }
+
+        bool truncated() const { return truncated_; }
+
+    private:
+        std::string &out_;
+        bool truncated_ = false;
+    };
+
+    // Reader pulls fields back out of a body. If the body is too short, ok() turns false and every following read gives 0 / empty.
+    // We check ok() once at the end instead of after every field - it keeps the message handling code readable.
+    class Reader
+    {
+    public:
+        explicit Reader(std::string_view in) : in_(in) {}
+
+        bool ok() const { return ok_; }
+        std::string_view rest() const { return ok_ ? in_ : std::string_view(); }
+
+        std::uint8_t u8()
+        {
+            if (!take(1))
+                return 0;
+            return static_cast<std::uint8_t>(last_[0]);
+        }
+
+        std::uint16_t u16()
+        {
+            if (!take(2))
+                return 0;
+            const auto *p = reinterpret_cast<const unsigned char *>(last_);
+            return static_cast<std::uint16_t>((p[0] << 8) | p[1]);
+        }
+
+        std::uint32_t u32()
+        {
+            if (!take(4))
+                return 0;
+            return get_u32(last_);
+        }
+
+        std::uint64_t u64()
+        {
+            std::uint64_t high = u32();
+            return (high << 32) | u32();
+        }
+
+        Hash hash()
+        {
+            Hash value{};
+            if (take(value.size()))
+                std::memcpy(value.data(), last_, value.size());
+            return value;
+        }
+
+        std::string_view str()
+        {
+            std::size_t length = u16();
+            if (!take(length))
+                return {};
+            return std::string_view(last_, length);
+        }
+
+        // The next count bytes, as they are.
+        std::string_view raw(std::size_t count)
+        {
+            if (!take(count))
+                return {};
+            return std::string_view(last_, count);
+        }
+
+    private:
+        bool take(std::size_t count)
+        {
+            if (!ok_ || in_.size() < count)
+            {
+                ok_ = false;
+                return false;
+            }
+            last_ = in_.data();
+            in_.remove_prefix(count);
+            return true;
+        }
+
+        std::string_view in_;
+        const char *last_ = nullptr;
+        bool ok_ = true;
+    };
+
+    // ---------------------------------- //
+    // The envelope. A chat line or a file announcement from the server starts with everything about it that isn't the text (or
+    // the file), always in the same layout:
+    //
+    //   byte  0: sequence number (u64)        byte 16: sender number (u32, see names)    byte 22: flags (u8, see EnvelopeFlag)
+    //   byte  8: when the server got it       byte 20: room (u16) - there is only one    byte 23: how long the envelope is (u8)
+    //            (u64, ms since 1970)                  room for now, so always 0                  - where the text starts
+    //
+    // Because every field is always at the same place, Envelope reads it straight out of the body when it's asked for - nothing is
+    // parsed or copied first, and a client that only wants the text and the sequence number never looks at the rest.
+    // The length byte is what lets this grow: a newer server can add fields after byte 24, and an older client still finds the
+    // text (it just doesn't know about the new fields). So adding something costs the readers nothing.
+    //
+    // A file announcement has sender number 0 and the sharer's name after the file name: a private one isn't kept in the history,
+    // and a sender number only means something while that sender has lines in the history (see ServerState::senders).
+    // Its sequence number is 0 too if it's private - like a private message, it isn't numbered.
+    //
+    // The other frames the server sends to many clients keep their own layout, without an envelope: presence, names and events
+    // (each one is a list of many people's entries, not one message), notice (plain text from the server itself), and direct
+    // (clients send those to each other over a direct connection too - see peer.hpp).
+    constexpr std::size_t envelope_length = 24;
+
+    enum EnvelopeFlag : std::uint8_t
+    {
+        envelope_from_node = 1 // It was sent on another server in the mesh (see federation.hpp).
+    };
+
+    inline void write_envelope(Writer &writer, std::uint64_t sequence, std::uint32_t sender, std::uint8_t flags = 0)
+    {
+        auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+        writer.u64(sequence);
+        writer.u64(static_cast<std::uint64_t>(now.count()));
+        writer.u32(sender);
+        writer.u16(0); // The room.
+        writer.u8(flags);
+        writer.u8(static_cast<std::uint8_t>(envelope_length));
+    }
+
+    // A look at the envelope at the start of a body. It doesn't copy anything, so the body has to stay alive while it's used.
+    // Check ok() first - the other functions assume the body is long enough.
+    class Envelope
+    {
+    public:
+        explicit Envelope(std::string_view body) : body_(body) {}
+
+        bool ok() const
+        {
+            return body_.size() >= envelope_length && length() >= envelope_length && body_.size() >= length();
+        }
+
+        std::uint64_t sequence() const { return get_u64(body_.data()); }
+        std::chrono::system_clock::time_point time() const
+        {
+            return std::chrono::system_clock::time_point(std::chrono::milliseconds(get_u64(body_.data() + 8)));
+        }
+        std::uint32_t sender() const { return get_u32(body_.data() + 16); }
+        std::uint16_t room() const { return get_u16(body_.data() + 20); }
+        std::uint8_t flags() const { return static_cast<std::uint8_t>(body_[22]); }
+        std::string_view text() const { return body_.substr(length()); }
+
+    private:
+        std::size_t length() const { return static_cast<std::uint8_t>(body_[23]); }
+
+        std::string_view body_;
+    };
+
+    // ---------------------------------- //
+
+    // A Frame is one complete message ready to be written to a socket.
+    // It is always handed around as a std::shared_ptr<const Frame> - so when the server broadcasts to 50 clients,
+    // the message is built ONCE and all 50 sessions write the very same bytes.
+    // tail is optional: it lets a frame point at bytes that live somewhere else (for example inside a memory mapped file)
+    // without copying them. tail_owner keeps that "somewhere else" alive until every session has finished writing.
+    //
+    // A busy server makes and throws away a frame for every chat line, so frames are recycled instead of going to the heap each
+    // time: the Frame itself (with its reference counts) comes from object_pool, and when it's destroyed its body string - with
+    // the memory it has already got - goes on a list of spare bodies. Build a new body in take_body() and it usually doesn't
+    // allocate at all.
+    constexpr std::size_t max_spare_bodies = 256;
+    constexpr std::size_t min_recycled_body = 512;      // Room for an ordinary chat line, so writing one into a recycled body never has to grow it.
+    constexpr std::size_t max_recycled_body = 4 * 1024; // A bigger body (a file chunk) is freed - we don't hang on to that much memory for chat.
+
+    struct SpareBodies
+    {
+        SpareBodies() { bodies.reserve(max_spare_bodies); }
+        ~SpareBodies() { closed = true; }
+
+        std::vector<std::string> bodies;
+        static inline thread_local bool closed = false; // A frame destroyed at exit, after this thread's list, just frees its body.
+    };
+
+    inline SpareBodies &spare_bodies()
+    {
+        thread_local SpareBodies spare;
+        return spare;
+    }
+
+    // An empty string with room for at least min_recycled_body bytes - from the spares if there is one.
+    inline std::string take_body()
+    {
+        if (SpareBodies::closed || spare_bodies().bodies.empty())
+        {
+            std::string body;
+            body.reserve(min_recycled_body);
+            return body;
+        }
+        auto &bodies = spare_bodies().bodies;
+        std::string body = std::move(bodies.back());
+        bodies.pop_back();
+        body.clear();
+        return body;
+    }
+
+    inline void give_back_body(std::string &body)
+    {
+        if (body.capacity() < min_recycled_body || body.capacity() > max_recycled_body || SpareBodies::closed)
+        {
+            return;
+        }
+        auto &bodies = spare_bodies().bodies;
+        if (bodies.size() < max_spare_bodies)
+        {
+            bodies.push_back(std::move(body));
+        }
+    }
+
+    struct Frame
+    {
+        std::array<char, header_length> header{};
+        std::string body;
+        boost::asio::const_buffer tail;
+        std::shared_ptr<const void> tail_owner;
+
+        ~Frame() { give_back_body(body); }
+
+        std::array<boost::asio::const_buffer, 3> buffers() const
+        {
+            return {boost::asio::buffer(header), boost::asio::buffer(body), tail};
+        }
+    };
+
+    // Fills in the header once the body is complete (see make_frame()).
+    inline void seal_frame(Frame &frame, MessageType type, bool compressed = false)
+    {
+        put_u32(frame.header.data(), static_cast<std::uint32_t>(1 + frame.body.size() + frame.tail.size()));
+        frame.header[4] = static_cast<char>(static_cast<std::uint8_t>(type) | (compressed ? compressed_flag : 0));
+    }
+
+    // An empty frame from the pool, with a body from take_body(). Write the body straight into it, then seal_frame() it -
+    // the way to make a frame without building the body somewhere else first and copying it.
+    inline std::shared_ptr<Frame> new_frame()
+    {
+        auto frame = std::allocate_shared<Frame>(object_pool::Allocator<Frame>());
+        frame->body = take_body();
+        return frame;
+    }
+
+    inline std::shared_ptr<const Frame> make_frame(MessageType type, std::string body,
+                                                   boost::asio::const_buffer tail = {},
+                                                   std::shared_ptr<const void> tail_owner = nullptr,
+                                                   bool compressed = false)
+    {
+        auto frame = std::allocate_shared<Frame>(object_pool::Allocator<Frame>());
+        frame->body = std::move(body);
+        frame->tail = tail;
+        frame->tail_owner = std::move(tail_owner);
+        seal_frame(*frame, type, compressed);
+        return frame;
+    }
+
+    // The SSL stream turns every separate buffer it is given into its own TLS record (and usually its own system call).
+    // A chat frame is a 5 byte header + a short body - as separate buffers that would be 2 records per message.
+    // So the writers (server and client) copy the frames waiting in their queue one after the other into one staging string,
+    // and hand the SSL stream that ONE buffer: many messages, one record.
+    // The only thing not copied is a big tail (a file chunk from a memory mapping) - that goes out as a second buffer straight from where it lives.
+    // Returns how many frames from the front of the queue ended up in buffers.
+    constexpr std::size_t max_copied_tail = 4 * 1024;
+
+    template <typename Queue>
+    std::size_t stage_frames(const Queue &queue, std::string &staging, std::vector<boost::asio::const_buffer> &buffers,
+                             std::size_t max_frames, std::size_t max_bytes)
+    {
+        staging.clear();
+        buffers.clear();
+
+        std::size_t frames = 0;
+        boost::asio::const_buffer large_tail;
+        for (const auto &frame : queue)
+        {
+            if (frames == max_frames || staging.size() >= max_bytes)
+            {
+                break;
+            }
+
+            staging.append(frame->header.data(), frame->header.size());
+            staging.append(frame->body);
+            ++frames;
+
+            if (frame->tail.size() > max_copied_tail)
+            {
+                large_tail = frame->tail;
+                break;
+            }
+            staging.append(static_cast<const char *>(frame->tail.data()), frame->tail.size());
+        }
+
+        buffers.push_back(boost::asio::buffer(staging));
+        if (large_tail.size() > 0)
+        {
+            buffers.push_back(large_tail);
+        }
+        return frames;
+    }
+
+    inline MessageType frame_type(const Frame &frame)
+    {
+        return static_cast<MessageType>(static_cast<std::uint8_t>(frame.header[4]) & ~compressed_flag);
+    }
+
+    // Once we have read a header, this gives back the type, whether the body is compressed and how many body bytes still need to be read.
+    // Returns false if the length is impossible (0 or too big) - the caller should drop the connection.
+    inline bool parse_header(const char *header, MessageType &type, bool &compressed, std::size_t &body_length)
+    {
+        std::uint32_t length = get_u32(header);
+        if (length == 0 || length - 1 > max_body_length)
+            return false;
+        auto type_byte = static_cast<std::uint8_t>(header[4]);
+        type = static_cast<MessageType>(type_byte & ~compressed_flag);
+        compressed = (type_byte & compressed_flag) != 0;
+        body_length = length - 1;
+        return true;
+    }
+
+    // ---------------------------------- //
+    // SHA-256 helpers. We already link OpenSSL for the TLS part, so we use its EVP interface for hashing too.
+
+    class Hasher
+    {
+    public:
+        Hasher() : ctx_(EVP_MD_CTX_new(), EVP_MD_CTX_free) { EVP_DigestInit_ex(ctx_.get(), EVP_sha256(), nullptr); }
+
+        void update(const void *data, std::size_t length) { EVP_DigestUpdate(ctx_.get(), data, length); }
+
+        Hash finish()
+        {
+            Hash value{};
+            unsigned int length = 0;
+            EVP_DigestFinal_ex(ctx_.get(), value.data(), &length);
+            return value;
+        }
+
+    private:
+        std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx_;
+    };
+
+    inline std::string to_hex(const Hash &value)
+    {
+        static const char digits[] = "0123456789abcdef";
+        std::string out;
+        out.reserve(value.size() * 2);
+        for (unsigned char byte : value)
+        {
+            out.push_back(digits[byte >> 4]);
+            out.push_back(digits[byte & 0x0f]);
+        }
+        return out;
+    }
+
+    inline bool from_hex(std::string_view text, Hash &value)
+    {
+        if (text.size() != value.size() * 2)
+            return false;
+        auto nibble = [](char c) -> int
+        {
+            if (c >= '0' && c <= '9')
+                return c - '0';
+            if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+            return -1;
+        };
+        for (std::size_t i = 0; i < value.size(); ++i)
+        {
+            int high = nibble(text[i * 2]);
+            int low = nibble(text[i * 2 + 1]);
+            if (high < 0 || low < 0)
+                return false;
+            value[i] = static_cast<unsigned char>((high << 4) | low);
+        }
+        return true;
+    }
+}
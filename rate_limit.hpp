@@ -0,0 +1,146 @@
+#pragma once
+
+// rate_limit.hpp
+// Stops one client from flooding the chat.
+//
+// Every chat line a client sends is copied to everyone else, so one client sending 10,000 lines a second into a room of 100
+// is a million messages a second for the server to write. We limit how fast each client may send with "token buckets":
+//
+//   A bucket holds up to `burst` tokens and refills at `rate` tokens per second. Every message takes tokens out.
+//   While there are tokens, messages go straight through - so normal chatting (and pasting a few lines at once) is never slowed down.
+//   Once it's empty, the client has to wait for it to refill.
+//
+// "Waiting" means the server simply stops reading from that client for a while (see Session::reader()). We never buffer their
+// messages up - the unread bytes stay in the operating system's socket buffers, and once those are full TCP makes the client's
+// own writes wait. So a flooding client costs us nothing while it's paused, and it slows itself down.
+//
+// There are three sets of buckets, and a message has to get past all of them:
+//   - per session (one connection),
+//   - per name (several connections logged in with the same name share one),
+//   - per IP address (several connections from the same machine share one).
+// Each set has a bucket for messages and one for bytes - a few huge lines are as bad as lots of small ones.
+//
+// The limits are read from rate_limits.txt next to the server (and re-read on SIGHUP, like the blocklist). For example:
+//   session_messages = 20 40      <- 20 per second, bursts of up to 40
+//   ip_bytes = 131072 524288
+// A rate of 0 means "no limit".
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+struct RateLimit
+{
+    double rate = 0;  // Tokens per second. 0 = no limit.
+    double burst = 0; // How many tokens the bucket holds.
+};
+
+struct RateLimits
+{
+    RateLimit session_messages{20, 40};
+    RateLimit session_bytes{64 * 1024, 256 * 1024};
+    RateLimit name_messages{30, 60};
+    RateLimit name_bytes{128 * 1024, 512 * 1024};
+    RateLimit ip_messages{50, 100};
+    RateLimit ip_bytes{256 * 1024, 1024 * 1024};
+
+    // Lines that don't make sense are counted in bad_lines and skipped. A missing file means the defaults above.
+    static RateLimits load(const std::string &path, std::size_t &bad_lines)
+    {
+        RateLimits limits;
+        bad_lines = 0;
+
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line))
+        {
+            std::replace(line.begin(), line.end(), '=', ' ');
+            std::istringstream words(line);
+            std::string name;
+            RateLimit limit;
+            if (!(words >> name) || name[0] == '#')
+            {
+                continue;
+            }
+            RateLimit *target = limits.find(name);
+            if (!target || !(words >> limit.rate) || limit.rate < 0)
+            {
+                ++bad_lines;
+                continue;
+            }
+            if (!(words >> limit.burst))
+            {
+                limit.burst = limit.rate; // One second's worth.
+            }
+            *target = limit;
+        }
+        return limits;
+    }
+
+private:
+    RateLimit *find(const std::string &name)
+    {
+        if (name == "session_messages") return &session_messages;
+        if (name == "session_bytes") return &session_bytes;
+        if (name == "name_messages") return &name_messages;
+        if (name == "name_bytes") return &name_bytes;
+        if (name == "ip_messages") return &ip_messages;
+        if (name == "ip_bytes") return &ip_bytes;
+        return nullptr;
+    }
+};
+
+// The bucket itself only remembers how full it was and when - the limit is passed in every time,
+// so a reload of rate_limits.txt applies to everyone straight away.
+class TokenBucket
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Takes cost tokens and returns how long the sender should now wait (zero if there were enough).
+    // The bucket is allowed to go below zero: the message has already arrived, so we let it through and make the sender
+    // wait until the bucket is back to zero. That way we never have to hold a message back, only the reading of the next one.
+    Clock::duration take(const RateLimit &limit, double cost, Clock::time_point now)
+    {
+        if (limit.rate <= 0)
+        {
+            return Clock::duration::zero();
+        }
+        if (!started_)
+        {
+            started_ = true;
+            tokens_ = limit.burst;
+        }
+        else
+        {
+            tokens_ = std::min(limit.burst, tokens_ + std::chrono::duration<double>(now - last_).count() * limit.rate);
+        }
+        last_ = now;
+
+        tokens_ -= cost;
+        if (tokens_ >= 0)
+        {
+            return Clock::duration::zero();
+        }
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(-tokens_ / limit.rate));
+    }
+
+private:
+    double tokens_ = 0;
+    Clock::time_point last_;
+    bool started_ = false;
+};
+
+// One message bucket and one byte bucket - what each session, name and IP address gets.
+struct RateBuckets
+{
+    TokenBucket messages;
+    TokenBucket bytes;
+
+    TokenBucket::Clock::duration take(const RateLimit &message_limit, const RateLimit &byte_limit, std::size_t size, TokenBucket::Clock::time_point now)
+    {
+        return std::max(messages.take(message_limit, 1, now), bytes.take(byte_limit, static_cast<double>(size), now));
+    }
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+// record_sizing.hpp
+// How big the TLS records we send are.
+//
+// TLS cuts what we write into "records" and encrypts each one separately. The other side can't decrypt - or use - any of a
+// record until ALL of it has arrived, because the check that it wasn't tampered with comes at the end. OpenSSL makes records as big
+// as it can (16 KB). For a file that's what we want: fewer records, less work per byte. But a 16 KB record is about 11 TCP
+// packets - if the first chat message of a burst is at the start of it, the client still has to wait for all 11 (and on a fresh
+// connection TCP may not even be allowed to send that many yet) before it can show anything.
+//
+// So we size them as we go, like the big web servers do:
+//   - A new connection, or one that has been quiet for idle_reset, gets small records: one TCP packet each (the connection's
+//     MSS - "maximum segment size" - minus the record's own overhead). Every packet that arrives can be decrypted straight away.
+//   - Once we've sent bulk_after bytes without a pause, it's a bulk transfer (a file, a long history) - 16 KB records from then on.
+//     A single write that big (the history a reconnecting client catches up on, a file chunk) is bulk from the start.
+//
+// Use: start() once the TCP connection is up, then before_write() before every write on the SSL stream. It says how big the
+// records should be: write in pieces of that size, one SSL_write per piece - OpenSSL makes one record of a write that fits.
+// We don't make OpenSSL cut them smaller itself (SSL_set_max_send_fragment()): it sizes its write buffer for the records of
+// the moment and doesn't grow it when the records grow - the first big record after small ones then fails with an "internal
+// error". This way its buffer is always big enough. One per connection, only used from that connection's thread.
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <boost/asio.hpp>
+
+class RecordSizer
+{
+public:
+    static constexpr std::size_t large_record = 16384;             // The most TLS allows.
+    static constexpr std::size_t fallback_small_record = 1400 - 29; // When we can't ask for the MSS: a typical one, minus the overhead.
+    static constexpr std::size_t record_overhead = 29;             // Header, nonce and tag (TLS 1.2 with AES-GCM - TLS 1.3 needs a bit less).
+    static constexpr std::size_t bulk_after = 64 * 1024;
+    static constexpr std::chrono::milliseconds idle_reset{1000};
+
+    void start(boost::asio::ip::tcp::socket &socket)
+    {
+        small_record_ = fallback_small_record;
+#if defined(TCP_MAXSEG)
+        boost::system::error_code ec;
+        MaxSegment mss;
+        socket.get_option(mss, ec);
+        if (!ec && mss.value > 0)
+        {
+            // 16384 is the most a record can hold, and below 512 the overhead isn't worth it. On loopback the MSS is about 64 KB, so that ends up as big records - which is right there.
+            small_record_ = std::clamp<std::size_t>(static_cast<std::size_t>(mss.value) - std::min<std::size_t>(record_overhead, static_cast<std::size_t>(mss.value)), 512, large_record);
+        }
+#else
+        (void)socket;
+#endif
+    }
+
+    // How big to make the records of a write of length bytes.
+    std::size_t before_write(std::size_t length)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_write_ >= idle_reset)
+        {
+            sent_ = 0; // Quiet for a while - whatever comes next is probably a message somebody is waiting for.
+        }
+        last_write_ = now;
+        std::size_t size = sent_ >= bulk_after || length >= bulk_after ? large_record : small_record_;
+        sent_ += length;
+        return size;
+    }
+
+private:
+#if defined(TCP_MAXSEG)
+    // The socket option for the MSS, in the shape ASIO's get_option() wants.
+    struct MaxSegment
+    {
+        int value = 0;
+        template <typename Protocol>
+        int level(const Protocol &) const { return IPPROTO_TCP; }
+        template <typename Protocol>
+        int name(const Protocol &) const { return TCP_MAXSEG; }
+        template <typename Protocol>
+        int *data(const Protocol &) { return &value; }
+        template <typename Protocol>
+        const int *data(const Protocol &) const { return &value; }
+        template <typename Protocol>
+        std::size_t size(const Protocol &) const { return sizeof(value); }
+        template <typename Protocol>
+        void resize(const Protocol &, std::size_t) {}
+    };
+#endif
+
+    std::size_t small_record_ = fallback_small_record;
+    std::size_t sent_ = 0; // Bytes since the last pause.
+    std::chrono::steady_clock::time_point last_write_{};
+};
@@ -0,0 +1,288 @@
+#pragma once
+
+// replication.hpp
+// A hot standby: a second server process that follows everything the running one (the "primary") does, and takes over if it dies.
+//
+//   ./server 12345 --replicate 15345                    <- the primary. Standbys link up with it on port 15345.
+//   ./server 12345 --standby 127.0.0.1:15345            <- the standby. It doesn't take any clients while the primary is alive.
+//
+// When the standby links up, the primary sends it a snapshot (Server::replication_snapshot()): the TLS ticket keys, the run ID and
+// latest sequence number, the whole history and who is online. After that it sends every new history entry and every join and leave
+// as they happen. The standby just keeps all of it, in the same form a hot restart hands over (see Server::save_state()).
+//
+// If the link drops and the standby can't link up again within failover_after, the primary is taken to be dead. The standby then
+// starts a normal server with that state - exactly like the new server in a hot restart does. The clients' own retry logic brings
+// them back: they resume from the last sequence number they saw and their TLS tickets still work, so to them it's just a short blip.
+// (For the clients to find the standby it has to be reachable at the address they use - the same port on the same machine, like above,
+// or a shared IP address that moves over.)
+//
+// A primary that is being hot restarted sends going_away first, and the standby gives the new primary handover_patience to come up
+// instead of taking over itself.
+//
+// Like the other links between servers, this one is TLS with the server's own certificate at both ends (see peer::use_server_certificate()).
+// Shared files aren't copied - the standby uses the attachments folder it finds, so run it in the same folder (or on shared storage).
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include "peer.hpp"
+#include "protocol.hpp"
+
+// The primary's side: takes links from standbys and keeps them up to date.
+class Replication
+{
+public:
+    // snapshot() gives the frames that bring a new standby up to date (repl_begin, repl_entry..., repl_presence...).
+    using Snapshot = std::function<std::vector<std::shared_ptr<const protocol::Frame>>()>;
+
+    Replication(boost::asio::io_context &io_context, unsigned short port, Snapshot snapshot)
+        : io_context_(io_context), context_(boost::asio::ssl::context::tls), acceptor_(io_context), snapshot_(std::move(snapshot))
+    {
+        fingerprint_ = peer::use_server_certificate(context_);
+        boost::asio::co_spawn(io_context_, accept_standbys(port), boost::asio::detached);
+    }
+
+    // Sends a frame to every standby. The frame is built once, however many standbys there are.
+    void send(const std::shared_ptr<const protocol::Frame> &frame)
+    {
+        for (const auto &link : links_)
+        {
+            link->send(frame);
+        }
+    }
+
+    std::size_t standbys() const { return links_.size(); }
+
+    // We're being hot restarted (see Server::hand_over()): the standbys should wait for the new server instead of taking over.
+    // The links stay open until the process exits, so nothing sent while the clients are draining is lost.
+    void going_away()
+    {
+        closed_ = true;
+        boost::system::error_code ignored;
+        acceptor_.close(ignored);
+        send(protocol::make_frame(protocol::MessageType::going_away, std::string()));
+    }
+
+private:
+    using tcp = boost::asio::ip::tcp;
+    using Stream = peer::PeerLink::Stream;
+
+    boost::asio::awaitable<void> accept_standbys(unsigned short port)
+    {
+        co_await peer::listen_when_free(acceptor_, port, closed_);
+        while (!closed_)
+        {
+            boost::system::error_code ec;
+            tcp::socket socket(io_context_);
+            co_await acceptor_.async_accept(socket, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+            if (ec)
+            {
+                if (closed_ || ec == boost::asio::error::operation_aborted)
+                {
+                    co_return;
+                }
+                continue;
+            }
+            boost::asio::co_spawn(io_context_, accept_standby(std::move(socket)), boost::asio::detached);
+        }
+    }
+
+    boost::asio::awaitable<void> accept_standby(tcp::socket socket)
+    {
+        boost::system::error_code ec;
+        auto endpoint = socket.remote_endpoint(ec);
+        std::string name = "standby " + endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+        auto stream = std::make_shared<Stream>(std::move(socket), context_);
+        auto deadline = peer::handshake_deadline(stream, std::chrono::seconds(5));
+        co_await stream->async_handshake(boost::asio::ssl::stream_base::server, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        deadline->cancel();
+        if (ec || closed_)
+        {
+            co_return;
+        }
+        if (peer::remote_fingerprint(stream->native_handle()) != fingerprint_)
+        {
+            std::cout << "Refused a link from " << name << " - it doesn't have our certificate." << std::endl << std::endl;
+            boost::system::error_code ignored;
+            stream->lowest_layer().close(ignored);
+            co_return;
+        }
+
+        // A standby never sends us anything.
+        peer::PeerLink::Handlers handlers{
+            [](peer::PeerLink &link, protocol::MessageType, std::string_view)
+            { link.close(); },
+            [](peer::PeerLink &) {},
+            [this](peer::PeerLink &link)
+            { on_closed(link); }};
+        auto link = std::make_shared<peer::PeerLink>(std::move(*stream), name, std::move(handlers));
+        link->start();
+
+        // The snapshot goes in the link's queue before anything new can - the server has one thread, so nothing happens in between.
+        auto frames = snapshot_();
+        for (auto &frame : frames)
+        {
+            link->send(std::move(frame));
+        }
+        links_.insert(link);
+        std::cout << "Linked to " << name << " (sent it " << frames.size() << " frames to catch up)." << std::endl << std::endl;
+    }
+
+    void on_closed(peer::PeerLink &link)
+    {
+        for (auto it = links_.begin(); it != links_.end(); ++it)
+        {
+            if (it->get() == &link)
+            {
+                std::cout << "Lost the link to " << link.name() << "." << std::endl << std::endl;
+                links_.erase(it);
+                return;
+            }
+        }
+    }
+
+    boost::asio::io_context &io_context_;
+    boost::asio::ssl::context context_;
+    tcp::acceptor acceptor_;
+    Snapshot snapshot_;
+    protocol::Hash fingerprint_{};
+    std::set<std::shared_ptr<peer::PeerLink>> links_;
+    bool closed_ = false;
+};
+
+// The standby's side: keeps a link to the primary, hands every frame on to frame(), and calls promote() once the primary is gone for good.
+class Standby
+{
+public:
+    struct Handlers
+    {
+        std::function<void(protocol::MessageType, std::string_view)> frame;
+        std::function<void()> promote;
+    };
+
+    Standby(boost::asio::io_context &io_context, std::string primary, Handlers handlers)
+        : io_context_(io_context), context_(boost::asio::ssl::context::tls), primary_(std::move(primary)), handlers_(std::move(handlers))
+    {
+        fingerprint_ = peer::use_server_certificate(context_);
+    }
+
+    void start()
+    {
+        boost::asio::co_spawn(io_context_, follow(), boost::asio::detached);
+    }
+
+private:
+    using tcp = boost::asio::ip::tcp;
+    using Stream = peer::PeerLink::Stream;
+
+    // Links up with the primary and, whenever the link drops, links up again. Only once we've had a snapshot (there's something to take
+    // over with) and the primary has been gone long enough do we take over.
+    boost::asio::awaitable<void> follow()
+    {
+        auto colon = primary_.rfind(':');
+        std::string host = primary_.substr(0, colon);
+        std::string port = colon == std::string::npos ? std::string() : primary_.substr(colon + 1);
+        boost::asio::steady_timer retry(io_context_);
+        tcp::resolver resolver(io_context_);
+        std::cout << "Standing by for the server at " << primary_ << "..." << std::endl << std::endl;
+
+        while (true)
+        {
+            if (!link_)
+            {
+                boost::system::error_code ec;
+                auto endpoints = co_await resolver.async_resolve(host, port, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+                auto stream = std::make_shared<Stream>(io_context_, context_);
+                auto deadline = peer::handshake_deadline(stream, std::chrono::seconds(2));
+                if (!ec)
+                {
+                    co_await boost::asio::async_connect(stream->lowest_layer(), endpoints, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+                }
+                if (!ec)
+                {
+                    co_await stream->async_handshake(boost::asio::ssl::stream_base::client, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+                }
+                deadline->cancel();
+                if (!ec && peer::remote_fingerprint(stream->native_handle()) != fingerprint_)
+                {
+                    std::cout << "The server at " << primary_ << " doesn't have our certificate - not following it." << std::endl;
+                    ec = boost::asio::error::access_denied;
+                }
+                if (!ec)
+                {
+                    link_up(std::move(*stream));
+                }
+            }
+
+            if (!link_ && synced_ && std::chrono::steady_clock::now() - lost_at_ >= (primary_going_away_ ? handover_patience : failover_after))
+            {
+                std::cout << "The server at " << primary_ << " is gone - taking over." << std::endl << std::endl;
+                handlers_.promote();
+                co_return;
+            }
+
+            boost::system::error_code ignored;
+            retry.expires_after(retry_delay);
+            co_await retry.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ignored));
+        }
+    }
+
+    void link_up(Stream stream)
+    {
+        peer::PeerLink::Handlers handlers{
+            [this](peer::PeerLink &, protocol::MessageType type, std::string_view body)
+            { on_frame(type, body); },
+            [](peer::PeerLink &) {},
+            [this](peer::PeerLink &link)
+            { on_closed(link); }};
+        link_ = std::make_shared<peer::PeerLink>(std::move(stream), primary_, std::move(handlers));
+        primary_going_away_ = false;
+        link_->start();
+        std::cout << "Following the server at " << primary_ << "." << std::endl << std::endl;
+    }
+
+    void on_frame(protocol::MessageType type, std::string_view body)
+    {
+        if (type == protocol::MessageType::going_away)
+        {
+            primary_going_away_ = true;
+            return;
+        }
+        if (type == protocol::MessageType::repl_begin)
+        {
+            synced_ = true;
+        }
+        handlers_.frame(type, body);
+    }
+
+    void on_closed(peer::PeerLink &link)
+    {
+        if (link_.get() != &link)
+        {
+            return;
+        }
+        std::cout << "Lost the server at " << primary_ << (primary_going_away_ ? " (it's being restarted)." : ".") << std::endl << std::endl;
+        link_.reset();
+        lost_at_ = std::chrono::steady_clock::now();
+    }
+
+    static constexpr std::chrono::seconds retry_delay{1};
+    static constexpr std::chrono::seconds failover_after{3};
+    static constexpr std::chrono::seconds handover_patience{30};
+
+    boost::asio::io_context &io_context_;
+    boost::asio::ssl::context context_;
+    std::string primary_;
+    Handlers handlers_;
+    protocol::Hash fingerprint_{};
+    std::shared_ptr<peer::PeerLink> link_;
+    std::chrono::steady_clock::time_point lost_at_;
+    bool synced_ = false;
+    bool primary_going_away_ = false;
+};
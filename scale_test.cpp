@@ -0,0 +1,684 @@
+#include <iostream>
+#include <utility> // Boost 1.74's awaitable.hpp uses std::exchange without including this itself.
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <openssl/ssl.h>
+#include "protocol.hpp"
+
+// Overview:
+// How many idle clients can the server hold, and what does each one cost? This opens thousands of TLS connections to a server
+// on the same machine, logs every one of them in, and leaves them idle - answering the server's pings, like a real client that
+// nobody is typing into. It does that in steps (10000, then 50000, then 100000 by default) and at every step it measures the
+// SERVER process, from /proc:
+//
+//   - how long each new connection took, from connect() to the welcome frame ("time to accept") - as a curve, every 1000 connections
+//   - its memory (RSS) - in total and per connection
+//   - its file descriptors
+//   - the CPU it uses while all of them sit idle - in total, and per heartbeat (every idle client gets a ping every heartbeat_interval)
+//
+//   ./server 12345 > /dev/null &                                 <- > /dev/null: it prints a line for every client
+//   ./scale_test 12345 $!                                         <- the port and the server's process ID
+//   ./scale_test 12345 $! --steps 1000,10000 --hold 60 --out results.jsonl --max-kb-per-connection 30
+//
+// The results go to scale_results.jsonl (or --out), one JSON object per line, so a script can plot them or compare two runs:
+//   {"type":"accept", ...}  a point on the time to accept curve
+//   {"type":"step", ...}    everything measured once a step's connections were all in and idle for --hold seconds
+// --max-kb-per-connection turns it into a test: it exits with 1 if the server used more memory than that per connection.
+// We measured 22 to 24 KB from 1000 to 19900 connections (the numbers for each step are in README.md), so 30 is a good limit.
+// It also exits with 1 if any connection failed - that's where the server (or the machine) falls over.
+//
+// Before a big run:
+//   - Both programs need a file descriptor per connection. The server raises its own limit as far as it's allowed, and so does
+//     this program - but that's only up to the "hard" limit (ulimit -Hn). Raise that first (ulimit -n 200000 as root, or
+//     /etc/security/limits.conf) - 100000 connections need more than 100000 for each of them.
+//   - One address can only make about 28000 connections to the same port (that's how many ports the system hands out for
+//     outgoing connections). So we spread the connections over 127.0.0.1, 127.0.0.2, ... - every 127.x.x.x address is this
+//     machine on Linux - with 20000 on each.
+//   - Memory: the server needs roughly its per connection figure times the number of connections, this program about 30 KB each.
+//
+// Why OpenSSL directly, and not boost::asio::ssl::stream like the client? An ssl::stream keeps about 70 KB of buffers for every
+// connection. That's fine for one client, but this program has to hold many more connections than the server it's testing -
+// so here each connection is just a socket and an SSL object (which lets go of its buffers while idle - SSL_MODE_RELEASE_BUFFERS),
+// and ASIO only tells us when the socket is ready (async_wait). OpenSSL does the reading and writing itself, straight on the socket.
+//
+// Linux only - it reads the server's numbers from /proc.
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+using boost::asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+// ---------------------------------- //
+// What /proc says about the server process right now.
+
+struct ProcessSample
+{
+    bool ok = false;
+    std::uint64_t rss_kb = 0;
+    std::uint64_t fds = 0;
+    double cpu_seconds = 0; // User + system, since it started.
+};
+
+static ProcessSample sample_process(int pid)
+{
+    ProcessSample sample;
+    std::string proc = "/proc/" + std::to_string(pid);
+
+    std::ifstream status(proc + "/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.rfind("VmRSS:", 0) == 0)
+        {
+            sample.rss_kb = std::stoull(line.substr(6)); // "VmRSS:     81234 kB"
+            sample.ok = true;
+        }
+    }
+
+    // /proc/<pid>/stat: the 2nd field is the program's name in brackets (which can have spaces in it), so we start after the ')'.
+    // From there, utime and stime are the 12th and 13th fields - in clock ticks.
+    std::ifstream stat(proc + "/stat");
+    std::string all((std::istreambuf_iterator<char>(stat)), std::istreambuf_iterator<char>());
+    auto after_name = all.rfind(')');
+    if (after_name != std::string::npos)
+    {
+        std::istringstream fields(all.substr(after_name + 2));
+        std::string field;
+        std::uint64_t utime = 0, stime = 0;
+        for (int i = 1; i <= 13 && fields >> field; ++i)
+        {
+            if (i == 12)
+            {
+                utime = std::stoull(field);
+            }
+            if (i == 13)
+            {
+                stime = std::stoull(field);
+            }
+        }
+        sample.cpu_seconds = static_cast<double>(utime + stime) / static_cast<double>(::sysconf(_SC_CLK_TCK));
+    }
+
+    if (DIR *directory = ::opendir((proc + "/fd").c_str()))
+    {
+        while (dirent *entry = ::readdir(directory))
+        {
+            sample.fds += entry->d_name[0] != '.' ? 1 : 0;
+        }
+        ::closedir(directory);
+    }
+    return sample;
+}
+
+// Our own file descriptor limit, as high as we're allowed. Returns what we got.
+static std::uint64_t raise_descriptor_limit()
+{
+    rlimit descriptors{};
+    ::getrlimit(RLIMIT_NOFILE, &descriptors);
+    if (descriptors.rlim_cur < descriptors.rlim_max)
+    {
+        descriptors.rlim_cur = descriptors.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &descriptors);
+        ::getrlimit(RLIMIT_NOFILE, &descriptors);
+    }
+    return descriptors.rlim_cur;
+}
+
+class ScaleTest;
+
+// ---------------------------------- //
+// One idle client: connect, TLS handshake, hello, wait for the welcome - and from then on only answer pings.
+
+class Connection
+{
+public:
+    Connection(ScaleTest &test, boost::asio::io_context &io_context, SSL_CTX *context, std::size_t number)
+        : test_(test), socket_(io_context), ssl_(SSL_new(context)), number_(number) {}
+
+    ~Connection()
+    {
+        SSL_free(ssl_);
+    }
+
+    void start(const tcp::endpoint &server, const boost::asio::ip::address_v4 &source);
+
+    // Still connecting or logging in - and since when.
+    bool setting_up() const { return state_ != State::ready && state_ != State::failed; }
+    Clock::time_point started() const { return started_; }
+
+    void fail();
+
+private:
+    enum class State
+    {
+        connecting,
+        handshaking,
+        logging_in, // Hello sent, waiting for the welcome.
+        ready,
+        failed
+    };
+
+    void handshake();
+    void read();
+    bool handle_frames();
+    bool write(protocol::MessageType type, std::string body);
+    bool flush();
+    void retry_flush();
+    void wait(tcp::socket::wait_type type, void (Connection::*then)());
+
+    ScaleTest &test_;
+    tcp::socket socket_;
+    SSL *ssl_;
+    std::size_t number_;
+    State state_ = State::connecting;
+    Clock::time_point started_;
+    std::string inbox_;  // A frame that has only partly arrived.
+    std::string outbox_; // What OpenSSL couldn't write yet (see flush()).
+};
+
+// ---------------------------------- //
+// Opens the connections a step at a time and measures.
+
+class ScaleTest
+{
+public:
+    struct Options
+    {
+        unsigned short port = 0;
+        int server_pid = 0;
+        std::vector<std::size_t> steps{10000, 50000, 100000};
+        // Long enough for every connection to be pinged (the server lets go of its TLS buffers then), and for the server to hand
+        // that memory back to the system (every 30 s) - with less, we'd count memory that is on its way out.
+        std::chrono::seconds hold{4 * protocol::heartbeat_interval};
+        std::string out = "scale_results.jsonl";
+        double max_kb_per_connection = 0; // 0: don't check.
+    };
+
+    static constexpr std::size_t in_flight = 100;      // Connections being set up at the same time, like a crowd arriving.
+    static constexpr std::size_t curve_every = 1000;   // One point on the time to accept curve per this many connections.
+    static constexpr std::size_t per_source = 20000;   // Connections from each 127.x.x.x address - see the overview.
+    // A connection that isn't logged in after this long counts as failed. A server that has run out of file descriptors
+    // leaves new connections waiting in its listen queue - they'd never finish, and neither would the step.
+    static constexpr std::chrono::seconds setup_timeout{30};
+
+    ScaleTest(const Options &options) : options_(options), context_(SSL_CTX_new(TLS_client_method())), results_(options.out)
+    {
+        // We're measuring the server, not checking who it is - it's our own, on this machine. (The real client does check.)
+        SSL_CTX_set_verify(context_, SSL_VERIFY_NONE, nullptr);
+        SSL_CTX_set_mode(context_, SSL_MODE_RELEASE_BUFFERS | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    }
+
+    ~ScaleTest()
+    {
+        connections_.clear(); // Before the SSL_CTX goes - every SSL object holds on to it.
+        SSL_CTX_free(context_);
+    }
+
+    // Runs all the steps. Returns the exit code: 0 if everything held up.
+    int run()
+    {
+        if (!results_)
+        {
+            std::cerr << "Can't write " << options_.out << std::endl;
+            return 1;
+        }
+
+        auto limit = raise_descriptor_limit();
+        auto baseline = sample_process(options_.server_pid);
+        if (!baseline.ok)
+        {
+            std::cerr << "Can't read /proc/" << options_.server_pid << " - is that the server's process ID?" << std::endl;
+            return 1;
+        }
+        std::cout << "Server before any connections: " << baseline.rss_kb << " KB, " << baseline.fds << " file descriptors." << std::endl;
+
+        bool passed = true;
+        for (auto target : options_.steps)
+        {
+            if (target + 64 > limit)
+            {
+                std::cout << "Skipping " << target << " connections - this program may only open " << limit
+                          << " files (ulimit -Hn). See the top of scale_test.cpp." << std::endl;
+                passed = false;
+                continue;
+            }
+            if (!step(target, baseline))
+            {
+                passed = false;
+                if (!sample_process(options_.server_pid).ok)
+                {
+                    std::cout << "The server has gone - stopping here." << std::endl;
+                    break;
+                }
+            }
+        }
+
+        std::cout << "Results are in " << options_.out << (passed ? "" : " - FAILED") << std::endl;
+        return passed ? 0 : 1;
+    }
+
+    // Called by the connections.
+    void connected(Clock::time_point started)
+    {
+        bucket_.push_back(std::chrono::duration<double, std::milli>(Clock::now() - started).count());
+        ++ready_;
+        --setting_up_;
+        if (bucket_.size() == curve_every)
+        {
+            write_curve_point();
+        }
+        settled();
+    }
+
+    void failed(bool was_ready)
+    {
+        if (was_ready)
+        {
+            ++dropped_; // It was logged in, and the server closed it (or stopped answering).
+            --ready_;
+        }
+        else
+        {
+            ++failed_;
+            --setting_up_;
+            settled();
+        }
+    }
+
+    void pinged() { ++pings_; }
+
+private:
+    // Opens connections until there are target of them, lets them sit idle for options_.hold, and writes a "step" line.
+    bool step(std::size_t target, const ProcessSample &baseline)
+    {
+        std::cout << "Opening connections up to " << target << "..." << std::endl;
+        auto ramp_started = Clock::now();
+        std::size_t failed_before = failed_;
+        dropped_ = 0;
+        ramp_target_ = target;
+        while (connections_.size() < target && setting_up_ < in_flight)
+        {
+            open_one(); // The rest follow one by one, as these finish - see settled().
+        }
+        auto next_check = Clock::now() + std::chrono::seconds(1);
+        while (setting_up_ > 0)
+        {
+            io_context_.run_one_for(std::chrono::seconds(1));
+            if (Clock::now() >= next_check)
+            {
+                give_up_on_slow_connections();
+                next_check = Clock::now() + std::chrono::seconds(1);
+            }
+        }
+        if (!bucket_.empty())
+        {
+            write_curve_point();
+        }
+        double ramp_seconds = std::chrono::duration<double>(Clock::now() - ramp_started).count();
+
+        // Now they all sit there. The server pings each one every heartbeat_interval - we count the pings and the CPU it uses.
+        std::cout << ready_ << " connected - holding them idle for " << options_.hold.count() << " seconds..." << std::endl;
+        auto before = sample_process(options_.server_pid);
+        pings_ = 0;
+        io_context_.run_for(options_.hold);
+        auto after = sample_process(options_.server_pid);
+        if (!after.ok)
+        {
+            std::cout << "The server has gone." << std::endl;
+            return false;
+        }
+
+        double cpu = after.cpu_seconds - before.cpu_seconds;
+        double hold = static_cast<double>(options_.hold.count());
+        double kb_per_connection = ready_ > 0 ? static_cast<double>(after.rss_kb - std::min(after.rss_kb, baseline.rss_kb)) / static_cast<double>(ready_) : 0;
+        std::size_t step_failed = failed_ - failed_before;
+
+        results_ << "{\"type\":\"step\",\"target\":" << target << ",\"connections\":" << ready_ << ",\"failed\":" << step_failed
+                 << ",\"dropped\":" << dropped_ << ",\"ramp_seconds\":" << ramp_seconds << ",\"rss_kb\":" << after.rss_kb
+                 << ",\"rss_kb_per_connection\":" << kb_per_connection << ",\"fds\":" << after.fds
+                 << ",\"hold_seconds\":" << hold << ",\"cpu_seconds\":" << cpu << ",\"cpu_percent\":" << 100 * cpu / hold
+                 << ",\"pings\":" << pings_ << ",\"cpu_us_per_ping\":" << (pings_ > 0 ? 1e6 * cpu / static_cast<double>(pings_) : 0)
+                 << ",\"cpu_ms_per_heartbeat_interval\":" << 1000 * cpu / hold * static_cast<double>(protocol::heartbeat_interval.count())
+                 << ",\"client_rss_kb\":" << sample_process(static_cast<int>(::getpid())).rss_kb << "}" << std::endl;
+
+        std::cout << "  " << ready_ << " connections in " << ramp_seconds << " s (" << step_failed << " failed, " << dropped_ << " dropped)"
+                  << ", server: " << after.rss_kb << " KB (" << kb_per_connection << " KB per connection), " << after.fds << " fds, "
+                  << 100 * cpu / hold << "% CPU while idle (" << pings_ << " pings)" << std::endl;
+
+        bool passed = step_failed == 0 && dropped_ == 0;
+        if (options_.max_kb_per_connection > 0 && kb_per_connection > options_.max_kb_per_connection)
+        {
+            std::cout << "  More than " << options_.max_kb_per_connection << " KB per connection!" << std::endl;
+            passed = false;
+        }
+        return passed;
+    }
+
+    void open_one()
+    {
+        std::size_t number = connections_.size();
+        // 127.0.0.1 for the first per_source connections, 127.0.0.2 for the next, and so on.
+        boost::asio::ip::address_v4 source(0x7f000001 + static_cast<std::uint32_t>(number / per_source));
+        ++setting_up_;
+        connections_.push_back(std::make_unique<Connection>(*this, io_context_, context_, number));
+        connections_.back()->start(tcp::endpoint(boost::asio::ip::make_address_v4("127.0.0.1"), options_.port), source);
+    }
+
+    void give_up_on_slow_connections()
+    {
+        auto now = Clock::now();
+        // By index: giving up on one starts the next (see settled()), which adds to connections_.
+        for (std::size_t i = 0, count = connections_.size(); i < count; ++i)
+        {
+            if (connections_[i]->setting_up() && now - connections_[i]->started() > setup_timeout)
+            {
+                connections_[i]->fail();
+            }
+        }
+    }
+
+    // One connection has finished setting up (either way) - start the next one, if this step needs more.
+    void settled()
+    {
+        if (connections_.size() < ramp_target_)
+        {
+            open_one();
+        }
+    }
+
+    void write_curve_point()
+    {
+        std::sort(bucket_.begin(), bucket_.end());
+        auto at = [this](double fraction)
+        { return bucket_[std::min(bucket_.size() - 1, static_cast<std::size_t>(fraction * static_cast<double>(bucket_.size())))]; };
+        results_ << "{\"type\":\"accept\",\"connections\":" << ready_ << ",\"p50_ms\":" << at(0.5) << ",\"p99_ms\":" << at(0.99)
+                 << ",\"max_ms\":" << bucket_.back() << "}" << std::endl;
+        bucket_.clear();
+    }
+
+    Options options_;
+    boost::asio::io_context io_context_; // Before connections_, so the sockets go first.
+    SSL_CTX *context_;
+    std::vector<std::unique_ptr<Connection>> connections_;
+    std::ofstream results_;
+
+    std::size_t ramp_target_ = 0;
+    std::size_t setting_up_ = 0; // Connections that are neither logged in nor failed yet.
+    std::size_t ready_ = 0;
+    std::size_t failed_ = 0;
+    std::size_t dropped_ = 0;
+    std::uint64_t pings_ = 0;
+    std::vector<double> bucket_; // Times to accept (ms) for the curve point we're collecting.
+};
+
+// ---------------------------------- //
+
+void Connection::start(const tcp::endpoint &server, const boost::asio::ip::address_v4 &source)
+{
+    started_ = Clock::now();
+    boost::system::error_code ec;
+    socket_.open(tcp::v4(), ec);
+    if (!ec && source != boost::asio::ip::address_v4::loopback())
+    {
+        // Only pick the port at connect() time - bind() on its own would pick one that's free for ANY destination, and run out sooner.
+        int yes = 1;
+        ::setsockopt(socket_.native_handle(), IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &yes, sizeof(yes));
+        socket_.bind(tcp::endpoint(source, 0), ec);
+    }
+    if (ec)
+    {
+        return fail();
+    }
+    socket_.async_connect(server, [this](boost::system::error_code ec)
+                          {
+                              if (ec)
+                              {
+                                  return fail();
+                              }
+                              socket_.non_blocking(true, ec);
+                              SSL_set_fd(ssl_, socket_.native_handle());
+                              state_ = State::handshaking;
+                              handshake(); });
+}
+
+void Connection::handshake()
+{
+    int result = SSL_connect(ssl_);
+    if (result == 1)
+    {
+        std::string body;
+        protocol::Writer writer(body);
+        writer.str("scale-" + std::to_string(number_));
+        writer.u32(0); // No compression, no UDP - an idle client doesn't need them.
+        writer.u32(0);
+        writer.u64(0);
+        writer.u64(0);
+        state_ = State::logging_in;
+        if (write(protocol::MessageType::hello, std::move(body)))
+        {
+            read();
+        }
+        return;
+    }
+    switch (SSL_get_error(ssl_, result))
+    {
+    case SSL_ERROR_WANT_READ:
+        return wait(tcp::socket::wait_read, &Connection::handshake);
+    case SSL_ERROR_WANT_WRITE:
+        return wait(tcp::socket::wait_write, &Connection::handshake);
+    default:
+        return fail();
+    }
+}
+
+// Reads everything there is into one buffer that all the connections share (there's only one thread), and keeps just the
+// end of a frame that hasn't fully arrived yet. Then waits until there's more.
+void Connection::read()
+{
+    static std::array<char, 64 * 1024> buffer;
+    while (true)
+    {
+        int length = SSL_read(ssl_, buffer.data(), static_cast<int>(buffer.size()));
+        if (length > 0)
+        {
+            inbox_.append(buffer.data(), static_cast<std::size_t>(length));
+            if (!handle_frames())
+            {
+                return fail();
+            }
+            continue;
+        }
+        switch (SSL_get_error(ssl_, length))
+        {
+        case SSL_ERROR_WANT_READ:
+            if (inbox_.empty() && inbox_.capacity() > 0)
+            {
+                std::string().swap(inbox_); // The roster at login can be big - an idle connection doesn't keep that memory.
+            }
+            return wait(tcp::socket::wait_read, &Connection::read);
+        case SSL_ERROR_WANT_WRITE:
+            return wait(tcp::socket::wait_write, &Connection::read);
+        default:
+            return fail(); // Closed, or broken.
+        }
+    }
+}
+
+bool Connection::handle_frames()
+{
+    std::size_t start = 0;
+    protocol::MessageType type;
+    bool compressed = false;
+    std::size_t length = 0;
+    while (inbox_.size() - start >= protocol::header_length)
+    {
+        if (!protocol::parse_header(inbox_.data() + start, type, compressed, length))
+        {
+            return false;
+        }
+        if (inbox_.size() - start < protocol::header_length + length)
+        {
+            break;
+        }
+        std::string_view body(inbox_.data() + start + protocol::header_length, length);
+        start += protocol::header_length + length;
+
+        if (type == protocol::MessageType::welcome && state_ == State::logging_in)
+        {
+            state_ = State::ready;
+            test_.connected(started_);
+        }
+        else if (type == protocol::MessageType::ping)
+        {
+            test_.pinged();
+            if (!write(protocol::MessageType::pong, std::string(body)))
+            {
+                return false;
+            }
+        }
+        // Everything else (presence, history, notices...) an idle client just lets go by.
+    }
+    inbox_.erase(0, start);
+    return true;
+}
+
+bool Connection::write(protocol::MessageType type, std::string body)
+{
+    auto frame = protocol::make_frame(type, std::move(body));
+    outbox_.append(frame->header.data(), frame->header.size());
+    outbox_ += frame->body;
+    return flush();
+}
+
+// Hellos and pongs are tiny, so this nearly always goes in one go. If the socket is full we keep the rest and try again once
+// it has room (OpenSSL wants the same bytes again then - SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER lets them be somewhere else).
+bool Connection::flush()
+{
+    while (!outbox_.empty())
+    {
+        int written = SSL_write(ssl_, outbox_.data(), static_cast<int>(outbox_.size()));
+        if (written > 0)
+        {
+            outbox_.erase(0, static_cast<std::size_t>(written));
+            continue;
+        }
+        int error = SSL_get_error(ssl_, written);
+        if (error != SSL_ERROR_WANT_WRITE && error != SSL_ERROR_WANT_READ)
+        {
+            return false;
+        }
+        wait(tcp::socket::wait_write, &Connection::retry_flush);
+        return true;
+    }
+    std::string().swap(outbox_);
+    return true;
+}
+
+void Connection::retry_flush()
+{
+    if (!flush())
+    {
+        fail();
+    }
+}
+
+void Connection::wait(tcp::socket::wait_type type, void (Connection::*then)())
+{
+    socket_.async_wait(type, [this, then](boost::system::error_code ec)
+                       {
+                           if (ec)
+                           {
+                               return fail();
+                           }
+                           (this->*then)(); });
+}
+
+void Connection::fail()
+{
+    if (state_ == State::failed)
+    {
+        return;
+    }
+    bool was_ready = state_ == State::ready;
+    state_ = State::failed;
+    boost::system::error_code ignored;
+    socket_.close(ignored); // Cancels whatever we were waiting for - those handlers see an error and come back here.
+    test_.failed(was_ready);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+#if defined(__linux__)
+    ScaleTest::Options options;
+    bool usage_ok = argc >= 3;
+    if (usage_ok)
+    {
+        options.port = static_cast<unsigned short>(std::atoi(argv[1]));
+        options.server_pid = std::atoi(argv[2]);
+    }
+    for (int i = 3; i + 1 < argc && usage_ok; i += 2)
+    {
+        std::string option = argv[i];
+        std::string value = argv[i + 1];
+        if (option == "--steps")
+        {
+            options.steps.clear();
+            std::istringstream list(value);
+            std::string count;
+            while (std::getline(list, count, ','))
+            {
+                options.steps.push_back(static_cast<std::size_t>(std::stoull(count)));
+            }
+        }
+        else if (option == "--hold")
+        {
+            options.hold = std::chrono::seconds(std::atoi(value.c_str()));
+        }
+        else if (option == "--out")
+        {
+            options.out = value;
+        }
+        else if (option == "--max-kb-per-connection")
+        {
+            options.max_kb_per_connection = std::atof(value.c_str());
+        }
+        else
+        {
+            usage_ok = false;
+        }
+    }
+    if (!usage_ok || argc % 2 == 0 || options.port == 0 || options.server_pid <= 0 || options.steps.empty())
+    {
+        std::cerr << "Usage: ./scale_test <server port> <server pid> [--steps 10000,50000,100000] [--hold <seconds>] [--out <file>] [--max-kb-per-connection <KB>]\n";
+        return 1;
+    }
+
+    try
+    {
+        ScaleTest test(options);
+        return test.run();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Exception: " << e.what() << "\n";
+        return 1;
+    }
+#else
+    std::cerr << "scale_test reads the server's numbers from /proc - Linux only.\n";
+    return 1;
+#endif
+}
+
+// g++ -o scale_test scale_test.cpp -lssl -lcrypto -pthread -std=c++20
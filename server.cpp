@@ -1,13 +1,570 @@
 #include <iostream>
+#include <utility> // Boost 1.74's awaitable.hpp uses std::exchange without including this itself.
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
+#include <boost/circular_buffer.hpp>
 #include <memory>
 #include <thread>
 #include <vector>
 #include <algorithm>
+#include <array>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <random>
+#include <set>
+#include <unordered_map>
+#include "protocol.hpp"
+#include "attachment_store.hpp"
+#include "compression.hpp"
+#include "timing_wheel.hpp"
+#include "hot_restart.hpp"
+#include "ip_blocklist.hpp"
+#include "rate_limit.hpp"
+#include "federation.hpp"
+#include "transport.hpp"
+#include "edge.hpp"
+#include "replication.hpp"
+#include "datagram.hpp"
+#include "shm_ring.hpp"
+#include "object_pool.hpp"
+
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+#include <unistd.h> // dup() for the console - see Server::read_console().
+#include <sys/resource.h> // setrlimit() - see main().
+#endif
+#if defined(LOCAL_CLIENTS_SUPPORTED)
+#include <sys/stat.h> // umask() for the local socket - see Server::listen_locally().
+#endif
+#if defined(__GLIBC__)
+#include <malloc.h> // malloc_trim() - see Server::trim_heap().
+#endif
 
 using boost::asio::ip::tcp;
 
+// The sessions are written as C++20 coroutines (see Session::run()). These are the Boost ASIO pieces for that:
+// awaitable<T> is the return type of a coroutine, use_awaitable makes an async_ function "co_await-able",
+// and redirect_error puts any error into an error_code instead of throwing an exception.
+using boost::asio::awaitable;
+using boost::asio::use_awaitable;
+using boost::asio::redirect_error;
+
+class Session;
+
+// This holds everything that all the sessions share. There is one ServerState, owned by the Server, and every Session gets a reference to it.
+// Before this, each shared thing was passed into the Session constructor one by one - the list was getting long.
+struct ServerState
+{
+    ServerState(boost::asio::io_context &io_context, const std::string &dictionary_bytes)
+        : executor(io_context.get_executor()), wheel(io_context, std::chrono::milliseconds(500), 128), attachments("attachments", io_context.get_executor()), dictionary(dictionary_bytes), codec(dictionary_bytes),
+          run_id(new_run_id()) {}
+
+    static std::uint64_t new_run_id()
+    {
+        std::random_device random;
+        std::mt19937_64 generator(random());
+        return std::uniform_int_distribution<std::uint64_t>(1)(generator);
+    }
+
+    // The io_context's own executor. Sessions post to it to let others run first (see Session::writer()). Through the
+    // any_io_executor a transport gives them, ASIO would wrap - and allocate - the continuation every time; through this it doesn't.
+    boost::asio::io_context::executor_type executor;
+
+    // Every session's timeouts (login, heartbeats) run off this one wheel - see timing_wheel.hpp.
+    // It ticks every half second and goes round once every 64 seconds. It's declared before sessions so it outlives them.
+    TimingWheel wheel;
+
+    // This is a vector that holds all the sessions that are currently connected to the server.
+    std::vector<std::shared_ptr<Session>> sessions;
+
+    // Read buffers, lent to sessions while they have something to read (see Session::reader()). A quiet session gives its buffer
+    // back and waits without one - with 100,000 mostly idle clients we only need as many buffers as are reading right now.
+    // The server has one thread, so this one pool is all the "per thread" pools there are.
+    static constexpr std::size_t read_buffer_size = 16 * 1024;
+    static constexpr std::size_t max_spare_read_buffers = 64; // More than that are freed - they'd only be kept for a rush that may never come.
+    std::vector<std::vector<char>> spare_read_buffers;
+
+    std::vector<char> borrow_read_buffer()
+    {
+        if (spare_read_buffers.empty())
+        {
+            return std::vector<char>(read_buffer_size);
+        }
+        auto buffer = std::move(spare_read_buffers.back());
+        spare_read_buffers.pop_back();
+        return buffer;
+    }
+
+    // Takes the buffer (leaving it empty). One that grew for a big frame (a file chunk) is freed instead of kept.
+    void give_back_read_buffer(std::vector<char> &buffer)
+    {
+        if (buffer.size() == read_buffer_size && spare_read_buffers.size() < max_spare_read_buffers)
+        {
+            spare_read_buffers.push_back(std::move(buffer));
+        }
+        buffer = std::vector<char>();
+    }
+
+    // The same for the strings writers copy their frames into (see Session::writer()): borrowed while there's something to send.
+    static constexpr std::size_t max_spare_write_staging = 64;
+    std::vector<std::string> spare_write_staging;
+
+    std::string borrow_write_staging()
+    {
+        if (spare_write_staging.empty())
+        {
+            return std::string();
+        }
+        auto staging = std::move(spare_write_staging.back());
+        spare_write_staging.pop_back();
+        return staging;
+    }
+
+    void give_back_write_staging(std::string &staging)
+    {
+        if (staging.capacity() > std::string().capacity() && spare_write_staging.size() < max_spare_write_staging)
+        {
+            spare_write_staging.push_back(std::move(staging));
+        }
+        // Not staging = std::string(): assigning a short string keeps the memory the long one had (libstdc++ just copies the
+        // characters in). With 64 spares already, every idle session kept its 16 KB that way - swap() really lets go of it.
+        std::string().swap(staging);
+    }
+
+    // This is where shared files are stored (in the "attachments" folder next to the server). See attachment_store.hpp.
+    AttachmentStore attachments;
+
+    // The trained zstd dictionary (may be empty) and the compressor that uses it. See compression.hpp.
+    // The server only has one thread, so one Codec is enough for every session.
+    std::string dictionary;
+    compression::Codec codec;
+
+    // Every chat message and file announcement gets the next sequence number, and the last history_size of them are kept here.
+    // A client that lost its connection tells us the last number it saw when it comes back, and we send it what it missed.
+    // Sequence numbers start again from 1 when the server restarts - run_id (random, picked at start up) is how clients can tell.
+    struct HistoryEntry
+    {
+        std::uint64_t sequence;
+        std::string skip_name; // The sender, if the message wasn't sent back to them in the first place. Empty otherwise.
+        std::shared_ptr<const protocol::Frame> frame;
+        bool from_node = false; // It came from another server (see federation.hpp) - so we don't send it back out to the other servers.
+        std::uint32_t sender = 0; // Who sent it (see senders below). 0 for things that aren't somebody's chat line.
+    };
+    // Every logged in session, by name - so a private message finds its recipient without going through every session.
+    // Names don't have to be unique (you can be logged in on two machines), so each name has a list. Nearly always it's just one.
+    // Sessions add themselves once they've sent their hello and take themselves out in stop(), so there are never stale entries.
+    std::unordered_map<std::string, std::vector<Session *>> by_name;
+
+    void add_name(const std::string &name, Session *session)
+    {
+        auto it = by_name.try_emplace(name).first;
+        auto &list = it->second;
+        list.push_back(session);
+        if (list.size() == 1)
+        {
+            online_names.insert(it->first);
+            note_presence(name, +1); // A second device with the same name doesn't change who's online.
+        }
+    }
+
+    void remove_name(const std::string &name, Session *session)
+    {
+        auto it = by_name.find(name);
+        if (it == by_name.end())
+        {
+            return;
+        }
+        auto &list = it->second;
+        list.erase(std::remove(list.begin(), list.end(), session), list.end());
+        if (list.empty())
+        {
+            online_names.erase(it->first);
+            by_name.erase(it);
+            note_presence(name, -1);
+        }
+    }
+
+    // ---------------------------------- //
+    // Presence - who joined and who left.
+    // Telling everybody about every join straight away is fine with 10 people. But when the server restarts and 10,000 clients
+    // come back, that's 10,000 joins x 10,000 people = 100,000,000 messages. So joins and leaves are only collected here,
+    // and once per tick Server::flush_presence() sends ONE update with all of them (see take_presence_changes()).
+    // Someone who joins and leaves again within the same tick cancels out and nobody hears about it.
+    std::unordered_map<std::string, int> presence_changes; // +1 joined, -1 left.
+
+    void note_presence(const std::string &name, int change)
+    {
+        int &net = presence_changes[name];
+        net += change;
+        if (net == 0)
+        {
+            presence_changes.erase(name);
+        }
+    }
+
+    // Everybody online, sorted by name - kept up to date as people come and go (a name is added and removed in O(log n)),
+    // so nothing ever has to sort the whole list. The names point into by_name's keys, which stay put until they're erased.
+    std::set<std::string_view> online_names;
+
+    // Everybody online as a list - what the who command pages through. It's copied out of online_names at most once per tick
+    // (take_presence_changes() marks it stale), and only if somebody asks "who?" in that tick.
+    const std::vector<std::string> &roster()
+    {
+        if (roster_stale)
+        {
+            roster_cache.assign(online_names.begin(), online_names.end());
+            roster_stale = false;
+        }
+        return roster_cache;
+    }
+
+    // The presence snapshot, built once per tick and shared by everyone who logs in during it. compressed is empty if it didn't help.
+    struct CachedFrame
+    {
+        std::shared_ptr<const protocol::Frame> frame;
+        std::shared_ptr<const protocol::Frame> compressed;
+    };
+
+    // Somebody who has just logged in only gets the first page of the roster (the first who_page_size names) and how many are
+    // online in all - the rest is there with /who. When 10,000 people come back after a restart, sending each of them the whole
+    // list is 10,000 x 10,000 names; this way every one of them costs the same, however many are online.
+    const std::vector<CachedFrame> &roster_snapshot()
+    {
+        if (snapshot_cache.empty())
+        {
+            std::vector<std::string> first_page;
+            for (auto it = online_names.begin(); it != online_names.end() && first_page.size() < protocol::who_page_size; ++it)
+            {
+                first_page.emplace_back(*it);
+            }
+            for (auto &frame : presence_frames(protocol::PresenceKind::snapshot, first_page, {}, online_names.size()))
+            {
+                auto compressed = codec.compress(*frame);
+                snapshot_cache.push_back({std::move(frame), std::move(compressed)});
+            }
+        }
+        return snapshot_cache;
+    }
+
+    // Hands over (and forgets) the joins and leaves since the last call - sorted, so the update is easy to read.
+    void take_presence_changes(std::vector<std::string> &joined, std::vector<std::string> &left)
+    {
+        for (const auto &change : presence_changes)
+        {
+            (change.second > 0 ? joined : left).push_back(change.first);
+        }
+        presence_changes.clear();
+        std::sort(joined.begin(), joined.end());
+        std::sort(left.begin(), left.end());
+        roster_stale = true;
+        snapshot_cache.clear();
+    }
+
+    // Packs names into presence frames of about presence_frame_bytes each (one frame with 100,000 names would be bigger than
+    // max_body_length). Only the first frame of a snapshot is a "snapshot" - the rest are "snapshot_more".
+    static std::vector<std::shared_ptr<const protocol::Frame>> presence_frames(protocol::PresenceKind kind, const std::vector<std::string> &joined,
+                                                                              const std::vector<std::string> &left, std::size_t online)
+    {
+        std::vector<std::shared_ptr<const protocol::Frame>> frames;
+        std::size_t next_joined = 0;
+        std::size_t next_left = 0;
+        do
+        {
+            std::string body;
+            protocol::Writer writer(body);
+            bool first = frames.empty() || kind == protocol::PresenceKind::update;
+            writer.u8(static_cast<std::uint8_t>(first ? kind : protocol::PresenceKind::snapshot_more));
+            writer.u32(static_cast<std::uint32_t>(online));
+            pack_names(writer, body, joined, next_joined);
+            pack_names(writer, body, left, next_left);
+            frames.push_back(protocol::make_frame(protocol::MessageType::presence, std::move(body)));
+        } while (next_joined < joined.size() || next_left < left.size());
+        return frames;
+    }
+
+    // A count followed by as many names (from next onwards) as fit.
+    static void pack_names(protocol::Writer &writer, std::string &body, const std::vector<std::string> &names, std::size_t &next)
+    {
+        std::size_t count_at = body.size();
+        writer.u32(0); // Filled in below, once we know how many fitted.
+        std::uint32_t count = 0;
+        while (next < names.size() && body.size() < presence_frame_bytes)
+        {
+            writer.str(names[next++]);
+            ++count;
+        }
+        protocol::put_u32(body.data() + count_at, count);
+    }
+
+    static constexpr std::size_t presence_frame_bytes = 32 * 1024;
+
+    std::vector<std::string> roster_cache;
+    std::vector<CachedFrame> snapshot_cache;
+    bool roster_stale = true;
+
+    // Flood protection - see rate_limit.hpp. Every session has its own buckets; these are the ones shared by all the
+    // sessions with the same name or from the same IP address. An entry goes away when the last of those sessions does.
+    RateLimits limits;
+    std::unordered_map<std::string, std::shared_ptr<RateBuckets>> name_buckets;
+    std::unordered_map<std::string, std::shared_ptr<RateBuckets>> ip_buckets;
+    std::uint64_t throttled_messages = 0; // How many messages had to wait - just a counter, so it's cheap to keep.
+
+    static std::shared_ptr<RateBuckets> share_buckets(std::unordered_map<std::string, std::shared_ptr<RateBuckets>> &buckets, const std::string &key)
+    {
+        auto &slot = buckets[key];
+        if (!slot)
+        {
+            slot = std::make_shared<RateBuckets>();
+        }
+        return slot;
+    }
+
+    static void release_buckets(std::unordered_map<std::string, std::shared_ptr<RateBuckets>> &buckets, const std::string &key, std::shared_ptr<RateBuckets> &mine)
+    {
+        if (!mine)
+        {
+            return;
+        }
+        mine.reset();
+        auto it = buckets.find(key);
+        if (it != buckets.end() && it->second.use_count() == 1)
+        {
+            buckets.erase(it);
+        }
+    }
+
+    static constexpr std::size_t history_size = 1024;
+    std::uint64_t run_id; // Also this server's node ID when it's part of a federation.
+    std::uint64_t last_sequence = 0;
+    // A ring of history_size entries, made once. (A std::deque would allocate and free a block every few messages as it moves along.)
+    boost::circular_buffer<HistoryEntry> history{history_size};
+
+    // The other servers in the mesh, if this server is part of one (./server ... --node / --peer). Owned by the Server.
+    Federation *federation = nullptr;
+
+    // Our hot standbys, if we take any (./server ... --replicate). Owned by the Server. Every new history entry goes to them too.
+    Replication *replication = nullptr;
+
+    // The UDP side channel, if it's switched on (./server ... --udp). Owned by the Server. Each session that uses it is listed
+    // under its identity (see datagram.hpp), so an event that comes in over UDP finds the session it belongs to.
+    DatagramServer *datagrams = nullptr;
+    std::unordered_map<std::string, Session *> by_datagram_identity;
+
+    // Events (see protocol::EventKind) waiting for the next tick - see Server::flush_events(). Only the newest one per sender and kind
+    // is kept: somebody whose status changes five times in one tick only needs to be told about the last one.
+    std::map<std::pair<std::string, std::uint8_t>, std::string> pending_events;
+
+    // ---------------------------------- //
+    // Who sent what. A chat frame used to start with "name: " - with long names and short lines that was most of the bytes,
+    // copied into every frame. Now everybody who says something gets a number, and the frame carries just that (4 bytes).
+    // Clients learn who the numbers are from names frames: all the ones in use when they log in (names_snapshot()), and after
+    // that each new one just before its first line (names_frame()). The name goes over the wire once, not with every line.
+    // Numbers are handed out when somebody first speaks, not when they log in - 10,000 people coming back after a restart
+    // shouldn't mean 10,000 names for everybody - and they are never reused, so a client can't mix up an old number with a new one.
+    // A sender is forgotten when the last of their lines leaves the history. Nobody can be sent an older line than that.
+    struct Sender
+    {
+        std::string name;
+        std::size_t in_history = 0; // How many history entries are theirs.
+    };
+    std::unordered_map<std::uint32_t, Sender> senders;
+    std::unordered_map<std::string, std::uint32_t> sender_ids;
+    std::uint32_t next_sender_id = 1; // 0 means "nobody".
+    std::vector<CachedFrame> names_cache;
+
+    // The sender's number - a new one if they don't have one yet. Then is_new is set and it's up to the caller to tell everybody
+    // (with names_frame()) before they send the line.
+    std::uint32_t sender_id(const std::string &name, bool &is_new)
+    {
+        auto it = sender_ids.find(name);
+        is_new = it == sender_ids.end();
+        if (!is_new)
+        {
+            return it->second; // Nearly always - and a lookup doesn't allocate anything.
+        }
+        std::uint32_t id = next_sender_id++;
+        sender_ids.emplace(name, id);
+        senders.emplace(id, Sender{name, 0});
+        names_cache.clear();
+        return id;
+    }
+
+    const std::string &sender_name(std::uint32_t id) const
+    {
+        static const std::string nobody;
+        auto it = senders.find(id);
+        return it == senders.end() ? nobody : it->second.name;
+    }
+
+    // "This number is this name" for one sender.
+    std::shared_ptr<const protocol::Frame> names_frame(std::uint32_t id) const
+    {
+        std::string body;
+        protocol::Writer writer(body);
+        writer.u32(1);
+        writer.u32(id);
+        writer.str(sender_name(id));
+        return protocol::make_frame(protocol::MessageType::names, std::move(body));
+    }
+
+    // Every sender in the history, for somebody who has just logged in - built once and shared until it changes, like the roster.
+    // There can't be more than history_size of them, but it's still split over frames of about presence_frame_bytes.
+    const std::vector<CachedFrame> &names_snapshot()
+    {
+        if (names_cache.empty() && !senders.empty())
+        {
+            auto it = senders.begin();
+            while (it != senders.end())
+            {
+                std::string body;
+                protocol::Writer writer(body);
+                writer.u32(0); // Filled in below, once we know how many fitted.
+                std::uint32_t count = 0;
+                for (; it != senders.end() && body.size() < presence_frame_bytes; ++it, ++count)
+                {
+                    writer.u32(it->first);
+                    writer.str(it->second.name);
+                }
+                protocol::put_u32(body.data(), count);
+                auto frame = protocol::make_frame(protocol::MessageType::names, std::move(body));
+                auto compressed = codec.compress(*frame);
+                names_cache.push_back({std::move(frame), std::move(compressed)});
+            }
+        }
+        return names_cache;
+    }
+
+    void count_sender(std::uint32_t id, int change)
+    {
+        auto it = senders.find(id);
+        if (it == senders.end())
+        {
+            return;
+        }
+        it->second.in_history += change;
+        if (it->second.in_history == 0)
+        {
+            sender_ids.erase(it->second.name);
+            senders.erase(it);
+            names_cache.clear();
+        }
+    }
+
+    // Once the history is full, the oldest entry's place is reused for the new one (rotate() is cheap on a full ring) - so its
+    // skip_name string keeps its memory, and a new message doesn't allocate anything here.
+    void append_history(std::uint64_t sequence, std::string_view skip_name, std::shared_ptr<const protocol::Frame> frame, bool from_node = false, std::uint32_t sender = 0)
+    {
+        if (history.full())
+        {
+            history.rotate(history.begin() + 1);
+        }
+        else
+        {
+            history.push_back(HistoryEntry{});
+        }
+        auto &entry = history.back();
+        std::uint32_t dropped = entry.sender; // The oldest entry's sender, if we've just reused its place.
+        entry.sequence = sequence;
+        entry.skip_name.assign(skip_name);
+        entry.frame = std::move(frame); // The oldest message's frame goes back to the pool here (unless a session is still sending it).
+        entry.from_node = from_node;
+        entry.sender = sender;
+        count_sender(sender, +1); // Before the drop - so somebody who is both the oldest and the newest isn't forgotten in between.
+        count_sender(dropped, -1);
+        if (replication)
+        {
+            replication->send(entry_frame(history.back()));
+        }
+    }
+
+    // One history entry as it's saved for a hot restart, and sent to a standby (see replication.hpp). The sequence number comes first.
+    // The sender's name is saved with their number, so whoever reads it back can rebuild the senders too.
+    void save_entry(protocol::Writer &writer, const HistoryEntry &entry) const
+    {
+        writer.u64(entry.sequence);
+        writer.str(entry.skip_name);
+        writer.u32(entry.sender);
+        writer.str(sender_name(entry.sender));
+        writer.u8(static_cast<std::uint8_t>(protocol::frame_type(*entry.frame)));
+        writer.u32(static_cast<std::uint32_t>(entry.frame->body.size()));
+        writer.raw(entry.frame->body);
+        writer.u8(entry.from_node ? 1 : 0);
+    }
+
+    std::shared_ptr<const protocol::Frame> entry_frame(const HistoryEntry &entry) const
+    {
+        std::string body;
+        protocol::Writer writer(body);
+        save_entry(writer, entry);
+        return protocol::make_frame(protocol::MessageType::repl_entry, std::move(body));
+    }
+
+    // For a hot restart (see hot_restart.hpp) the new server carries on with our run ID, sequence numbers and history,
+    // so to the clients it looks like the same server - they resume where they left off instead of being told "the server restarted".
+    // History frames are never compressed (publish() stores the original), so the type and body are all we need to rebuild them.
+    std::string save_history() const
+    {
+        std::string out;
+        protocol::Writer writer(out);
+        writer.u64(run_id);
+        writer.u64(last_sequence);
+        writer.u32(static_cast<std::uint32_t>(history.size()));
+        for (const auto &entry : history)
+        {
+            save_entry(writer, entry);
+        }
+        return out;
+    }
+
+    bool restore_history(protocol::Reader &reader)
+    {
+        auto saved_run_id = reader.u64();
+        auto saved_sequence = reader.u64();
+        boost::circular_buffer<HistoryEntry> saved(history_size);
+        std::map<std::uint32_t, std::string> saved_senders;
+        for (std::uint32_t count = reader.u32(); count > 0 && reader.ok(); --count)
+        {
+            auto sequence = reader.u64();
+            auto skip_name = reader.str();
+            auto sender = reader.u32();
+            auto sender_name = reader.str();
+            auto type = static_cast<protocol::MessageType>(reader.u8());
+            auto body = reader.raw(reader.u32());
+            bool from_node = reader.u8() != 0;
+            saved.push_back({sequence, std::string(skip_name), protocol::make_frame(type, std::string(body)), from_node, sender});
+            if (sender != 0)
+            {
+                saved_senders[sender] = sender_name;
+            }
+        }
+        if (!reader.ok() || saved_run_id == 0)
+        {
+            return false;
+        }
+        run_id = saved_run_id;
+        last_sequence = saved_sequence;
+        history = std::move(saved);
+
+        // The clients that come back still know these numbers, so they keep them.
+        for (const auto &[id, name] : saved_senders)
+        {
+            sender_ids[name] = id;
+            senders[id].name = name;
+            next_sender_id = std::max(next_sender_id, id + 1);
+        }
+        for (const auto &entry : history)
+        {
+            if (entry.sender != 0)
+            {
+                ++senders[entry.sender].in_history;
+            }
+        }
+        names_cache.clear();
+        return true;
+    }
+};
+
 // We create a session class. This session class is a class that represents a connection to each client.
 // Everytime we get a new connection, we create a new session object. This new session object is managed by a std::shared_ptr.
 // std::enable_shared_from_this is a CLASS TEMPLATE that enables objects of derived classes to be shared with std::shared_ptr.
@@ -23,308 +580,2477 @@ class Session : public std::enable_shared_from_this<Session>
 {
 public:
     // We create a constructor for the Session class.
-    // The constructor takes a boost::asio::ssl::stream<tcp::socket> object and a std::vector<std::shared_ptr<Session>> object as arguments.
-    // boost::asio::ssl::stream<tcp::socket> is the SSL socket that is used to communicate with the client.
-    // std::vector<std::shared_ptr<Session>> is a vector that holds all the sessions that are currently connected to the server.
-    // The constructor initialises the ssl_socket_ member variable with the SSL socket object that is passed in as an argument.
-    // Later in the code we will declare a vector to hold all the sessions that are connected to the server.
-    Session(boost::asio::ssl::stream<tcp::socket> socket,
-            std::vector<std::shared_ptr<Session>> &sessions)
-        : ssl_socket_(std::move(socket)), sessions_(sessions) {}
+    // The constructor takes the client's Transport and the ServerState as arguments.
+    // The Transport is how we talk to the client: a TLS socket of its own (TlsTransport), or a channel on an edge's link (see transport.hpp).
+    // ServerState holds the vector of all the sessions that are currently connected to the server, plus the other things every session shares.
+    // sessions_ and attachments_ are just shortcuts into the state - they are used all over the place.
+    Session(std::unique_ptr<Transport> transport, ServerState &state)
+        : transport_(std::move(transport)), write_queue_(initial_queue_capacity), write_signal_(transport_->executor()), throttle_timer_(transport_->executor()), state_(state), sessions_(state.sessions), attachments_(state.attachments)
+    {
+        // write_signal_ is a timer that never goes off by itself - see deliver() and writer().
+        write_signal_.expires_at(boost::asio::steady_timer::time_point::max());
+    }
+
+    // Sessions are made with this instead of std::make_shared: the memory comes from (and goes back to) a pool - see object_pool.hpp.
+    // Clients connect and disconnect all day, and every Session is the same size, so we may as well keep reusing the same blocks.
+    static std::shared_ptr<Session> create(std::unique_ptr<Transport> transport, ServerState &state)
+    {
+        return std::allocate_shared<Session>(object_pool::Allocator<Session>(), std::move(transport), state);
+    }
+
+    // ---------------------------------- //
+
+    // Now we create public member functions for the Session class - availabe to everything to call without limits.
+
+    // This gets called when we start the session.
+    // co_spawn starts the run() coroutine on the io_context. The lambda holds a shared_ptr to the session (self),
+    // so the session stays alive for as long as the coroutine is running - the same job `auto self(shared_from_this())` did in every callback before.
+    void start()
+    {
+        sessions_.push_back(shared_from_this()); // Here we add the session to the sessions vector.
+
+        address_ = transport_->address();
+        ip_buckets_ = ServerState::share_buckets(state_.ip_buckets, address_);
+
+        // We used to print every connected client here (and again in stop()). With lots of clients coming and going that's
+        // a list of everyone for every join - Server::flush_presence() prints a short summary once per tick instead.
+
+        // The client gets login_timeout to finish the handshake and send its hello - after that the timer becomes the heartbeat.
+        // Without this, somebody could open thousands of connections and just never say anything.
+        last_heard_ = state_.wheel.ticks();
+        state_.wheel.schedule(heartbeat_timer_, login_timeout);
+
+        boost::asio::co_spawn(transport_->executor(), [self = shared_from_this()]()
+                              { return self->run(); },
+                              boost::asio::detached);
+    }
+
+    // This queues a frame to be sent to this client.
+    // We can't just call async_write every time - if a second async_write starts before the first one has finished,
+    // the bytes of the two messages can get mixed up on the wire. So frames wait in write_queue_ and the writer() coroutine sends them.
+    // If writer() is waiting for something to do, cancelling write_signal_ wakes it up.
+    // We only do that when it really is waiting - when it's busy writing it will find the new frame by itself.
+    // write_queue_ is a ring that only grows when it's full (and shrinks back in writer() once it's empty again).
+    void deliver(std::shared_ptr<const protocol::Frame> frame)
+    {
+        if (write_queue_.full())
+        {
+            write_queue_.set_capacity(write_queue_.capacity() * 2);
+        }
+        write_queue_.push_back(std::move(frame));
+        last_sent_ = state_.wheel.ticks();
+        wake_writer();
+    }
+
+    // A session only takes part in the chat once the handshake is done and the client has told us its name.
+    bool ready() const { return !client_name_.empty(); }
+
+    // The server is being handed over to a new process (see Server::hand_over()). We ask the client to disconnect and come back
+    // at a random moment within window - the new server then sees a trickle of reconnects instead of everyone at once.
+    // A client that hasn't logged in yet has nothing to lose, so it's simply closed - it will connect again by itself.
+    void go_away(std::chrono::milliseconds window)
+    {
+        if (!ready())
+        {
+            stop();
+            return;
+        }
+        std::string body;
+        protocol::Writer(body).u32(static_cast<std::uint32_t>(window.count()));
+        deliver(protocol::make_frame(protocol::MessageType::going_away, std::move(body)));
+    }
+
+    // For clients that ignore going_away (older versions) or don't manage to leave in time.
+    void close() { stop(); }
+
+    // An event from this client (see protocol::EventKind) - from the TCP stream, or over UDP by way of Server::on_datagram().
+    // It only waits for the next tick, and is never kept after that. Returns false if it's broken.
+    bool handle_event(std::string_view body)
+    {
+        protocol::Reader reader(body);
+        auto kind = reader.u8();
+        auto text = reader.str();
+        if (!reader.ok() || (kind != static_cast<std::uint8_t>(protocol::EventKind::typing) && kind != static_cast<std::uint8_t>(protocol::EventKind::status)) ||
+            text.size() > protocol::max_event_text)
+        {
+            return false;
+        }
+        state_.pending_events[{client_name_, kind}] = std::string(text);
+        return true;
+    }
+
+    // One tick's events (see Server::flush_events()). Over UDP if this client's side channel is working, otherwise in the stream.
+    // If the stream is backed up (a file on its way), they would be stale by the time they got through, so then we just drop them.
+    void deliver_events(const std::shared_ptr<const protocol::Frame> &frame)
+    {
+        if (!datagram_identity_.empty() && state_.datagrams->send(datagram_identity_, *frame))
+        {
+            return;
+        }
+        if (write_queue_.size() < max_frames_per_write)
+        {
+            deliver(frame);
+        }
+    }
+
+    // Did this client and the server agree to use compression? See compression.hpp.
+    bool compression() const { return compression_; }
+
+    // This function prints the connected clients.
+    // It goes through all the sessions that are currently connected to the server and prints the IP address of the client that is connected on + the port number.
+    // It's static because it's about all the sessions, not one - type /clients in the server window to see it (see Server::read_console()).
+    static void print_connected_clients(const std::vector<std::shared_ptr<Session>> &sessions)
+    {
+        std::cout << "Connected clients:" << std::endl;
+
+        for (const auto &session : sessions) // I prefer &session instead of auto& session - but it's the same thing.
+        {
+            // describe() is the IP address and port number of the client (or, for a client that came in through an edge, its IP address and the edge).
+            std::cout << session->transport_->describe();
+            if (session->rtt_.count() > 0)
+            {
+                std::cout << " (" << session->client_name_ << ", round trip " << session->rtt_.count() / 1000.0 << " ms)";
+            }
+            std::cout << std::endl;
+        }
+
+        std::cout << std::endl;
+    }
+
+private:
+    // This is the whole life of a session, written top to bottom as a coroutine.
+    // Before, this was a chain of callbacks: do_handshake() -> read() -> handle -> read() -> ..., with write() as another chain on the side.
+    // Every co_await below waits for the async operation to finish WITHOUT blocking the thread - while we wait, the io_context
+    // gets on with other sessions. It reads like normal blocking code, but it behaves exactly like the callbacks did.
+    // Boost ASIO re-uses the memory of finished coroutine frames, so there is no extra heap allocation per message compared to the callbacks.
+    awaitable<void> run()
+    {
+        boost::system::error_code ec;
+
+        // This does the SSL handshake (see TlsTransport) - or nothing at all, if an edge has already done it.
+        co_await transport_->handshake(ec);
+        if (ec)
+        {
+            // If we have an error in the handshake, we remove the session from the sessions vector.
+            // Later, in future versions, we can add code to try to reconnect and try connecting again x number of times before erasing.
+            stop();
+            co_return;
+        }
+
+        // Reading and writing happen at the same time, so the writer gets its own coroutine.
+        // Only writer() ever writes to the socket and only reader() ever reads from it - that's what keeps them from getting in each other's way.
+        boost::asio::co_spawn(transport_->executor(), [self = shared_from_this()]()
+                              { return self->writer(); },
+                              boost::asio::detached);
+
+        co_await reader();
+    }
+
+    // This function reads data from the client.
+    // Every message is a frame (see protocol.hpp): a 5 byte header that tells us the type and length, then the body.
+    // We don't read one frame at a time though - we read as much as the socket has (up to the size of read_buffer_) and then
+    // handle every complete frame that is in there. A busy client sends lots of small frames, and one read for many of them
+    // is a lot cheaper than two reads (header + body) for each one.
+    // A frame that is only partly there stays at the front of the buffer until the rest arrives.
+    // The buffer is borrowed from state_ (see ServerState::borrow_read_buffer()): whenever everything in it has been handled, we give
+    // it back and wait for the client to send more WITHOUT a buffer (transport_->wait_readable()). Most clients are quiet most of
+    // the time, so most sessions don't have one.
+    awaitable<void> reader()
+    {
+        boost::system::error_code ec;
+        std::size_t start = 0; // First byte we haven't handled yet.
+        std::size_t end = 0;   // One past the last byte we have read.
+
+        while (!stopped_)
+        {
+            // Handle every complete frame we have.
+            protocol::MessageType type;
+            bool compressed = false;
+            std::size_t body_length = 0;
+            bool broken = false;
+            while (end - start >= protocol::header_length)
+            {
+                if (!protocol::parse_header(read_buffer_.data() + start, type, compressed, body_length))
+                {
+                    broken = true;
+                    break;
+                }
+                if (end - start < protocol::header_length + body_length)
+                {
+                    break; // The rest of this frame hasn't arrived yet.
+                }
+
+                // Messages that get copied to everyone are charged to the rate limits. If the client is over its limit,
+                // we handle this message and then stop reading for a while before the next one - see rate_limit.hpp.
+                auto wait = TokenBucket::Clock::duration::zero();
+                if (type == protocol::MessageType::chat || type == protocol::MessageType::file_offer || type == protocol::MessageType::direct)
+                {
+                    wait = take_tokens(body_length);
+                }
+
+                // A compressed body is unpacked into inflated_ first. Only clients that agreed to compression may send one.
+                std::string_view body(read_buffer_.data() + start + protocol::header_length, body_length);
+                if (compressed)
+                {
+                    if (!compression_ || !state_.codec.decompress(body, inflated_))
+                    {
+                        broken = true;
+                        break;
+                    }
+                    body = std::string_view(inflated_.data(), inflated_.size());
+                }
+
+                start += protocol::header_length + body_length;
+                if (!handle_frame(type, body) || stopped_)
+                {
+                    broken = true;
+                    break;
+                }
+
+                if (wait > TokenBucket::Clock::duration::zero() || (upload_ && upload_->busy()))
+                {
+                    // We won't read while we wait, so the buffer goes back to the pool - a crowd of throttled senders mustn't
+                    // hold on to them all. The frames we've already read and not handled yet wait in unread_ (just their size),
+                    // and go into a freshly borrowed buffer afterwards.
+                    unread_.assign(read_buffer_.data() + start, end - start);
+                    state_.give_back_read_buffer(read_buffer_);
+                    if (wait > TokenBucket::Clock::duration::zero())
+                    {
+                        co_await slow_down(wait, throttle_timer_);
+                    }
+                    if (upload_ && upload_->busy() && !stopped_)
+                    {
+                        co_await wait_for_disk();
+                    }
+                    if (stopped_)
+                    {
+                        broken = true;
+                        break;
+                    }
+                    read_buffer_ = state_.borrow_read_buffer();
+                    read_buffer_.resize(std::max(read_buffer_.size(), unread_.size()));
+                    std::memcpy(read_buffer_.data(), unread_.data(), unread_.size());
+                    start = 0;
+                    end = unread_.size();
+                    std::string().swap(unread_);
+                }
+            }
+            if (broken)
+            {
+                break;
+            }
+
+            // Move the unfinished frame (if any) to the front, and make room for it if it's bigger than the buffer.
+            if (start > 0)
+            {
+                std::memmove(read_buffer_.data(), read_buffer_.data() + start, end - start);
+                end -= start;
+                start = 0;
+            }
+            if (end >= protocol::header_length)
+            {
+                read_buffer_.resize(std::max(read_buffer_.size(), protocol::header_length + body_length));
+            }
+
+            if (end == 0)
+            {
+                state_.give_back_read_buffer(read_buffer_);
+                release_idle_memory(inflated_);
+                co_await transport_->wait_readable(ec);
+                if (ec || stopped_)
+                {
+                    break;
+                }
+                read_buffer_ = state_.borrow_read_buffer();
+            }
+
+            // Read what's there. If there's nothing after all (only part of a TLS record has arrived, say), wait and try again -
+            // see the note at the top of transport.hpp for why the transport doesn't do that waiting itself.
+            Transport::Wait wait;
+            std::size_t length = transport_->read_some(boost::asio::buffer(read_buffer_.data() + end, read_buffer_.size() - end), wait, ec);
+            while (ec == boost::asio::error::would_block && !stopped_)
+            {
+                co_await transport_->wait(wait, ec);
+                length = transport_->read_some(boost::asio::buffer(read_buffer_.data() + end, read_buffer_.size() - end), wait, ec);
+            }
+            if (ec || stopped_)
+            {
+                break;
+            }
+            end += length;
+            last_heard_ = state_.wheel.ticks();
+        }
+
+        state_.give_back_read_buffer(read_buffer_);
+        stop();
+    }
+
+    // A scratch buffer that grew for something big is freed once it's done - a session that had one busy moment shouldn't keep
+    // that memory for as long as it stays connected. Small ones are kept, so ordinary chat doesn't allocate every time.
+    template <typename Buffer>
+    static void release_idle_memory(Buffer &buffer)
+    {
+        if (buffer.capacity() > idle_buffer_capacity)
+        {
+            Buffer().swap(buffer);
+        }
+    }
+
+    // ---------------------------------- //
+    // A shared memory ring from a publisher on this machine - see shm_ring.hpp. ring_attach came in on the local socket, with the
+    // ring's memory and eventfd attached. The ring is read by its own coroutine, next to reader(): frames from the two aren't in
+    // any particular order with each other. Only chat lines may come through the ring, and the same rate limits apply.
+    bool handle_ring_attach()
+    {
+#if defined(SHM_RING_SUPPORTED)
+        int memory = transport_->take_descriptor();
+        int wake = transport_->take_descriptor();
+        if (memory < 0 || wake < 0 || ring_)
+        {
+            // Whichever descriptors did come are ours now - close those, but not a -1 that never arrived.
+            for (int fd : {memory, wake})
+            {
+                if (fd >= 0)
+                {
+                    ::close(fd);
+                }
+            }
+            return false;
+        }
+        auto ring = std::make_unique<shm_ring::Reader>(memory);
+        if (!ring->ok())
+        {
+            ::close(wake);
+            send_notice("That ring can't be used (it has to be sealed against shrinking - see shm_ring.hpp).");
+            return true;
+        }
+        ring_ = std::move(ring);
+        ring_wake_ = std::make_unique<boost::asio::posix::stream_descriptor>(transport_->executor(), wake);
+        ring_timer_ = std::make_unique<boost::asio::steady_timer>(transport_->executor());
+        boost::asio::co_spawn(transport_->executor(), [self = shared_from_this()]()
+                              { return self->ring_reader(); },
+                              boost::asio::detached);
+        std::cout << client_name_ << " attached a shared memory ring." << std::endl << std::endl;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+#if defined(SHM_RING_SUPPORTED)
+    awaitable<void> ring_reader()
+    {
+        boost::system::error_code ec;
+        std::uint64_t wakeups = 0;
+        while (!stopped_)
+        {
+            // Up to max_ring_frames at a time - then we let the other sessions have a go before carrying on.
+            std::size_t handled = 0;
+            bool broken = false;
+            protocol::MessageType type;
+            std::string_view body;
+            while (handled < max_ring_frames && !stopped_)
+            {
+                auto result = ring_->peek(type, body);
+                if (result == shm_ring::Reader::Result::empty)
+                {
+                    break;
+                }
+                if (result == shm_ring::Reader::Result::broken || type != protocol::MessageType::chat)
+                {
+                    broken = true;
+                    break;
+                }
+                auto wait = take_tokens(body.size());
+                bool ok = handle_frame(type, body);
+                ring_->pop();
+                ++handled;
+                if (!ok)
+                {
+                    broken = true;
+                    break;
+                }
+                if (wait > TokenBucket::Clock::duration::zero())
+                {
+                    co_await slow_down(wait, *ring_timer_);
+                }
+            }
+            if (broken)
+            {
+                std::cout << client_name_ << " wrote something into its ring that isn't a chat line - closing the connection." << std::endl << std::endl;
+                break;
+            }
+            if (handled == max_ring_frames)
+            {
+                co_await boost::asio::post(state_.executor, use_awaitable);
+                continue;
+            }
+
+            // Empty. Tell the publisher to wake us, and wait - unless something arrived just now.
+            if (stopped_ || !ring_->prepare_to_sleep())
+            {
+                continue;
+            }
+            co_await ring_wake_->async_read_some(boost::asio::buffer(&wakeups, sizeof(wakeups)), redirect_error(use_awaitable, ec));
+            if (ec)
+            {
+                break;
+            }
+        }
+        stop();
+    }
+#endif
+
+    // Takes the tokens for one message from this session's buckets, and from the ones for its name and IP address.
+    // Returns how long we should stop reading for - the longest wait of them all.
+    TokenBucket::Clock::duration take_tokens(std::size_t size)
+    {
+        auto now = TokenBucket::Clock::now();
+        const auto &limits = state_.limits;
+        auto wait = session_buckets_.take(limits.session_messages, limits.session_bytes, size, now);
+        if (name_buckets_)
+        {
+            wait = std::max(wait, name_buckets_->take(limits.name_messages, limits.name_bytes, size, now));
+        }
+        if (ip_buckets_)
+        {
+            wait = std::max(wait, ip_buckets_->take(limits.ip_messages, limits.ip_bytes, size, now));
+        }
+        return wait;
+    }
+
+    // We just don't read from the socket for a while. The client's messages pile up in the socket buffers, not in our memory.
+    // (Or in its shared memory ring - that one waits on its own timer, see ring_reader().)
+    awaitable<void> slow_down(TokenBucket::Clock::duration wait, boost::asio::steady_timer &timer)
+    {
+        ++state_.throttled_messages;
+        if (!throttled_)
+        {
+            throttled_ = true;
+            std::cout << client_name_ << " (" << address_ << ") is sending too fast - slowing them down. "
+                      << state_.throttled_messages << " message(s) slowed down so far." << std::endl;
+        }
+
+        boost::system::error_code ec;
+        timer.expires_after(wait);
+        co_await timer.async_wait(redirect_error(use_awaitable, ec));
+        last_heard_ = state_.wheel.ticks(); // We weren't listening - that's not the client's fault.
+    }
+
+    // The disk thread is behind with this client's upload (see AttachmentStore::Upload) - we stop reading until it has caught up.
+    // The timer never goes off by itself: the upload cancels it when it's ready (and stop() does, if the client goes).
+    awaitable<void> wait_for_disk()
+    {
+        boost::system::error_code ec;
+        throttle_timer_.expires_at(boost::asio::steady_timer::time_point::max());
+        upload_->when_ready([self = shared_from_this()]()
+                            { self->throttle_timer_.cancel(); });
+        co_await throttle_timer_.async_wait(redirect_error(use_awaitable, ec));
+        last_heard_ = state_.wheel.ticks(); // We weren't listening - that's not the client's fault.
+    }
+
+    // This is where we decide what to do with each message the client sends us.
+    // Returns false if the client sent something broken - the session is then closed.
+    bool handle_frame(protocol::MessageType type, std::string_view body)
+    {
+        using protocol::MessageType;
+
+        if (client_name_.empty() && type != MessageType::hello)
+        {
+            return false; // The name always comes first.
+        }
+
+        switch (type)
+        {
+        case MessageType::hello:
+            return handle_hello(body);
+
+        case MessageType::chat:
+            // '\n', not std::endl: endl also flushes, which is a write() system call for every line anybody sends.
+            // The line goes out with the next flush instead (a full buffer, or the next std::endl - a join, a leave).
+            std::cout << "[" << client_name_ << "]: " << body << '\n';
+            broadcast(body);
+            return true;
+
+        case MessageType::file_offer:
+            return handle_file_offer(body);
+
+        case MessageType::file_chunk:
+            return handle_file_chunk(body);
+
+        case MessageType::file_request:
+            return handle_file_request(body);
+
+        case MessageType::direct:
+            return handle_direct(body);
+
+        case MessageType::who:
+            return handle_who(body);
+
+        case MessageType::peer_info:
+            return handle_peer_info(body);
+
+        case MessageType::peer_request:
+            return handle_peer_request(body);
+
+        case MessageType::event:
+            return handle_event(body);
+
+        case MessageType::ring_attach:
+            return handle_ring_attach();
+
+        case MessageType::ping:
+            deliver(protocol::make_frame(MessageType::pong, std::string(body)));
+            return true;
+
+        case MessageType::pong:
+            handle_pong(body);
+            return true;
+
+        default:
+            return false;
+        }
+    }
+
+    // The hello frame has the client's name, the optional features it supports and the ID of the dictionary it already has.
+    // We answer with a welcome frame saying which features are switched on. If the client doesn't have our dictionary,
+    // we send it along - it's only a few KB and the client keeps it for next time.
+    bool handle_hello(std::string_view body)
+    {
+        protocol::Reader reader(body);
+        auto name = reader.str();
+        auto features = reader.u32();
+        auto client_dictionary_id = reader.u32();
+        auto resume_run_id = reader.u64();
+        auto resume_after = reader.u64();
+        if (!client_name_.empty() || !reader.ok() || name.empty() || name.size() > protocol::max_name_length)
+        {
+            return false; // A name goes into the name index, every roster and every names frame - a huge one would be copied to everybody.
+        }
+
+        client_name_ = std::string(name);
+        name_buckets_ = ServerState::share_buckets(state_.name_buckets, client_name_);
+        state_.add_name(client_name_, this);
+        std::cout << "Client name received: " << client_name_ << std::endl;
+        std::cout << "Welcome " << client_name_ << std::endl << std::endl;
+
+        std::uint32_t enabled = features & protocol::feature_zstd;
+        std::uint32_t dictionary_id = compression::dictionary_id(state_.dictionary);
+        if ((features & protocol::feature_datagrams) && state_.datagrams)
+        {
+            auto secret = transport_->datagram_secret();
+            if (!secret.identity.empty() && state_.by_datagram_identity.emplace(secret.identity, this).second)
+            {
+                datagram_identity_ = secret.identity;
+                state_.datagrams->expect(secret);
+                enabled |= protocol::feature_datagrams;
+            }
+        }
+
+        std::string welcome;
+        protocol::Writer writer(welcome);
+        writer.u32(enabled);
+        writer.u32(dictionary_id);
+        writer.u64(state_.run_id);
+        writer.u64(state_.last_sequence);
+        if ((enabled & protocol::feature_zstd) && dictionary_id != 0 && client_dictionary_id != dictionary_id)
+        {
+            writer.raw(state_.dictionary);
+        }
+
+        // The welcome itself is never compressed - the client can't decompress anything until it has read it.
+        deliver(protocol::make_frame(protocol::MessageType::welcome, std::move(welcome)));
+        compression_ = (enabled & protocol::feature_zstd) != 0;
+
+        // Who the sender numbers in the history are - before any of the history, so every line can be shown with its name.
+        for (const auto &cached : state_.names_snapshot())
+        {
+            deliver(compression_ && cached.compressed ? cached.compressed : cached.frame);
+        }
+
+        if (resume_run_id != 0)
+        {
+            replay_history(resume_run_id, resume_after);
+        }
+
+        // Who is online. Everything that changes after this comes in the next presence update - see Server::flush_presence().
+        for (const auto &cached : state_.roster_snapshot())
+        {
+            deliver(compression_ && cached.compressed ? cached.compressed : cached.frame);
+        }
+        return true;
+    }
+
+    // A client that is reconnecting gets everything it missed since resume_after - as long as we still have it.
+    // This runs before the session is ready(), and the server has only one thread, so no new message can slip in between
+    // the replay and the live messages: the client gets each message exactly once.
+    void replay_history(std::uint64_t resume_run_id, std::uint64_t resume_after)
+    {
+        if (resume_run_id != state_.run_id)
+        {
+            send_notice("The server restarted while you were away - messages sent in between are lost.");
+            return;
+        }
+
+        auto &history = state_.history;
+        if (!history.empty() && history.front().sequence > resume_after + 1)
+        {
+            send_notice(std::to_string(history.front().sequence - resume_after - 1) + " older messages were missed while you were away.");
+        }
+
+        for (const auto &entry : history)
+        {
+            if (entry.sequence > resume_after && entry.skip_name != client_name_)
+            {
+                send(entry.frame);
+            }
+        }
+    }
+
+    // ---------------------------------- //
+    // Private messages. The name index (ServerState::by_name) takes us straight to the recipient - one hash lookup,
+    // however many people are online. Private messages aren't numbered or kept in the history, so they're only
+    // delivered to people who are online right now.
+    bool handle_direct(std::string_view body)
+    {
+        protocol::Reader reader(body);
+        auto recipient = std::string(reader.str());
+        auto text = reader.rest();
+        if (!reader.ok() || recipient.empty())
+        {
+            return false;
+        }
+
+        auto it = state_.by_name.find(recipient);
+        if (it == state_.by_name.end())
+        {
+            send_notice("Nobody called " + recipient + " is online.");
+            return true;
+        }
+
+        std::string message;
+        protocol::Writer writer(message);
+        writer.str(client_name_);
+        writer.raw(text);
+        auto frame = protocol::make_frame(protocol::MessageType::direct, std::move(message));
+        for (Session *session : it->second)
+        {
+            session->send(frame);
+        }
+        return true;
+    }
+
+    // ---------------------------------- //
+    // Direct connections (see peer.hpp). We never carry that traffic ourselves - we just tell two clients how to find each other.
+
+    // "I take direct connections on this port, and my certificate has this fingerprint."
+    bool handle_peer_info(std::string_view body)
+    {
+        protocol::Reader reader(body);
+        auto port = reader.u16();
+        auto fingerprint = reader.hash();
+        if (!reader.ok())
+        {
+            return false;
+        }
+        peer_port_ = port;
+        peer_fingerprint_ = fingerprint;
+        return true;
+    }
+
+    // "Introduce me to <name>." Both of them get a peer_intro about the other one: the one who asked connects, and the other one
+    // now knows which fingerprint to expect. The address is the one WE see them connecting from - on a home network behind a router
+    // that usually won't take incoming connections, and then the clients simply carry on through us.
+    // If either side can't take direct connections, the one who asked gets an intro with port 0, meaning "use the server".
+    bool handle_peer_request(std::string_view body)
+    {
+        protocol::Reader reader(body);
+        auto name = std::string(reader.str());
+        if (!reader.ok())
+        {
+            return false;
+        }
+
+        Session *target = nullptr;
+        auto it = state_.by_name.find(name);
+        if (it != state_.by_name.end())
+        {
+            for (Session *session : it->second)
+            {
+                if (session->peer_port_ != 0 && session != this)
+                {
+                    target = session; // The newest connection with that name wins.
+                }
+            }
+        }
+
+        if (!target || peer_port_ == 0)
+        {
+            send(peer_intro(name, "", 0, protocol::Hash{}));
+            return true;
+        }
+        // The target's intro goes first, so it is (almost always) there before our client's connection arrives.
+        target->send(peer_intro(client_name_, address_, peer_port_, peer_fingerprint_));
+        send(peer_intro(name, target->address_, target->peer_port_, target->peer_fingerprint_));
+        return true;
+    }
+
+    static std::shared_ptr<const protocol::Frame> peer_intro(std::string_view name, std::string_view host, std::uint16_t port, const protocol::Hash &fingerprint)
+    {
+        std::string body;
+        protocol::Writer writer(body);
+        writer.str(name);
+        writer.str(host);
+        writer.u16(port);
+        writer.hash(fingerprint);
+        return protocol::make_frame(protocol::MessageType::peer_intro, std::move(body));
+    }
+
+    // The who reply is one page of the roster: u32 how many are online, u32 this page, u32 how many pages, u16 names on this page, the names.
+    // Pages keep the reply small however big the room gets.
+    bool handle_who(std::string_view body)
+    {
+        protocol::Reader reader(body);
+        std::size_t page = reader.u32();
+        if (!reader.ok())
+        {
+            return false;
+        }
+
+        const auto &roster = state_.roster();
+        std::size_t pages = std::max<std::size_t>(1, (roster.size() + protocol::who_page_size - 1) / protocol::who_page_size);
+        page = std::min(page, pages - 1);
+        std::size_t first = page * protocol::who_page_size;
+        std::size_t last = std::min(roster.size(), first + protocol::who_page_size);
+
+        std::string reply;
+        protocol::Writer writer(reply);
+        writer.u32(static_cast<std::uint32_t>(roster.size()));
+        writer.u32(static_cast<std::uint32_t>(page));
+        writer.u32(static_cast<std::uint32_t>(pages));
+        writer.u16(static_cast<std::uint16_t>(last - first));
+        for (std::size_t i = first; i < last; ++i)
+        {
+            writer.str(roster[i]);
+        }
+        send(protocol::make_frame(protocol::MessageType::who, std::move(reply)));
+        return true;
+    }
+
+    // ---------------------------------- //
+    // Heartbeats. This runs off the timing wheel every heartbeat_interval (and once at login_timeout, before that).
+    // If we haven't heard ANYTHING from the client for heartbeat_timeout, it's gone (a pulled network cable never sends a "goodbye"),
+    // so we close the session. If it has been quiet for heartbeat_interval we send a ping, to make it say something.
+    // The client watches for the same thing from its end, so we also ping when WE haven't sent it anything for that long.
+    // A connection with something going both ways doesn't need one - with 100,000 connections that would be 100,000 frames
+    // every interval for nothing. Except now and then (rtt_sample_interval): the pong tells us the round trip time, for /clients.
+    void heartbeat()
+    {
+        auto self(shared_from_this()); // stop() takes us out of sessions_ - this keeps us alive until we return.
+
+        if (!ready())
+        {
+            std::cout << "A client didn't log in within " << login_timeout.count() << " seconds - disconnecting it." << std::endl;
+            stop();
+            return;
+        }
+
+        auto quiet = (state_.wheel.ticks() - last_heard_) * state_.wheel.tick();
+        auto silent = (state_.wheel.ticks() - last_sent_) * state_.wheel.tick();
+        if (quiet >= protocol::heartbeat_timeout)
+        {
+            std::cout << client_name_ << " stopped answering - disconnecting." << std::endl;
+            stop();
+            return;
+        }
+
+        if (quiet >= protocol::heartbeat_interval && silent >= protocol::heartbeat_interval)
+        {
+            // Nothing has gone either way for a while - TLS doesn't need its buffers for that (see TlsTransport).
+            transport_->release_buffers();
+        }
+
+        auto now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch());
+        bool sample_rtt = rtt_.count() == 0 || now - last_ping_ >= rtt_sample_interval;
+        if (quiet >= protocol::heartbeat_interval || silent >= protocol::heartbeat_interval || sample_rtt)
+        {
+            std::string body;
+            protocol::Writer(body).u64(static_cast<std::uint64_t>(now.count()));
+            deliver(protocol::make_frame(protocol::MessageType::ping, std::move(body)));
+            last_ping_ = now;
+        }
+
+        state_.wheel.schedule(heartbeat_timer_, protocol::heartbeat_interval);
+    }
+
+    // The pong carries the time we sent the ping, so the round trip time is just "now - then".
+    // We smooth it the same way TCP does (7/8 old + 1/8 new) so one slow pong doesn't throw the number all over the place.
+    void handle_pong(std::string_view body)
+    {
+        protocol::Reader reader(body);
+        auto sent = std::chrono::microseconds(reader.u64());
+        auto now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch());
+        if (!reader.ok() || sent > now)
+        {
+            return;
+        }
+        auto sample = now - sent;
+        rtt_ = rtt_.count() == 0 ? sample : (rtt_ * 7 + sample) / 8;
+
+        // For an idle client the ping and this pong were all that went through - and they made TLS take its buffers again.
+        // A busy one only gets a ping now and then (rtt_sample_interval), so giving them back here costs it next to nothing.
+        if (write_queue_.empty())
+        {
+            transport_->release_buffers();
+        }
+    }
+
+    // This function broadcasts data to all the clients that are connected to the server.
+    // It goes through all the sessions that are currently connected to the server.
+    // If the session is not the current session, it writes the data to the session.
+    // The data is written to the session using the deliver function, which queues it up behind anything else that session is still sending.
+    // The frame is built only once - every session gets a shared_ptr to the very same bytes.
+    // The same goes for compression: the first session that wants it compressed causes it to be compressed, and everyone after that re-uses the result.
+
+    /* Sunday 02 March 2025 0048 - in the newer version, I add the clients name when they send a message. */
+    /*
+    void broadcast(std::size_t length)
+    {
+        for (auto &session : sessions_)
+        {
+            // We check if the session is not the current session.
+            // If it's not the current session, we write the data to the session.
+            if (session != shared_from_this())
+            {
+                session->write(data_, length);
+            }
+        }
+    }
+    */
+
+    // This new version of the broadcast function adds who sent the message - as their sender number (see ServerState::senders),
+    // not their name. If this is the first thing they've said, everybody is told the number first.
+    void broadcast(std::string_view message)
+    {
+        bool is_new = false;
+        std::uint32_t id = state_.sender_id(client_name_, is_new);
+        if (is_new)
+        {
+            broadcast_frame(state_.names_frame(id), true);
+        }
+        publish(protocol::MessageType::chat, id, {message}, false);
+
+        // Chat lines go to the other servers in the mesh too - with the name, because our numbers mean nothing over there.
+        // Files stay on the server they were shared on, so their announcements don't.
+        if (state_.federation)
+        {
+            std::string body;
+            protocol::Writer writer(body);
+            writer.str(client_name_);
+            writer.raw(message);
+            state_.federation->forward(state_.last_sequence, protocol::MessageType::chat, body);
+        }
+    }
+
+    // Chat messages and file announcements go through here: they get an envelope with the next sequence number in front of the body
+    // (see protocol::Envelope), are remembered in the history (for clients that reconnect) and are broadcast.
+    // The body comes in pieces that are written straight into a recycled frame (see protocol::new_frame()),
+    // instead of being glued together in a string first and then copied again. In the steady state a chat line
+    // doesn't allocate anything from here to the other sessions' write queues - allocation_test.cpp checks that.
+    void publish(protocol::MessageType type, std::uint32_t sender, std::initializer_list<std::string_view> body, bool include_self)
+    {
+        auto frame = protocol::new_frame();
+        protocol::Writer writer(frame->body);
+        protocol::write_envelope(writer, ++state_.last_sequence, sender);
+        for (auto piece : body)
+        {
+            writer.raw(piece);
+        }
+        protocol::seal_frame(*frame, type);
+
+        state_.append_history(state_.last_sequence, include_self ? std::string_view() : client_name_, frame, false, sender);
+
+        broadcast_frame(frame, include_self);
+    }
+
+    void broadcast_frame(const std::shared_ptr<const protocol::Frame> &frame, bool include_self)
+    {
+        std::shared_ptr<const protocol::Frame> compressed;
+        bool tried_compressing = false;
+
+        for (auto &session : sessions_)
+        {
+            // If the session is not the current session, write the frame to the session.
+            // Sessions that haven't finished the handshake and sent their name yet are skipped.
+            if (session->ready() && (include_self || session.get() != this))
+            {
+                if (session->compression() && !tried_compressing)
+                {
+                    compressed = state_.codec.compress(*frame);
+                    tried_compressing = true;
+                }
+                session->deliver(session->compression() && compressed ? compressed : frame);
+            }
+        }
+    }
+
+    // Send a frame to just this client - compressed if we agreed to that and it makes the frame smaller.
+    // Returns true if it went out compressed.
+    bool send(const std::shared_ptr<const protocol::Frame> &frame)
+    {
+        if (compression_)
+        {
+            if (auto compressed = state_.codec.compress(*frame))
+            {
+                deliver(std::move(compressed));
+                return true;
+            }
+        }
+        deliver(frame);
+        return false;
+    }
+
+    // ---------------------------------- //
+    // File sharing.
+    //
+    // 1. The client sends file_offer with the hash, size and name of the file. The AttachmentStore looks it up on its disk thread.
+    // 2. If the AttachmentStore already has that hash, nothing needs uploading - we reply "stored" and announce it straight away.
+    //    Otherwise we reply "upload" and the client sends the file as file_chunk frames.
+    // 3. Once the last chunk is in and the hash checks out, we reply "stored" and announce the file to everyone.
+    // 4. Anyone can then send file_request with the hash, and we stream the file back out of a memory mapping.
+
+    void send_file_status(const protocol::Hash &hash, protocol::FileStatus status)
+    {
+        std::string body;
+        protocol::Writer writer(body);
+        writer.hash(hash);
+        writer.u8(static_cast<std::uint8_t>(status));
+        send(protocol::make_frame(protocol::MessageType::file_status, std::move(body)));
+    }
+
+    void send_notice(const std::string &text)
+    {
+        send(protocol::make_frame(protocol::MessageType::notice, text));
+    }
+
+    bool handle_file_offer(std::string_view body)
+    {
+        protocol::Reader reader(body);
+        auto hash = reader.hash();
+        auto size = reader.u64();
+        auto file_name = reader.str();
+        auto recipient = reader.rest().empty() ? std::string_view() : reader.str(); // Only there for a private file - see announce_file().
+        if (!reader.ok())
+        {
+            return false;
+        }
+
+        if (upload_ || offering_)
+        {
+            send_file_status(hash, protocol::FileStatus::rejected);
+            send_notice("Please wait for your current upload to finish before sharing another file.");
+            return true;
+        }
+
+        if (size > AttachmentStore::max_attachment_size)
+        {
+            send_file_status(hash, protocol::FileStatus::rejected);
+            send_notice("That file is too big to share.");
+            return true;
+        }
+
+        // The answer comes back later, on the io thread - until then another offer is turned away like one during an upload.
+        offering_ = true;
+        attachments_.offer(hash, size,
+                           [self = shared_from_this(), hash, size, name = std::string(file_name), recipient = std::string(recipient)](bool stored, std::unique_ptr<AttachmentStore::Upload> upload) mutable
+                           {
+                               self->offering_ = false;
+                               if (self->stopped_)
+                               {
+                                   return;
+                               }
+                               self->handle_offer_result(hash, size, std::move(name), std::move(recipient), stored, std::move(upload));
+                           });
+        return true;
+    }
+
+    void handle_offer_result(const protocol::Hash &hash, std::uint64_t size, std::string file_name, std::string recipient,
+                             bool stored, std::unique_ptr<AttachmentStore::Upload> upload)
+    {
+        if (stored)
+        {
+            // Somebody already shared this exact file - no need to send the bytes again.
+            std::cout << client_name_ << " re-shared " << file_name << " (already stored)" << std::endl;
+            send_file_status(hash, protocol::FileStatus::stored);
+            announce_file(hash, size, file_name, recipient);
+            return;
+        }
+
+        if (!upload)
+        {
+            send_file_status(hash, protocol::FileStatus::rejected);
+            send_notice("The server couldn't store the file.");
+            return;
+        }
+
+        upload_ = std::move(upload);
+        upload_name_ = std::move(file_name);
+        upload_recipient_ = std::move(recipient);
+        send_file_status(hash, protocol::FileStatus::upload);
+
+        if (size == 0)
+        {
+            finish_upload();
+        }
+    }
+
+    bool handle_file_chunk(std::string_view body)
+    {
+        protocol::Reader reader(body);
+        auto hash = reader.hash();
+        reader.u64(); // Total size - we already know it from the offer.
+        auto offset = reader.u64();
+        if (!reader.ok() || !upload_ || hash != upload_->hash() || !upload_->write(offset, reader.rest()))
+        {
+            return false;
+        }
+
+        if (upload_->complete())
+        {
+            finish_upload();
+        }
+        return true;
+    }
+
+    // The AttachmentStore finishes the file on its disk thread and calls us back here once it's stored (or not).
+    // The lambda holds a shared_ptr to the session, so it's still there by then even if the client has left.
+    void finish_upload()
+    {
+        auto hash = upload_->hash();
+        auto size = upload_->size();
+        attachments_.finish_upload(std::move(upload_),
+                                   [self = shared_from_this(), hash, size, name = std::move(upload_name_), recipient = std::move(upload_recipient_)](bool stored)
+                                   {
+                                       if (stored)
+                                       {
+                                           std::cout << self->client_name_ << " shared " << name << " (" << size << " bytes)" << std::endl;
+                                           self->send_file_status(hash, protocol::FileStatus::stored);
+                                           self->announce_file(hash, size, name, recipient);
+                                       }
+                                       else
+                                       {
+                                           self->send_file_status(hash, protocol::FileStatus::rejected);
+                                           self->send_notice("The uploaded file didn't match its hash, so it was thrown away.");
+                                       }
+                                   });
+    }
+
+    // Tell everyone (including the sender, so they know it worked) that a file is available.
+    // Each announcement is one "post" - it holds a reference on the stored file until it expires.
+    // A private file (a /sendto that couldn't go over a direct connection) is only announced to the recipient and the sender.
+    // Like a private message it has no sequence number (0 in the envelope) and isn't kept in the history.
+    void announce_file(const protocol::Hash &hash, std::uint64_t size, std::string_view file_name, std::string_view recipient)
+    {
+        attachments_.add_post(hash);
+
+        std::string body;
+        protocol::Writer writer(body);
+        writer.hash(hash);
+        writer.u64(size);
+        writer.str(file_name);
+        writer.str(client_name_);
+        if (recipient.empty())
+        {
+            publish(protocol::MessageType::file_announce, 0, {body}, true);
+            return;
+        }
+
+        std::string unnumbered;
+        protocol::Writer envelope(unnumbered);
+        protocol::write_envelope(envelope, 0, 0);
+        unnumbered += body;
+        auto frame = protocol::make_frame(protocol::MessageType::file_announce, std::move(unnumbered));
+        send(frame);
+        auto it = state_.by_name.find(std::string(recipient));
+        if (it == state_.by_name.end())
+        {
+            send_notice("Nobody called " + std::string(recipient) + " is online.");
+            return;
+        }
+        for (Session *session : it->second)
+        {
+            session->send(frame);
+        }
+    }
+
+    bool handle_file_request(std::string_view body)
+    {
+        protocol::Reader reader(body);
+        auto hash = reader.hash();
+        if (!reader.ok())
+        {
+            return false;
+        }
+
+        auto mapping = attachments_.open(hash);
+        if (!mapping)
+        {
+            send_file_status(hash, protocol::FileStatus::rejected); // So the client stops waiting for it.
+            send_notice("The server doesn't have that file (any more).");
+            return true;
+        }
+
+        downloads_.push_back(Download{hash, std::move(mapping), 0, compression_});
+        wake_writer(); // The writer() picks up the first chunk as soon as it has nothing else to send.
+        return true;
+    }
+
+    // Downloads are sent one chunk at a time, only when the write queue is empty.
+    // If we queued a whole 100 MB file in one go, chat messages would be stuck behind it until it was all sent.
+    // The chunk frame doesn't copy the file - its tail points straight into the memory mapping.
+    // If the client agreed to compression we try compressing each chunk. Lots of files (photos, zips, videos) are already compressed,
+    // so as soon as one chunk doesn't get smaller we stop trying for the rest of that file - no point burning CPU for nothing.
+    void queue_next_chunk()
+    {
+        if (downloads_.empty())
+        {
+            return;
+        }
+
+        auto &download = downloads_.front();
+        auto size = download.mapping->size();
+        auto length = std::min<std::uint64_t>(protocol::file_chunk_size, size - download.offset);
+
+        std::string body;
+        protocol::Writer writer(body);
+        writer.hash(download.hash);
+        writer.u64(size);
+        writer.u64(download.offset);
+
+        auto frame = protocol::make_frame(protocol::MessageType::file_chunk, std::move(body),
+                                          boost::asio::buffer(download.mapping->data() + download.offset, length),
+                                          download.mapping);
+
+        download.offset += length;
+        bool try_compressing = download.compressible;
+        bool finished = download.offset >= size;
+
+        if (try_compressing)
+        {
+            download.compressible = send(frame);
+        }
+        else
+        {
+            deliver(std::move(frame));
+        }
+
+        if (finished)
+        {
+            downloads_.pop_front();
+        }
+    }
+
+    // ---------------------------------- //
+
+    // Damn this VSCode is good - it's really good - I'm loving it - it's so good - it's really AWESOME! 😎
+
+    // This sends everything in write_queue_. When the queue is empty it tops it up with the next piece of any download,
+    // and if there is still nothing to send it waits on write_signal_ until deliver() wakes it up.
+    // Everything that is waiting goes out in ONE async_write (up to a limit) - when a busy room sends us 100 messages
+    // while the previous write was still going, that's one write instead of 100 (see protocol::stage_frames()).
+    // NOTE: writing no longer calls read() when it finishes. Calling read() from write() meant we could end up with two reads
+    // going at the same time on the same socket.
+    awaitable<void> writer()
+    {
+        boost::system::error_code ec;
+        bool yielded = false;
+
+        while (!stopped_)
+        {
+            if (write_queue_.empty())
+            {
+                queue_next_chunk();
+            }
+
+            if (write_queue_.empty() && !yielded)
+            {
+                // Before going to sleep, let the io_context run whatever else is ready first (usually other sessions reading messages).
+                // In a busy room those messages are mostly for us - so we wake up with a full queue and send it in one write,
+                // instead of going through a sleep + wake up for every single message.
+                yielded = true;
+                co_await boost::asio::post(state_.executor, use_awaitable);
+                continue;
+            }
+
+            if (write_queue_.empty())
+            {
+                yielded = false;
+                state_.give_back_write_staging(write_staging_);
+                release_idle_memory(write_buffers_);
+                if (write_queue_.capacity() > max_frames_per_write)
+                {
+                    write_queue_.set_capacity(initial_queue_capacity); // A download or a backlog made it big - it's over now.
+                }
+                writer_waiting_ = true;
+                co_await write_signal_.async_wait(redirect_error(use_awaitable, ec)); // "Fails" with operation_aborted when wake_writer() cancels it - that's the wake up.
+                writer_waiting_ = false;
+                continue;
+            }
+
+            if (write_staging_.capacity() <= std::string().capacity())
+            {
+                write_staging_ = state_.borrow_write_staging();
+            }
+            std::size_t frames = protocol::stage_frames(write_queue_, write_staging_, write_buffers_, max_frames_per_write, max_bytes_per_write);
+
+            // As much as the transport takes right away - usually all of it. When it's stuck (the client isn't reading fast
+            // enough) we wait for room and carry on from where it stopped. The loop is here and not in the transport so that
+            // there's no coroutine in between - see the note at the top of transport.hpp.
+            std::size_t total = boost::asio::buffer_size(write_buffers_);
+            std::size_t written = 0;
+            Transport::Wait wait;
+            while (written < total && !stopped_)
+            {
+                written += transport_->write_some(write_buffers_, written, wait, ec);
+                if (ec == boost::asio::error::would_block)
+                {
+                    co_await transport_->wait(wait, ec);
+                    ec = {}; // If the connection has gone, the next write_some() says so.
+                }
+                else if (ec)
+                {
+                    break;
+                }
+            }
+            if (ec || stopped_)
+            {
+                break;
+            }
+            write_queue_.erase_begin(frames);
+            yielded = false;
+        }
+
+        stop();
+    }
+
+    void wake_writer()
+    {
+        if (writer_waiting_)
+        {
+            write_signal_.cancel_one();
+        }
+    }
+
+    // We remove the session from the sessions vector and close the socket.
+    // Closing the socket makes any read or write that is still waiting finish with an error - the reader and writer then call stop() too,
+    // so we check stopped_ to make sure we only do this (and print the connected clients) once.
+    // Cancelling write_signal_ wakes the writer up if it was waiting, so it sees stopped_ and finishes.
+    void stop()
+    {
+        if (stopped_)
+        {
+            return;
+        }
+        stopped_ = true;
+
+        auto self(shared_from_this());
+        sessions_.erase(std::remove(sessions_.begin(), sessions_.end(), self), sessions_.end());
+
+        transport_->close();
+        write_signal_.cancel();
+        throttle_timer_.cancel();
+#if defined(SHM_RING_SUPPORTED)
+        if (ring_wake_)
+        {
+            boost::system::error_code ignored;
+            ring_wake_->close(ignored);
+            ring_timer_->cancel();
+        }
+#endif
+        heartbeat_timer_.cancel();
+        state_.remove_name(client_name_, this);
+        if (!datagram_identity_.empty())
+        {
+            state_.by_datagram_identity.erase(datagram_identity_);
+            state_.datagrams->forget(datagram_identity_);
+        }
+        ServerState::release_buckets(state_.name_buckets, client_name_, name_buckets_);
+        ServerState::release_buckets(state_.ip_buckets, address_, ip_buckets_);
+    }
+
+    // This is how we talk to the client - see transport.hpp.
+    // All complexities of the socket and SSL (or of the edge's link) are handled by this object.
+    std::unique_ptr<Transport> transport_;
+
+    // These are the buffers that are used to store the data that is read from the client.
+    // read_buffer_ is borrowed from state_ while there's something to read - see reader(). It's ServerState::read_buffer_size,
+    // and only grows if a single frame is bigger than that (a file chunk).
+    // Don't get mixed up with the socket buffeer, the socket buffer is a buffer that is used by the socket to store data that is read from the client.
+    std::vector<char> read_buffer_;
+    std::vector<char> inflated_; // Where compressed bodies get unpacked to.
+    std::string unread_;         // What was left in read_buffer_ while we were slowed down - see reader().
+    static constexpr std::size_t idle_buffer_capacity = 1024; // See release_idle_memory().
+
+    // Frames waiting to be written to this client - see deliver() and writer().
+    boost::circular_buffer<std::shared_ptr<const protocol::Frame>> write_queue_;
+    static constexpr std::size_t initial_queue_capacity = 16;
+    std::string write_staging_;
+    std::vector<boost::asio::const_buffer> write_buffers_;
+    boost::asio::steady_timer write_signal_;
+    bool writer_waiting_ = false;
+    static constexpr std::size_t max_frames_per_write = 256;
+    static constexpr std::size_t max_bytes_per_write = 64 * 1024;
+
+    // Flood protection - see take_tokens() and slow_down().
+    RateBuckets session_buckets_;
+    std::shared_ptr<RateBuckets> name_buckets_;
+    std::shared_ptr<RateBuckets> ip_buckets_;
+    std::string address_;
+    boost::asio::steady_timer throttle_timer_;
+    bool throttled_ = false; // So we only print "sending too fast" once per session.
+
+    ServerState &state_;
+
+    // See heartbeat(). last_heard_ and last_sent_ are in wheel ticks, rtt_ is the smoothed round trip time (0 until the first pong).
+    TimingWheel::Timer heartbeat_timer_{[this]()
+                                        { heartbeat(); }};
+    std::uint64_t last_heard_ = 0;
+    std::uint64_t last_sent_ = 0;
+    std::chrono::microseconds rtt_{0};
+    std::chrono::microseconds last_ping_{0}; // When we last sent a ping, in steady_clock time.
+    static constexpr std::chrono::seconds login_timeout{10};
+    static constexpr std::chrono::minutes rtt_sample_interval{5};
+
+    // This is a vector that holds all the sessions that are currently connected to the server.
+    // Theoretically, this vector should hold all the sessions that are currently connected to the server.
+    std::vector<std::shared_ptr<Session>> &sessions_;
+
+    AttachmentStore &attachments_;
+
+    // The file this client is uploading right now (if any) and the name they gave it.
+    std::unique_ptr<AttachmentStore::Upload> upload_;
+    std::string upload_name_;
+    std::string upload_recipient_; // Empty unless it's a private file.
+    bool offering_ = false;        // The AttachmentStore is still looking up the last file_offer.
+
+    // Files this client asked for that we are still sending.
+    struct Download
+    {
+        protocol::Hash hash;
+        std::shared_ptr<const AttachmentStore::Mapping> mapping;
+        std::uint64_t offset;
+        bool compressible; // Stays true while compressing the chunks is still making them smaller.
+    };
+    std::deque<Download> downloads_;
+
+    std::string client_name_; // Sunday 02 March 2025 0033 - I need to store the name of the client - this is a bit of a hack I think, I would prefer to pass in as an object
+
+    // Where other clients can connect to this one directly (0 = they can't) - see handle_peer_request().
+    std::uint16_t peer_port_ = 0;
+    protocol::Hash peer_fingerprint_{};
+
+    std::string datagram_identity_; // Empty unless this client uses the UDP side channel - see handle_hello().
+
+#if defined(SHM_RING_SUPPORTED)
+    // A shared memory ring, if this is a local publisher that attached one - see handle_ring_attach().
+    std::unique_ptr<shm_ring::Reader> ring_;
+    std::unique_ptr<boost::asio::posix::stream_descriptor> ring_wake_;
+    std::unique_ptr<boost::asio::steady_timer> ring_timer_;
+    static constexpr std::size_t max_ring_frames = 256;
+#endif
+
+    bool compression_ = false;
+    bool stopped_ = false;
+};
+
+// We create a server class.
+// The server class is a class that represents the server.
+// The server class is used to accept connections from clients and create a new session object for each client that connects.
+class Server
+{
+
+public:
+    // We create a constructor for the Server class.
+    // The constructor takes a boost::asio::io_context object, a boost::asio::ssl::context object and a short object as arguments.
+    // The boost::asio::io_context object is used to manage the I/O services.
+    // The boost::asio::ssl::context object is used to manage the SSL context.
+    // The short object is used to store the port number that the server listens on. short is a 16-bit integer - part of C++.
+    // The constructor initialises the acceptor_ member variable with the io_context object and the port number that is passed in as arguments.
+    // handed_over_socket and handed_over_state come from the server we are taking over from (see hot_restart.hpp) - or are -1 and empty
+    // for a normal start, in which case we open the port ourselves.
+    // federation says which other servers to link up with (see federation.hpp) - by default none.
+    // edge_port is where edge proxies link up with us (see edge.hpp), replication_port where hot standbys do (see replication.hpp) - 0 means we don't take any.
+    // A standby that takes over passes the state it kept in handed_over_state, with handed_over_socket -1 - it opens the port itself.
+    // datagrams switches on the UDP side channel (see datagram.hpp), on the same port number.
+    // local_path is a Unix domain socket for programs on this machine (see accept_local()) - empty means we don't make one.
+    Server(boost::asio::io_context &io_context, boost::asio::ssl::context &ssl_context, short port,
+           int handed_over_socket = -1, const std::string &handed_over_state = std::string(), const Federation::Options &federation = {},
+           unsigned short edge_port = 0, unsigned short replication_port = 0, bool datagrams = false, const std::string &local_path = std::string())
+        : io_context_(io_context), acceptor_(io_context), ssl_context_(ssl_context), state_(io_context, compression::load_dictionary()), // state_ is declared further below - this is why we can use here. In classes, you can declare something further down and use it before it's declared.
+          garbage_timer_(io_context), trim_timer_(io_context), accept_retry_timer_(io_context), reload_signals_(io_context), return_timer_(io_context), handover_timer_(io_context)
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+          ,
+          console_(io_context)
+#endif
+#if defined(HOT_RESTART_SUPPORTED)
+          ,
+          control_(io_context)
+#endif
+    {
+        std::string federation_state;
+        if (handed_over_socket >= 0)
+        {
+            // The listening socket is already open, bound and listening - clients may even be waiting in its queue.
+            acceptor_.assign(tcp::v4(), handed_over_socket);
+        }
+        else
+        {
+            // This is what the acceptor_(io_context, endpoint) constructor used to do for us.
+            tcp::endpoint endpoint(tcp::v4(), port);
+            acceptor_.open(endpoint.protocol());
+            acceptor_.set_option(tcp::acceptor::reuse_address(true));
+            acceptor_.bind(endpoint);
+            acceptor_.listen();
+        }
+        if (!handed_over_state.empty() && restore_state(handed_over_state, federation_state))
+        {
+            std::cout << "Took over from the previous server (" << state_.history.size() << " messages of history, TLS tickets kept)." << std::endl << std::endl;
+        }
+
+        std::cout << "Message server started. Ready to accept connections..." << std::endl << std::endl;
+
+        if (!state_.dictionary.empty())
+        {
+            std::cout << "Loaded compression dictionary " << compression::dictionary_path << " (" << state_.dictionary.size() << " bytes)." << std::endl << std::endl;
+        }
+
+        if (federation.enabled())
+        {
+            start_federation(federation, federation_state);
+        }
+
+        if (edge_port != 0)
+        {
+            edge_hub_ = std::make_unique<EdgeHub>(io_context_, edge_port, [this](std::unique_ptr<Transport> transport)
+                                                  { accept_from_edge(std::move(transport)); });
+        }
+
+        if (replication_port != 0)
+        {
+            replication_ = std::make_unique<Replication>(io_context_, replication_port, [this]()
+                                                         { return replication_snapshot(); });
+            state_.replication = replication_.get();
+        }
+
+        if (datagrams)
+        {
+            start_datagrams(static_cast<unsigned short>(port));
+        }
+
+        if (!local_path.empty())
+        {
+            listen_locally(local_path);
+        }
+
+        reload_blocklist();
+        reload_limits();
+#if defined(SIGHUP) // Windows doesn't have SIGHUP - there the list is only read at start up.
+        reload_signals_.add(SIGHUP);
+#endif
+        wait_for_reload_signal();
+
+        accept();
+        collect_garbage();
+        trim_heap();
+        listen_for_takeover(static_cast<unsigned short>(port));
+        read_console();
+        state_.wheel.schedule(presence_timer_, state_.wheel.tick());
+    }
+    // Can you remember and recall what the single : does above?
+    // The single : is used to initialise the member variables of the class.
+    // This is quite unique to C++ and is not found in other programming languages. I couldn't find any other languages that use this method.
+
+    // STOPPED HERE Wednesday 26 February 2025 1520 - need to read up on ssl_context_(ssl_context)
+
+    // A standby that has just taken over (see replication.hpp) knows who was online on the old server. Those people are about to
+    // reconnect, and nobody needs to hear that they "joined" - they never left. Whoever isn't back within return_window has left.
+    void expect_back(const std::set<std::string> &names)
+    {
+        expected_back_ = names;
+        return_timer_.expires_after(return_window);
+        return_timer_.async_wait(
+            [this](boost::system::error_code ec)
+            {
+                if (ec)
+                {
+                    return;
+                }
+                for (const auto &name : expected_back_)
+                {
+                    state_.note_presence(name, -1);
+                }
+                expected_back_.clear();
+            });
+    }
+
+private:
+    void accept()
+    {
+        // The acceptor_.async_accept function is an asynchronous function that accepts connections from clients.
+        // It sets up an asynchronous operation that waits for a client to connect and then calls the lambda function that is passed in as an argument.
+        // It only triggers when a client connects to the server or when an error occurs.
+        acceptor_.async_accept(
+            [this](boost::system::error_code ec, tcp::socket socket)
+            {
+                if (handing_over_ || ec == boost::asio::error::operation_aborted)
+                {
+                    return; // The new server accepts from now on - see hand_over(). The socket (if any) is simply closed.
+                }
+
+                // Usually "too many open files": every descriptor we're allowed is in use. The client stays in the listen queue, so
+                // calling accept() again straight away would just fail again straight away - a busy loop taking all the CPU, just
+                // when the server is at its busiest. So we wait a little (clients leaving free up descriptors) and try again.
+                if (ec)
+                {
+                    if (!accept_failing_)
+                    {
+                        std::cout << "Can't accept new connections (" << ec.message() << ") - trying again every "
+                                  << accept_retry_delay.count() << " ms." << std::endl << std::endl;
+                        accept_failing_ = true;
+                    }
+                    accept_retry_timer_.expires_after(accept_retry_delay);
+                    accept_retry_timer_.async_wait([this](boost::system::error_code ec)
+                                                   {
+                                                       if (!ec)
+                                                       {
+                                                           accept();
+                                                       } });
+                    return;
+                }
+                if (accept_failing_)
+                {
+                    std::cout << "Accepting new connections again." << std::endl << std::endl;
+                    accept_failing_ = false;
+                }
+
+                // Blocked addresses are turned away here, before we spend anything on them - no Session, no TLS handshake.
+                // We don't print anything either: when somebody is flooding us, printing a line per connection would cost more than the check.
+                boost::system::error_code endpoint_error;
+                auto remote = socket.remote_endpoint(endpoint_error);
+                if (endpoint_error || blocklist_->contains(remote.address()))
+                {
+                    ++blocked_connections_;
+                    socket.close(endpoint_error);
+                }
+                else
+                {
+                    std::cout << "New client connected!" << std::endl << std::endl;
+
+                    // We create a new session object for the client that has connected.
+                    // We use make_shared - make_shared is part of C++ and created a shared_pointer.
+                    Session::create(std::make_unique<TlsTransport>(std::move(socket), ssl_context_), state_)->start();
+                }
+
+                // This is what makes the server keep on accepting connections from clients.
+                // This loop sits within the io_context.run(); loop.
+                // Normally, recursion could cause a stack overflow - but in this case, it's safe because the accept function is called asynchronously.
+                // Boost.Asio and C++ are designed to handle this kind of asynchronous recursion efficiently and safely.
+                accept();
+            });
+        // The function doesn't loop indefinitely in a blocking manner and only sets up an asynchronous operation.
+        // The io_context.run() event loop manages the execution, ensuring the handler is called when a client connects.
+    }
+
+    // A client that connected to one of our edges (see edge.hpp). The edge has done the TLS handshake already - but the blocklist
+    // check is ours, with the client's own address that the edge passed on.
+    void accept_from_edge(std::unique_ptr<Transport> transport)
+    {
+        boost::system::error_code ec;
+        auto address = boost::asio::ip::make_address(transport->address(), ec);
+        if (handing_over_ || ec || blocklist_->contains(address))
+        {
+            if (!handing_over_)
+            {
+                ++blocked_connections_;
+            }
+            transport->close();
+            return;
+        }
+        std::cout << "New client connected (through an edge)!" << std::endl << std::endl;
+        Session::create(std::move(transport), state_)->start();
+    }
+
+    // ---------------------------------- //
+    // Programs on this machine (bots, scripts) - see LocalTransport in transport.hpp. They connect to a Unix domain socket,
+    // a file at local_path, and skip TLS. Two things decide who gets in:
+    // - the file's permissions: only our user and our group can open it (0660 - and the folder it's in has to let them get to it),
+    // - the peer's credentials: the operating system tells us which user is at the other end, and we check it again.
+    //   That second check still holds if somebody loosens the permissions by mistake.
+    void listen_locally(const std::string &path)
+    {
+#if defined(LOCAL_CLIENTS_SUPPORTED)
+        namespace local = boost::asio::local;
+        ::unlink(path.c_str()); // Left behind by the last server (a crash, or the one we've just taken over from).
+
+        boost::system::error_code ec;
+        local_acceptor_ = std::make_unique<local::stream_protocol::acceptor>(io_context_);
+        local_acceptor_->open(local::stream_protocol(), ec);
+        if (!ec)
+        {
+            auto old_mask = ::umask(0117); // The file is made 0660 straight away - there's no moment where anybody else could open it.
+            local_acceptor_->bind(local::stream_protocol::endpoint(path), ec);
+            ::umask(old_mask);
+        }
+        if (!ec)
+            local_acceptor_->listen(boost::asio::socket_base::max_listen_connections, ec);
+        if (ec)
+        {
+            std::cout << "Couldn't create the local socket " << path << ": " << ec.message() << std::endl << std::endl;
+            local_acceptor_.reset();
+            return;
+        }
+        std::cout << "Taking local clients on " << path << "." << std::endl << std::endl;
+        accept_local();
+#else
+        std::cout << "Local clients (" << path << ") need Linux or macOS - only TCP this time." << std::endl << std::endl;
+#endif
+    }
+
+#if defined(LOCAL_CLIENTS_SUPPORTED)
+    void accept_local()
+    {
+        local_acceptor_->async_accept(
+            [this](boost::system::error_code ec, boost::asio::local::stream_protocol::socket socket)
+            {
+                if (ec == boost::asio::error::operation_aborted || handing_over_)
+                {
+                    return;
+                }
+                if (!ec)
+                {
+                    auto credentials = peer_credentials(socket.native_handle());
+                    if (!credentials.known || !(credentials.uid == ::geteuid() || credentials.uid == 0 || credentials.gid == ::getegid()))
+                    {
+                        std::cout << "Refused a local client (uid " << credentials.uid << ") - it isn't our user or group." << std::endl << std::endl;
+                        boost::system::error_code ignored;
+                        socket.close(ignored);
+                    }
+                    else
+                    {
+                        std::cout << "New local client connected (uid " << credentials.uid << ")!" << std::endl << std::endl;
+                        Session::create(std::make_unique<LocalTransport>(std::move(socket), credentials), state_)->start();
+                    }
+                }
+                accept_local();
+            });
+    }
+#endif
+
+    // Once an hour we let the AttachmentStore throw away shared files that nobody has posted for a while.
+    // Same trick as accept() - the timer handler sets the timer up again, so this keeps going for as long as the server runs.
+    void collect_garbage()
+    {
+        garbage_timer_.expires_after(std::chrono::hours(1));
+        garbage_timer_.async_wait(
+            [this](boost::system::error_code ec)
+            {
+                if (!ec)
+                {
+                    // The AttachmentStore looks through its folders on its own thread and tells us how it went when it's done.
+                    state_.attachments.collect_garbage([](std::size_t deleted)
+                                                       {
+                                                           if (deleted > 0)
+                                                           {
+                                                               std::cout << "Removed " << deleted << " shared file(s) that are no longer referenced." << std::endl << std::endl;
+                                                           } });
+                    collect_garbage();
+                }
+            });
+    }
+
+    // A crowd of new connections takes a lot of memory for a moment - every TLS handshake needs OpenSSL's buffers - and the
+    // sessions give it back once they're quiet (see Session::heartbeat()). But glibc only returns memory to the operating system
+    // from the very end of the heap, and those buffers are free holes in between the sessions that are still there. So now and
+    // then we ask it to give back every free page, wherever it is. It walks the whole heap (1 to 17 ms with 10,000 connections
+    // in scale_test), which is why it's a timer and not something every session does.
+    void trim_heap()
+    {
+#if defined(__GLIBC__)
+        trim_timer_.expires_after(trim_interval);
+        trim_timer_.async_wait(
+            [this](boost::system::error_code ec)
+            {
+                if (!ec)
+                {
+                    malloc_trim(0);
+                    trim_heap();
+                }
+            });
+#endif
+    }
+
+    // ---------------------------------- //
+    // Below we have the member variables of the Server class. These are meant to be private, no need to allow public access to these variables.
+
+    boost::asio::io_context &io_context_;
+
+    // This is the acceptor that is used to accept connections from clients.
+    // The acceptor is a boost::asio::ip::tcp::acceptor object that is used to accept connections from clients.
+    // The tcp::acceptor class is used to listen for incoming TCP connections on a specific port.
+    // The acceptor_ binds to a specific IP address and port number where it will listen for incoming connections.
+    tcp::acceptor acceptor_;
+
+    // The ssl_context_ is a boost::asio::ssl::context object that is used to manage the SSL context.
+    // context is a term used in SSL/TLS to refer to the configuration and state of the SSL/TLS connection.
+    // It's just an object that we need to use to add SSL/TLS.
+    boost::asio::ssl::context &ssl_context_;
+    // ssl_context is passed in as a refernece when the server is created. So the ssl_contextt is created before we pass it in.
+    // This is done in the main fn.
+
+    // ---------------------------------- //
+    // Announcements: every line typed into the server's own window is sent to everybody as a notice.
+    // Like the client's keyboard, this uses a posix::stream_descriptor - so Linux/macOS only, and only when stdin is a terminal or pipe
+    // (a server started in the background with stdin redirected from a file or /dev/null just doesn't read it).
+    void read_console()
+    {
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+        if (!console_.is_open())
+        {
+            boost::system::error_code ec;
+            int descriptor = ::dup(STDIN_FILENO);
+            if (descriptor < 0)
+            {
+                return;
+            }
+            console_.assign(descriptor, ec);
+            if (ec)
+            {
+                ::close(descriptor);
+                return;
+            }
+        }
+
+        boost::asio::async_read_until(console_, console_buffer_, '\n',
+                                      [this](boost::system::error_code ec, std::size_t length)
+                                      {
+                                          if (ec)
+                                          {
+                                              return;
+                                          }
+                                          std::string line(static_cast<const char *>(console_buffer_.data().data()), length - 1);
+                                          console_buffer_.consume(length);
+                                          if (line == "/clients")
+                                          {
+                                              Session::print_connected_clients(state_.sessions);
+                                          }
+                                          else if (!line.empty())
+                                          {
+                                              announce(line);
+                                          }
+                                          read_console();
+                                      });
+#endif
+    }
+
+    void announce(const std::string &text)
+    {
+        std::size_t count = send_to_everyone(protocol::make_frame(protocol::MessageType::notice, "[server] " + text));
+        std::cout << "Announced to " << count << " client(s)." << std::endl << std::endl;
+    }
+
+    // One frame for everyone who has logged in, compressed at most once - same idea as Session::broadcast_frame().
+    std::size_t send_to_everyone(const std::shared_ptr<const protocol::Frame> &frame)
+    {
+        auto compressed = state_.codec.compress(*frame);
+        std::size_t count = 0;
+        for (auto &session : state_.sessions)
+        {
+            if (session->ready())
+            {
+                session->deliver(session->compression() && compressed ? compressed : frame);
+                ++count;
+            }
+        }
+        return count;
+    }
+
+    // Once per wheel tick: everybody who joined or left since the last tick, in one update for everyone (see ServerState::note_presence()).
+    // People who logged in during this tick already have a snapshot that may include some of these changes - that's fine,
+    // the client just ignores a "joined" for someone it already has.
+    // One update is a frame for every session, though - encrypted and written once for each. With 15,000 online that's 30,000
+    // writes a second for as long as anybody keeps joining, and that is what made logging in crawl past 14,000 in scale_test
+    // (a connection took 15 s to get in). So once there are more than presence_frames_per_tick people, the changes are saved up
+    // for a few ticks and go out together: the server never sends more than about presence_frames_per_tick updates a tick.
+    void flush_presence()
+    {
+        state_.wheel.schedule(presence_timer_, state_.wheel.tick());
+        flush_events();
+        if (state_.presence_changes.empty() || ++presence_ticks_ < 1 + state_.sessions.size() / presence_frames_per_tick)
+        {
+            return;
+        }
+        presence_ticks_ = 0;
+
+        std::vector<std::string> joined;
+        std::vector<std::string> left;
+        state_.take_presence_changes(joined, left);
+        if (replication_)
+        {
+            for (auto &frame : replication_presence(joined, left))
+            {
+                replication_->send(frame);
+            }
+        }
+        if (!expected_back_.empty())
+        {
+            joined.erase(std::remove_if(joined.begin(), joined.end(), [this](const std::string &name)
+                                        { return expected_back_.erase(name) > 0; }),
+                         joined.end());
+        }
+        for (auto &frame : ServerState::presence_frames(protocol::PresenceKind::update, joined, left, state_.by_name.size()))
+        {
+            send_to_everyone(frame);
+        }
+
+        std::cout << state_.by_name.size() << " online (" << state_.sessions.size() << " connections): "
+                  << joined.size() << " joined, " << left.size() << " left. Type /clients for the list." << std::endl;
+        if (replication_)
+        {
+            std::cout << replication_->standbys() << " standby server(s) following." << std::endl;
+        }
+        if (datagrams_)
+        {
+            std::cout << datagrams_->linked() << " client(s) on the UDP side channel." << std::endl;
+        }
+        if (federation_)
+        {
+            federation_->set_members(static_cast<std::uint32_t>(state_.by_name.size()));
+            std::cout << federation_->nodes() << " other server(s) linked, " << federation_->remote_members() << " online there." << std::endl;
+        }
+        std::cout << std::endl;
+    }
 
     // ---------------------------------- //
+    // Events and the UDP side channel - see datagram.hpp.
 
-    // Now we create public member functions for the Session class - availabe to everything to call without limits.
-
-    // This gets called when we start the session.
-    void start()
+    // It's on the same port number as TCP (a UDP port and a TCP port are separate things, even with the same number).
+    // If we can't have the port, the server still works - events then go over TCP.
+    void start_datagrams(unsigned short port)
     {
-        sessions_.push_back(shared_from_this()); // Here we add the session to the sessions vector.
-
-        print_connected_clients(); // We print the connected clients.
-
-        do_handshake(); // We do the SSL handshake.
+        try
+        {
+            datagrams_ = std::make_unique<DatagramServer>(io_context_, port, DatagramServer::Handlers{[this](const std::string &identity, protocol::MessageType type, std::string_view body)
+                                                                                                     { on_datagram(identity, type, body); }});
+            state_.datagrams = datagrams_.get();
+            std::cout << "UDP side channel on port " << port << "." << std::endl << std::endl;
+        }
+        catch (const boost::system::system_error &e)
+        {
+            std::cout << "Couldn't open UDP port " << port << " (" << e.what() << ") - events will go over TCP." << std::endl << std::endl;
+        }
     }
 
-private:
-    // This function prints the connected clients.
-    // It goes through all the sessions that are currently connected to the server and prints the IP address of the client that is connected on + the port number.
-    void print_connected_clients()
+    // Only events come in over UDP. A broken one is just dropped - unlike on TCP, anybody can send us a datagram, and one
+    // that doesn't make sense isn't a reason to throw out the client's connection.
+    void on_datagram(const std::string &identity, protocol::MessageType type, std::string_view body)
     {
-        std::cout << "Connected clients:" << std::endl;
-
-        for (const auto &session : sessions_) // I prefer &session instead of auto& session - but it's the same thing.
+        auto it = state_.by_datagram_identity.find(identity);
+        if (it != state_.by_datagram_identity.end() && type == protocol::MessageType::event)
         {
-            // By calling ssl_socket_.lowest_layer(), you are retrieving the underlying tcp::socket object that the SSL stream is using for network communication.
-            // remote_endpoint(): It returns an object of type boost::asio::ip::tcp::endpoint, which contains both the IP address and the port number of the connected peer.
-            std::cout << session->ssl_socket_.lowest_layer().remote_endpoint() << std::endl;
+            it->second->handle_event(body);
         }
-
-        std::cout << std::endl;
     }
 
-    // This function does the SSL handshake. This is standard procedure when using SSL with boost code.
-    void do_handshake()
+    // Once per wheel tick: the events since the last tick, packed into frames that each fit in one datagram (datagram::max_payload).
+    // Each frame is built once and goes to everybody - over UDP to those who have the side channel, in the stream to the rest.
+    void flush_events()
     {
-        // We create a shared pointer to the current session object.
-        // This is needed because the async_handshake function requires a shared pointer to the current object.
-        auto self(shared_from_this());
+        if (datagrams_)
+        {
+            datagrams_->tick();
+        }
+        if (state_.pending_events.empty())
+        {
+            return;
+        }
 
-        // This is the main function that does the SSL handshake.
-        // The async_handshake function is an asynchronous function that performs an SSL handshake on the stream.
-        ssl_socket_.async_handshake(
-            boost::asio::ssl::stream_base::server,
+        std::vector<std::shared_ptr<const protocol::Frame>> frames;
+        std::string items;
+        std::uint32_t count = 0;
+        auto finish = [&]()
+        {
+            std::string body;
+            protocol::Writer(body).u32(count);
+            body += items;
+            frames.push_back(protocol::make_frame(protocol::MessageType::events, std::move(body)));
+            items.clear();
+            count = 0;
+        };
+        for (const auto &[key, text] : state_.pending_events)
+        {
+            std::string item;
+            protocol::Writer writer(item);
+            writer.u8(key.second);
+            writer.str(key.first);
+            writer.str(text);
+            if (count > 0 && 4 + items.size() + item.size() > datagram::max_payload)
+            {
+                finish();
+            }
+            items += item;
+            ++count;
+        }
+        finish();
+        state_.pending_events.clear();
 
-            [this, self](boost::system::error_code ec)
+        for (auto &session : state_.sessions)
+        {
+            if (session->ready())
             {
-                if (!ec)
+                for (const auto &frame : frames)
                 {
-                    std::cout << "Server side: SSL handshake completed successfully with client." << std::endl << std::endl;
-                    read();
+                    session->deliver_events(frame);
                 }
-                else
+            }
+        }
+    }
+
+    // ---------------------------------- //
+    // Federation - see federation.hpp. The Federation object does the linking; we give it our chat lines (Session::publish())
+    // and it gives us the ones from the other servers (deliver_from_node()).
+    void start_federation(const Federation::Options &options, const std::string &saved)
+    {
+        Federation::Handlers handlers{
+            [this](protocol::MessageType type, std::string_view body)
+            { deliver_from_node(type, body); },
+            [this]()
+            { return state_.last_sequence; },
+            [this](std::uint64_t after, const std::function<void(std::uint64_t, protocol::MessageType, std::string_view)> &send)
+            {
+                for (const auto &entry : state_.history)
                 {
-                    // If we have an error in the handshake, we remove the session from the sessions vector.
-                    // Later, in future versions, we can add code to try to reconnect and try connecting again x number of times before erasing.
-                    sessions_.erase(
-                        std::remove(sessions_.begin(), sessions_.end(), self),
-                        sessions_.end());
-                    print_connected_clients();
+                    if (entry.sequence > after && !entry.from_node && protocol::frame_type(*entry.frame) == protocol::MessageType::chat)
+                    {
+                        // Just the text, without our envelope - the other server numbers it again, and needs the name instead
+                        // of our sender number (see Session::broadcast()).
+                        protocol::Envelope envelope(entry.frame->body);
+                        std::string body;
+                        protocol::Writer writer(body);
+                        writer.str(state_.sender_name(entry.sender));
+                        writer.raw(envelope.text());
+                        send(entry.sequence, protocol::MessageType::chat, body);
+                    }
                 }
-            });
+            }};
+        federation_ = std::make_unique<Federation>(io_context_, options, state_.run_id, std::move(handlers));
+        protocol::Reader reader(saved);
+        federation_->restore(reader);
+        state_.federation = federation_.get();
     }
 
-    // This function reads data from the client.
-    // It reads data from the SSL socket and stores it in the data_ member variable.
-    // The function then prints the data that was read and calls the broadcast function.
-    // The broadcast function sends the data to all the other clients that are connected to the server.
-    // The function then calls itself again to read more data from the client.
-    // It will keep on reading data from the client until there is no data left.
-    // When there is no data left, an error is raised.
-    void read()
+    // A chat line from somebody on another server (their name, then the text). To our clients it's just the next message - it gets
+    // our next sequence number and one of our sender numbers, and goes in our history, so a client that reconnects to us gets it too.
+    void deliver_from_node(protocol::MessageType type, std::string_view body)
     {
-        auto self(shared_from_this());
+        if (type != protocol::MessageType::chat)
+        {
+            return; // Newer servers might share more than chat - we only know what to do with chat.
+        }
+        protocol::Reader reader(body);
+        auto name = std::string(reader.str());
+        auto text = reader.rest();
+        if (!reader.ok() || name.empty() || name.size() > protocol::max_name_length)
+        {
+            return;
+        }
+        std::cout << "[via another server] " << name << ": " << text << std::endl;
 
-        ssl_socket_.async_read_some(boost::asio::buffer(data_, max_length),
-                                    [this, self](boost::system::error_code ec, std::size_t length)
-                                    {
-                                        if (!ec)
-                                        {
-                                            /* Sunday 02 March 2025 0035
-                                            // We print the data that was received from the client.
-                                            // TODO - add the name of the client to the message.
-                                            std::cout << "Received message: " << std::string(data_, length) << std::endl;
-
-                                            broadcast(length);
-                                            read();
-                                            */
-
-                                            // ---------------------------------- //
-                                            // Added Sunday 02 March 2025 0039
-                                            if (!ec)
-                                            {
-                                                if (client_name_.empty()) // Name hasn't been set yet
-                                                {
-                                                    client_name_ = std::string(data_, length);
-                                                    std::cout << "Client name received: " << client_name_ << std::endl;
-                                                    std::cout << "Welcome " << client_name_ << std::endl << std::endl;
-                                                }
-                                                else
-                                                {
-                                                    std::cout << "[" << client_name_ << "]: " << std::string(data_, length) << std::endl;
-                                                    broadcast(length);
-                                                }
-                                                read();
-                                            }
-                                            // ---------------------------------- //
-
-                                            
-                                        }
-                                        else
-                                        {
-                                            sessions_.erase(std::remove(sessions_.begin(), sessions_.end(), self), sessions_.end());
-                                            print_connected_clients();
-                                        }
-                                    });
+        bool is_new = false;
+        std::uint32_t id = state_.sender_id(name, is_new);
+        if (is_new)
+        {
+            send_to_everyone(state_.names_frame(id));
+        }
+        std::string numbered;
+        protocol::Writer writer(numbered);
+        protocol::write_envelope(writer, ++state_.last_sequence, id, protocol::envelope_from_node);
+        writer.raw(text);
+        auto frame = protocol::make_frame(type, std::move(numbered));
+        state_.append_history(state_.last_sequence, {}, frame, true, id);
+        send_to_everyone(frame);
     }
 
-    // This function broadcasts data to all the clients that are connected to the server.
-    // It goes through all the sessions that are currently connected to the server.
-    // If the session is not the current session, it writes the data to the session.
-    // The data is written to the session using the write function.
-    // The write function writes the data to the session and then calls the read function to read more data from the client.
-    // The write function is an asynchronous function that writes data to the SSL socket.
-    // I asked why we need to pass length and why we can't use max_length - the answer is that we need to pass the length of the data that we want to write.
-    // So for example, if we wrtie "Hello", that is 5 characters long - so we need to pass 5 as the length.
+    // ---------------------------------- //
+    // Hot standbys - see replication.hpp. A new standby gets everything a hot restart would hand over (see save_state()), as frames:
+    // repl_begin with the ticket keys, run ID, sequence number and federation state, then every history entry, then who is online.
+    // After that it gets each new history entry from ServerState::append_history(), and the joins and leaves from flush_presence().
+    std::vector<std::shared_ptr<const protocol::Frame>> replication_snapshot()
+    {
+        std::string body;
+        protocol::Writer writer(body);
+        writer.str(ticket_keys());
+        writer.u64(state_.run_id);
+        writer.u64(state_.last_sequence);
+        writer.raw(federation_ ? federation_->save() : std::string());
+
+        std::vector<std::shared_ptr<const protocol::Frame>> frames;
+        frames.push_back(protocol::make_frame(protocol::MessageType::repl_begin, std::move(body)));
+        for (const auto &entry : state_.history)
+        {
+            frames.push_back(state_.entry_frame(entry));
+        }
+        for (auto &frame : replication_presence(state_.roster(), {}))
+        {
+            frames.push_back(std::move(frame));
+        }
+        return frames;
+    }
 
-    /* Sunday 02 March 2025 0048 - in the newer version, I add the clients name when they send a message. */
-    /*
-    void broadcast(std::size_t length)
+    // Joins and leaves for the standbys - packed the same way as the presence frames for the clients.
+    static std::vector<std::shared_ptr<const protocol::Frame>> replication_presence(const std::vector<std::string> &joined, const std::vector<std::string> &left)
     {
-        for (auto &session : sessions_)
+        std::vector<std::shared_ptr<const protocol::Frame>> frames;
+        std::size_t next_joined = 0;
+        std::size_t next_left = 0;
+        do
         {
-            // We check if the session is not the current session.
-            // If it's not the current session, we write the data to the session.
-            if (session != shared_from_this())
+            std::string body;
+            protocol::Writer writer(body);
+            ServerState::pack_names(writer, body, joined, next_joined);
+            ServerState::pack_names(writer, body, left, next_left);
+            frames.push_back(protocol::make_frame(protocol::MessageType::repl_presence, std::move(body)));
+        } while (next_joined < joined.size() || next_left < left.size());
+        return frames;
+    }
+
+    // ---------------------------------- //
+    // The blocklist (see ip_blocklist.hpp) is read at start up, and again whenever the server gets SIGHUP (so are the rate limits):
+    //   kill -HUP <server pid>
+    // The new list is built completely before it replaces the old one, so accept() always sees either the whole old list
+    // or the whole new one - and a broken file just means a few bad lines are skipped, never an empty list by accident.
+    void reload_blocklist()
+    {
+        std::size_t bad_lines = 0;
+        blocklist_ = IpBlocklist::load(blocklist_path, bad_lines);
+
+        if (blocklist_->size() > 0 || bad_lines > 0 || blocked_connections_ > 0)
+        {
+            std::cout << "Blocklist " << blocklist_path << ": " << blocklist_->size() << " address range(s)";
+            if (bad_lines > 0)
             {
-                session->write(data_, length);
+                std::cout << ", " << bad_lines << " line(s) skipped because they aren't addresses";
             }
+            std::cout << ". " << blocked_connections_ << " connection(s) blocked so far." << std::endl << std::endl;
         }
     }
-    */
 
-    // This new version of the broadcast function adds the name of the client to the message.
-    void broadcast(std::size_t length)
+    // The rate limits (see rate_limit.hpp) are re-read at the same times as the blocklist.
+    void reload_limits()
     {
-        std::string formatted_message = client_name_ + ": " + std::string(data_, length);
-    
-        for (auto &session : sessions_)
+        std::size_t bad_lines = 0;
+        state_.limits = RateLimits::load(limits_path, bad_lines);
+        if (bad_lines > 0)
         {
-            // If the session is not the current session, write the formatted message to the session.
-            if (session != shared_from_this())
-            {
-                session->write(formatted_message.c_str(), formatted_message.size());
-            }
+            std::cout << "Skipped " << bad_lines << " line(s) of " << limits_path << " that aren't limits." << std::endl << std::endl;
         }
     }
-    
 
-    // Damn this VSCode is good - it's really good - I'm loving it - it's so good - it's really AWESOME! 😎
+    void wait_for_reload_signal()
+    {
+#if defined(SIGHUP)
+        reload_signals_.async_wait(
+            [this](boost::system::error_code ec, int)
+            {
+                if (!ec)
+                {
+                    reload_blocklist();
+                    reload_limits();
+                    wait_for_reload_signal();
+                }
+            });
+#endif
+    }
 
-    void write(const char *data, std::size_t length)
+    // ---------------------------------- //
+    // Hot restart - see hot_restart.hpp for the whole story. This is the old server's side.
+    // We listen on a control socket. When a new server connects to it:
+    //   1. We stop accepting. The listening socket stays open, so new clients wait in its queue rather than being refused.
+    //   2. Every client is asked to leave (going_away) and come back at a random moment within reconnect_window.
+    //   3. Once they have all gone (or drain_timeout has passed) nothing can change any more, so we save the state,
+    //      send it to the new server together with the listening socket, and stop.
+    // The state is saved AFTER the drain so that every message we handled is in it - the new server replays it to whoever missed it.
+    void listen_for_takeover(unsigned short port)
     {
-        // We create a shared pointer to the current session object.
-        // This is needed because the async_write function requires a shared pointer to the current object.
-        // We use shared_from_this() to get a shared pointer to the current object.
-        auto self(shared_from_this());
+#if defined(HOT_RESTART_SUPPORTED)
+        namespace local = boost::asio::local;
+        control_path_ = hot_restart::control_path(port);
+        ::unlink(control_path_.c_str()); // Left behind if the last server on this port crashed.
+
+        boost::system::error_code ec;
+        control_.open(local::stream_protocol(), ec);
+        if (!ec)
+            control_.bind(local::stream_protocol::endpoint(control_path_), ec);
+        if (!ec)
+            control_.listen(1, ec);
+        if (ec)
+        {
+            std::cout << "Hot restart is off - couldn't create " << control_path_ << ": " << ec.message() << std::endl << std::endl;
+            return;
+        }
 
-        boost::asio::async_write(ssl_socket_, boost::asio::buffer(data, length),
-                                 [this, self](boost::system::error_code ec, std::size_t /*length*/)
-                                 {
-                                     if (!ec)
-                                     {
-                                         read();
-                                     }
-                                     else
-                                     {
-                                         sessions_.erase(std::remove(sessions_.begin(), sessions_.end(), self), sessions_.end());
-                                         print_connected_clients();
-                                     }
-                                 });
-    }
-
-    // This is the SSL socket that is used to communicate with the client.
-    // It is a boost::asio::ssl::stream object that is used to communicate with the client.
-    // All complexities of the socket and SSL are handled by this object.
-    // The SSL socket is a stream that is used to communicate with the client.
-    boost::asio::ssl::stream<tcp::socket> ssl_socket_;
-
-    // This is a buffer that is used to store the data that is read from the client.
-    // It is a char array that is used to store the data that is read from the client.
-    enum
-    {
-        max_length = 1024
-    };
+        control_.async_accept(
+            [this](boost::system::error_code ec, local::stream_protocol::socket successor)
+            {
+                if (!ec)
+                {
+                    hand_over(std::move(successor));
+                }
+            });
+#else
+        (void)port;
+#endif
+    }
 
-    // This is a char array that is used to store the data that is read from the client.
-    // This is our buffer that we use to store the data that is read from the client.
-    // Don't get mixed up with the socket buffeer, the socket buffer is a buffer that is used by the socket to store data that is read from the client.
-    char data_[max_length];
+#if defined(HOT_RESTART_SUPPORTED)
+    void hand_over(boost::asio::local::stream_protocol::socket successor)
+    {
+        std::cout << "A new server is taking over - asking " << state_.sessions.size() << " client(s) to reconnect." << std::endl << std::endl;
 
-    // This is a vector that holds all the sessions that are currently connected to the server.
-    // Theoretically, this vector should hold all the sessions that are currently connected to the server.
-    std::vector<std::shared_ptr<Session>> &sessions_;
+        handing_over_ = true;
+        boost::system::error_code ignored;
+        acceptor_.cancel(ignored);
+        if (federation_)
+        {
+            federation_->close(); // The new server links up with the other servers again, and they send it whatever it missed.
+        }
+        if (replication_)
+        {
+            replication_->going_away(); // So our standbys wait for the new server instead of taking over.
+        }
+        if (datagrams_)
+        {
+            datagrams_->close(); // The new server opens the UDP port itself. Until then events go over TCP.
+        }
+#if defined(LOCAL_CLIENTS_SUPPORTED)
+        if (local_acceptor_)
+        {
+            local_acceptor_->close(ignored); // The new server makes the socket file again - local clients reconnect to that.
+        }
+#endif
+        control_.close(ignored);
+        ::unlink(control_path_.c_str()); // So the new server can create its own.
 
-    std::string client_name_; // Sunday 02 March 2025 0033 - I need to store the name of the client - this is a bit of a hack I think, I would prefer to pass in as an object
+        // go_away() may close a session, which takes it out of the vector - so we loop over a copy.
+        auto sessions = state_.sessions;
+        for (auto &session : sessions)
+        {
+            session->go_away(reconnect_window);
+        }
 
-};
+        successor_ = std::make_unique<boost::asio::local::stream_protocol::socket>(std::move(successor));
+        drain_deadline_ = std::chrono::steady_clock::now() + drain_timeout;
+        wait_for_drain();
+    }
 
-// We create a server class.
-// The server class is a class that represents the server.
-// The server class is used to accept connections from clients and create a new session object for each client that connects.
-class Server
-{
+    void wait_for_drain()
+    {
+        if (!state_.sessions.empty() && std::chrono::steady_clock::now() < drain_deadline_)
+        {
+            handover_timer_.expires_after(std::chrono::milliseconds(100));
+            handover_timer_.async_wait(
+                [this](boost::system::error_code ec)
+                {
+                    if (!ec)
+                    {
+                        wait_for_drain();
+                    }
+                });
+            return;
+        }
 
-public:
-    // We create a constructor for the Server class.
-    // The constructor takes a boost::asio::io_context object, a boost::asio::ssl::context object and a short object as arguments.
-    // The boost::asio::io_context object is used to manage the I/O services.
-    // The boost::asio::ssl::context object is used to manage the SSL context.
-    // The short object is used to store the port number that the server listens on. short is a 16-bit integer - part of C++.
-    // The constructor initialises the acceptor_ member variable with the io_context object and the port number that is passed in as arguments.
-    Server(boost::asio::io_context &io_context, boost::asio::ssl::context &ssl_context, short port)
-        : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)), ssl_context_(ssl_context), sessions_() // sessions_() is declared further below - this is why we can use here. In classes, you can declare something further down and use it before it's declared.
+        auto stragglers = state_.sessions;
+        for (auto &session : stragglers)
+        {
+            session->close();
+        }
+        if (edge_hub_)
+        {
+            edge_hub_->close(); // The edges connect to the new server by themselves.
+        }
+
+        // sendmsg() is a plain blocking call - make sure the socket really is in blocking mode.
+        boost::system::error_code ignored;
+        successor_->native_non_blocking(false, ignored);
+        if (hot_restart::send_handoff(successor_->native_handle(), acceptor_.native_handle(), save_state()))
+        {
+            std::cout << "Handed over to the new server. Bye!" << std::endl;
+        }
+        else
+        {
+            std::cerr << "Couldn't hand over to the new server: " << std::strerror(errno) << std::endl;
+        }
+        io_context_.stop();
+    }
+#endif
+
+    // The state we hand over: the TLS session ticket keys, then the history (ServerState::save_history()), then what we've seen from
+    // the other servers in the mesh (Federation::save() - empty if there is no mesh).
+    // Clients resume their TLS sessions with tickets, and a ticket can only be opened with the keys that made it.
+    // OpenSSL picks random keys for every new SSL_CTX - so without this, every client would need a full handshake with the new server.
+    std::string save_state()
     {
-        std::cout << "Message server started. Ready to accept connections..." << std::endl << std::endl;
+        return ticket_keys() + state_.save_history() + (federation_ ? federation_->save() : std::string());
+    }
 
-        accept();
+    std::string ticket_keys()
+    {
+        std::string keys(ticket_keys_length, '\0');
+        if (SSL_CTX_get_tlsext_ticket_keys(ssl_context_.native_handle(), keys.data(), keys.size()) != 1)
+        {
+            keys.assign(ticket_keys_length, '\0'); // All zeroes means "no keys" - see restore_state().
+        }
+        return keys;
     }
-    // Can you remember and recall what the single : does above?
-    // The single : is used to initialise the member variables of the class.
-    // This is quite unique to C++ and is not found in other programming languages. I couldn't find any other languages that use this method.
 
-    // STOPPED HERE Wednesday 26 February 2025 1520 - need to read up on ssl_context_(ssl_context)
+    bool restore_state(const std::string &saved, std::string &federation_state)
+    {
+        protocol::Reader reader(saved);
+        auto keys = reader.raw(ticket_keys_length);
+        if (!state_.restore_history(reader))
+        {
+            return false;
+        }
+        federation_state = std::string(reader.rest());
+        if (keys.find_first_not_of('\0') != std::string_view::npos)
+        {
+            std::string copy(keys);
+            SSL_CTX_set_tlsext_ticket_keys(ssl_context_.native_handle(), copy.data(), copy.size());
+        }
+        return true;
+    }
 
-private:
-    void accept()
+    static constexpr std::size_t ticket_keys_length = 80; // key name (16) + HMAC key (32) + AES key (32)
+    static constexpr std::chrono::milliseconds reconnect_window{3000};
+    static constexpr std::chrono::seconds drain_timeout{10};
+    static constexpr std::chrono::seconds return_window{15};
+
+    // This holds the vector of all the sessions that are currently connected to the server, and everything else they share.
+    ServerState state_;
+    boost::asio::steady_timer garbage_timer_;
+    static constexpr std::chrono::seconds trim_interval{30}; // Twice protocol::heartbeat_interval - see trim_heap().
+    boost::asio::steady_timer trim_timer_;
+
+    static constexpr const char *blocklist_path = "blocklist.txt";
+    static constexpr const char *limits_path = "rate_limits.txt";
+    std::shared_ptr<const IpBlocklist> blocklist_;
+    std::uint64_t blocked_connections_ = 0;
+    // See accept() - what we do when we run out of file descriptors.
+    static constexpr std::chrono::milliseconds accept_retry_delay{100};
+    boost::asio::steady_timer accept_retry_timer_;
+    bool accept_failing_ = false;
+    boost::asio::signal_set reload_signals_;
+
+    TimingWheel::Timer presence_timer_{[this]()
+                                       { flush_presence(); }};
+    static constexpr std::size_t presence_frames_per_tick = 2500;
+    std::size_t presence_ticks_ = 0; // Ticks since the last presence update - see flush_presence().
+
+    std::unique_ptr<Federation> federation_;
+    std::unique_ptr<EdgeHub> edge_hub_;
+    std::unique_ptr<Replication> replication_;
+    std::unique_ptr<DatagramServer> datagrams_;
+#if defined(LOCAL_CLIENTS_SUPPORTED)
+    std::unique_ptr<boost::asio::local::stream_protocol::acceptor> local_acceptor_; // See listen_locally().
+#endif
+    std::set<std::string> expected_back_; // See expect_back().
+    boost::asio::steady_timer return_timer_;
+
+    boost::asio::steady_timer handover_timer_;
+    bool handing_over_ = false;
+    std::chrono::steady_clock::time_point drain_deadline_;
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+    boost::asio::posix::stream_descriptor console_;
+    boost::asio::streambuf console_buffer_;
+#endif
+#if defined(HOT_RESTART_SUPPORTED)
+    boost::asio::local::stream_protocol::acceptor control_;
+    std::unique_ptr<boost::asio::local::stream_protocol::socket> successor_;
+    std::string control_path_;
+#endif
+};
+
+// What a standby (./server <port> --standby <host:port>) has been told by the primary - see replication.hpp.
+// It's kept in the form Server::save_state() would hand it over in a hot restart, so when the standby takes over it starts
+// the Server exactly like the new server in a hot restart does. There's no Server (and no AttachmentStore) until then.
+struct StandbyState
+{
+    std::string keys;
+    std::uint64_t run_id = 0;
+    std::uint64_t last_sequence = 0;
+    std::deque<std::string> entries; // Each one saved by ServerState::save_entry().
+    std::string federation;
+    std::set<std::string> online;
+
+    void apply(protocol::MessageType type, std::string_view body)
     {
-        // The acceptor_.async_accept function is an asynchronous function that accepts connections from clients.
-        // It sets up an asynchronous operation that waits for a client to connect and then calls the lambda function that is passed in as an argument.
-        // It only triggers when a client connects to the server or when an error occurs.
-        acceptor_.async_accept(
-            [this](boost::system::error_code ec, tcp::socket socket)
+        protocol::Reader reader(body);
+        switch (type)
+        {
+        case protocol::MessageType::repl_begin:
+        {
+            // A new snapshot - whatever we had before is replaced.
+            auto saved_keys = reader.str();
+            auto saved_run_id = reader.u64();
+            auto saved_sequence = reader.u64();
+            auto saved_federation = reader.rest();
+            if (reader.ok())
             {
-                if (!ec)
-                {
-                    std::cout << "New client connected!" << std::endl << std::endl;
+                keys = saved_keys;
+                run_id = saved_run_id;
+                last_sequence = saved_sequence;
+                federation = saved_federation;
+                entries.clear();
+                online.clear();
+            }
+            break;
+        }
 
-                    // We create a new session object for the client that has connected.
-                    // We use make_shared - make_shared is part of C++ and created a shared_pointer.
-                    std::make_shared<Session>(boost::asio::ssl::stream<tcp::socket>(std::move(socket), ssl_context_), sessions_)->start();
+        case protocol::MessageType::repl_entry:
+        {
+            auto sequence = reader.u64();
+            if (reader.ok())
+            {
+                last_sequence = std::max(last_sequence, sequence);
+                entries.emplace_back(body);
+                if (entries.size() > ServerState::history_size)
+                {
+                    entries.pop_front();
                 }
+            }
+            break;
+        }
 
-                // This is what makes the server keep on accepting connections from clients.
-                // This loop sits within the io_context.run(); loop.
-                // Normally, recursion could cause a stack overflow - but in this case, it's safe because the accept function is called asynchronously.
-                // Boost.Asio and C++ are designed to handle this kind of asynchronous recursion efficiently and safely.
-                accept();
-            });
-        // The function doesn't loop indefinitely in a blocking manner and only sets up an asynchronous operation.
-        // The io_context.run() event loop manages the execution, ensuring the handler is called when a client connects.
-    }
-
-    // ---------------------------------- //
-    // Below we have the member variables of the Server class. These are meant to be private, no need to allow public access to these variables.
-
-    // This is the acceptor that is used to accept connections from clients.
-    // The acceptor is a boost::asio::ip::tcp::acceptor object that is used to accept connections from clients.
-    // The tcp::acceptor class is used to listen for incoming TCP connections on a specific port.
-    // The acceptor_ binds to a specific IP address and port number where it will listen for incoming connections.
-    tcp::acceptor acceptor_;
+        case protocol::MessageType::repl_presence:
+        {
+            for (std::uint32_t count = reader.u32(); count > 0 && reader.ok(); --count)
+            {
+                online.insert(std::string(reader.str()));
+            }
+            for (std::uint32_t count = reader.u32(); count > 0 && reader.ok(); --count)
+            {
+                online.erase(std::string(reader.str()));
+            }
+            break;
+        }
 
-    // The ssl_context_ is a boost::asio::ssl::context object that is used to manage the SSL context.
-    // context is a term used in SSL/TLS to refer to the configuration and state of the SSL/TLS connection.
-    // It's just an object that we need to use to add SSL/TLS.
-    boost::asio::ssl::context &ssl_context_;
-    // ssl_context is passed in as a refernece when the server is created. So the ssl_contextt is created before we pass it in.
-    // This is done in the main fn.
+        default:
+            break;
+        }
+    }
 
-    // This is a vector that holds all the sessions that are currently connected to the server.
-    std::vector<std::shared_ptr<Session>> sessions_;
+    // The same layout as Server::save_state(): ticket keys, then ServerState::save_history(), then the federation state.
+    std::string save() const
+    {
+        std::string out = keys;
+        protocol::Writer writer(out);
+        writer.u64(run_id);
+        writer.u64(last_sequence);
+        writer.u32(static_cast<std::uint32_t>(entries.size()));
+        for (const auto &entry : entries)
+        {
+            writer.raw(entry);
+        }
+        writer.raw(federation);
+        return out;
+    }
 };
 
+// allocation_test.cpp includes this file to test the Session code, and brings its own main().
+#if !defined(CHAT_SERVER_NO_MAIN)
 int main(int argc, char *argv[])
 {
     try
     {
         // First we check if we have called the function with the correct number of arguments.
         // If we haven't, we print an error message and return 1 and the code exits and doesn't run
-        if (argc != 2)
+        // ./server <port> --takeover starts a new server in place of the one already running on that port - see hot_restart.hpp.
+        // ./server <port> --node <port> --peer <host:port> ... links this server up with others into one big room - see federation.hpp.
+        // ./server <port> --edge <port> takes clients through edge proxies too - see edge.hpp.
+        // ./server <port> --replicate <port> lets hot standbys follow this server, ./server <port> --standby <host:port> is one - see replication.hpp.
+        // ./server <port> --udp opens a UDP side channel for typing and status events - see datagram.hpp.
+        // ./server <port> --local <path> takes programs on this machine through a Unix domain socket, without TLS - see Server::listen_locally().
+        bool takeover = false;
+        Federation::Options federation;
+        unsigned short edge_port = 0;
+        unsigned short replication_port = 0;
+        std::string standby_for;
+        bool datagrams = false;
+        std::string local_path;
+        bool usage_ok = argc >= 2;
+        for (int i = 2; i < argc && usage_ok; ++i)
+        {
+            std::string option = argv[i];
+            if (option == "--takeover")
+            {
+                takeover = true;
+            }
+            else if (option == "--node" && i + 1 < argc)
+            {
+                federation.port = static_cast<unsigned short>(std::atoi(argv[++i]));
+            }
+            else if (option == "--peer" && i + 1 < argc)
+            {
+                federation.peers.push_back(argv[++i]);
+            }
+            else if (option == "--edge" && i + 1 < argc)
+            {
+                edge_port = static_cast<unsigned short>(std::atoi(argv[++i]));
+            }
+            else if (option == "--replicate" && i + 1 < argc)
+            {
+                replication_port = static_cast<unsigned short>(std::atoi(argv[++i]));
+            }
+            else if (option == "--standby" && i + 1 < argc)
+            {
+                standby_for = argv[++i];
+            }
+            else if (option == "--udp")
+            {
+                datagrams = true;
+            }
+            else if (option == "--local" && i + 1 < argc)
+            {
+                local_path = argv[++i];
+            }
+            else
+            {
+                usage_ok = false;
+            }
+        }
+        if (!usage_ok)
         {
-            std::cerr << "Usage: ./server <port>\n";
+            std::cerr << "Usage: ./server <port> [--takeover] [--node <port>] [--peer <host:port>]... [--edge <port>] [--replicate <port>] [--standby <host:port>] [--udp] [--local <path>]\n";
             return 1;
         }
 
+#if defined(BOOST_ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+        // Every client takes a file descriptor, and most systems give a program only 1024 unless it asks for more - so without
+        // this the server stops taking clients at about a thousand. We ask for as many as we're allowed (the "hard" limit).
+        // (scale_test.cpp is how we found that out - it's what to run to see how far the server goes on a machine.)
+        rlimit descriptors{};
+        if (::getrlimit(RLIMIT_NOFILE, &descriptors) == 0 && descriptors.rlim_cur < descriptors.rlim_max)
+        {
+            descriptors.rlim_cur = descriptors.rlim_max;
+            ::setrlimit(RLIMIT_NOFILE, &descriptors); // If it doesn't work (macOS can say no to "unlimited"), we carry on with what we have.
+        }
+#endif
+#if defined(SIGPIPE)
+        // Writing to a connection the client has already closed raises SIGPIPE, which ends the program unless we ignore it.
+        // ASIO avoids it by itself, but TlsTransport lets OpenSSL write to the socket directly (see transport.hpp) - so we ignore it
+        // here, and the write just fails with an error like any other.
+        std::signal(SIGPIPE, SIG_IGN);
+#endif
+
         // We create an io_context object. This object is used to manage the I/O services. It's the main big boss that runs the show 😎 
         boost::asio::io_context io_context;
 
@@ -335,11 +3061,49 @@ int main(int argc, char *argv[])
 
         ssl_context.use_certificate_chain_file("ssl_certification/certificate.crt");
         ssl_context.use_private_key_file("ssl_certification/private.key", boost::asio::ssl::context::pem);
+        // OpenSSL keeps a read and a write buffer (about 17 KB each) for every connection. We don't set SSL_MODE_RELEASE_BUFFERS
+        // (free them after every record) - the Session frees them once it has gone quiet. See TlsTransport in transport.hpp.
         // ---------------------------------- //
 
         // We create a Server object. This object is used to represent the server.
         // The Server object is created with the io_context object, the ssl_context object and the port number that is passed in as arguments.
-        Server server(io_context, ssl_context, std::atoi(argv[1]));
+        // For a takeover we wait here until the old server has said goodbye to its clients and sent us its listening socket.
+        // This happens before the Server (and its AttachmentStore) is created, so we read the attachments the old server left behind.
+        int handed_over_socket = -1;
+        std::string handed_over_state;
+        if (takeover)
+        {
+#if defined(HOT_RESTART_SUPPORTED)
+            std::cout << "Waiting for the running server to hand over..." << std::endl;
+            handed_over_socket = hot_restart::receive_handoff(hot_restart::control_path(static_cast<unsigned short>(std::atoi(argv[1]))), handed_over_state);
+            if (handed_over_socket < 0)
+            {
+                std::cout << "There is no server to take over from - starting normally." << std::endl;
+            }
+#else
+            std::cout << "Hot restart needs Linux or macOS - starting normally." << std::endl;
+#endif
+        }
+
+        // A standby follows the primary until it's gone. Only then does the io_context stop - and we carry on below with what we were told.
+        StandbyState standby_state;
+        if (!standby_for.empty())
+        {
+            Standby standby(io_context, standby_for, {[&standby_state](protocol::MessageType type, std::string_view body)
+                                                      { standby_state.apply(type, body); },
+                                                      [&io_context]()
+                                                      { io_context.stop(); }});
+            standby.start();
+            io_context.run();
+            io_context.restart();
+            handed_over_state = standby_state.save();
+        }
+
+        Server server(io_context, ssl_context, std::atoi(argv[1]), handed_over_socket, handed_over_state, federation, edge_port, replication_port, datagrams, local_path);
+        if (!standby_for.empty())
+        {
+            server.expect_back(standby_state.online);
+        }
 
         // We run the io_context object. This is the main event loop that runs the server - and all other asynchronous operations.
         // The io_context object is the main boss that runs the show 😎
@@ -352,6 +3116,7 @@ int main(int argc, char *argv[])
 
     return 0;
 }
+#endif
 
 // Build: g++ more_advanced_boost.cpp -o more_advanced_boost -lboost_system -pthread
 // Run: ./more_advanced_boost 1234
@@ -363,6 +3128,12 @@ int main(int argc, char *argv[])
 // VSCODE gave this:
 // g++ -o server server.cpp -L/C/Coding/C++/boost_1_87_0/stage/lib -lboost_system-mgw14-mt-x64-1_87 -lboost_filesystem-mgw14-mt-x64-1_87 -lws2_32 -lmswsock -lssl -lcrypto -pthread
 // g++ -o server server.cpp -L/C/Coding/C++/boost_1_87_0/stage/lib -lboost_system-mgw14-mt-x64-1_87 -lboost_filesystem-mgw14-mt-x64-1_87 -lws2_32 -lmswsock -lssl -lcrypto -pthread -std=c++11
+// protocol.hpp and attachment_store.hpp use std::filesystem and std::string_view, so we now need C++17:
+// g++ -o server server.cpp -L/C/Coding/C++/boost_1_87_0/stage/lib -lboost_system-mgw14-mt-x64-1_87 -lboost_filesystem-mgw14-mt-x64-1_87 -lws2_32 -lmswsock -lssl -lcrypto -pthread -std=c++17
+// compression.hpp needs zstd (MSYS2: pacman -S mingw-w64-ucrt-x86_64-zstd), so add -lzstd:
+// g++ -o server server.cpp -L/C/Coding/C++/boost_1_87_0/stage/lib -lboost_system-mgw14-mt-x64-1_87 -lboost_filesystem-mgw14-mt-x64-1_87 -lws2_32 -lmswsock -lssl -lcrypto -lzstd -pthread -std=c++17
+// The sessions are coroutines now (co_await), so we need C++20:
+// g++ -o server server.cpp -L/C/Coding/C++/boost_1_87_0/stage/lib -lboost_system-mgw14-mt-x64-1_87 -lboost_filesystem-mgw14-mt-x64-1_87 -lws2_32 -lmswsock -lssl -lcrypto -lzstd -pthread -std=c++20
 
 /*
 Usage:
@@ -549,7 +3320,7 @@ Loving this auto fill feature in VS Code - it's really good. 😎
 /*
 Add other keywords:
 
-WHO - this will show all the clients that are connected to the server and give other details like IP and port connected on.
+WHO - this will show all the clients that are connected to the server and give other details like IP and port connected on. ✔️ (/who in the client)
 
 
 */
@@ -593,7 +3364,7 @@ Need to change the alphabet to include emojis.
 /*
 TODO (but not urgent):
 
-Add a way for the server to send a message to all the clients.
+Add a way for the server to send a message to all the clients. ✔️ (type it into the server window)
 
 Instead of ending sessions on error, we can try to reconnect. Allow clients to attempt to reconnect 3 times before ending the session.
 
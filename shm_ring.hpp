@@ -0,0 +1,329 @@
+#pragma once
+
+// shm_ring.hpp
+// A ring buffer in shared memory, for publishers on the same machine that send a LOT of messages (price alerts, log lines...).
+//
+// Even the local socket (./server ... --local, see LocalTransport in transport.hpp) costs a system call to send and one to receive,
+// and the kernel copies every byte twice. With a ring, the publisher and the server map the SAME memory: the publisher copies its
+// frames in, the server reads them out, and the kernel isn't involved at all - except to wake the server up when it has run out
+// of work and gone to sleep.
+//
+// How it's set up (see Bot::attach_ring() in bot.cpp):
+//   1. The publisher connects to the local socket and sends its hello as usual.
+//   2. It makes the ring (Writer) - a memfd, which is memory with a file descriptor - and an eventfd, a counter the server can wait on.
+//   3. It sends a ring_attach frame with both descriptors attached (SCM_RIGHTS, like the hot restart hands over its socket).
+//      The server maps the memory (Reader) and from then on reads frames from the ring as well as from the socket.
+//
+// The ring itself: head is how many bytes the publisher has written in total, tail how many the server has read. Only the publisher
+// moves head and only the server moves tail, so no locks are needed - one producer, one consumer. (More publishers = more rings.)
+// The frames are exactly the bytes that would have gone over the socket (see protocol.hpp), wrapping round at the end of the memory.
+//
+// Waking up - the whole point is to have no system calls while things are busy:
+// - The server reads until the ring is empty. Only then does it set consumer_sleeping and wait on the eventfd. A publisher that
+//   finds consumer_sleeping set (the ring was empty) clears it and writes to the eventfd - one system call per "empty -> not empty",
+//   however many frames follow while the server is busy.
+// - If the ring is full, the publisher sets producer_waiting and sleeps on it with a futex (a "wait until this memory changes" call).
+//   The server wakes it when it has made room.
+// Both flags are set and checked again the other way round, with full memory ordering, so a wake up can never get lost in between.
+//
+// The publisher can't be trusted blindly - it could write nonsense into the ring, or shrink the memory under our feet (and reading
+// memory that's gone crashes the process). So the server checks every frame like it checks frames from a socket, and only takes
+// memory that is sealed against shrinking (F_SEAL_SHRINK - once set, nobody can undo it).
+//
+// memfd, eventfd and futex are Linux things, so this is Linux only.
+
+#if defined(__linux__)
+#define SHM_RING_SUPPORTED 1
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "protocol.hpp"
+
+namespace shm_ring
+{
+    constexpr std::uint32_t magic = 0x52494e47;                 // "RING"
+    constexpr std::size_t default_capacity = 4 * 1024 * 1024;    // Bytes of frames. Must be a power of two.
+    constexpr std::size_t max_capacity = 64 * 1024 * 1024;
+
+    // The start of the shared memory. Each counter gets its own cache line (64 bytes): if head and tail shared one, every write by
+    // one side would throw the line out of the other CPU's cache.
+    struct Header
+    {
+        std::uint32_t magic;
+        std::uint32_t capacity;
+        alignas(64) std::atomic<std::uint64_t> head;              // Written by the publisher.
+        alignas(64) std::atomic<std::uint64_t> tail;              // Written by the server.
+        alignas(64) std::atomic<std::uint32_t> consumer_sleeping; // 1: the server is waiting on the eventfd.
+        alignas(64) std::atomic<std::uint32_t> producer_waiting;  // 1: the publisher is waiting for room (a futex word).
+    };
+    constexpr std::size_t data_offset = 4096; // The frames start on the second page of the memory.
+    static_assert(sizeof(Header) <= data_offset);
+    static_assert(std::atomic<std::uint64_t>::is_always_lock_free && std::atomic<std::uint32_t>::is_always_lock_free,
+                  "The counters are shared between processes - they can't have a lock hidden inside.");
+
+    // There's no futex() function in the C library, only the system call. The memory is shared, so no FUTEX_PRIVATE_FLAG.
+    inline void futex_wait(std::atomic<std::uint32_t> &word, std::uint32_t expected, std::chrono::milliseconds timeout)
+    {
+        timespec time{static_cast<time_t>(timeout.count() / 1000), static_cast<long>(timeout.count() % 1000) * 1000000};
+        ::syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&word), FUTEX_WAIT, expected, &time, nullptr, 0);
+    }
+
+    inline void futex_wake(std::atomic<std::uint32_t> &word)
+    {
+        ::syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+    }
+
+    // The shared memory, mapped into this process.
+    class Mapping
+    {
+    public:
+        Mapping() = default;
+        Mapping(const Mapping &) = delete;
+        Mapping &operator=(const Mapping &) = delete;
+        ~Mapping()
+        {
+            if (base_ != MAP_FAILED)
+            {
+                ::munmap(base_, size_);
+            }
+        }
+
+        bool map(int fd, std::size_t size)
+        {
+            base_ = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            size_ = size;
+            return base_ != MAP_FAILED;
+        }
+
+        Header &header() const { return *static_cast<Header *>(base_); }
+        char *data() const { return static_cast<char *>(base_) + data_offset; }
+
+    private:
+        void *base_ = MAP_FAILED;
+        std::size_t size_ = 0;
+    };
+
+    // The publisher's side.
+    class Writer
+    {
+    public:
+        // Makes the ring. Check ok() - memfd_create() or eventfd() can fail (too many open files...).
+        explicit Writer(std::size_t capacity = default_capacity) : capacity_(capacity)
+        {
+            memory_fd_ = ::memfd_create("chat ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            wake_fd_ = ::eventfd(0, EFD_CLOEXEC);
+            if (memory_fd_ < 0 || wake_fd_ < 0 || ::ftruncate(memory_fd_, static_cast<off_t>(data_offset + capacity_)) != 0 ||
+                ::fcntl(memory_fd_, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0 || !mapping_.map(memory_fd_, data_offset + capacity_))
+            {
+                return;
+            }
+            auto &header = mapping_.header();
+            header.magic = magic;
+            header.capacity = static_cast<std::uint32_t>(capacity_);
+            ok_ = true;
+        }
+
+        Writer(const Writer &) = delete;
+        Writer &operator=(const Writer &) = delete;
+        ~Writer()
+        {
+            if (memory_fd_ >= 0)
+                ::close(memory_fd_);
+            if (wake_fd_ >= 0)
+                ::close(wake_fd_);
+        }
+
+        bool ok() const { return ok_; }
+        int memory_fd() const { return memory_fd_; }
+        int wake_fd() const { return wake_fd_; }
+
+        // Copies one frame into the ring. If there's no room, waits until the server has made some - unless stop() is called.
+        // Returns false if the frame can never fit, or we were stopped.
+        bool write(const protocol::Frame &frame)
+        {
+            std::size_t length = protocol::header_length + frame.body.size();
+            if (!ok_ || frame.tail.size() != 0 || length > capacity_)
+            {
+                return false;
+            }
+
+            auto &header = mapping_.header();
+            std::uint64_t head = header.head.load(std::memory_order_relaxed); // Only we write it.
+            while (capacity_ - (head - header.tail.load(std::memory_order_acquire)) < length)
+            {
+                if (stopped_.load())
+                {
+                    return false;
+                }
+                header.producer_waiting.store(1);
+                if (capacity_ - (head - header.tail.load()) < length)
+                {
+                    futex_wait(header.producer_waiting, 1, std::chrono::milliseconds(100)); // The timeout is only so stop() gets noticed.
+                }
+            }
+
+            copy_in(head, frame.header.data(), protocol::header_length);
+            copy_in(head + protocol::header_length, frame.body.data(), frame.body.size());
+            header.head.store(head + length); // Publishes the frame. Full ordering, so it can't pass the check below.
+
+            if (header.consumer_sleeping.load() && header.consumer_sleeping.exchange(0))
+            {
+                std::uint64_t one = 1;
+                [[maybe_unused]] auto written = ::write(wake_fd_, &one, sizeof(one));
+            }
+            return true;
+        }
+
+        // Has the server read everything?
+        bool drained() const
+        {
+            auto &header = mapping_.header();
+            return header.head.load() == header.tail.load();
+        }
+
+        // Makes a write() that is waiting for room give up (from another thread - when the server has gone, say).
+        void stop() { stopped_.store(true); }
+
+    private:
+        void copy_in(std::uint64_t position, const char *bytes, std::size_t length)
+        {
+            std::size_t offset = static_cast<std::size_t>(position & (capacity_ - 1));
+            std::size_t first = std::min(length, capacity_ - offset);
+            std::memcpy(mapping_.data() + offset, bytes, first);
+            std::memcpy(mapping_.data(), bytes + first, length - first);
+        }
+
+        std::size_t capacity_;
+        int memory_fd_ = -1;
+        int wake_fd_ = -1;
+        Mapping mapping_;
+        std::atomic<bool> stopped_{false};
+        bool ok_ = false;
+    };
+
+    // The server's side. It takes over the memory descriptor (the eventfd is the caller's - the server waits on it with ASIO).
+    class Reader
+    {
+    public:
+        explicit Reader(int memory_fd)
+        {
+            struct stat info{};
+            int seals = ::fcntl(memory_fd, F_GET_SEALS);
+            bool usable = ::fstat(memory_fd, &info) == 0 && seals >= 0 && (seals & F_SEAL_SHRINK) &&
+                          static_cast<std::size_t>(info.st_size) > data_offset &&
+                          static_cast<std::size_t>(info.st_size) - data_offset <= max_capacity &&
+                          mapping_.map(memory_fd, static_cast<std::size_t>(info.st_size));
+            ::close(memory_fd);
+            if (!usable)
+            {
+                return;
+            }
+            auto &header = mapping_.header();
+            capacity_ = header.capacity; // Read once - the publisher could change it later, we don't care.
+            ok_ = header.magic == magic && capacity_ != 0 && (capacity_ & (capacity_ - 1)) == 0 &&
+                  capacity_ <= static_cast<std::size_t>(info.st_size) - data_offset;
+        }
+
+        bool ok() const { return ok_; }
+
+        enum class Result
+        {
+            frame,  // type and body are the next frame. Call pop() when done with it.
+            empty,  // Nothing there.
+            broken  // The publisher wrote something that isn't a frame - stop reading this ring.
+        };
+
+        // The next frame, without taking it out of the ring. The body points straight into the shared memory - unless it wraps round
+        // the end, then it's copied out first.
+        Result peek(protocol::MessageType &type, std::string_view &body)
+        {
+            auto &header = mapping_.header();
+            std::uint64_t tail = header.tail.load(std::memory_order_relaxed); // Only we write it.
+            std::uint64_t available = header.head.load(std::memory_order_acquire) - tail;
+            if (available == 0)
+            {
+                return Result::empty;
+            }
+
+            char frame_header[protocol::header_length];
+            bool compressed = false;
+            std::size_t length = 0;
+            if (available > capacity_ || available < protocol::header_length)
+            {
+                return Result::broken;
+            }
+            copy_out(tail, frame_header, protocol::header_length);
+            if (!protocol::parse_header(frame_header, type, compressed, length) || compressed || available < protocol::header_length + length)
+            {
+                return Result::broken;
+            }
+
+            std::size_t offset = static_cast<std::size_t>((tail + protocol::header_length) & (capacity_ - 1));
+            if (offset + length <= capacity_)
+            {
+                body = std::string_view(mapping_.data() + offset, length);
+            }
+            else
+            {
+                wrapped_.resize(length);
+                copy_out(tail + protocol::header_length, wrapped_.data(), length);
+                body = wrapped_;
+            }
+            pending_ = protocol::header_length + length;
+            return Result::frame;
+        }
+
+        // We're done with the frame peek() gave us - the publisher may now write over it.
+        void pop()
+        {
+            auto &header = mapping_.header();
+            header.tail.store(header.tail.load(std::memory_order_relaxed) + pending_); // Full ordering - see the check below.
+            pending_ = 0;
+            if (header.producer_waiting.load() && header.producer_waiting.exchange(0))
+            {
+                futex_wake(header.producer_waiting);
+            }
+        }
+
+        // Call before waiting on the eventfd. Returns false if something arrived in the meantime - then read it instead of waiting.
+        bool prepare_to_sleep()
+        {
+            auto &header = mapping_.header();
+            header.consumer_sleeping.store(1);
+            if (header.head.load() != header.tail.load(std::memory_order_relaxed))
+            {
+                header.consumer_sleeping.store(0);
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        void copy_out(std::uint64_t position, char *bytes, std::size_t length) const
+        {
+            std::size_t offset = static_cast<std::size_t>(position & (capacity_ - 1));
+            std::size_t first = std::min(length, capacity_ - offset);
+            std::memcpy(bytes, mapping_.data() + offset, first);
+            std::memcpy(bytes + first, mapping_.data(), length - first);
+        }
+
+        Mapping mapping_;
+        std::size_t capacity_ = 0;
+        std::size_t pending_ = 0;
+        std::string wrapped_;
+        bool ok_ = false;
+    };
+}
+#endif
@@ -0,0 +1,192 @@
+#pragma once
+
+// timing_wheel.hpp
+// A "hashed timing wheel" - lots of timeouts for the price of ONE timer.
+//
+// Every session needs a few timeouts: "has this client finished its handshake yet?", "is it time to send a ping?",
+// "has this client gone quiet for too long?". Giving every session its own steady_timer works, but each one is a separate
+// entry in Boost ASIO's timer queue, and with 100,000 connections that queue gets busy.
+//
+// The wheel works like a clock face with `slots` positions. One steady_timer ticks once every `tick`, and each tick the hand
+// moves on one slot. A timeout of N ticks is put in the slot N positions ahead of the hand (that's the "hashing" - slot = (hand + N) % slots).
+// When the hand gets to a slot, every timer in it whose time has come is fired. A timeout longer than one trip round the wheel
+// just waits for a few extra trips (rounds).
+//
+// Adding and cancelling a timer is O(1) - the slots are linked lists, and each Timer is a node that lives inside its owner
+// (no memory is allocated). Each tick only looks at one slot.
+//
+// The catch: timers only go off on a tick, so they can be up to one tick late. For heartbeats measured in seconds that's fine.
+// Not thread safe - one wheel per io thread, and only used from that thread.
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+class TimingWheel
+{
+public:
+    // One timeout. Put it inside whatever needs the timeout (for example a Session) - it removes itself from the wheel when it's destroyed.
+    // The callback is set once; schedule() it as often as you like. A timer is either waiting in one slot or not scheduled at all.
+    class Timer
+    {
+    public:
+        explicit Timer(std::function<void()> callback) : callback_(std::move(callback)) {}
+        ~Timer() { cancel(); }
+
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+
+        bool scheduled() const { return wheel_ != nullptr; }
+
+        void cancel()
+        {
+            if (wheel_)
+            {
+                wheel_->unlink(*this);
+            }
+        }
+
+    private:
+        friend class TimingWheel;
+
+        std::function<void()> callback_;
+        TimingWheel *wheel_ = nullptr;
+        Timer *previous_ = nullptr;
+        Timer *next_ = nullptr;
+        std::size_t slot_ = 0;
+        std::uint64_t rounds_ = 0;
+    };
+
+    TimingWheel(boost::asio::io_context &io_context, std::chrono::milliseconds tick, std::size_t slots)
+        : timer_(io_context), tick_(tick), slots_(slots, nullptr)
+    {
+        next_tick_ = std::chrono::steady_clock::now() + tick_;
+        wait_for_tick();
+    }
+
+    // If the wheel goes away first, the timers still pointing at it are simply forgotten.
+    ~TimingWheel()
+    {
+        for (Timer *head : slots_)
+        {
+            for (Timer *timer = head; timer;)
+            {
+                Timer *next = timer->next_;
+                timer->wheel_ = nullptr;
+                timer->previous_ = timer->next_ = nullptr;
+                timer = next;
+            }
+        }
+    }
+
+    TimingWheel(const TimingWheel &) = delete;
+    TimingWheel &operator=(const TimingWheel &) = delete;
+
+    // Fire the timer after (at least) delay. Scheduling a timer that is already waiting moves it.
+    void schedule(Timer &timer, std::chrono::milliseconds delay)
+    {
+        timer.cancel();
+
+        std::uint64_t ticks = std::max<std::uint64_t>(1, (delay.count() + tick_.count() - 1) / tick_.count());
+        timer.slot_ = (hand_ + ticks) % slots_.size();
+        timer.rounds_ = (ticks - 1) / slots_.size();
+        timer.wheel_ = this;
+
+        // New timers go at the front of the list. If we are in the middle of firing this very slot (a callback scheduling
+        // a timer exactly one trip round the wheel ahead), the walk in on_tick() has already gone past the front - so it won't fire early.
+        timer.previous_ = nullptr;
+        timer.next_ = slots_[timer.slot_];
+        if (timer.next_)
+        {
+            timer.next_->previous_ = &timer;
+        }
+        slots_[timer.slot_] = &timer;
+        ++size_;
+    }
+
+    // How many ticks have gone by since the wheel started. Cheaper than asking the clock - good for "when did we last hear from them?".
+    std::uint64_t ticks() const { return ticks_; }
+    std::chrono::milliseconds tick() const { return tick_; }
+    std::size_t size() const { return size_; }
+
+private:
+    void unlink(Timer &timer)
+    {
+        if (cursor_ == &timer)
+        {
+            cursor_ = timer.next_; // on_tick() was about to look at this one - skip over it.
+        }
+        if (timer.previous_)
+        {
+            timer.previous_->next_ = timer.next_;
+        }
+        else
+        {
+            slots_[timer.slot_] = timer.next_;
+        }
+        if (timer.next_)
+        {
+            timer.next_->previous_ = timer.previous_;
+        }
+        timer.previous_ = timer.next_ = nullptr;
+        timer.wheel_ = nullptr;
+        --size_;
+    }
+
+    // The timer expires at fixed points in time (start + n * tick) rather than "tick from now", so the wheel doesn't drift.
+    // If the thread was busy and we are late, we catch up on every tick we missed.
+    void wait_for_tick()
+    {
+        timer_.expires_at(next_tick_);
+        timer_.async_wait(
+            [this](boost::system::error_code ec)
+            {
+                if (ec)
+                {
+                    return;
+                }
+                auto now = std::chrono::steady_clock::now();
+                while (next_tick_ <= now)
+                {
+                    next_tick_ += tick_;
+                    on_tick();
+                }
+                wait_for_tick();
+            });
+    }
+
+    void on_tick()
+    {
+        ++ticks_;
+        hand_ = (hand_ + 1) % slots_.size();
+
+        // cursor_ is a member (not a local) so that a callback cancelling the next timer in this slot can move it along - see unlink().
+        cursor_ = slots_[hand_];
+        while (cursor_)
+        {
+            Timer *timer = cursor_;
+            cursor_ = timer->next_;
+            if (timer->rounds_ > 0)
+            {
+                --timer->rounds_;
+                continue;
+            }
+            unlink(*timer);
+            timer->callback_(); // May schedule this timer again or cancel others - but must not destroy the timer while it's running.
+        }
+    }
+
+    boost::asio::steady_timer timer_;
+    std::chrono::milliseconds tick_;
+    std::chrono::steady_clock::time_point next_tick_;
+    std::vector<Timer *> slots_;
+    std::size_t hand_ = 0;
+    std::uint64_t ticks_ = 0;
+    std::size_t size_ = 0;
+    Timer *cursor_ = nullptr;
+};
@@ -0,0 +1,69 @@
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <zdict.h>
+#include "compression.hpp"
+
+// This little program trains the zstd dictionary that the server and client use to compress short chat lines (see compression.hpp).
+//
+// Give it a text file with lots of example chat lines - one message per line. The more (and the more typical) the better;
+// a few thousand lines is a good start. It writes the dictionary to compression/chat.dict, which is where the server looks for it.
+//
+// The server sends the dictionary to each client the first time they connect, so after training you only need to restart the server.
+// NOTE: clients that are still connected keep using the old dictionary until they reconnect - that's fine, the welcome frame sorts it out.
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3)
+    {
+        std::cerr << "Usage: ./train_dictionary <chat_samples.txt> [dictionary size in KB, default 16]\n";
+        return 1;
+    }
+
+    std::ifstream input(argv[1]);
+    if (!input)
+    {
+        std::cerr << "Can't open " << argv[1] << "\n";
+        return 1;
+    }
+
+    // zstd wants all the samples one after the other in one buffer, plus a list of how long each one is.
+    std::string samples;
+    std::vector<std::size_t> sample_sizes;
+    std::string line;
+    while (std::getline(input, line))
+    {
+        if (line.empty())
+        {
+            continue;
+        }
+        samples += line;
+        sample_sizes.push_back(line.size());
+    }
+
+    std::size_t dictionary_size = (argc == 3 ? std::stoul(argv[2]) : 16) * 1024;
+    std::string dictionary(dictionary_size, '\0');
+
+    std::size_t length = ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(), samples.data(),
+                                               sample_sizes.data(), static_cast<unsigned>(sample_sizes.size()));
+    if (ZDICT_isError(length))
+    {
+        std::cerr << "Training failed: " << ZDICT_getErrorName(length) << "\n";
+        std::cerr << "(zstd needs quite a lot of sample text - try a bigger file, or a smaller dictionary size.)\n";
+        return 1;
+    }
+    dictionary.resize(length);
+
+    std::filesystem::create_directories(std::filesystem::path(compression::dictionary_path).parent_path());
+    std::ofstream(compression::dictionary_path, std::ios::binary | std::ios::trunc).write(dictionary.data(), dictionary.size());
+
+    std::cout << "Trained a " << dictionary.size() << " byte dictionary from " << sample_sizes.size() << " lines." << std::endl;
+    std::cout << "Dictionary ID: " << compression::dictionary_id(dictionary) << std::endl;
+    std::cout << "Saved to " << compression::dictionary_path << std::endl;
+
+    return 0;
+}
+
+// g++ -o train_dictionary train_dictionary.cpp -lzstd -lcrypto -std=c++17
@@ -0,0 +1,515 @@
+#pragma once
+
+// transport.hpp
+// How a Session talks to its client.
+//
+// Most clients connect straight to the server over TLS (TlsTransport). But a client can also come in through an edge proxy
+// (see edge.cpp and edge.hpp): the edge does the TLS, and passes the client's bytes to us over one shared link. Then there is
+// no socket of the client's own on the server at all - just a "channel" on that link (EdgeTransport in edge.hpp).
+//
+// A program on the same machine (a bot, say) can also connect through a Unix domain socket, without TLS at all (LocalTransport).
+//
+// The Session doesn't care which one it has: it reads bytes, writes bytes and closes, through this interface.
+//
+// A note on memory: every co_await on a coroutine makes a "frame" for it, and Boost ASIO recycles those through a cache that
+// keeps ONE spare block per thread. If read_some() were a coroutine of its own that co_awaits the socket, two frames would be
+// alive at once (ours and ASIO's), and every read that had to wait would miss the cache and go to the heap. So read_some() and
+// write_some() don't wait at all: they do what can be done right now, and if that isn't everything they say so (would_block)
+// and which way to wait. The Session then co_awaits wait() - which hands back ASIO's own operation, it isn't a coroutine of
+// ours - and tries again. The only coroutine frames on the message path are ASIO's, one at a time.
+// handshake() is a real coroutine, but it only runs once per connection.
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <span>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include "datagram.hpp"
+#include "record_sizing.hpp"
+
+class Transport
+{
+public:
+    virtual ~Transport() = default;
+
+    // Which way read_some() or write_some() is stuck: waiting for the client to send something, or for room to send to it.
+    using Wait = boost::asio::socket_base::wait_type;
+
+    virtual boost::asio::any_io_executor executor() = 0;
+
+    // The TLS handshake, if we're the ones doing TLS. An edge has already done it.
+    virtual boost::asio::awaitable<void> handshake(boost::system::error_code &ec) = 0;
+
+    // Reads what has arrived (up to the size of buffer) without waiting, and returns how many bytes. ec is eof when the client
+    // has gone. If nothing has arrived yet it returns 0 with ec = would_block - co_await wait(wait) and call it again.
+    virtual std::size_t read_some(boost::asio::mutable_buffer buffer, Wait &wait, boost::system::error_code &ec) = 0;
+
+    // Waits until read_some() has something to return (or the client has gone - read_some() then says so), without needing
+    // a buffer to read into yet. That lets a quiet session give its read buffer back while it waits - see Session::reader().
+    virtual boost::asio::awaitable<void> wait_readable(boost::system::error_code &ec) = 0;
+
+    // Writes buffers, starting offset bytes in, as far as it can without waiting, and returns how many bytes that was.
+    // If it got stuck, ec is would_block: co_await wait(wait), then call it again with offset moved on by what it returned.
+    // (TLS needs that - a write that got stuck must be tried again with exactly the same bytes.)
+    virtual std::size_t write_some(std::span<const boost::asio::const_buffer> buffers, std::size_t offset, Wait &wait, boost::system::error_code &ec) = 0;
+
+    // Waits until read_some() or write_some() can get further. Whatever goes wrong here (the connection closing), the next
+    // read_some() or write_some() says so - so the Session just tries again.
+    virtual boost::asio::awaitable<void> wait(Wait wait, boost::system::error_code &ec) = 0;
+
+    // The session has gone quiet: let go of memory that's only needed while bytes are going through.
+    virtual void release_buffers() {}
+
+    // Any read or write that is waiting finishes with an error.
+    virtual void close() = 0;
+
+    // The client's IP address (for the blocklist and the rate limits), and a longer description for /clients.
+    virtual std::string address() = 0;
+    virtual std::string describe() = 0;
+
+    // The identity and key for the UDP side channel, made from this client's TLS connection (see datagram.hpp).
+    // Empty if we don't have the TLS connection ourselves - behind an edge the client can't reach our UDP port anyway.
+    virtual datagram::Secret datagram_secret() { return {}; }
+
+    // A file descriptor the client sent along with its bytes (only possible on a local socket - see LocalTransport), oldest first.
+    // The caller owns it from then on. -1 if there isn't one.
+    virtual int take_descriptor() { return -1; }
+};
+
+// A client connected straight to us.
+// We drive OpenSSL ourselves, on the socket's own file descriptor, rather than through ASIO's ssl::stream. ssl::stream keeps
+// two fixed 17 KB buffers and a pair of BIOs (OpenSSL's in-memory pipes) for every connection, whether it's saying anything or
+// not - about 70 KB for a client that is just sitting there. Here OpenSSL reads from and writes to the socket directly.
+// (scale_test.cpp does the same on the client side, for the same reason.)
+//
+// OpenSSL still has a read and a write buffer of its own (about 17 KB each) once bytes have gone through.
+// SSL_MODE_RELEASE_BUFFERS would free them after every record - but then a busy connection pays a malloc and a free for every
+// record it reads or writes (allocation_test counted about 6000 buffers for its 2000 lines, and none this way). So we free
+// them when the session goes quiet instead: release_buffers(), called from the Session's heartbeat (Server::trim_heap() then
+// hands the memory back to the operating system). A busy connection keeps its buffers, an idle one costs what's measured in
+// README.md - about 1 KB more than with SSL_MODE_RELEASE_BUFFERS, as the freed buffers leave some holes in the heap.
+//
+// The socket is non-blocking. Every operation is: ask OpenSSL, and if it says "want read" or "want write", the Session waits
+// for the socket to be ready (wait() - no buffer needed for that) and asks again with the same arguments, as OpenSSL requires.
+// reader() and writer() use the one SSL object in turns - the server has one thread, so they never run at the same moment.
+class TlsTransport : public Transport
+{
+public:
+    TlsTransport(boost::asio::ip::tcp::socket socket, boost::asio::ssl::context &context)
+        : socket_(std::move(socket)), ssl_(SSL_new(context.native_handle()))
+    {
+        boost::system::error_code ignored;
+        socket_.non_blocking(true, ignored);
+        SSL_set_fd(ssl_, static_cast<int>(socket_.native_handle()));
+        SSL_set_accept_state(ssl_);
+        records_.start(socket_);
+    }
+
+    ~TlsTransport() override { SSL_free(ssl_); }
+
+    TlsTransport(const TlsTransport &) = delete;
+    TlsTransport &operator=(const TlsTransport &) = delete;
+
+    boost::asio::any_io_executor executor() override { return socket_.get_executor(); }
+
+    boost::asio::awaitable<void> handshake(boost::system::error_code &ec) override
+    {
+        while (true)
+        {
+            ERR_clear_error();
+            int result = SSL_do_handshake(ssl_);
+            if (result == 1)
+            {
+                ec = {};
+                std::cout << "Server side: SSL handshake completed successfully with client." << std::endl << std::endl;
+                co_return;
+            }
+            Wait wait;
+            failed(result, wait, ec);
+            if (ec != boost::asio::error::would_block)
+            {
+                co_return;
+            }
+            co_await socket_.async_wait(wait, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+            if (ec)
+            {
+                co_return;
+            }
+        }
+    }
+
+    // The Session has usually just been told (by wait_readable()) that there is something - but a record can come in pieces,
+    // and OpenSSL can't hand out any of it until it has the whole thing.
+    std::size_t read_some(boost::asio::mutable_buffer buffer, Wait &wait, boost::system::error_code &ec) override
+    {
+        ERR_clear_error();
+        std::size_t length = 0;
+        int result = SSL_read_ex(ssl_, buffer.data(), buffer.size(), &length);
+        if (result == 1)
+        {
+            ec = {};
+            return length;
+        }
+        failed(result, wait, ec);
+        return 0;
+    }
+
+    // A "zero byte read": we wait for the socket to become readable, and only then does the Session need a buffer.
+    // OpenSSL may already have the rest of a record it read part of earlier - SSL_has_pending() - and then there's nothing to wait for.
+    boost::asio::awaitable<void> wait_readable(boost::system::error_code &ec) override
+    {
+        if (SSL_has_pending(ssl_))
+        {
+            ec = {};
+            return boost::asio::post(socket_.get_executor(), boost::asio::use_awaitable);
+        }
+        return socket_.async_wait(boost::asio::ip::tcp::socket::wait_read, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    }
+
+    // One SSL_write_ex() per record: small ones for a message, big ones for a file - see record_sizing.hpp. Without
+    // SSL_MODE_ENABLE_PARTIAL_WRITE each one writes all of its piece or (stuck) none of it as far as we're concerned - so offset
+    // always lands at the start of a piece, and the retry is the same call again. That's also why the record size isn't
+    // worked out again for a retry: OpenSSL wants that piece exactly like the first try.
+    std::size_t write_some(std::span<const boost::asio::const_buffer> buffers, std::size_t offset, Wait &wait, boost::system::error_code &ec) override
+    {
+        if (!write_stuck_)
+        {
+            record_size_ = records_.before_write(boost::asio::buffer_size(buffers) - offset);
+        }
+        std::size_t total = 0;
+        for (const auto &buffer : buffers)
+        {
+            if (offset >= buffer.size())
+            {
+                offset -= buffer.size();
+                continue;
+            }
+            const char *data = static_cast<const char *>(buffer.data());
+            for (std::size_t done = offset; done < buffer.size();)
+            {
+                ERR_clear_error();
+                std::size_t written = 0;
+                int result = SSL_write_ex(ssl_, data + done, std::min(record_size_, buffer.size() - done), &written);
+                if (result != 1)
+                {
+                    failed(result, wait, ec);
+                    write_stuck_ = ec == boost::asio::error::would_block;
+                    return total;
+                }
+                done += written;
+                total += written;
+            }
+            offset = 0;
+        }
+        write_stuck_ = false;
+        ec = {};
+        return total;
+    }
+
+    boost::asio::awaitable<void> wait(Wait wait, boost::system::error_code &ec) override
+    {
+        return socket_.async_wait(wait, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    }
+
+    // Frees OpenSSL's read and write buffers. Not while there's a record in them that isn't finished (SSL_has_pending()) -
+    // OpenSSL checks that itself too, but older versions had a bug there.
+    void release_buffers() override
+    {
+        if (!SSL_has_pending(ssl_) && !write_stuck_)
+        {
+            (void)SSL_free_buffers(ssl_); // 0 just means it couldn't right now - we try again next time.
+        }
+    }
+
+    void close() override
+    {
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+    }
+
+    std::string address() override
+    {
+        boost::system::error_code ec;
+        return socket_.remote_endpoint(ec).address().to_string();
+    }
+
+    // remote_endpoint() is the IP address AND port of the client. We pass in an error_code - a socket that has just dropped
+    // has no remote endpoint any more, and we don't want that to throw.
+    std::string describe() override
+    {
+        boost::system::error_code ec;
+        auto endpoint = socket_.remote_endpoint(ec);
+        return ec ? std::string("(disconnected)") : endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+    }
+
+    datagram::Secret datagram_secret() override { return datagram::export_secret(ssl_); }
+
+private:
+    // After an OpenSSL call that didn't finish: ec is would_block and wait says which way to wait for the socket before trying
+    // again - or, if the connection is finished (closed by the client, or broken), ec says that.
+    void failed(int result, Wait &wait, boost::system::error_code &ec)
+    {
+        int saved_errno = errno;
+        switch (SSL_get_error(ssl_, result))
+        {
+        case SSL_ERROR_WANT_READ:
+            wait = Wait::wait_read;
+            ec = boost::asio::error::would_block;
+            return;
+        case SSL_ERROR_WANT_WRITE:
+            wait = Wait::wait_write;
+            ec = boost::asio::error::would_block;
+            return;
+        case SSL_ERROR_ZERO_RETURN:
+            ec = boost::asio::error::eof; // The client said goodbye properly.
+            return;
+        case SSL_ERROR_SYSCALL:
+            // The socket itself failed - or, with errno 0, the client just went without saying goodbye.
+            ec = saved_errno != 0 ? boost::system::error_code(saved_errno, boost::system::system_category()) : boost::system::error_code(boost::asio::error::eof);
+            return;
+        default:
+            ec = boost::system::error_code(static_cast<int>(ERR_get_error()), boost::asio::error::get_ssl_category());
+            if (!ec)
+            {
+                ec = boost::asio::error::connection_aborted;
+            }
+            return;
+        }
+    }
+
+    boost::asio::ip::tcp::socket socket_;
+    SSL *ssl_;
+    RecordSizer records_;
+    std::size_t record_size_ = RecordSizer::large_record; // From records_, for the write going on now.
+    bool write_stuck_ = false; // The last write_some() got stuck - the next one is its retry.
+};
+
+// Unix domain sockets are files on this machine - only programs running here can connect to one. Windows has them too nowadays,
+// but not the "who is on the other end" question we need to ask (see peer_credentials()), so they're Linux and macOS only here.
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS) && !defined(_WIN32)
+#define LOCAL_CLIENTS_SUPPORTED 1
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Who is at the other end of a Unix domain socket - the operating system knows, and the other end can't lie about it.
+struct PeerCredentials
+{
+    bool known = false;
+    uid_t uid = 0;
+    gid_t gid = 0;
+    pid_t pid = 0; // 0 if the operating system doesn't tell us (macOS).
+};
+
+inline PeerCredentials peer_credentials(int socket)
+{
+    PeerCredentials credentials;
+#if defined(SO_PEERCRED)
+    ucred peer{};
+    socklen_t length = sizeof(peer);
+    if (::getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &peer, &length) == 0)
+    {
+        credentials = {true, peer.uid, peer.gid, peer.pid};
+    }
+#else
+    if (::getpeereid(socket, &credentials.uid, &credentials.gid) == 0)
+    {
+        credentials.known = true;
+    }
+#endif
+    return credentials;
+}
+
+// A program on this machine, connected through the server's Unix domain socket (./server ... --local <path>).
+// There is no TLS: the bytes never leave the machine, and who may connect is decided by the socket file's permissions and the
+// peer's credentials (see Server::accept_local()). No handshake and no encryption per message - that's where the time goes with TLS.
+// A local client can also send us file descriptors (a shared memory ring - see shm_ring.hpp), so we read with recvmsg() ourselves.
+class LocalTransport : public Transport
+{
+public:
+    LocalTransport(boost::asio::local::stream_protocol::socket socket, const PeerCredentials &credentials)
+        : socket_(std::move(socket)), credentials_(credentials) {}
+
+    ~LocalTransport() override
+    {
+        for (int fd : descriptors_)
+        {
+            ::close(fd);
+        }
+    }
+
+    boost::asio::any_io_executor executor() override { return socket_.get_executor(); }
+
+    boost::asio::awaitable<void> handshake(boost::system::error_code &) override { co_return; }
+
+    // Reads whatever is there without blocking, and keeps descriptors that come with the bytes (see take_descriptor()) instead
+    // of throwing them away - which is why this is recvmsg() and not ASIO's read_some().
+    std::size_t read_some(boost::asio::mutable_buffer buffer, Wait &wait, boost::system::error_code &ec) override
+    {
+        while (true)
+        {
+            iovec data{buffer.data(), buffer.size()};
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * max_descriptors)];
+            msghdr message{};
+            message.msg_iov = &data;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+
+            int flags = MSG_DONTWAIT;
+#if defined(MSG_CMSG_CLOEXEC)
+            flags |= MSG_CMSG_CLOEXEC;
+#endif
+            ssize_t length = ::recvmsg(socket_.native_handle(), &message, flags);
+            if (length >= 0)
+            {
+                keep_descriptors(message);
+                ec = length == 0 ? boost::system::error_code(boost::asio::error::eof) : boost::system::error_code();
+                return static_cast<std::size_t>(length);
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                wait = Wait::wait_read;
+                ec = boost::asio::error::would_block;
+            }
+            else
+            {
+                ec.assign(errno, boost::system::system_category());
+            }
+            return 0;
+        }
+    }
+
+    boost::asio::awaitable<void> wait_readable(boost::system::error_code &ec) override
+    {
+        return socket_.async_wait(boost::asio::socket_base::wait_read, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    }
+
+    // One sendmsg() for as many buffers as fit into iovecs (the array is on the stack - nothing to allocate).
+    std::size_t write_some(std::span<const boost::asio::const_buffer> buffers, std::size_t offset, Wait &wait, boost::system::error_code &ec) override
+    {
+        std::array<iovec, 64> pieces;
+        std::size_t count = 0;
+        for (const auto &buffer : buffers)
+        {
+            if (offset >= buffer.size())
+            {
+                offset -= buffer.size();
+                continue;
+            }
+            if (count == pieces.size())
+            {
+                break; // The rest goes with the next call.
+            }
+            pieces[count++] = iovec{const_cast<char *>(static_cast<const char *>(buffer.data())) + offset, buffer.size() - offset};
+            offset = 0;
+        }
+
+        msghdr message{};
+        message.msg_iov = pieces.data();
+        message.msg_iovlen = count;
+        int flags = MSG_DONTWAIT;
+#if defined(MSG_NOSIGNAL)
+        flags |= MSG_NOSIGNAL; // A bot that has gone away is an error here, not a SIGPIPE.
+#endif
+        while (true)
+        {
+            ssize_t written = ::sendmsg(socket_.native_handle(), &message, flags);
+            if (written >= 0)
+            {
+                ec = {};
+                return static_cast<std::size_t>(written);
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                wait = Wait::wait_write;
+                ec = boost::asio::error::would_block;
+            }
+            else
+            {
+                ec.assign(errno, boost::system::system_category());
+            }
+            return 0;
+        }
+    }
+
+    boost::asio::awaitable<void> wait(Wait wait, boost::system::error_code &ec) override
+    {
+        return socket_.async_wait(wait, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    }
+
+    void close() override
+    {
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+    }
+
+    // There's no IP address - the rate limits go by user instead, so one user's bots share one set of buckets.
+    std::string address() override { return "uid " + std::to_string(credentials_.uid); }
+
+    std::string describe() override
+    {
+        return "local socket (uid " + std::to_string(credentials_.uid) + (credentials_.pid ? ", pid " + std::to_string(credentials_.pid) : std::string()) + ")";
+    }
+
+    int take_descriptor() override
+    {
+        if (descriptors_.empty())
+        {
+            return -1;
+        }
+        int fd = descriptors_.front();
+        descriptors_.pop_front();
+        return fd;
+    }
+
+private:
+    // A client that sends us descriptors nobody asks for mustn't be able to use up all of ours - past max_descriptors they're closed.
+    static constexpr std::size_t max_descriptors = 4;
+
+    void keep_descriptors(msghdr &message)
+    {
+        for (cmsghdr *part = CMSG_FIRSTHDR(&message); part; part = CMSG_NXTHDR(&message, part))
+        {
+            if (part->cmsg_level != SOL_SOCKET || part->cmsg_type != SCM_RIGHTS)
+            {
+                continue;
+            }
+            std::size_t count = (part->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                int fd;
+                std::memcpy(&fd, CMSG_DATA(part) + i * sizeof(int), sizeof(fd));
+                if (descriptors_.size() < max_descriptors)
+                {
+                    descriptors_.push_back(fd);
+                }
+                else
+                {
+                    ::close(fd);
+                }
+            }
+        }
+    }
+
+    boost::asio::local::stream_protocol::socket socket_;
+    PeerCredentials credentials_;
+    std::deque<int> descriptors_;
+};
+#endif